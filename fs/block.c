@@ -39,21 +39,759 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #ifdef _TEST_BLOCK_INC
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #define printk printf
 #else
+#include <ox/types.h>
 #include <ox/error_rpt.h>
 #endif
 
 // TODO - Figure out what ox kernel headers are needed.
 
+// Build with -DBLOCK_TRACE to log every device request the
+// cache makes, the console write is too costly to leave on.
+#ifdef BLOCK_TRACE
+#define block_trace printk
+#else
+#define block_trace(...)
+#endif
+
+// Longest request the cache makes, a read-ahead run or a write cluster.
+#define BLOCK_IO_VEC ((BLOCK_RA_MAX > BLOCK_CLUSTER_MAX) ? BLOCK_RA_MAX : BLOCK_CLUSTER_MAX)
+
 static bool init = false;
-static block_t  curr = 0;
-static block_t highest = 0; // Highest LRU value.
-static bool dirty[BLOCK_ARRAY_SIZE]; // true if the associated block needs write.
-static block_t block_lru[BLOCK_ARRAY_SIZE]; // Count to implement LRU algorithm.
-static block_t  block_map[BLOCK_ARRAY_SIZE]; // Either it's BLOCK_FREE or the actual block number.
-static char block_array[BLOCK_ARRAY_SIZE][DEV_BLOCK_SIZE]; // The cache.
-static int  block_dev[BLOCK_ARRAY_SIZE]; // Device the block is on.
+// The per slot arrays are carved out of one region by block_cache_init,
+// either memory handed to us at boot or 'block_default_mem' below.
+static block_t block_nr = 0; // Number of slots in the cache.
+static block_t block_hash_size = 0; // Number of hash chains.
+static bool *dirty; // true if the associated block needs write.
+static block_t  *block_map; // Either it's BLOCK_FREE or the actual block number.
+static char (*block_array)[DEV_BLOCK_SIZE]; // The cache.
+static int  *block_dev; // Device the block is on.
+static block_t *block_hash; // First slot in each hash chain or BLOCK_NOPOS.
+static block_t *block_hash_next; // Next slot in the same hash chain.
+static int  *block_ref; // Number of block_get references pinning the slot.
+static int  *block_list; // Which replacement list the slot is on.
+static block_t *block_prev; // Previous (more recently used) slot on the list.
+static block_t *block_next; // Next (less recently used) slot on the list.
+static unsigned long *block_dirtied; // block_epoch when the slot became dirty.
+static block_t *sync_tab; // Slots written by block_sync, sorted.
+static int  *block_hot; // In 2Q mode, true if the slot is on the hot (Am) lists.
+static bool *block_ra; // true if read-ahead brought the block in and it was not hit yet.
+static int  *block_io; // Entry of 'io_req' the slot is being read or written by, or -1.
+static int  *ghost_dev; // Device of a block recently evicted cold or DEV_NODEV.
+static block_t *ghost_block; // Block number of a recently evicted cold block.
+static block_t *ghost_hash; // First ghost in each hash chain or BLOCK_NOPOS.
+static block_t *ghost_next; // Next ghost in the same hash chain.
+static block_t ghost_nr = 0; // Number of ghosts remembered (2Q Kout).
+static block_t ghost_pos = 0; // Next ghost to be replaced, they form a ring.
+static int  block_policy = BLOCK_POLICY; // BLOCK_POLICY_LRU or BLOCK_POLICY_2Q.
+static block_t list_head[BLOCK_NR_LISTS]; // Most recently used slot per list.
+static block_t list_tail[BLOCK_NR_LISTS]; // Least recently used slot per list.
+static block_t list_len[BLOCK_NR_LISTS]; // Number of slots per list.
+static const int dirty_lists[2] = { BLOCK_LIST_DIRTY, BLOCK_LIST_HOT_DIRTY };
+static int  ra_dev[BLOCK_RA_DEVS]; // Device tracked for read-ahead or DEV_NODEV.
+static int  ra_window[BLOCK_RA_DEVS]; // Current read-ahead window, 0 if not sequential.
+static block_t ra_limit[BLOCK_RA_DEVS]; // Last block read-ahead may touch, 0 if unknown.
+static block_t ra_tab[BLOCK_RA_MAX]; // Slots taken for a read-ahead run.
+static unsigned long block_epoch = 0; // Number of block_flush passes.
+static int  block_dirty_ratio = BLOCK_DIRTY_RATIO; // Percentage of the cache allowed dirty.
+static int  block_dirty_age = BLOCK_DIRTY_AGE; // Passes a block may stay dirty.
+static block_t flush_tab[BLOCK_FLUSH_MAX]; // Slots picked by block_flush, sorted.
+static block_t evict_tab[BLOCK_CLUSTER_MAX]; // Dirty run written with an evicted slot.
+static dev_req_t io_req[BLOCK_IO_MAX]; // Device requests in flight.
+static bool io_used[BLOCK_IO_MAX]; // true until block_io_end is done with the entry.
+static int  io_nr = 0; // Number of entries used.
+static bool io_ra[BLOCK_IO_MAX]; // true for a read-ahead request.
+static block_t io_tab[BLOCK_IO_MAX][BLOCK_IO_VEC]; // Slots of each request.
+static char *io_vec[BLOCK_IO_MAX][BLOCK_IO_VEC]; // Their buffers.
+static int  stat_dev[BLOCK_STAT_DEVS]; // Device statistics are kept for or DEV_NODEV.
+static block_stat_t stat_tab[BLOCK_STAT_DEVS]; // Statistics per device.
+static block_stat_t stat_none; // Absorbs counts once 'stat_dev' is full.
+
+// Bytes of cache memory used per slot, the block itself and one
+// entry in each of the arrays above, the hash has a chain per slot.
+#define BLOCK_SLOT_SIZE (DEV_BLOCK_SIZE + 9 * sizeof(block_t) + \
+                         sizeof(unsigned long) + 6 * sizeof(int) + 2 * sizeof(bool))
+// Allowance for aligning each array.
+#define BLOCK_SLOT_ALIGN (16 * sizeof(unsigned long))
+
+// Used when no memory was given to block_cache_init.
+static unsigned long block_default_mem[(BLOCK_ARRAY_SIZE * BLOCK_SLOT_SIZE + 
+                                        BLOCK_SLOT_ALIGN) / sizeof(unsigned long)];
+
+//
+// block_stat_get:
+// Return the statistics for 'dev', claiming a free entry if
+// the device has none yet. Counting never fails, when the table
+// is full the counts go to 'stat_none'.
+//
+static block_stat_t *block_stat_get(int dev)
+{
+   register int i = 0, j = -1;
+   for(i = 0; i < BLOCK_STAT_DEVS; i++) {
+      if(stat_dev[i] == dev) {
+         return &stat_tab[i];
+      }
+      if(stat_dev[i] == DEV_NODEV && j < 0) {
+         j = i;
+      }
+   }
+   if(j < 0) {
+      return &stat_none;
+   }
+   stat_dev[j] = dev;
+   memset(&stat_tab[j], 0, sizeof(block_stat_t));
+   return &stat_tab[j];
+}
+
+//
+// block_dev_write:
+// Write a single block to the device, counting the request.
+//
+static dev_rtvl_t block_dev_write(int dev, block_t block, char *data)
+{
+   block_stat_t *st = block_stat_get(dev);
+   dev_rtvl_t rtvl = DEV_OK;
+
+   block_trace("block_dev_write:: dev_write block %d\n", block);
+   ++st->dev_writes;
+   if((rtvl = dev_write(dev, block, data)) == DEV_OK) {
+      st->bytes_written += DEV_BLOCK_SIZE;
+   }
+   return rtvl;
+}
+
+//
+// The hash table indexes the parallel arrays above by (dev, block)
+// so that finding a cached block does not require a scan of
+// 'block_map'. Each chain is threaded through 'block_hash_next'
+// and only slots whose 'block_map' entry is not BLOCK_FREE are
+// on a chain.
+//
+static block_t block_hash_fn(int dev, block_t block)
+{
+   return (block + ((block_t)dev * 31)) % block_hash_size;
+}
+
+static block_t block_lookup(int dev, block_t block)
+{
+   register block_t i = block_hash[block_hash_fn(dev, block)];
+   while(i != BLOCK_NOPOS) {
+      if(block_map[i] == block && block_dev[i] == dev) {
+         return i;
+      }
+      i = block_hash_next[i];
+   }
+   return BLOCK_NOPOS;
+}
+
+static void block_hash_insert(block_t i)
+{
+   register block_t h = block_hash_fn(block_dev[i], block_map[i]);
+   block_hash_next[i] = block_hash[h];
+   block_hash[h] = i;
+}
+
+static void block_hash_remove(block_t i)
+{
+   register block_t h = 0, j = 0;
+   if(block_map[i] == BLOCK_FREE) {
+      return;
+   }
+   h = block_hash_fn(block_dev[i], block_map[i]);
+   if(block_hash[h] == i) {
+      block_hash[h] = block_hash_next[i];
+   } else {
+      for(j = block_hash[h]; j != BLOCK_NOPOS; j = block_hash_next[j]) {
+         if(block_hash_next[j] == i) {
+            block_hash_next[j] = block_hash_next[i];
+            break;
+         }
+      }
+   }
+   block_hash_next[i] = BLOCK_NOPOS;
+}
+
+//
+// Replacement lists.
+//
+// Every slot is on exactly one doubly linked list threaded
+// through 'block_prev' and 'block_next': the free list, the clean
+// list or the dirty list, or in 2Q mode the hot clean or hot dirty
+// list. The lists are kept with the most recently used slot at the
+// head, so a hit is an O(1) move to the head and the replacement
+// victim is taken from a tail, clean before dirty. Slots pinned by
+// block_get stay on their list but are skipped when choosing a victim.
+//
+// In BLOCK_POLICY_LRU mode only the clean and dirty lists are used.
+// In BLOCK_POLICY_2Q mode a block read for the first time is cold and
+// goes on the clean and dirty lists (2Q's A1in) which are not reordered
+// on a hit. Once more than a quarter of the cache is cold the victim
+// is the oldest cold block and its number is remembered as a ghost
+// (A1out). A miss on a ghost means the block is reused and it comes
+// back hot, onto the hot lists (Am) which are kept in LRU order. A
+// long scan then only cycles through the cold lists and the blocks
+// that are reused, the master block, root inode and bitmaps, stay.
+//
+static void block_list_remove(block_t i)
+{
+   register int list = block_list[i];
+   if(block_prev[i] != BLOCK_NOPOS) {
+      block_next[block_prev[i]] = block_next[i];
+   } else {
+      list_head[list] = block_next[i];
+   }
+   if(block_next[i] != BLOCK_NOPOS) {
+      block_prev[block_next[i]] = block_prev[i];
+   } else {
+      list_tail[list] = block_prev[i];
+   }
+   block_prev[i] = block_next[i] = BLOCK_NOPOS;
+   --list_len[list];
+}
+
+static void block_list_push(int list, block_t i)
+{
+   block_list[i] = list;
+   block_prev[i] = BLOCK_NOPOS;
+   block_next[i] = list_head[list];
+   if(list_head[list] != BLOCK_NOPOS) {
+      block_prev[list_head[list]] = i;
+   } else {
+      list_tail[list] = i;
+   }
+   list_head[list] = i;
+   ++list_len[list];
+}
+
+//
+// block_victim:
+// Return the least recently used slot on 'list' that is not pinned.
+//
+static block_t block_victim(int list)
+{
+   register block_t i = list_tail[list];
+   while(i != BLOCK_NOPOS && block_ref[i]) {
+      i = block_prev[i];
+   }
+   return i;
+}
+
+//
+// block_touch:
+// Move a slot to the head of the clean or dirty list
+// according to its dirty bit, or of the hot lists for a hot slot.
+//
+static void block_touch(block_t i)
+{
+   block_list_remove(i);
+   if(block_hot[i]) {
+      block_list_push(dirty[i] ? BLOCK_LIST_HOT_DIRTY : BLOCK_LIST_HOT_CLEAN, i);
+   } else {
+      block_list_push(dirty[i] ? BLOCK_LIST_DIRTY : BLOCK_LIST_CLEAN, i);
+   }
+}
+
+//
+// block_hit:
+// Record a reference to a cached slot, in 2Q mode cold slots
+// keep their place.
+//
+static void block_hit(block_t i)
+{
+   if(block_policy == BLOCK_POLICY_LRU || block_hot[i]) {
+      block_touch(i);
+   }
+}
+
+//
+// Ghosts, the (dev, block) of the last 'ghost_nr' cold blocks evicted
+// in 2Q mode. They are kept in a ring and hashed like the cache.
+//
+static block_t ghost_hash_fn(int dev, block_t block)
+{
+   return (block + ((block_t)dev * 31)) % ghost_nr;
+}
+
+static void ghost_unlink(block_t g)
+{
+   register block_t h = ghost_hash_fn(ghost_dev[g], ghost_block[g]), j = 0;
+   if(ghost_hash[h] == g) {
+      ghost_hash[h] = ghost_next[g];
+   } else {
+      for(j = ghost_hash[h]; j != BLOCK_NOPOS; j = ghost_next[j]) {
+         if(ghost_next[j] == g) {
+            ghost_next[j] = ghost_next[g];
+            break;
+         }
+      }
+   }
+   ghost_dev[g] = DEV_NODEV;
+   ghost_next[g] = BLOCK_NOPOS;
+}
+
+static void ghost_add(int dev, block_t block)
+{
+   register block_t g = ghost_pos, h = 0;
+   if(ghost_dev[g] != DEV_NODEV) {
+      ghost_unlink(g);
+   }
+   ghost_dev[g] = dev;
+   ghost_block[g] = block;
+   h = ghost_hash_fn(dev, block);
+   ghost_next[g] = ghost_hash[h];
+   ghost_hash[h] = g;
+   ghost_pos = (ghost_pos + 1) % ghost_nr;
+}
+
+//
+// ghost_remove:
+// Return true and forget the ghost if (dev, block) was
+// recently evicted cold.
+//
+static bool ghost_remove(int dev, block_t block)
+{
+   register block_t g = ghost_hash[ghost_hash_fn(dev, block)];
+   while(g != BLOCK_NOPOS) {
+      if(ghost_block[g] == block && ghost_dev[g] == dev) {
+         ghost_unlink(g);
+         return true;
+      }
+      g = ghost_next[g];
+   }
+   return false;
+}
+
+//
+// block_mark_dirty:
+// Mark a slot dirty, remembering when it first became dirty
+// for block_flush, and move it to the head of the dirty list.
+//
+static void block_mark_dirty(block_t i)
+{
+   if(!dirty[i]) {
+      dirty[i] = true;
+      block_dirtied[i] = block_epoch;
+   }
+   block_touch(i);
+}
+
+//
+// block_release:
+// Return a slot to the free list.
+//
+static void block_release(block_t i)
+{
+   block_hash_remove(i);
+   block_list_remove(i);
+   block_map[i] = BLOCK_FREE;
+   block_dev[i] = DEV_NODEV;
+   dirty[i] = false;
+   block_hot[i] = false;
+   block_ra[i] = false;
+   block_list_push(BLOCK_LIST_FREE, i);
+}
+
+//
+// Requests in flight.
+//
+// Read-ahead and write-back go through the device queue (dev_submit)
+// without waiting. Each request takes an entry of 'io_req' and its
+// slots are pinned and marked in 'block_io' until block_io_end sees
+// it complete, so they are neither evicted nor handed out meanwhile.
+//
+
+//
+// block_io_end:
+// Finish a completed request: unpin its slots, mark written slots
+// clean and read-ahead slots as such, and drop slots whose read
+// failed. A failed write leaves the slots dirty for a later pass.
+//
+static void block_io_end(int k)
+{
+   dev_req_t *req = &io_req[k];
+   block_stat_t *st = block_stat_get(req->dev);
+   register block_t i = 0;
+   register int j = 0;
+
+   for(j = 0; j < req->count; j++) {
+      i = io_tab[k][j];
+      --block_ref[i];
+      block_io[i] = -1;
+      if(req->status != DEV_OK) {
+         if(req->op == DEV_REQ_READ && !block_ref[i]) {
+            block_release(i);
+         }
+      } else if(req->op == DEV_REQ_WRITE) {
+         dirty[i] = false;
+         block_touch(i);
+      } else if(io_ra[k]) {
+         block_ra[i] = true;
+         ++st->ra_blocks;
+      }
+   }
+   if(req->status != DEV_OK) {
+      printk("block_io_end:: error %s blocks [%d-%d]\n",
+             (req->op == DEV_REQ_WRITE) ? "writing" : "reading",
+             req->block, req->block + req->count - 1);
+   } else if(req->op == DEV_REQ_WRITE) {
+      st->bytes_written += req->count * DEV_BLOCK_SIZE;
+   } else {
+      st->bytes_read += req->count * DEV_BLOCK_SIZE;
+   }
+   io_used[k] = false;
+   --io_nr;
+}
+
+//
+// block_io_reap:
+// Finish the requests that have completed.
+//
+static void block_io_reap(void)
+{
+   register int k = 0;
+   for(k = 0; io_nr && k < BLOCK_IO_MAX; k++) {
+      if(io_used[k] && io_req[k].status != DEV_BUSY) {
+         block_io_end(k);
+      }
+   }
+}
+
+//
+// block_io_wait:
+// Wait for request 'k' and finish it. Returns its status.
+//
+static dev_rtvl_t block_io_wait(int k)
+{
+   dev_wait(&io_req[k]);
+   if(io_used[k]) {
+      block_io_end(k);
+   }
+   return io_req[k].status;
+}
+
+//
+// block_io_get:
+// Return a free request entry, waiting for the oldest
+// request in flight if there is none.
+//
+static int block_io_get(void)
+{
+   register int k = 0, oldest = 0;
+   block_io_reap();
+   for(k = 0; k < BLOCK_IO_MAX; k++) {
+      if(!io_used[k]) {
+         return k;
+      }
+      if(io_req[k].seq < io_req[oldest].seq) {
+         oldest = k;
+      }
+   }
+   block_io_wait(oldest);
+   return oldest;
+}
+
+//
+// block_io_submit:
+// Queue the 'n' slots in 'tab', consecutive blocks on one device,
+// to be read or written with request 'k'. They stay pinned until
+// block_io_end.
+//
+static void block_io_submit(int k, int op, block_t *tab, int n)
+{
+   dev_req_t *req = &io_req[k];
+   register int j = 0;
+
+   for(j = 0; j < n; j++) {
+      io_tab[k][j] = tab[j];
+      io_vec[k][j] = block_array[tab[j]];
+      ++block_ref[tab[j]];
+      block_io[tab[j]] = k;
+   }
+   req->op = op;
+   req->dev = block_dev[tab[0]];
+   req->block = block_map[tab[0]];
+   req->count = n;
+   req->data = io_vec[k];
+   req->done = NULL;
+   req->arg = NULL;
+   io_used[k] = true;
+   io_ra[k] = false;
+   ++io_nr;
+   if(dev_submit(req) == DEV_PARAM) {
+      req->status = DEV_FAIL;
+   }
+}
+
+//
+// block_io_drain:
+// Wait for every request in flight.
+//
+static void block_io_drain(void)
+{
+   register int k = 0;
+   for(k = 0; k < BLOCK_IO_MAX; k++) {
+      if(io_used[k]) {
+         block_io_wait(k);
+      }
+   }
+}
+
+//
+// block_find:
+// Look (dev, block) up, waiting for a request in flight on its slot.
+//
+static block_t block_find(int dev, block_t block)
+{
+   register block_t i = block_lookup(dev, block);
+   while(i != BLOCK_NOPOS && block_io[i] >= 0) {
+      block_io_wait(block_io[i]);
+      i = block_lookup(dev, block);
+   }
+   return i;
+}
+
+//
+// block_sort:
+// Shell sort slot numbers on (dev, block).
+//
+static int block_cmp(block_t a, block_t b)
+{
+   if(block_dev[a] != block_dev[b]) {
+      return (block_dev[a] < block_dev[b]) ? -1 : 1;
+   }
+   if(block_map[a] != block_map[b]) {
+      return (block_map[a] < block_map[b]) ? -1 : 1;
+   }
+   return 0;
+}
+
+static void block_sort(block_t *tab, int n)
+{
+   register int gap = 0, j = 0, k = 0;
+   register block_t t = 0;
+   for(gap = n / 2; gap > 0; gap /= 2) {
+      for(j = gap; j < n; j++) {
+         t = tab[j];
+         for(k = j; k >= gap && block_cmp(tab[k - gap], t) > 0; k -= gap) {
+            tab[k] = tab[k - gap];
+         }
+         tab[k] = t;
+      }
+   }
+}
+
+//
+// block_write_sorted:
+// Write the dirty slots in 'tab', sorted by block_sort, merging
+// each run of consecutive blocks on a device into one request of
+// at most BLOCK_CLUSTER_MAX blocks. The requests of a device are
+// queued together so that the elevator sees all of them. Written
+// slots become clean, at once if 'wait' is set, otherwise when the
+// request is seen to complete. Returns the number of slots that
+// could not be written or queued.
+//
+static int block_write_sorted(block_t *tab, int n, bool wait)
+{
+   register int j = 0, len = 0, failed = 0, k = 0;
+   register block_t i = 0;
+
+   for(j = 0; j < n; j += len) {
+      i = tab[j];
+      for(len = 1; j + len < n && len < BLOCK_CLUSTER_MAX; len++) {
+         if(block_dev[tab[j + len]] != block_dev[i] ||
+            block_map[tab[j + len]] != block_map[i] + len) {
+            break;
+         }
+      }
+      k = block_io_get();
+      if(!j || block_dev[tab[j - 1]] != block_dev[i]) {
+         if(j) {
+            dev_unplug(block_dev[tab[j - 1]]);
+         }
+         dev_plug(block_dev[i]);
+      }
+      block_trace("block_write_sorted:: dev_submit block %d count %d\n",
+                  block_map[i], len);
+      ++block_stat_get(block_dev[i])->dev_writes;
+      block_io_submit(k, DEV_REQ_WRITE, &tab[j], len);
+   }
+   if(n) {
+      dev_unplug(block_dev[tab[n - 1]]);
+   }
+   if(wait) {
+      block_io_drain();
+   } else {
+      block_io_reap();
+   }
+   for(j = 0; j < n; j++) {
+      if(dirty[tab[j]] && block_io[tab[j]] < 0) {
+         failed++;
+      }
+   }
+   return failed;
+}
+
+//
+// block_cluster:
+// Fill 'tab' with the run of dirty, unpinned cached blocks on disk
+// around slot 'i', in ascending order, and return its length.
+//
+static int block_cluster(block_t i, block_t *tab)
+{
+   register block_t j = 0, first = block_map[i];
+   register int n = 0, dev = block_dev[i];
+
+   while(first > 0 && block_map[i] - (first - 1) < BLOCK_CLUSTER_MAX) {
+      j = block_lookup(dev, first - 1);
+      if(j == BLOCK_NOPOS || !dirty[j] || block_ref[j]) {
+         break;
+      }
+      first--;
+   }
+   for(n = 0; n < BLOCK_CLUSTER_MAX; n++) {
+      j = block_lookup(dev, first + n);
+      if(j == BLOCK_NOPOS || !dirty[j] || (block_ref[j] && j != i)) {
+         break;
+      }
+      tab[n] = j;
+   }
+   return n;
+}
+
+//
+// block_alloc:
+// Find a slot for (dev, block) which is known not to be cached.
+// We take a free slot if there is one, otherwise a victim from the
+// lists in the order below, clean before dirty. A dirty victim is
+// first written out to its own device and block, together with the
+// dirty blocks next to it on disk. The slot is returned hashed under
+// (dev, block), clean and at the head of its list, or BLOCK_NOPOS
+// on failure.
+//
+static const int lru_order[BLOCK_NR_LISTS] = {
+   BLOCK_LIST_FREE, BLOCK_LIST_CLEAN, BLOCK_LIST_HOT_CLEAN,
+   BLOCK_LIST_DIRTY, BLOCK_LIST_HOT_DIRTY
+};
+static const int cold_order[BLOCK_NR_LISTS] = {
+   BLOCK_LIST_FREE, BLOCK_LIST_CLEAN, BLOCK_LIST_DIRTY,
+   BLOCK_LIST_HOT_CLEAN, BLOCK_LIST_HOT_DIRTY
+};
+static const int hot_order[BLOCK_NR_LISTS] = {
+   BLOCK_LIST_FREE, BLOCK_LIST_HOT_CLEAN, BLOCK_LIST_HOT_DIRTY,
+   BLOCK_LIST_CLEAN, BLOCK_LIST_DIRTY
+};
+
+static block_t block_alloc(int dev, block_t block)
+{
+   register block_t i = BLOCK_NOPOS;
+   register int k = 0;
+   const int *order = lru_order;
+
+   if(block_policy == BLOCK_POLICY_2Q) {
+      // Take from the cold lists while they hold more
+      // than a quarter of the cache (2Q Kin).
+      order = (list_len[BLOCK_LIST_CLEAN] + list_len[BLOCK_LIST_DIRTY] > block_nr / 4) ?
+               cold_order : hot_order;
+   }
+   for(k = 0; k < BLOCK_NR_LISTS; k++) {
+      if((i = block_victim(order[k])) != BLOCK_NOPOS) {
+         break;
+      }
+   }
+   if(i == BLOCK_NOPOS) {
+      // If we got here every slot is pinned.
+      printk("block_alloc:: no unpinned buffers dev=%d block=%u\n", dev, block);
+      return BLOCK_NOPOS;
+   }
+   if(dirty[i]) {
+      // Care must be taken to write out to the existing pages device
+      // and block as these differ from the user supplied ones.
+      // The neighbouring dirty blocks go out in the same request.
+      block_write_sorted(evict_tab, block_cluster(i, evict_tab), true);
+      if(dirty[i]) {
+         return BLOCK_NOPOS;
+      }
+      ++block_stat_get(block_dev[i])->evict_dirty;
+   } else if(block_map[i] != BLOCK_FREE) {
+      ++block_stat_get(block_dev[i])->evict_clean;
+   }
+   if(block_policy == BLOCK_POLICY_2Q && 
+      block_map[i] != BLOCK_FREE && !block_hot[i]) {
+      ghost_add(block_dev[i], block_map[i]);
+   }
+   block_release(i);
+   block_list_remove(i);
+   block_map[i] = block;
+   block_dev[i] = dev;
+   block_hot[i] = (block_policy == BLOCK_POLICY_2Q && ghost_remove(dev, block));
+   block_ra[i] = false;
+   block_hash_insert(i);
+   block_list_push(block_hot[i] ? BLOCK_LIST_HOT_CLEAN : BLOCK_LIST_CLEAN, i);
+   return i;
+}
+
+//
+// block_carve:
+// Take 'bytes' from the region at '*mem', keeping each array
+// aligned to an unsigned long.
+//
+static void *block_carve(char **mem, unsigned long bytes)
+{
+   void *ptr = *mem;
+   bytes = (bytes + sizeof(unsigned long) - 1) & ~(sizeof(unsigned long) - 1);
+   *mem += bytes;
+   return ptr;
+}
+
+unsigned long block_cache_bytes(block_t nr)
+{
+   return nr * BLOCK_SLOT_SIZE + BLOCK_SLOT_ALIGN;
+}
+
+block_rtvl_t block_cache_init(void *mem, unsigned long bytes)
+{
+   char *ptr = (char *)mem;
+   block_t nr = 0;
+
+   if(init) {
+      // The cache is in use.
+      return BLOCK_FAIL;
+   }
+   if(!mem || bytes < block_cache_bytes(1)) {
+      return BLOCK_PARAM;
+   }
+   nr = (bytes - BLOCK_SLOT_ALIGN) / BLOCK_SLOT_SIZE;
+   // The blocks come first so that they keep the alignment
+   // of the region, page aligned when allocated at boot.
+   block_array = block_carve(&ptr, nr * DEV_BLOCK_SIZE);
+   block_map = block_carve(&ptr, nr * sizeof(block_t));
+   block_hash = block_carve(&ptr, nr * sizeof(block_t));
+   block_hash_next = block_carve(&ptr, nr * sizeof(block_t));
+   block_prev = block_carve(&ptr, nr * sizeof(block_t));
+   block_next = block_carve(&ptr, nr * sizeof(block_t));
+   sync_tab = block_carve(&ptr, nr * sizeof(block_t));
+   block_dirtied = block_carve(&ptr, nr * sizeof(unsigned long));
+   block_dev = block_carve(&ptr, nr * sizeof(int));
+   block_ref = block_carve(&ptr, nr * sizeof(int));
+   block_list = block_carve(&ptr, nr * sizeof(int));
+   block_hot = block_carve(&ptr, nr * sizeof(int));
+   block_ra = block_carve(&ptr, nr * sizeof(bool));
+   block_io = block_carve(&ptr, nr * sizeof(int));
+   ghost_dev = block_carve(&ptr, nr * sizeof(int));
+   ghost_block = block_carve(&ptr, nr * sizeof(block_t));
+   ghost_hash = block_carve(&ptr, nr * sizeof(block_t));
+   ghost_next = block_carve(&ptr, nr * sizeof(block_t));
+   dirty = block_carve(&ptr, nr * sizeof(bool));
+   block_nr = nr;
+   block_hash_size = nr;
+   // 2Q remembers half the cache size worth of ghosts (Kout).
+   ghost_nr = (nr / 2) ? (nr / 2) : 1;
+   printk("block_cache_init:: %u blocks\n", nr);
+   return BLOCK_OK;
+}
 
 block_rtvl_t block_open(char *path, int *dev)
 {
@@ -63,16 +801,49 @@ block_rtvl_t block_open(char *path, int *dev)
    }
    if(!init) {
       printk("block_open:: initializing buffer cache\n");
-      for(i = 0; i < BLOCK_ARRAY_SIZE; i++) {
+      for(i = 0; i < BLOCK_NR_LISTS; i++) {
+         list_head[i] = list_tail[i] = BLOCK_NOPOS;
+         list_len[i] = 0;
+      }
+      if(!block_nr) {
+         block_cache_init(block_default_mem, sizeof(block_default_mem));
+      }
+      for(i = 0; i < block_nr; i++) {
          // Initialize each block which is of size 'DEV_BLOCK_SIZE'
          // which in turn must be the size of the disk sector read/write
          // historically 512 bytes. New hard drives may now support 4096 bytes.
          memset(block_array[i],0x0,DEV_BLOCK_SIZE);
          dirty[i] = false;
          block_map[i] = BLOCK_FREE;
-         block_lru[i] = 0;
          block_dev[i] = DEV_NODEV;
+         block_ref[i] = 0;
+         block_hot[i] = false;
+         block_ra[i] = false;
+         block_io[i] = -1;
+         block_hash_next[i] = BLOCK_NOPOS;
+         block_list_push(BLOCK_LIST_FREE, i);
+      }
+      for(i = 0; i < ghost_nr; i++) {
+         ghost_dev[i] = DEV_NODEV;
+         ghost_hash[i] = BLOCK_NOPOS;
+         ghost_next[i] = BLOCK_NOPOS;
       }
+      ghost_pos = 0;
+      for(i = 0; i < block_hash_size; i++) {
+         block_hash[i] = BLOCK_NOPOS;
+      }
+      for(i = 0; i < BLOCK_STAT_DEVS; i++) {
+         stat_dev[i] = DEV_NODEV;
+      }
+      for(i = 0; i < BLOCK_RA_DEVS; i++) {
+         ra_dev[i] = DEV_NODEV;
+         ra_window[i] = 0;
+         ra_limit[i] = 0;
+      }
+      for(i = 0; i < BLOCK_IO_MAX; i++) {
+         io_used[i] = false;
+      }
+      io_nr = 0;
       init = true;
    }
    // TODO - Open the device. In user space, a file, in kernel
@@ -90,296 +861,225 @@ block_rtvl_t block_open(char *path, int *dev)
    }
 }
 
-block_rtvl_t block_read(int dev, block_t block, char *data)
+//
+// block_ra_get:
+// Return the read-ahead entry for 'dev', claiming a free one
+// if the device is not tracked yet, or -1 if the table is full.
+//
+static int block_ra_get(int dev)
 {
-   register block_t i = 0,
-            found = BLOCK_NOPOS,
-            free_block_ptr = BLOCK_NOPOS,
-            lowest_clean_block = BLOCK_MAX_LRU, lowest_clean_block_ptr = BLOCK_NOPOS,
-            lowest_dirty_block = BLOCK_MAX_LRU, lowest_dirty_block_ptr = BLOCK_NOPOS;
+   register int i = 0, j = -1;
+   for(i = 0; i < BLOCK_RA_DEVS; i++) {
+      if(ra_dev[i] == dev) {
+         return i;
+      }
+      if(ra_dev[i] == DEV_NODEV && j < 0) {
+         j = i;
+      }
+   }
+   if(j >= 0) {
+      ra_dev[j] = dev;
+      ra_window[j] = 0;
+      ra_limit[j] = 0;
+   }
+   return j;
+}
 
-   if(dev < 0 || block < 0 || !data) {
+block_rtvl_t block_set_limit(int dev, block_t limit)
+{
+   register int r = 0;
+   if(dev < 0) {
       return BLOCK_PARAM;
    }
-   // Scan the cache to see if the block is there.
-
-   // Current is a pointer into the cache. It is a slight
-   // optimization as we will allocate from current if possible.
-   if(curr >= BLOCK_ARRAY_SIZE) {
-      curr = 0;
+   if((r = block_ra_get(dev)) < 0) {
+      return BLOCK_FAIL;
    }
+   ra_limit[r] = limit;
+   return BLOCK_OK;
+}
 
-   for(i = curr; i < BLOCK_ARRAY_SIZE; i++) {
-        if(block_map[i] == block && block_dev[i] == dev) {
-            // Found the desired block, we are done.
-            printk("found line %d\n",__LINE__);
-            found = i;
-            break;
-        }
+//
+// block_ra_count:
+// On a miss of (dev, block) return how many blocks to read starting
+// at 'block'. A miss whose preceding block is cached is taken to be
+// sequential, this also holds when the preceding block was brought
+// in by read-ahead, so the window doubles up to BLOCK_RA_MAX while
+// a device is streamed and drops back to a single block on a random
+// miss. The run stops at the first block already cached, so cached
+// (and possibly dirty) data is never overwritten, and at the device
+// limit set by block_set_limit.
+//
+static int block_ra_count(int dev, block_t block)
+{
+   register int r = block_ra_get(dev), n = 0;
+
+   if(r < 0) {
+      return 1;
    }
-   // We may have to go around again...
-   if(curr && found == BLOCK_NOPOS) {
-        for(i = 0; i < curr; i++) {
-            if(block_map[i] == block && block_dev[i] == dev) {
-                // Found the desired block, we are done.
-                curr = i;
-                found = i;
-                printk("found line %d\n",__LINE__);
-                break;
-            }
-        }
+   if(block > 0 && block_lookup(dev, block - 1) != BLOCK_NOPOS) {
+      ra_window[r] = ra_window[r] ? ra_window[r] * 2 : BLOCK_RA_MIN;
+      if(ra_window[r] > BLOCK_RA_MAX) {
+         ra_window[r] = BLOCK_RA_MAX;
+      }
+   } else {
+      ra_window[r] = 0;
+      return 1;
    }
-        
-   // Here we found the block in the cache.
-   if(found != BLOCK_NOPOS) {
-         i = found;
-         // Found, return a copy of it.
-         memcpy(data,block_array[i],DEV_BLOCK_SIZE);
-         // Increment the count.
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            ++block_lru[i];
-         }
-         curr = i;
-         printk("found line %d\n",__LINE__);
-         return BLOCK_OK;
-   }
-
-   // We scan to see if there is a free block in case its not there.
-   // We scan for the lowest LRU block that is not dirty.
-   // We scan for the lowest LRU block that is dirty.
-   // The rest of the code handles the cases as it is possible that
-   // there is no match for one of the cases but not all. 
-   // NOTE: This is an optimization, the cache
-   // as written requires a scan to find a record, we include our
-   // checks in one scan so as to not do many scans.
-   for(i = 0; i < BLOCK_ARRAY_SIZE; i++) {
-        if(block_map[i] == BLOCK_FREE) {
-            free_block_ptr = i;
-            break;
-        }
-        if(!dirty[i]) {
-            if(block_lru[i] < lowest_clean_block) {
-                lowest_clean_block = block_lru[i];
-                lowest_clean_block_ptr = i;
-            }
-        }
-        if(dirty[i]) {
-            if(block_lru[i] < lowest_dirty_block) {
-                lowest_dirty_block = block_lru[i];
-                lowest_dirty_block_ptr = i;
-            }
-        }
-        if(block_lru[i] > highest) {
-            highest = block_lru[i];
-        }
+   for(n = 1; n < ra_window[r]; n++) {
+      if(ra_limit[r] && block + n > ra_limit[r]) {
+         break;
+      }
+      if(block_lookup(dev, block + n) != BLOCK_NOPOS) {
+         break;
+      }
    }
+   return n;
+}
 
-   // Found a free block.
-   if(free_block_ptr != BLOCK_NOPOS) {
-         i = free_block_ptr;
-         if(dev_scan(dev,block) != DEV_OK) {
-            return BLOCK_FAIL; 
-         }
-         printk("dev_read line %d block %d\n",__LINE__, block);
-         if(dev_read(dev, block, block_array[i]) != DEV_OK) {
-            block_map[i] = BLOCK_FREE;
-            return BLOCK_FAIL;
-         }
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
+//
+// block_fill:
+// Return the slot holding (dev, block), reading it from the
+// device into a slot chosen by block_alloc if it is not cached.
+// On a sequential miss the following blocks are read in the
+// same device request and cached as well.
+//
+static block_t block_fill(int dev, block_t block)
+{
+   register block_t i = 0, j = 0;
+   register int n = 0, k = 0, ra = -1, r = 0;
+   block_stat_t *st = block_stat_get(dev);
+
+   block_io_reap();
+   // Look the block up in the hash table.
+   i = block_find(dev, block);
+
+   // Here we found the block in the cache.
+   if(i != BLOCK_NOPOS) {
+         ++st->hits;
+         if(block_ra[i]) {
+            ++st->ra_hits;
+            block_ra[i] = false;
          }
-         block_map[i] = block;
-         block_dev[i] = dev;
-         dirty[i] = false;
-         memcpy(data,block_array[i],DEV_BLOCK_SIZE);
-         curr = i;
-         printk("block_ok line %d\n",__LINE__);
-         return BLOCK_OK;
+         block_hit(i);
+         return i;
    }
+   ++st->misses;
 
-   /* We have a request and there are no more buffers
-    * to store it, we have to free one up.
-    * Here we free the block with the lowest LRU that is not
-    * dirty.
-    */
-   if(lowest_clean_block_ptr != BLOCK_NOPOS) {
-         i = lowest_clean_block_ptr;
-         if(dev_scan(dev, block) != DEV_OK) {
-            return BLOCK_FAIL;   
-         }
-         printk("dev_read line %d block %d\n",__LINE__, block);
-         if(dev_read(dev, block, block_array[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
-         }
-         block_map[i] = block;
-         block_dev[i] = dev;
-         memcpy(data,block_array[i],DEV_BLOCK_SIZE);
-         dirty[i] = false;
-         curr = i;
-         return BLOCK_OK;
-  }
-
-  // Here we free the lowest LRU block that is dirty.
-  // This requires us to write the block that was in the cache first,
-  // then read into its position the requested buffer.
-  if(lowest_dirty_block_ptr != BLOCK_NOPOS) {
-         i = lowest_dirty_block_ptr;
-         // Care must be taken to write out to the existing pages device
-         // as this may differ from the user supplied 'dev'.
-         if(dev_scan(block_dev[i],block_map[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         if(dev_write(block_dev[i], block, block_array[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         if(dev_scan(dev, block) != DEV_OK) {
-            return BLOCK_FAIL;   
-         }
-         printk("dev_read line %d block %d\n",__LINE__, block);
-         if(dev_read(dev, block, block_array[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
-         }
-         block_map[i] = block;
-         block_dev[i] = dev;
-         memcpy(data,block_array[i],DEV_BLOCK_SIZE);
-         curr = i;
-         dirty[i] = false;
-         return BLOCK_OK;
+   // We have a request and it is not cached, take a slot
+   // using the replacement lists and read the block into it.
+   n = block_ra_count(dev, block);
+   i = block_alloc(dev, block);
+   if(i == BLOCK_NOPOS) {
+      return BLOCK_NOPOS;
    }
-   // If we got here the cached read has failed.
-   // This is logically not possible.
-   return BLOCK_FAIL;
+   // Take a slot for every block of the run first so that it is
+   // read straight into the cache. Each slot is pinned so that
+   // taking the next one can not evict it.
+   ra_tab[0] = i;
+   ++block_ref[i];
+   for(k = 1; k < n; k++) {
+      if((j = block_alloc(dev, block + k)) == BLOCK_NOPOS) {
+         break;
+      }
+      ra_tab[k] = j;
+      ++block_ref[j];
+   }
+   n = k;
+   // The block asked for and the read-ahead behind it are
+   // separate requests, only the first is waited for. The device
+   // is plugged so that they still go out as one transfer.
+   ++st->dev_reads;
+   block_trace("block_fill:: dev_submit block %d count %d\n", block, n);
+   dev_plug(dev);
+   r = block_io_get();
+   block_io_submit(r, DEV_REQ_READ, ra_tab, 1);
+   if(n > 1) {
+      ra = block_io_get();
+      block_io_submit(ra, DEV_REQ_READ, &ra_tab[1], n - 1);
+      io_ra[ra] = true;
+   }
+   for(k = 0; k < n; k++) {
+      --block_ref[ra_tab[k]];
+   }
+   dev_unplug(dev);
+   if(block_io_wait(r) != DEV_OK) {
+      return BLOCK_NOPOS;
+   }
+   block_touch(i);
+   return i;
 }
 
-block_rtvl_t block_write(int dev, block_t block, char *data)
+block_rtvl_t block_read(int dev, block_t block, char *data)
 {
-   register block_t i = 0,
-            free_block_ptr = BLOCK_NOPOS,
-            lowest_clean_block = BLOCK_MAX_LRU, lowest_clean_block_ptr = BLOCK_NOPOS,
-            lowest_dirty_block = BLOCK_MAX_LRU, lowest_dirty_block_ptr = BLOCK_NOPOS;
+   register block_t i = 0;
 
-   if(curr >= BLOCK_ARRAY_SIZE) {
-      curr = 0;
+   if(dev < 0 || block < 0 || !data) {
+      return BLOCK_PARAM;
    }
-   for(i = curr; i < BLOCK_ARRAY_SIZE; i++) {
-      if(block_map[i] == block && block_dev[i] == dev) {
-         curr = i;
-         dirty[i] = true;
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            ++block_lru[i];
-         }
-         memcpy(block_array[i],data,DEV_BLOCK_SIZE);
-         return BLOCK_OK;
-      }
-   }
-   if(curr) {
-        for(i = 0; i < curr; i++) {
-            if(block_map[i] == block && block_dev[i] == dev) {
-                curr = i;
-                dirty[i] = true;
-                if(block_lru[i] < BLOCK_MAX_LRU) {
-                    ++block_lru[i];
-                }
-                memcpy(block_array[i],data,DEV_BLOCK_SIZE);
-                return BLOCK_OK;
-            }
-        }
+   if((i = block_fill(dev, block)) == BLOCK_NOPOS) {
+      return BLOCK_FAIL;
    }
+   // Return a copy of it.
+   memcpy(data,block_array[i],DEV_BLOCK_SIZE);
+   return BLOCK_OK;
+}
 
-   // In the above, we scanned to see if it is in the cache,
-   // if it is not, we do our block replacement algorithm which
-   // should be the same as block_read.
-
-   // We scan to see if there is a free block in case its not there.
-   // We scan for the lowest LRU block that is not dirty.
-   // We scan for the lowest LRU block that is dirty.
-   // The rest of the code handles the cases as it is possible that
-   // there is no match for one of the cases but not all. 
-   // NOTE: This is an optimization, the cache
-   // as written requires a scan to find a record, we include our
-   // checks in one scan so as to not do many scans.
-   for(i = 0; i < BLOCK_ARRAY_SIZE; i++) {
-        if(block_map[i] == BLOCK_FREE) {
-            free_block_ptr = i;
-            break;
-        }
-        if(!dirty[i]) {
-            if(block_lru[i] < lowest_clean_block) {
-                lowest_clean_block = block_lru[i];
-                lowest_clean_block_ptr = i;
-            }
-        }
-        if(dirty[i]) {
-            if(block_lru[i] < lowest_dirty_block) {
-                lowest_dirty_block = block_lru[i];
-                lowest_dirty_block_ptr = i;
-            }
-        }
-        if(block_lru[i] > highest) {
-            highest = block_lru[i];
-        }
+char *block_get(int dev, block_t block)
+{
+   register block_t i = 0;
+
+   if(dev < 0 || block < 0) {
+      return NULL;
+   }
+   if((i = block_fill(dev, block)) == BLOCK_NOPOS) {
+      return NULL;
    }
+   ++block_ref[i];
+   return block_array[i];
+}
 
-   if(free_block_ptr != BLOCK_NOPOS) {
-         i = free_block_ptr;
-         block_map[i] = block;
-         block_dev[i] = dev;
-         dirty[i] = true;
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
-         }
-         memcpy(block_array[i],data,DEV_BLOCK_SIZE); 
-         curr = i;
-         return BLOCK_OK;
+block_rtvl_t block_put(char *data, int modified)
+{
+   register block_t i = 0;
+
+   if(!data || data < block_array[0] ||
+      data >= block_array[0] + (block_nr * DEV_BLOCK_SIZE)) {
+      return BLOCK_PARAM;
+   }
+   i = (data - block_array[0]) / DEV_BLOCK_SIZE;
+   if(block_ref[i] <= 0) {
+      printk("block_put:: block=%u is not pinned\n", block_map[i]);
+      return BLOCK_PARAM;
+   }
+   --block_ref[i];
+   if(modified && !dirty[i]) {
+      block_mark_dirty(i);
    }
+   return BLOCK_OK;
+}
 
-   /* We have a request and there are no more buffers
-    * to store it, we have to free one up.
-    * Here we free the block with the lowest LRU that is not
-    * dirty.
-    */
-   if(lowest_clean_block_ptr != BLOCK_NOPOS) {
-         i = lowest_clean_block_ptr;
-         block_map[i] = block;
-         block_dev[i] = dev;
-         memcpy(block_array[i],data,DEV_BLOCK_SIZE);
-         dirty[i] = true;
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
-         }
-         curr = i;
-         return BLOCK_OK;
-   }
-   // Here we free the lowest LRU block that is dirty.
-   // This requires us to write the block that was in the cache first,
-   // then write into its position the requested buffer.
-   if(lowest_dirty_block_ptr != BLOCK_NOPOS) {
-         i  = lowest_dirty_block_ptr;
-         // Care must be taken to write out to the existing pages device
-         // as this may differ from the user supplied 'dev'.
-         if(dev_scan(block_dev[i],block_map[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         if(dev_write(block_dev[i], block, block_array[i]) != DEV_OK) {
-            return BLOCK_FAIL;
-         }
-         block_map[i] = block;
-         block_dev[i] = dev;
-         memcpy(block_array[i],data,DEV_BLOCK_SIZE);
-         curr = i;
-         dirty[i] = true;
-         if(block_lru[i] < BLOCK_MAX_LRU) {
-            block_lru[i] = ++highest;
-         }
-         return BLOCK_OK;
+block_rtvl_t block_write(int dev, block_t block, char *data)
+{
+   register block_t i = 0;
+
+   if(dev < 0 || block < 0 || !data) {
+      return BLOCK_PARAM;
    }
-   return BLOCK_FAIL; 
+   i = block_find(dev, block);
+   if(i == BLOCK_NOPOS) {
+      // Not in the cache, we do our block replacement algorithm
+      // which is the same as block_read.
+      ++block_stat_get(dev)->misses;
+      i = block_alloc(dev, block);
+      if(i == BLOCK_NOPOS) {
+         return BLOCK_FAIL;
+      }
+   } else {
+      ++block_stat_get(dev)->hits;
+   }
+   memcpy(block_array[i],data,DEV_BLOCK_SIZE);
+   block_mark_dirty(i);
+   return BLOCK_OK;
 }
 
 block_rtvl_t block_free(int dev, block_t block)
@@ -389,25 +1089,24 @@ block_rtvl_t block_free(int dev, block_t block)
    if(dev < 0 || block < 0) {
       return BLOCK_PARAM;
    }
-   for(i = 0; i < BLOCK_ARRAY_SIZE; i++) {
-      /* We assume that if the block is not in the cache, 
-       * that it was written to disk already.
-       */
-      if(block_map[i] == block && block_dev[i] == dev) {
-         if(dirty[i]) {
-            if(dev_scan(dev, block) != DEV_OK) {
-                return BLOCK_FAIL;
-            }
-            if(dev_write(dev, block, block_array[i]) != DEV_OK) {
-                return BLOCK_FAIL;
-            }
+   /* We assume that if the block is not in the cache, 
+    * that it was written to disk already.
+    */
+   i = block_find(dev, block);
+   if(i != BLOCK_NOPOS) {
+      if(dirty[i]) {
+         if(dev_scan(dev, block) != DEV_OK) {
+            return BLOCK_FAIL;
+         }
+         if(block_dev_write(dev, block, block_array[i]) != DEV_OK) {
+            return BLOCK_FAIL;
          }
-         block_lru[i] = 0;
-         block_map[i] = BLOCK_FREE;
-         block_dev[i] = DEV_NODEV;
          dirty[i] = false;
-         curr = i;
-         return BLOCK_OK;
+         block_touch(i);
+      }
+      // A pinned block stays cached until its last block_put.
+      if(!block_ref[i]) {
+         block_release(i);
       }
    }
    return BLOCK_OK;
@@ -416,59 +1115,147 @@ block_rtvl_t block_free(int dev, block_t block)
 block_rtvl_t block_sync(int dev)
 {
     register block_t i = 0;
-    register block_rtvl_t rtvl = BLOCK_OK;
-    for(i = 0; i < BLOCK_ARRAY_SIZE; i++) {
-        // Write out all dirty blocks for the specified device.
-        if(dirty[i] && block_dev[i] == dev) {
-            if(block_disk_write(dev, block_map[i], block_array[i]) == BLOCK_FAIL) {
-                printk("block_sync:: error writing block [%d]\n", block_map[i]);
-                rtvl = BLOCK_FAIL;
-            } else {
-                dirty[i] = false;
-                if(block_lru[i] < BLOCK_MAX_LRU) {
-                    ++block_lru[i];
-                }
+    register int n = 0, k = 0;
+    // Let write-back in flight finish so that no slot is queued twice.
+    block_io_drain();
+    // Collect the dirty blocks for the specified device
+    // and write them out in ascending block order.
+    for(k = 0; k < 2; k++) {
+        for(i = list_tail[dirty_lists[k]]; i != BLOCK_NOPOS; i = block_prev[i]) {
+            if(block_dev[i] == dev) {
+                sync_tab[n++] = i;
             }
         }
     }
+    block_sort(sync_tab, n);
     // If any one fail, then the return of this function
     // is fail, otherwise success. We clear the dirty bit
     // on all buffers since the data was written.
     // If the block failed to write, its dirty bit is still set
     // after this call to true.
-    return rtvl;
+    k = block_write_sorted(sync_tab, n, true);
+    block_stat_get(dev)->sync_writes += n - k;
+    if(k) {
+        printk("block_sync:: error writing blocks dev=%d\n", dev);
+        return BLOCK_FAIL;
+    }
+    return BLOCK_OK;
 }
 
-block_rtvl_t block_disk_write(int dev, block_t block, char *data)
+int block_flush(void)
 {
-    register block_t i = 0,
-             found = BLOCK_NOPOS;
+    register block_t i = 0;
+    register int n = 0, k = 0, nr_dirty = 0, limit = 0, written = 0;
 
-    if(curr >= BLOCK_ARRAY_SIZE) {
-        curr = 0;
+    ++block_epoch;
+    block_io_reap();
+    nr_dirty = list_len[BLOCK_LIST_DIRTY] + list_len[BLOCK_LIST_HOT_DIRTY];
+    limit = (block_nr * block_dirty_ratio) / 100;
+    // Pick from the least recently used end of the dirty lists,
+    // cold before hot. Pinned slots may be in the middle of an
+    // update and are left for a later pass.
+    for(k = 0; k < 2; k++) {
+        for(i = list_tail[dirty_lists[k]]; 
+            i != BLOCK_NOPOS && n < BLOCK_FLUSH_MAX; i = block_prev[i]) {
+            if(block_ref[i]) {
+                continue;
+            }
+            if(nr_dirty - n <= limit && 
+               block_epoch - block_dirtied[i] < block_dirty_age) {
+                continue;
+            }
+            flush_tab[n++] = i;
+        }
     }
-    for(i = curr; i < BLOCK_ARRAY_SIZE; i++) {
-        if(block_map[i] == block && block_dev[i] == dev) {
-            found = i;
-            break;
+    // Write in ascending (dev, block) order, merging runs. The
+    // writes are not waited for, the slots stay pinned until then.
+    block_sort(flush_tab, n);
+    block_write_sorted(flush_tab, n, false);
+    for(k = 0; k < n; k++) {
+        if(!dirty[flush_tab[k]] || block_io[flush_tab[k]] >= 0) {
+            ++block_stat_get(block_dev[flush_tab[k]])->sync_writes;
+            ++written;
         }
     }
-    if(curr && found == BLOCK_NOPOS) {
-        for(i = 0; i < curr; i++) {
-            if(block_map[i] == block && block_dev[i] == dev) {
-                found = i;
-                break;
-            }
+    return written;
+}
+
+block_rtvl_t block_flush_tune(int ratio, int age)
+{
+    if(ratio < 0 || ratio > 100 || age < 0) {
+        return BLOCK_PARAM;
+    }
+    block_dirty_ratio = ratio;
+    block_dirty_age = age;
+    return BLOCK_OK;
+}
+
+block_rtvl_t block_set_policy(int policy)
+{
+    register block_t i = 0, next = 0;
+
+    if(policy != BLOCK_POLICY_LRU && policy != BLOCK_POLICY_2Q) {
+        return BLOCK_PARAM;
+    }
+    if(policy == BLOCK_POLICY_LRU && block_nr) {
+        // Fold the hot lists back into the clean and dirty lists.
+        for(i = list_tail[BLOCK_LIST_HOT_CLEAN]; i != BLOCK_NOPOS; i = next) {
+            next = block_prev[i];
+            block_hot[i] = false;
+            block_touch(i);
         }
+        for(i = list_tail[BLOCK_LIST_HOT_DIRTY]; i != BLOCK_NOPOS; i = next) {
+            next = block_prev[i];
+            block_hot[i] = false;
+            block_touch(i);
+        }
+    }
+    block_policy = policy;
+    return BLOCK_OK;
+}
+
+block_rtvl_t block_stat(int dev, block_stat_t *st)
+{
+    register int i = 0;
+
+    if(dev < 0 || !st) {
+        return BLOCK_PARAM;
     }
+    for(i = 0; i < BLOCK_STAT_DEVS; i++) {
+        if(stat_dev[i] == dev) {
+            memcpy(st, &stat_tab[i], sizeof(block_stat_t));
+            return BLOCK_OK;
+        }
+    }
+    // Nothing was counted for the device yet.
+    memset(st, 0, sizeof(block_stat_t));
+    return BLOCK_OK;
+}
+
+block_rtvl_t block_stat_reset(int dev)
+{
+    if(dev < 0) {
+        return BLOCK_PARAM;
+    }
+    memset(block_stat_get(dev), 0, sizeof(block_stat_t));
+    return BLOCK_OK;
+}
+
+block_rtvl_t block_disk_write(int dev, block_t block, char *data)
+{
+    register block_t i = 0,
+             found = BLOCK_NOPOS;
+
+    found = block_find(dev, block);
     if(found != BLOCK_NOPOS) {
+        i = found;
         if(memcmp(block_array[i], data, DEV_BLOCK_SIZE) != 0) {
             memcpy(block_array[i], data, DEV_BLOCK_SIZE); 
         }
         if(dev_scan(dev,block) != DEV_OK) {
             return BLOCK_FAIL; 
         }
-        if(dev_write(dev, block, block_array[i]) != DEV_OK) {
+        if(block_dev_write(dev, block, block_array[i]) != DEV_OK) {
             return BLOCK_FAIL;
         }
         return BLOCK_OK;
@@ -483,7 +1270,7 @@ block_rtvl_t block_disk_write(int dev, block_t block, char *data)
     if(dev_scan(dev,block) != DEV_OK) {
         return BLOCK_FAIL; 
     }
-    if(dev_write(dev, block, data) != DEV_OK) {
+    if(block_dev_write(dev, block, data) != DEV_OK) {
         return BLOCK_FAIL;
     }
     return BLOCK_OK;
@@ -494,31 +1281,16 @@ block_rtvl_t block_disk_write_sync_cache(int dev, block_t block, char *data)
     register block_t i = 0,
              found = BLOCK_NOPOS;
 
-    if(curr >= BLOCK_ARRAY_SIZE) {
-        curr = 0;
-    }
-    for(i = curr; i < BLOCK_ARRAY_SIZE; i++) {
-        if(block_map[i] == block && block_dev[i] == dev) {
-            found = i;
-            break;
-        }
-    }
-    if(curr && found == BLOCK_NOPOS) {
-        for(i = 0; i < curr; i++) {
-            if(block_map[i] == block && block_dev[i] == dev) {
-                found = i;
-                break;
-            }
-        }
-    }
+    found = block_find(dev, block);
     if(found != BLOCK_NOPOS) {
+        i = found;
         if(memcmp(block_array[i], data, DEV_BLOCK_SIZE) != 0) {
             memcpy(block_array[i], data, DEV_BLOCK_SIZE); 
         }
         if(dev_scan(dev,block) != DEV_OK) {
             return BLOCK_FAIL; 
         }
-        if(dev_write(dev, block, block_array[i]) != DEV_OK) {
+        if(block_dev_write(dev, block, block_array[i]) != DEV_OK) {
             return BLOCK_FAIL;
         }
         return BLOCK_OK;
@@ -532,7 +1304,7 @@ block_rtvl_t block_disk_write_sync_cache(int dev, block_t block, char *data)
     if(dev_scan(dev,block) != DEV_OK) {
         return BLOCK_FAIL; 
     }
-    if(dev_write(dev, block, data) != DEV_OK) {
+    if(block_dev_write(dev, block, data) != DEV_OK) {
         return BLOCK_FAIL;
     }
     return block_read(dev, block, data);
@@ -540,16 +1312,24 @@ block_rtvl_t block_disk_write_sync_cache(int dev, block_t block, char *data)
 
 block_rtvl_t block_close(int dev)
 {
+    register int i = 0;
     bool error = false;
     if(block_sync(dev) != BLOCK_OK) {
         error = true; 
     }
+    // Forget the read-ahead state, the device number may be reused.
+    for(i = 0; i < BLOCK_RA_DEVS; i++) {
+        if(ra_dev[i] == dev) {
+            ra_dev[i] = DEV_NODEV;
+        }
+    }
     if(dev_close(dev) != DEV_OK) {
         error = true;
     }
     if(error) {
         return BLOCK_FAIL;
     }
+    return BLOCK_OK;
 }
 
 void block_reinit()
@@ -562,6 +1342,101 @@ void block_reinit()
 }
 
 #ifdef _TEST_BLOCK
+#define BLOCK_BENCH_LOOKUPS (1024 * 1024)
+//
+// block_bench:
+// Measure the cost of a cache hit as the number of cached blocks grows.
+// Each pass fills 'n' slots with block_write and then times
+// BLOCK_BENCH_LOOKUPS block_read calls against blocks known to be
+// resident. With the hash index the time per lookup should stay flat.
+// Build with -DBLOCK_ARRAY_SIZE=16384 to run passes from 128 to 16384.
+//
+int block_bench()
+{
+   block_t i = 0, n = 0;
+   int dev = 0;
+   char buf[DEV_BLOCK_SIZE]={0};
+   clock_t start = 0, end = 0;
+
+   for(n = 128; n <= BLOCK_ARRAY_SIZE; n <<= 1) {
+        block_reinit();
+        if(block_open("./block_cache.dat", &dev) != BLOCK_OK) {
+            printf("error opening cache\n");
+            return 1;
+        }
+        for(i = 0; i < n; ++i) {
+            sprintf(buf,"%lu\n",i);
+            if(block_write(dev, i, buf) != BLOCK_OK) {
+                printf("error writing block\n");
+                return 1;
+            }
+        }
+        start = clock();
+        for(i = 0; i < BLOCK_BENCH_LOOKUPS; ++i) {
+            if(block_read(dev, (i * 7) % n, buf) != BLOCK_OK) {
+                printf("error reading block\n");
+                return 1;
+            }
+        }
+        end = clock();
+        printf("bench blocks %6lu lookups %d ns/lookup %.1f\n", n,
+               BLOCK_BENCH_LOOKUPS,
+               ((double)(end - start) * 1e9 / CLOCKS_PER_SEC) / BLOCK_BENCH_LOOKUPS);
+        if(block_close(dev) != BLOCK_OK) {
+            printf("error closing cache\n");
+            return 1;
+        }
+   }
+   return 0;
+}
+
+//
+// block_scan_test:
+// Check that in 2Q mode a long sequential scan does not flush
+// blocks which are being reused. The hot blocks are read, pushed
+// out by a scan so they become ghosts and read again, which makes
+// them hot. A scan four times the size of the cache must then
+// leave them cached.
+//
+#define BLOCK_SCAN_HOT 8
+int block_scan_test()
+{
+   block_t i = 0;
+   int dev = 0;
+   char buf[DEV_BLOCK_SIZE]={0};
+
+   block_reinit();
+   if(block_open("./block_cache.dat", &dev) != BLOCK_OK) {
+        printf("error opening cache\n");
+        return 1;
+   }
+   block_set_policy(BLOCK_POLICY_2Q);
+   for(i = 0; i < BLOCK_SCAN_HOT; ++i) {
+        block_read(dev, i, buf);
+   }
+   for(i = 0; i < block_nr; ++i) {
+        block_read(dev, 1000 + i, buf);
+   }
+   for(i = 0; i < BLOCK_SCAN_HOT; ++i) {
+        block_read(dev, i, buf);
+   }
+   for(i = 0; i < 4 * block_nr; ++i) {
+        block_read(dev, 5000 + i, buf);
+   }
+   for(i = 0; i < BLOCK_SCAN_HOT; ++i) {
+        if(block_lookup(dev, i) == BLOCK_NOPOS) {
+            printf("scan failed\n");
+            return 1;
+        }
+   }
+   printf("scan ok\n");
+   if(block_close(dev) != BLOCK_OK) {
+        printf("error closing cache\n");
+        return 1;
+   }
+   return 0;
+}
+
 int main(int argc, char **argv)
 {
    // This test checks the buffer logic in reading/writing the first three blocks
@@ -571,6 +1446,7 @@ int main(int argc, char **argv)
    // all of the blocks and reads them ok.
    block_t i = 0, dev = 0;
    char buf[DEV_BLOCK_SIZE]={0};
+   block_stat_t st;
    // TODO - Finish writing test driver.
    if(block_open("./block_cache.dat", &dev) != BLOCK_OK) {
         printf("error opening cache\n");
@@ -625,10 +1501,17 @@ int main(int argc, char **argv)
         }
    }
    printf("read ok\n");
+   block_stat(dev, &st);
+   printf("stat hits %lu misses %lu ra %lu/%lu evict %lu/%lu reads %lu writes %lu\n",
+          st.hits, st.misses, st.ra_hits, st.ra_blocks, st.evict_clean,
+          st.evict_dirty, st.dev_reads, st.dev_writes);
    if(block_close(dev) != BLOCK_OK) {
         printf("error closing cache\n");
         return 1;
    }
-   return 0;
+   if(block_scan_test()) {
+        return 1;
+   }
+   return block_bench();
 }
 #endif
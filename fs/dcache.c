@@ -0,0 +1,288 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      dcache.c
+//
+// @description:
+//      Directory entry cache used by path resolution.
+//      Without it every component of a path costs a read of
+//      each inode in the directory until the name matches.
+//      Names that were looked up and not found are kept as
+//      well, with INODE_NULL as their block, so a failed open
+//      or stat of the same path does not scan again.
+//      Entries are hashed on (dev, parent, name) and replaced
+//      least recently used first.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#include "bool.h"
+#include "paths.h"
+#include "block.h"
+#include "dev.h"
+#include "inode.h"
+#include "compat.h"
+
+#if defined(_TEST_DCACHE_INC) || defined(_TEST_DCACHE)
+#include <stdio.h>
+#include <string.h>
+#define printk printf
+#else
+#include <ox/error_rpt.h>
+#include <ox/lib/string.h>
+#endif
+
+#include "dcache.h"
+
+#define DCACHE_NOPOS -1
+
+typedef struct dcache_entry {
+    int     dev;                   // DEV_NODEV if the entry is free.
+    block_t parent;                // Directory the name is in.
+    block_t block;                 // Inode of the name or INODE_NULL.
+    char    name[DCACHE_NAME_LEN];
+    int     hash_next;             // Next entry in the same hash chain.
+    int     prev;                  // More recently used entry.
+    int     next;                  // Less recently used entry.
+} dcache_entry_t;
+
+static bool init = false;
+static dcache_entry_t dcache_tab[DCACHE_SIZE];
+static int dcache_hash[DCACHE_HASH]; // First entry in each chain or DCACHE_NOPOS.
+static int dcache_head = DCACHE_NOPOS; // Most recently used entry.
+static int dcache_tail = DCACHE_NOPOS; // Least recently used entry, replaced next.
+
+static void dcache_init()
+{
+    int i = 0;
+    for(i = 0; i < DCACHE_HASH; ++i) {
+        dcache_hash[i] = DCACHE_NOPOS;
+    }
+    // Every entry starts free, on the list in slot order.
+    for(i = 0; i < DCACHE_SIZE; ++i) {
+        dcache_tab[i].dev = DEV_NODEV;
+        dcache_tab[i].hash_next = DCACHE_NOPOS;
+        dcache_tab[i].prev = i - 1;
+        dcache_tab[i].next = (i == DCACHE_SIZE - 1) ? DCACHE_NOPOS : i + 1;
+    }
+    dcache_head = 0;
+    dcache_tail = DCACHE_SIZE - 1;
+    init = true;
+}
+
+static int dcache_hash_fn(int dev, block_t parent, char *name)
+{
+    register unsigned h = (unsigned)parent + (unsigned)dev * 31;
+    while(*name) {
+        h = h * 31 + (unsigned char)*name++;
+    }
+    return h % DCACHE_HASH;
+}
+
+static void dcache_list_remove(int i)
+{
+    if(dcache_tab[i].prev != DCACHE_NOPOS) {
+        dcache_tab[dcache_tab[i].prev].next = dcache_tab[i].next;
+    } else {
+        dcache_head = dcache_tab[i].next;
+    }
+    if(dcache_tab[i].next != DCACHE_NOPOS) {
+        dcache_tab[dcache_tab[i].next].prev = dcache_tab[i].prev;
+    } else {
+        dcache_tail = dcache_tab[i].prev;
+    }
+}
+
+static void dcache_list_front(int i)
+{
+    dcache_list_remove(i);
+    dcache_tab[i].prev = DCACHE_NOPOS;
+    dcache_tab[i].next = dcache_head;
+    if(dcache_head != DCACHE_NOPOS) {
+        dcache_tab[dcache_head].prev = i;
+    } else {
+        dcache_tail = i;
+    }
+    dcache_head = i;
+}
+
+static void dcache_list_back(int i)
+{
+    dcache_list_remove(i);
+    dcache_tab[i].next = DCACHE_NOPOS;
+    dcache_tab[i].prev = dcache_tail;
+    if(dcache_tail != DCACHE_NOPOS) {
+        dcache_tab[dcache_tail].next = i;
+    } else {
+        dcache_head = i;
+    }
+    dcache_tail = i;
+}
+
+static int dcache_find(int dev, block_t parent, char *name)
+{
+    register int i = dcache_hash[dcache_hash_fn(dev, parent, name)];
+    for(; i != DCACHE_NOPOS; i = dcache_tab[i].hash_next) {
+        if(dcache_tab[i].dev == dev && dcache_tab[i].parent == parent &&
+           !strcmp(dcache_tab[i].name, name)) {
+            return i;
+        }
+    }
+    return DCACHE_NOPOS;
+}
+
+//
+// dcache_remove:
+//
+// Unhash entry 'i', free it and make it the next one replaced.
+//
+static void dcache_remove(int i)
+{
+    int h = dcache_hash_fn(dcache_tab[i].dev, dcache_tab[i].parent, dcache_tab[i].name);
+    int j = 0;
+    if(dcache_hash[h] == i) {
+        dcache_hash[h] = dcache_tab[i].hash_next;
+    } else {
+        for(j = dcache_hash[h]; j != DCACHE_NOPOS; j = dcache_tab[j].hash_next) {
+            if(dcache_tab[j].hash_next == i) {
+                dcache_tab[j].hash_next = dcache_tab[i].hash_next;
+                break;
+            }
+        }
+    }
+    dcache_tab[i].hash_next = DCACHE_NOPOS;
+    dcache_tab[i].dev = DEV_NODEV;
+    dcache_list_back(i);
+}
+
+dcache_rtvl_t dcache_lookup(int dev, block_t parent, char *name, block_t *block)
+{
+    int i = 0;
+    if(!init) {
+        dcache_init();
+    }
+    if(strlen(name) >= DCACHE_NAME_LEN) {
+        return DCACHE_MISS;
+    }
+    if((i = dcache_find(dev, parent, name)) == DCACHE_NOPOS) {
+        return DCACHE_MISS;
+    }
+    dcache_list_front(i);
+    *block = dcache_tab[i].block;
+    return DCACHE_HIT;
+}
+
+void dcache_enter(int dev, block_t parent, char *name, block_t block)
+{
+    int i = 0, h = 0;
+    if(!init) {
+        dcache_init();
+    }
+    if(strlen(name) >= DCACHE_NAME_LEN) {
+        return;
+    }
+    if((i = dcache_find(dev, parent, name)) == DCACHE_NOPOS) {
+        i = dcache_tail;
+        if(dcache_tab[i].dev != DEV_NODEV) {
+            dcache_remove(i);
+        }
+        dcache_tab[i].dev = dev;
+        dcache_tab[i].parent = parent;
+        strcpy(dcache_tab[i].name, name);
+        h = dcache_hash_fn(dev, parent, name);
+        dcache_tab[i].hash_next = dcache_hash[h];
+        dcache_hash[h] = i;
+    }
+    dcache_tab[i].block = block;
+    dcache_list_front(i);
+}
+
+void dcache_invalidate(int dev, block_t block)
+{
+    int i = 0;
+    if(!init) {
+        return;
+    }
+    for(i = 0; i < DCACHE_SIZE; ++i) {
+        if(dcache_tab[i].dev == dev &&
+           (dcache_tab[i].block == block || dcache_tab[i].parent == block)) {
+            dcache_remove(i);
+        }
+    }
+}
+
+void dcache_purge(int dev)
+{
+    int i = 0;
+    if(!init) {
+        return;
+    }
+    for(i = 0; i < DCACHE_SIZE; ++i) {
+        if(dcache_tab[i].dev == dev) {
+            dcache_remove(i);
+        }
+    }
+}
+
+#ifdef _TEST_DCACHE
+int
+main(int argc, char **argv)
+{
+    char name[DCACHE_NAME_LEN] = {0};
+    block_t block = 0;
+    int i = 0, fail = 0;
+
+    // Fill past the size, only the most recent DCACHE_SIZE remain.
+    for(i = 0; i < DCACHE_SIZE + 10; ++i) {
+        sprintf(name, "file%d", i);
+        dcache_enter(0, 1, name, 100 + i);
+    }
+    for(i = 0; i < DCACHE_SIZE + 10; ++i) {
+        sprintf(name, "file%d", i);
+        if((dcache_lookup(0, 1, name, &block) == DCACHE_HIT) != (i >= 10) ||
+           (i >= 10 && block != 100 + i)) {
+            printk("error lookup name=%s\n", name);
+            fail++;
+        }
+    }
+    // Negative entries, other devices and directories are distinct.
+    dcache_enter(0, 2, "file20", INODE_NULL);
+    if(dcache_lookup(0, 2, "file20", &block) != DCACHE_HIT || block != INODE_NULL ||
+       dcache_lookup(1, 1, "file20", &block) != DCACHE_MISS) {
+        printk("error negative entry\n");
+        fail++;
+    }
+    // Invalidate drops the name of a block and the names below it.
+    dcache_enter(0, 120, "child", 500);
+    dcache_invalidate(0, 120);
+    if(dcache_lookup(0, 1, "file20", &block) != DCACHE_MISS ||
+       dcache_lookup(0, 120, "child", &block) != DCACHE_MISS ||
+       dcache_lookup(0, 1, "file21", &block) != DCACHE_HIT) {
+        printk("error invalidate\n");
+        fail++;
+    }
+    dcache_purge(0);
+    if(dcache_lookup(0, 1, "file21", &block) != DCACHE_MISS) {
+        printk("error purge\n");
+        fail++;
+    }
+    printk("dcache test %s\n", fail ? "failed" : "passed");
+    return fail;
+}
+#endif
@@ -15,11 +15,6 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 */
-// TODO - change this to call ata_read, ata_write
-//      - lseek is a no-op
-//      - dev_open likely will also be a no-op
-//        just return dev = 0 for primary drive
-//
 // @file:
 //      dev.c
 //
@@ -27,55 +22,750 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 //      Low level device interface. For testing in user space,
 //      we read/write in sector blocks from a top a file system.
 //      In kernel mode, we make the actual calls to a hard disk
-//      via a driver.
+//      via a driver. A device is then a drive as the driver
+//      numbers them, 0-3 from the primary master to the secondary
+//      slave, each with its own request queue.
+//
+//      In user space blocks are moved with pread/pwrite at their
+//      offset in the file. Build with _DEV_DIRECT to open it O_DIRECT,
+//      bypassing the host page cache, or with _DEV_MMAP to map it.
 //
 //      NOTE: This code was tested as part of testing block.c.
 //
 // @author:
 //      Dr. Roger G. Doss, PhD
 //
+#if defined(_USER_SPACE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // For O_DIRECT, preadv and pwritev.
+#endif
 #include "block.h"
 #include "dev.h"
+#include "bool.h"
 
 #ifdef _USER_SPACE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #else
 //#include "pio.h"
 #include <drivers/block/pio.h>
+#include "paths.h"
+#include "inode.h" // Needed by compat.h.
+#include <ox/fs/compat.h> // For current_process and sleep_on.
+#include <platform/asm_core/util.h>
+#endif
+
+//
+// Request queues.
+//
+// Each device in use has a queue of pending requests linked in
+// ascending block order and at most one transfer in flight made
+// of one or more of them. The queue is only touched with interrupts
+// disabled in the kernel as the disk interrupt completes transfers
+// and starts the next one.
+//
+typedef struct dev_queue {
+   int dev;              // Device or DEV_NODEV if the entry is free.
+   bool plugged;         // Hold requests back, see dev_plug.
+   block_t pos;          // Block after the last transfer, C-LOOK's head.
+   dev_req_t *head;      // Pending requests in block order.
+   dev_req_t *active;    // Requests of the transfer in flight.
+   char *vec[DEV_IOV_MAX]; // Buffers of the transfer in flight.
+#ifndef _USER_SPACE
+   char *sec[(DEV_SECTORS > 1) ? DEV_IOV_MAX * DEV_SECTORS : 1]; // The same by sector.
+#endif
+} dev_queue_t;
+
+static dev_queue_t dev_queue_tab[DEV_QUEUES];
+static bool dev_queue_init = false;
+static unsigned long dev_seq = 0;
+
+#ifdef _USER_SPACE
+#define DEV_LOCK(flags)   ((void)(flags))
+#define DEV_UNLOCK(flags) ((void)(flags))
+#else
+#define DEV_LOCK(flags)   { (flags) = asm_get_eflags(); asm_disable_interrupt(); }
+#define DEV_UNLOCK(flags) asm_set_eflags(flags)
+#endif
+
+//
+// dev_queue_get:
+// Return the queue of 'dev', claiming a free entry if 'claim'
+// is set and it has none, or NULL.
+//
+static dev_queue_t *dev_queue_get(int dev, bool claim)
+{
+   register int i = 0, j = -1;
+   if(!dev_queue_init) {
+      for(i = 0; i < DEV_QUEUES; i++) {
+         dev_queue_tab[i].dev = DEV_NODEV;
+      }
+      dev_queue_init = true;
+   }
+   for(i = 0; i < DEV_QUEUES; i++) {
+      if(dev_queue_tab[i].dev == dev) {
+         return &dev_queue_tab[i];
+      }
+      if(dev_queue_tab[i].dev == DEV_NODEV && j < 0) {
+         j = i;
+      }
+   }
+   if(j < 0 || !claim) {
+      return NULL;
+   }
+   dev_queue_tab[j].dev = dev;
+   dev_queue_tab[j].plugged = false;
+   dev_queue_tab[j].pos = 0;
+   dev_queue_tab[j].head = NULL;
+   dev_queue_tab[j].active = NULL;
+   return &dev_queue_tab[j];
+}
+
+#ifdef _USER_SPACE
+//
+// dev_iov_skip:
+// Drop the first 'len' bytes of the 'n' entries at 'iov' after a
+// partial transfer, returning the first entry left.
+//
+static struct iovec *dev_iov_skip(struct iovec *iov, int *n, size_t len)
+{
+   while(*n && len >= iov->iov_len) {
+      len -= iov->iov_len;
+      iov++;
+      (*n)--;
+   }
+   if(*n) {
+      iov->iov_base = (char *)iov->iov_base + len;
+      iov->iov_len -= len;
+   }
+   return iov;
+}
+
+//
+// dev_pxfer:
+// Move 'count' blocks at 'block' with preadv/pwritev, one call for
+// the run unless the host returns short. Blocks past the end of the
+// file read as zeros.
+//
+static dev_rtvl_t dev_pxfer(int op, int dev, block_t block, int count, char **data)
+{
+   struct iovec iov[DEV_IOV_MAX], *v = iov;
+   off_t pos = (off_t)block * DEV_BLOCK_SIZE;
+   ssize_t len = 0, done = 0, want = (ssize_t)count * DEV_BLOCK_SIZE;
+   register int i = 0;
+   int n = count;
+   for(i = 0; i < count; ++i) {
+      iov[i].iov_base = data[i];
+      iov[i].iov_len = DEV_BLOCK_SIZE;
+   }
+   while(done < want) {
+      len = (op == DEV_REQ_WRITE) ? pwritev(dev, v, n, pos + done)
+                                  : preadv(dev, v, n, pos + done);
+      if(len < 0 && errno == EINTR) {
+         continue;
+      }
+      if(len <= 0) {
+         break;
+      }
+      done += len;
+      v = dev_iov_skip(v, &n, len);
+   }
+   if(len < 0 || (op == DEV_REQ_WRITE && done < want)) {
+      return DEV_FAIL;
+   }
+   for(i = done / DEV_BLOCK_SIZE; i < count; ++i) {
+      len = done - (ssize_t)i * DEV_BLOCK_SIZE;
+      len = (len > 0) ? len : 0;
+      memset(data[i] + len, 0x0, DEV_BLOCK_SIZE - len);
+   }
+   return DEV_OK;
+}
+
+#ifdef _DEV_DIRECT
+#define DEV_OPEN_FLAGS   O_DIRECT
+#define DEV_DIRECT_ALIGN 512
+static char *dev_bounce = NULL;
+
+//
+// dev_dxfer:
+// dev_pxfer for a file opened O_DIRECT. Buffers the host can not
+// transfer directly are staged in an aligned bounce buffer, and if
+// it refuses the transfer anyway the file drops back to buffered I/O.
+//
+static dev_rtvl_t dev_dxfer(int op, int dev, block_t block, int count, char **data)
+{
+   char *vec[DEV_IOV_MAX];
+   dev_rtvl_t rtvl = DEV_OK;
+   register int i = 0;
+   for(i = 0; i < count && !((unsigned long)data[i] % DEV_DIRECT_ALIGN); ++i)
+      ;
+   if(i < count) {
+      if(!dev_bounce &&
+         posix_memalign((void **)&dev_bounce, DEV_DIRECT_ALIGN,
+                        DEV_IOV_MAX * DEV_BLOCK_SIZE)) {
+         dev_bounce = NULL;
+         return DEV_FAIL;
+      }
+      for(i = 0; i < count; ++i) {
+         vec[i] = dev_bounce + i * DEV_BLOCK_SIZE;
+         if(op == DEV_REQ_WRITE) {
+            memcpy(vec[i], data[i], DEV_BLOCK_SIZE);
+         }
+      }
+      if((rtvl = dev_dxfer(op, dev, block, count, vec)) == DEV_OK &&
+         op == DEV_REQ_READ) {
+         for(i = 0; i < count; ++i) {
+            memcpy(data[i], vec[i], DEV_BLOCK_SIZE);
+         }
+      }
+      return rtvl;
+   }
+   if((rtvl = dev_pxfer(op, dev, block, count, data)) == DEV_FAIL &&
+      errno == EINVAL && (fcntl(dev, F_GETFL) & O_DIRECT)) {
+      fcntl(dev, F_SETFL, fcntl(dev, F_GETFL) & ~O_DIRECT);
+      rtvl = dev_pxfer(op, dev, block, count, data);
+   }
+   return rtvl;
+}
+#else
+#define DEV_OPEN_FLAGS 0
 #endif
 
+#ifdef _DEV_MMAP
+//
+// Mapped files.
+//
+// The mapping reserves more address space than the file holds so
+// that a growing image is only remapped when it passes the reserve,
+// pages past the end of the file are never touched.
+//
+#define DEV_MAPS      DEV_QUEUES
+#define DEV_MAP_MIN   (64UL << 20)
+
+typedef struct dev_map {
+   int dev;      // File or DEV_NODEV if the entry is free.
+   char *addr;   // Start of the mapping.
+   size_t len;   // Bytes reserved.
+   size_t size;  // Bytes in the file.
+} dev_map_t;
+
+static dev_map_t dev_map_tab[DEV_MAPS];
+static bool dev_map_init = false;
+
+static dev_map_t *dev_map_get(int dev)
+{
+   register int i = 0;
+   if(!dev_map_init) {
+      for(i = 0; i < DEV_MAPS; i++) {
+         dev_map_tab[i].dev = DEV_NODEV;
+      }
+      dev_map_init = true;
+   }
+   for(i = 0; i < DEV_MAPS; i++) {
+      if(dev_map_tab[i].dev == dev) {
+         return &dev_map_tab[i];
+      }
+   }
+   return NULL;
+}
+
+//
+// dev_map_reserve:
+// Map at least 'size' bytes of the file, doubling the reserve.
+//
+static dev_rtvl_t dev_map_reserve(dev_map_t *m, size_t size)
+{
+   size_t len = m->len ? m->len : DEV_MAP_MIN;
+   char *addr = NULL;
+   while(len < size) {
+      len <<= 1;
+   }
+   if(len == m->len) {
+      return DEV_OK;
+   }
+   addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, m->dev, 0);
+   if(addr == MAP_FAILED) {
+      return DEV_FAIL;
+   }
+   if(m->addr) {
+      munmap(m->addr, m->len);
+   }
+   m->addr = addr;
+   m->len = len;
+   return DEV_OK;
+}
+
+static dev_rtvl_t dev_map_open(int dev)
+{
+   dev_map_t *m = dev_map_get(DEV_NODEV);
+   struct stat st;
+   if(!m || fstat(dev, &st) < 0) {
+      return DEV_FAIL;
+   }
+   m->dev = dev;
+   m->addr = NULL;
+   m->len = 0;
+   m->size = st.st_size;
+   if(dev_map_reserve(m, m->size) != DEV_OK) {
+      m->dev = DEV_NODEV;
+      return DEV_FAIL;
+   }
+   return DEV_OK;
+}
+
+static void dev_map_close(int dev)
+{
+   dev_map_t *m = dev_map_get(dev);
+   if(m) {
+      munmap(m->addr, m->len);
+      m->dev = DEV_NODEV;
+   }
+}
+
+//
+// dev_map_xfer:
+// Copy 'count' blocks at 'block' in or out of the mapping, growing
+// the file for a write past its end.
+//
+static dev_rtvl_t dev_map_xfer(int op, int dev, block_t block, int count, char **data)
+{
+   dev_map_t *m = dev_map_get(dev);
+   size_t pos = (size_t)block * DEV_BLOCK_SIZE, end = pos + (size_t)count * DEV_BLOCK_SIZE;
+   size_t len = 0;
+   register int i = 0;
+   if(!m) {
+      return dev_pxfer(op, dev, block, count, data);
+   }
+   if(op == DEV_REQ_WRITE) {
+      if(end > m->size) {
+         if(ftruncate(dev, end) < 0 || dev_map_reserve(m, end) != DEV_OK) {
+            return DEV_FAIL;
+         }
+         m->size = end;
+      }
+      for(i = 0; i < count; ++i) {
+         memcpy(m->addr + pos + i * DEV_BLOCK_SIZE, data[i], DEV_BLOCK_SIZE);
+      }
+      return DEV_OK;
+   }
+   for(i = 0; i < count; ++i, pos += DEV_BLOCK_SIZE) {
+      len = (m->size > pos) ? m->size - pos : 0;
+      len = (len > DEV_BLOCK_SIZE) ? DEV_BLOCK_SIZE : len;
+      memcpy(data[i], m->addr + pos, len);
+      memset(data[i] + len, 0x0, DEV_BLOCK_SIZE - len);
+   }
+   return DEV_OK;
+}
+#endif
+#endif
+
+#ifndef _USER_SPACE
+//
+// dev_sectors:
+// The drive moves sectors, so describe the 'count' blocks in 'data'
+// as DEV_SECTORS sectors each in 'sec' and return it. The driver
+// merges them back into one DMA region. With 512 byte blocks
+// 'data' is returned as is.
+//
+static char **dev_sectors(char **sec, int count, char **data)
+{
+#if DEV_SECTORS > 1
+   register int i = 0;
+   for(i = 0; i < count * DEV_SECTORS; ++i) {
+      sec[i] = data[i / DEV_SECTORS] + (i % DEV_SECTORS) * DEV_SECTOR_SIZE;
+   }
+   return sec;
+#else
+   return data;
+#endif
+}
+#endif
+
+//
+// dev_xfer:
+// Move 'count' blocks starting at 'block' to or from 'data'
+// and wait for it, the synchronous path under the queue.
+//
+static dev_rtvl_t dev_xfer(int op, int dev, block_t block, int count, char **data)
+{
+#ifdef _USER_SPACE
+#if defined(_DEV_MMAP)
+   return dev_map_xfer(op, dev, block, count, data);
+#elif defined(_DEV_DIRECT)
+   return dev_dxfer(op, dev, block, count, data);
+#else
+   return dev_pxfer(op, dev, block, count, data);
+#endif
+#else
+   char *sec[(DEV_SECTORS > 1) ? DEV_IOV_MAX * DEV_SECTORS : 1];
+   data = dev_sectors(sec, count, data);
+   if(op == DEV_REQ_WRITE) {
+      return ata_writev(dev, (unsigned long)block * DEV_SECTORS,
+                        count * DEV_SECTORS, data) ? DEV_FAIL : DEV_OK;
+   }
+   return ata_readv(dev, (unsigned long)block * DEV_SECTORS,
+                    count * DEV_SECTORS, data) ? DEV_FAIL : DEV_OK;
+#endif
+}
+
+//
+// dev_queue_insert:
+// Link 'req' into the queue after the requests with a lower
+// or equal first block.
+//
+static void dev_queue_insert(dev_queue_t *q, dev_req_t *req)
+{
+   dev_req_t **pp = &q->head;
+   while(*pp && (*pp)->block <= req->block) {
+      pp = &(*pp)->next;
+   }
+   req->next = *pp;
+   *pp = req;
+}
+
+//
+// dev_hazard:
+// Return a request queued before 'req' that it overlaps on disk
+// where one of the two writes, or NULL. Such a request must be
+// issued first.
+//
+static dev_req_t *dev_hazard(dev_queue_t *q, dev_req_t *req)
+{
+   register dev_req_t *r = NULL;
+   for(r = q->head; r; r = r->next) {
+      if(r->seq < req->seq &&
+         (r->op == DEV_REQ_WRITE || req->op == DEV_REQ_WRITE) &&
+         r->block < req->block + req->count &&
+         req->block < r->block + r->count) {
+         return r;
+      }
+   }
+   return NULL;
+}
+
+static void dev_complete(dev_queue_t *q, dev_rtvl_t status);
+#ifndef _USER_SPACE
+static void dev_irq_done(void *arg, int status);
+#endif
+
+//
+// dev_start:
+// Issue the next transfers while the device is idle. The next one
+// is picked C-LOOK: the first request at or past the head, else
+// the lowest. Following requests of the same kind that continue
+// it on disk are issued with it. In the kernel a transfer is started
+// with ata_submit and completes from the interrupt, otherwise it is
+// done here. From the interrupt ('irq' set) nothing may wait, so a
+// transfer that can not be started asynchronously is left queued.
+//
+static void dev_start(dev_queue_t *q, bool irq)
+{
+   register dev_req_t *req = NULL, *last = NULL, *prev = NULL, *h = NULL;
+   register int n = 0, k = 0;
+   dev_rtvl_t status = DEV_OK;
+#ifndef _USER_SPACE
+   int rtvl = 0;
+#endif
+
+   while(!q->active && q->head && !q->plugged) {
+      for(req = q->head; req && req->block < q->pos; req = req->next)
+         ;
+      if(!req) {
+         req = q->head;
+      }
+      while((h = dev_hazard(q, req))) {
+         req = h;
+      }
+      for(n = 0; n < req->count; n++) {
+         q->vec[n] = req->data[n];
+      }
+      for(last = req; last->next && last->next->op == req->op &&
+          last->next->block == last->block + last->count &&
+          n + last->next->count <= DEV_IOV_MAX &&
+          !dev_hazard(q, last->next); last = last->next) {
+         for(k = 0; k < last->next->count; k++) {
+            q->vec[n++] = last->next->data[k];
+         }
+      }
+      // Unlink the run, it stays linked through 'next'.
+      if(q->head == req) {
+         q->head = last->next;
+      } else {
+         for(prev = q->head; prev->next != req; prev = prev->next)
+            ;
+         prev->next = last->next;
+      }
+      last->next = NULL;
+      q->active = req;
+      q->pos = req->block + n;
+#ifndef _USER_SPACE
+      rtvl = ata_submit(q->dev, (unsigned long)req->block * DEV_SECTORS,
+                        n * DEV_SECTORS, dev_sectors(q->sec, n, q->vec),
+                        req->op == DEV_REQ_WRITE, dev_irq_done, q);
+      if(!rtvl) {
+         return;
+      }
+      if(rtvl > 0 && irq) {
+         // Put it back for dev_wait or the next dev_submit.
+         q->active = NULL;
+         while(req) {
+            last = req->next;
+            dev_queue_insert(q, req);
+            req = last;
+         }
+         return;
+      }
+      status = (rtvl > 0) ? dev_xfer(req->op, q->dev, req->block, n, q->vec) : DEV_FAIL;
+#else
+      status = dev_xfer(req->op, q->dev, req->block, n, q->vec);
+#endif
+      dev_complete(q, status);
+   }
+}
+
+//
+// dev_complete:
+// End the transfer in flight, setting the status of its requests,
+// calling their completion routines and waking their waiters.
+//
+static void dev_complete(dev_queue_t *q, dev_rtvl_t status)
+{
+   register dev_req_t *req = q->active, *next = NULL;
+   q->active = NULL;
+   while(req) {
+      next = req->next;
+      req->next = NULL;
+      req->status = status;
+      if(req->done) {
+         req->done(req);
+      }
+#ifndef _USER_SPACE
+      if(req->waiter) {
+         wakeup(req);
+      }
+#endif
+      req = next;
+   }
+}
+
+#ifndef _USER_SPACE
+//
+// dev_irq_done:
+// Called by the ATA driver from the disk interrupt when a transfer
+// started by ata_submit ends. A failed DMA transfer is queued again,
+// the driver then falls back to PIO. Every queue is restarted as
+// one of them may have been waiting for the channel.
+//
+static void dev_irq_done(void *arg, int status)
+{
+   dev_queue_t *q = (dev_queue_t *)arg;
+   register dev_req_t *req = NULL, *next = NULL;
+   register int i = 0;
+   if(status) {
+      for(req = q->active, q->active = NULL; req; req = next) {
+         next = req->next;
+         dev_queue_insert(q, req);
+      }
+   } else {
+      dev_complete(q, DEV_OK);
+   }
+   for(i = 0; i < DEV_QUEUES; i++) {
+      if(dev_queue_tab[i].dev != DEV_NODEV) {
+         dev_start(&dev_queue_tab[i], true);
+      }
+   }
+}
+#endif
+
+dev_rtvl_t dev_submit(dev_req_t *req)
+{
+   dev_queue_t *q = NULL;
+   unsigned long flags = 0;
+   dev_rtvl_t status = DEV_OK;
+
+   if(!req || req->dev < 0 || req->count <= 0 || req->count > DEV_IOV_MAX ||
+      !req->data || (req->op != DEV_REQ_READ && req->op != DEV_REQ_WRITE)) {
+      return DEV_PARAM;
+   }
+   req->status = DEV_BUSY;
+   req->waiter = NULL;
+   req->next = NULL;
+   DEV_LOCK(flags);
+   req->seq = ++dev_seq;
+   if(!(q = dev_queue_get(req->dev, true))) {
+      // No queue to be had, do it now.
+      DEV_UNLOCK(flags);
+      req->status = dev_xfer(req->op, req->dev, req->block, req->count, req->data);
+      if(req->done) {
+         req->done(req);
+      }
+      return req->status;
+   }
+   dev_queue_insert(q, req);
+   dev_start(q, false);
+   status = req->status;
+   DEV_UNLOCK(flags);
+   return status;
+}
+
+dev_rtvl_t dev_wait(dev_req_t *req)
+{
+   dev_queue_t *q = NULL;
+   unsigned long flags = 0;
+
+   if(!req) {
+      return DEV_PARAM;
+   }
+   while(req->status == DEV_BUSY) {
+      DEV_LOCK(flags);
+      if((q = dev_queue_get(req->dev, false))) {
+         q->plugged = false;
+         dev_start(q, false);
+      }
+#ifndef _USER_SPACE
+      // Sleep until the disk interrupt, or the next clock tick
+      // in case it was missed and ata_poll has to finish it.
+      // Interrupts are still disabled so the wakeup from
+      // dev_complete can not come before the sleep.
+      if(req->status == DEV_BUSY && ata_poll(req->dev) && req->status == DEV_BUSY) {
+         if(current_process) {
+            req->waiter = current_process;
+            sleep_on(req, 1);
+            req->waiter = NULL;
+         } else {
+            asm_enable_interrupt();
+            asm_hlt();
+            asm_disable_interrupt();
+         }
+      }
+#endif
+      DEV_UNLOCK(flags);
+      if(!q && req->status == DEV_BUSY) {
+         // Not queued, it was never submitted.
+         return DEV_PARAM;
+      }
+   }
+   return req->status;
+}
+
+void dev_plug(int dev)
+{
+   dev_queue_t *q = NULL;
+   unsigned long flags = 0;
+   DEV_LOCK(flags);
+   if((q = dev_queue_get(dev, true))) {
+      q->plugged = true;
+   }
+   DEV_UNLOCK(flags);
+}
+
+void dev_unplug(int dev)
+{
+   dev_queue_t *q = NULL;
+   unsigned long flags = 0;
+   DEV_LOCK(flags);
+   if((q = dev_queue_get(dev, false))) {
+      q->plugged = false;
+      dev_start(q, false);
+   }
+   DEV_UNLOCK(flags);
+}
+
+//
+// dev_rw:
+// Submit a request and wait for it, used by the synchronous calls.
+//
+static dev_rtvl_t dev_rw(int op, int dev, block_t block, int count, char **data)
+{
+   dev_req_t req;
+   dev_rtvl_t rtvl = DEV_OK;
+   req.op = op;
+   req.dev = dev;
+   req.block = block;
+   req.count = count;
+   req.data = data;
+   req.done = NULL;
+   req.arg = NULL;
+   if((rtvl = dev_submit(&req)) != DEV_BUSY) {
+      return rtvl;
+   }
+   return dev_wait(&req);
+}
+
 dev_rtvl_t dev_open(char *path, int *dev)
 {
 #ifdef _USER_SPACE
    if(!path || !dev) {
       return DEV_PARAM;
    }
-   (*dev) = open(path, O_RDWR | O_CREAT, S_IRWXU); 
+   (*dev) = open(path, O_RDWR | O_CREAT | DEV_OPEN_FLAGS, S_IRWXU);
+   if(*dev < 0 && DEV_OPEN_FLAGS && errno == EINVAL) {
+      // The host file system can not do direct I/O.
+      (*dev) = open(path, O_RDWR | O_CREAT, S_IRWXU);
+   }
    if(*dev < 0) {
       *dev = DEV_FAIL;
       return DEV_FAIL;
    }
+#ifdef _DEV_MMAP
+   if(dev_map_open(*dev) != DEV_OK) {
+      // Fall back to pread/pwrite for this file.
+      return DEV_OK;
+   }
+#endif
    return DEV_OK;
 #else
-    // This is temporary, we need to mount properly
-    // based on the path and mount table.
-    // Right now, we check if there are any
-    // ATA drives and assign the first one (primary).
-    if(ata_nr_drives() > 0) {
-        *dev = 0;
-    }
-    return DEV_OK;
+   register int drive = 0;
+   if(!path || !dev) {
+      return DEV_PARAM;
+   }
+   // "/dev/hda" to "/dev/hdd" name a drive, anything else is
+   // the first ATA drive found.
+   if(path[0] == '/' && path[1] == 'd' && path[2] == 'e' && path[3] == 'v' &&
+      path[4] == '/' && path[5] == 'h' && path[6] == 'd' &&
+      path[7] >= 'a' && path[7] < 'a' + ATA_DRIVES && !path[8]) {
+      drive = path[7] - 'a';
+   } else {
+      while(drive < ATA_DRIVES && !ata_present(drive)) {
+         drive++;
+      }
+   }
+   if(drive >= ATA_DRIVES || !ata_present(drive)) {
+      *dev = DEV_FAIL;
+      return DEV_FAIL;
+   }
+   *dev = drive;
+   return DEV_OK;
 #endif
 }
 
 dev_rtvl_t dev_close(int dev)
 {
+   dev_queue_t *q = NULL;
+   unsigned long flags = 0;
+   // Let the queue drain and give up its entry.
+   if((q = dev_queue_get(dev, false))) {
+      dev_unplug(dev);
+      while(q->active || q->head) {
+         dev_wait(q->active ? q->active : q->head);
+      }
+      DEV_LOCK(flags);
+      q->dev = DEV_NODEV;
+      DEV_UNLOCK(flags);
+   }
 #ifdef _USER_SPACE
    if(dev < 0) {
       return DEV_PARAM;
    }
+#ifdef _DEV_MMAP
+   dev_map_close(dev);
+#endif
    close(dev);
    return DEV_OK;
 #else
@@ -85,56 +775,101 @@ dev_rtvl_t dev_close(int dev)
 
 dev_rtvl_t dev_read(int dev, block_t block, char *data)
 {
-#ifdef _USER_SPACE
    if(dev < 0 || !data) {
       return DEV_PARAM;
    }
-   if(read(dev, data, DEV_BLOCK_SIZE) < 0) {
-      return DEV_FAIL;
-   }
-   return DEV_OK;
-#else
-    // Do a PIO read of the drive.
-    if(!ata_read(dev, block, data)) {
-        return DEV_OK;
-    } else {
-        return DEV_FAIL;
-    }
-#endif
+   return dev_rw(DEV_REQ_READ, dev, block, 1, &data);
 }
 
 dev_rtvl_t dev_write(int dev, block_t block, char *data)
 {
-#ifdef _USER_SPACE
    if(dev < 0 || !data) {
       return DEV_PARAM;
    }
-   if(write(dev, data, DEV_BLOCK_SIZE) < 0) {
-      return DEV_FAIL;
-   }
-   return DEV_OK;
-#else
-    // Do a PIO write of the drive.
-    if(!ata_write(dev, block, data)) {
-        return DEV_OK;
-    } else {
-        return DEV_FAIL;
-    }
-#endif
+   return dev_rw(DEV_REQ_WRITE, dev, block, 1, &data);
 }
 
 dev_rtvl_t dev_scan(int dev, block_t block)
 {
 #ifdef _USER_SPACE
+   // Transfers are positioned, there is no file offset to move.
    if(dev < 0 || block < 0) {
       return DEV_PARAM;
    }
-   if(lseek(dev, block * DEV_BLOCK_SIZE, 0) < 0) {
-      return DEV_FAIL;
-   }
    return DEV_OK;
 #else
    // The PIO code will seek the drive in the read/write.
    return DEV_OK;
 #endif
 }
+
+//
+// dev_rw_blocks:
+// Move a contiguous buffer in requests of DEV_RW_CHUNK blocks,
+// submitted DEV_RW_REQS at a time with the device plugged so
+// that each batch goes out as one transfer.
+//
+#define DEV_RW_CHUNK 32
+#define DEV_RW_REQS  (DEV_IOV_MAX / DEV_RW_CHUNK)
+
+static dev_rtvl_t dev_rw_blocks(int op, int dev, block_t block, int count, char *data)
+{
+   dev_req_t req[DEV_RW_REQS];
+   char *vec[DEV_RW_REQS][DEV_RW_CHUNK];
+   register int i = 0, j = 0, k = 0, n = 0;
+   dev_rtvl_t rtvl = DEV_OK;
+
+   if(dev < 0 || count <= 0 || !data) {
+      return DEV_PARAM;
+   }
+   for(i = 0; i < count; i += n * DEV_RW_CHUNK) {
+      dev_plug(dev);
+      for(n = 0; n < DEV_RW_REQS && i + n * DEV_RW_CHUNK < count; n++) {
+         j = i + n * DEV_RW_CHUNK;
+         req[n].op = op;
+         req[n].dev = dev;
+         req[n].block = block + j;
+         req[n].count = (count - j > DEV_RW_CHUNK) ? DEV_RW_CHUNK : count - j;
+         req[n].data = vec[n];
+         req[n].done = NULL;
+         req[n].arg = NULL;
+         for(k = 0; k < req[n].count; k++) {
+            vec[n][k] = data + (j + k) * DEV_BLOCK_SIZE;
+         }
+         dev_submit(&req[n]);
+      }
+      dev_unplug(dev);
+      for(k = 0; k < n; k++) {
+         if(dev_wait(&req[k]) != DEV_OK) {
+            rtvl = DEV_FAIL;
+         }
+      }
+   }
+   return rtvl;
+}
+
+dev_rtvl_t dev_read_blocks(int dev, block_t block, int count, char *data)
+{
+   return dev_rw_blocks(DEV_REQ_READ, dev, block, count, data);
+}
+
+dev_rtvl_t dev_write_blocks(int dev, block_t block, int count, char *data)
+{
+   return dev_rw_blocks(DEV_REQ_WRITE, dev, block, count, data);
+}
+
+dev_rtvl_t dev_readv(int dev, block_t block, int count, char **data)
+{
+   if(dev < 0 || count <= 0 || count > DEV_IOV_MAX || !data) {
+      return DEV_PARAM;
+   }
+   return dev_rw(DEV_REQ_READ, dev, block, count, data);
+}
+
+dev_rtvl_t dev_writev(int dev, block_t block, int count, char **data)
+{
+   if(dev < 0 || count <= 0 || count > DEV_IOV_MAX || !data) {
+      return DEV_PARAM;
+   }
+   return dev_rw(DEV_REQ_WRITE, dev, block, count, data);
+}
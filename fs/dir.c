@@ -155,6 +155,61 @@ void krewinddir(DIR *dir)
     dir->__offset = 0;
 }
 
+/*
+   return the next entry of a directory in the INODE_DIR_ENTRIES
+   format, only the directory blocks are read. __block is the
+   directory block and __block_ptr the byte offset of the next
+   record in it.
+*/
+static struct dirent *kreaddir_entries(int dev, DIR *dir)
+{
+    static struct dirent zero_entry={0};
+    dir_block_t *dblk = NULL;
+    dir_entry_t *ent = NULL;
+    block_t next = INODE_NULL;
+    if(dir->__offset == 2) {
+        dir->__block = dir->__data.next;
+        dir->__block_ptr = 0;
+    }
+    while(dir->__block != INODE_NULL) {
+        if(!(dblk = (dir_block_t *)block_get(dev, dir->__block))) {
+            errno = EACCES;
+            printk("readdir:: error reading directory dev=%d block=%u\n",
+                    dev, dir->__block);
+            return NULL;
+        }
+        while(dir->__block_ptr < DIR_BLOCK_BYTES) {
+            if(!(ent = inode_dir_entry(dblk, dir->__block_ptr))) {
+                errno = EACCES;
+                printk("readdir:: inconsistent directory dev=%d block=%u\n",
+                        dev, dir->__block);
+                block_put((char *)dblk, false);
+                return NULL;
+            }
+            dir->__block_ptr += ent->rec_len;
+            if(ent->block == INODE_NULL) {
+                continue;
+            }
+            dir->__entry = zero_entry;
+            dir->__entry.d_type = ent->type;
+            dir->__entry.d_ino = ent->block;
+            dir->__entry.d_off = dir->__offset;
+            dir->__entry.d_reclen = ent->rec_len;
+            strncat(dir->__entry.d_name,dir->__path,MAX_PATH);
+            strncat(dir->__entry.d_name,"/",1);
+            strncat(dir->__entry.d_name,DIR_ENTRY_NAME(ent),ent->name_len);
+            block_put((char *)dblk, false);
+            dir->__offset++;
+            return &(dir->__entry);
+        }
+        next = dblk->next;
+        block_put((char *)dblk, false);
+        dir->__block = next;
+        dir->__block_ptr = 0;
+    }
+    return NULL;
+}
+
 /*
    return an entry in the dir filling the dirent struct accordingly
 */
@@ -163,8 +218,9 @@ struct dirent *kreaddir(DIR *dir)
     // Offset is the number of the file we are pointing to.
     // All data is in block_map starting from __data.next.
     static struct dirent zero_entry={0};
-    block_map_t bmap = {0};
-    inode_t tmp = {0};
+    block_map_t *bptr = NULL;
+    inode_t tmp = {0}, *iptr = NULL;
+    block_t ino = INODE_NULL;
     int dev = master_get_dev(dir->__path);
     int block  = 0;
     int offset = 0;
@@ -188,6 +244,9 @@ struct dirent *kreaddir(DIR *dir)
         dir->__offset++;
         return &(dir->__entry);
     }
+    if(master_get(dev) && master_get(dev)->dir_format == INODE_DIR_ENTRIES) {
+        return kreaddir_entries(dev, dir);
+    }
 RETRY:
     // We subtract the offset from 2 because
     // we have . and .. which are virtual files
@@ -197,46 +256,53 @@ RETRY:
     // printk("block_ptr=%u block=%u offset=%u\n", 
     //                  dir->__block_ptr,block,offset);
     if(dir->__block_ptr == block && dir->__block != INODE_NULL) {
-        if(block_read(dev, dir->__block, (char *)&bmap) != BLOCK_OK) {
+        // The block map and the entry are read in place
+        // from the buffer cache.
+        if(!(bptr = (block_map_t *)block_get(dev, dir->__block))) {
             errno = EACCES;
             printk("readdir:: error reading directory dev=%d block=%u\n",
                     dev, dir->__block);
             return NULL;
         }
-        if(bmap.blocks[offset] == INODE_NULL) {
+        ino = bptr->blocks[offset];
+        block_put((char *)bptr, false);
+        if(ino == INODE_NULL || ino == INODE_DIR_DELETED) {
             // We unlink by zero setting the entry,
             // so to traverse we have to skip all zero
             // entries until a null bmap.next found below
             // in scan to the correct block code.
+            // Hashed directories are sparse and mark
+            // unlinked entries deleted instead.
             dir->__offset++;
             goto RETRY;
         }
-        if(block_read(dev, bmap.blocks[offset], (char *)&tmp) != BLOCK_OK) {
+        if(!(iptr = (inode_t *)block_get(dev, ino))) {
             errno = ENOENT;
             printk("readdir:: error reading entry dev=%d block=%u\n",
-                    dev, bmap.blocks[offset]);
+                    dev, ino);
             return NULL;
         }
         // Struct assign.
         dir->__entry = zero_entry;
-        if(tmp.is_directory) {
+        if(iptr->is_directory) {
             dir->__entry.d_type = 'D'; // RGDTODO - Is this how we specify the type?
         }
-        if(tmp.is_file) {
+        if(iptr->is_file) {
             dir->__entry.d_type = 'F';
         }
-        if(tmp.is_symlink) {
+        if(iptr->is_symlink) {
             dir->__entry.d_type = 'S';
         }
-        if(tmp.is_hardlink) {
+        if(iptr->is_hardlink) {
             dir->__entry.d_type = 'H';
         }
-        dir->__entry.d_ino = bmap.blocks[offset];
+        dir->__entry.d_ino = ino;
         dir->__entry.d_off = offset;
-        dir->__entry.d_reclen = tmp.size;
+        dir->__entry.d_reclen = iptr->size;
         strncat(dir->__entry.d_name,dir->__path,MAX_PATH);
         strncat(dir->__entry.d_name,"/",1);
-        strncat(dir->__entry.d_name,tmp.path,MAX_PATH);
+        strncat(dir->__entry.d_name,iptr->path,MAX_PATH);
+        block_put((char *)iptr, false);
         dir->__offset++;
         return &(dir->__entry);
     }
@@ -251,14 +317,15 @@ RETRY:
        if(dir->__block == INODE_NULL) {
             return NULL;
        }
-       if(block_read(dev, dir->__block, (char *)&bmap) != BLOCK_OK) {
+       if(!(bptr = (block_map_t *)block_get(dev, dir->__block))) {
             errno = EACCES;
             printk("readdir:: error reading block dev=%d block=%u\n",
                     dev, dir->__block);
             return NULL;
        }
        // Advance block pointer.
-       dir->__block = bmap.next;
+       dir->__block = bptr->next;
+       block_put((char *)bptr, false);
     }
     // Terminate, if we put this case first, we would never
     // execute, but if we don't consider it, we will go into
@@ -314,6 +381,7 @@ int main(int argc, char **argv)
     // then readdir and see all the files we created are there).
     int  i  = 0;
     int fd  = 0;
+    int nfd = 0;
     int dev = 0;
     master_inode_t *master = NULL;
     struct stat stbuf={0};
@@ -443,8 +511,10 @@ int main(int argc, char **argv)
     for(i = 0; i < 129; ++i) {
        if(i == 2) continue;
        sprintf(buf, "/bar/foodir/file%d", i);
-       if(kcreat(buf, S_IRUSR) == -1) {
+       if((nfd = kcreat(buf, S_IRUSR)) == -1) {
             printk("kcreat:: error creating file [%s]\n", buf);
+       } else {
+            kclose(nfd);
        }
     }
     krewinddir(dir);
@@ -503,5 +573,50 @@ int main(int argc, char **argv)
     } else {
         printk("kclosedir:: successfully closed dir [/bar/foodir]\n");
     }
+    // Test a directory spanning several block maps, unlinking every
+    // third entry and creating them again (reusing deleted slots).
+    if(kmkdir("/big", S_IRWXU) == -1) {
+        printk("kmkdir:: error failed to make directory [/big]\n");
+    }
+    for(i = 0; i < 250; ++i) {
+       sprintf(buf, "/big/entry%d", i);
+       if((nfd = kcreat(buf, S_IRUSR)) == -1) {
+            printk("kcreat:: error creating file [%s]\n", buf);
+       } else {
+            kclose(nfd);
+       }
+    }
+    for(i = 0; i < 250; i += 3) {
+       sprintf(buf, "/big/entry%d", i);
+       if(kunlink(buf) == -1) {
+            printk("kunlink:: error unlinking file [%s]\n", buf);
+       }
+    }
+    for(fd = 0, i = 0; i < 250; ++i) {
+       sprintf(buf, "/big/entry%d", i);
+       if((kstat(buf, &stbuf) == -1) != ((i % 3) == 0)) {
+            fd++;
+       }
+    }
+    for(i = 0; i < 250; i += 3) {
+       sprintf(buf, "/big/entry%d", i);
+       if((nfd = kcreat(buf, S_IRUSR)) == -1) {
+            printk("kcreat:: error creating file [%s]\n", buf);
+       } else {
+            kclose(nfd);
+       }
+    }
+    dir = kopendir("/big");
+    i = 0;
+    while(dir && kreaddir(dir)) {
+        i++;
+    }
+    kclosedir(dir);
+    // Expect . .. and the 250 entries.
+    if(fd || i != 252) {
+        printk("kreaddir:: error large directory lookups failed=%d entries=%d\n", fd, i);
+    } else {
+        printk("kreaddir:: successfully read large directory [/big]\n");
+    }
 }
 #endif
@@ -0,0 +1,517 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      extent.c
+// 
+// @description:
+//      Extent tree mapping the blocks of a regular file.
+//      The first INODE_EXTENTS entries live in the inode, once
+//      they are used up the tree grows extent blocks below it.
+//      Each level is kept sorted by file block so a lookup is
+//      a binary search per level instead of a walk of the file.
+//      Blocks are only ever added at the end of the file, so the
+//      tree grows along its right edge.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#include "bool.h"
+#include "paths.h"
+#include "block.h"
+#include "dev.h"
+#include "inode.h"
+#include "compat.h"
+
+#ifdef _TEST_EXTENT_INC
+#include <stdio.h>
+#include <string.h>
+#define printk printf
+#else
+#include <ox/error_rpt.h>
+#include <ox/lib/string.h>
+#endif
+
+#include "extent.h"
+
+//
+// extent_search:
+//
+// Return the index of the last of the 'count' sorted entries
+// starting at or before 'lblock', -1 if there is none.
+//
+static int extent_search(extent_t *ext, block_t count, block_t lblock)
+{
+    int lo = 0, hi = (int)count - 1, mid = 0, found = -1;
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(ext[mid].lblock <= lblock) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+//
+// extent_get:
+//
+// Pin extent block 'block' expected at 'depth' in the tree.
+//
+static extent_block_t *extent_get(int dev, block_t block, block_t depth)
+{
+    extent_block_t *eb = NULL;
+    if(!(eb = (extent_block_t *)block_get(dev, block))) {
+        errno = EACCES;
+        printk("extent_get:: error reading block dev=%d block=%u\n",
+                dev, block);
+        return NULL;
+    }
+    if(eb->self != block || eb->depth != depth ||
+       eb->count > EXTENT_BLOCK_ENTRIES) {
+        errno = EACCES;
+        printk("extent_get:: inconsistent extent block dev=%d block=%u\n",
+                dev, block);
+        block_put((char *)eb, false);
+        return NULL;
+    }
+    return eb;
+}
+
+//
+// extent_new_block:
+//
+// Allocate an extent block at 'depth' holding the single entry 'ext'.
+//
+static extent_rtvl_t extent_new_block(int dev, block_t depth, extent_t *ext, block_t *block)
+{
+    extent_block_t *eb = NULL;
+    if(inode_get_data_block(dev, block) != INODE_OK) {
+        errno = ENOSPC;
+        printk("extent_new_block:: unable to allocate block dev=%d\n", dev);
+        return EXTENT_FAIL;
+    }
+    if(!(eb = (extent_block_t *)block_get(dev, *block))) {
+        errno = EACCES;
+        printk("extent_new_block:: error reading block dev=%d block=%u\n",
+                dev, *block);
+        return EXTENT_FAIL;
+    }
+    memset((char *)eb, 0x0, DEV_BLOCK_SIZE);
+    eb->self   = *block;
+    eb->depth  = depth;
+    eb->count  = 1;
+    eb->ext[0] = *ext;
+    block_put((char *)eb, true);
+    return EXTENT_OK;
+}
+
+extent_rtvl_t extent_map(int dev, inode_t *inode, block_t lblock,
+                         block_t *block, block_t *run)
+{
+    extent_block_t *eb = NULL;
+    extent_t *ext = inode->ext;
+    block_t count = inode->ext_count;
+    block_t depth = inode->ext_depth;
+    block_t child = 0;
+    int i = 0;
+
+    *block = INODE_NULL;
+    *run   = 0;
+    while(true) {
+        if((i = extent_search(ext, count, lblock)) < 0) {
+            break;
+        }
+        if(depth == 0) {
+            if(lblock - ext[i].lblock < ext[i].length) {
+                *block = ext[i].start + (lblock - ext[i].lblock);
+                *run   = ext[i].length - (lblock - ext[i].lblock);
+            }
+            break;
+        }
+        child = ext[i].start;
+        if(eb) {
+            block_put((char *)eb, false);
+        }
+        if(!(eb = extent_get(dev, child, --depth))) {
+            return EXTENT_FAIL;
+        }
+        ext   = eb->ext;
+        count = eb->count;
+    }
+    if(eb) {
+        block_put((char *)eb, false);
+    }
+    return EXTENT_OK;
+}
+
+extent_rtvl_t extent_end(int dev, inode_t *inode, block_t *lblock)
+{
+    extent_block_t *eb = NULL;
+    extent_t *ext = inode->ext;
+    block_t count = inode->ext_count;
+    block_t depth = inode->ext_depth;
+    block_t child = 0;
+
+    *lblock = 0;
+    while(count) {
+        if(depth == 0) {
+            *lblock = ext[count-1].lblock + ext[count-1].length;
+            break;
+        }
+        child = ext[count-1].start;
+        if(eb) {
+            block_put((char *)eb, false);
+        }
+        if(!(eb = extent_get(dev, child, --depth))) {
+            return EXTENT_FAIL;
+        }
+        ext   = eb->ext;
+        count = eb->count;
+    }
+    if(eb) {
+        block_put((char *)eb, false);
+    }
+    return EXTENT_OK;
+}
+
+extent_rtvl_t extent_append(int dev, inode_t *inode, block_t lblock, block_t block)
+{
+    block_t path[EXTENT_MAX_DEPTH + 1] = {0};
+    extent_block_t *eb = NULL;
+    extent_t *ext = inode->ext, *last = NULL, add = {0};
+    block_t count = inode->ext_count, cap = INODE_EXTENTS;
+    block_t depth = inode->ext_depth;
+    block_t level = 0, room = 0, child = 0;
+    bool has_room = false;
+
+    if(depth > EXTENT_MAX_DEPTH) {
+        errno = EACCES;
+        printk("extent_append:: inconsistent depth=%u\n", depth);
+        return EXTENT_FAIL;
+    }
+    // Walk the right edge down to the last leaf, path[level] is
+    // the extent block at each level, level 0 being the inode.
+    // Remember the deepest index level that can take another entry.
+    for(level = 0; level < depth; level++) {
+        if(count < cap) {
+            has_room = true;
+            room = level;
+        }
+        if(count == 0) {
+            errno = EACCES;
+            printk("extent_append:: inconsistent extent tree dev=%d\n", dev);
+            if(eb) {
+                block_put((char *)eb, false);
+            }
+            return EXTENT_FAIL;
+        }
+        path[level + 1] = ext[count-1].start;
+        if(eb) {
+            block_put((char *)eb, false);
+        }
+        if(!(eb = extent_get(dev, path[level + 1], depth - level - 1))) {
+            return EXTENT_FAIL;
+        }
+        ext   = eb->ext;
+        count = eb->count;
+        cap   = EXTENT_BLOCK_ENTRIES;
+    }
+    // ext is now the last leaf.
+    if(count) {
+        last = &ext[count-1];
+        if(last->lblock + last->length != lblock) {
+            errno = EINVAL;
+            printk("extent_append:: not at the end of the file lblock=%u\n",
+                    lblock);
+            if(eb) {
+                block_put((char *)eb, false);
+            }
+            return EXTENT_FAIL;
+        }
+        if(last->start + last->length == block) {
+            last->length++;
+            if(eb) {
+                block_put((char *)eb, true);
+            }
+            return EXTENT_OK;
+        }
+    }
+    add.lblock = lblock;
+    add.start  = block;
+    add.length = 1;
+    if(count < cap) {
+        ext[count] = add;
+        if(eb) {
+            eb->count++;
+            block_put((char *)eb, true);
+        } else {
+            inode->ext_count++;
+        }
+        return EXTENT_OK;
+    }
+    if(eb) {
+        block_put((char *)eb, false);
+    }
+    if(!has_room) {
+        // Every level is full, move the root into an extent block
+        // and make the inode point to it, then add from there.
+        if(depth == EXTENT_MAX_DEPTH) {
+            errno = EFBIG;
+            printk("extent_append:: extent tree full dev=%d\n", dev);
+            return EXTENT_FAIL;
+        }
+        if(extent_new_block(dev, depth, &inode->ext[0], &child) != EXTENT_OK) {
+            return EXTENT_FAIL;
+        }
+        if(!(eb = extent_get(dev, child, depth))) {
+            return EXTENT_FAIL;
+        }
+        memcpy((char *)eb->ext, (char *)inode->ext,
+               inode->ext_count * sizeof(extent_t));
+        eb->count = inode->ext_count;
+        block_put((char *)eb, true);
+        memset((char *)inode->ext, 0x0, sizeof(inode->ext));
+        inode->ext[0].lblock = eb->ext[0].lblock;
+        inode->ext[0].start  = child;
+        inode->ext_count = 1;
+        inode->ext_depth++;
+        return extent_append(dev, inode, lblock, block);
+    }
+    // Build a new right edge from the leaf up to the level with room.
+    if(extent_new_block(dev, 0, &add, &child) != EXTENT_OK) {
+        return EXTENT_FAIL;
+    }
+    add.length = 0;
+    for(level = depth - 1; level > room; level--) {
+        add.start = child;
+        if(extent_new_block(dev, depth - level, &add, &child) != EXTENT_OK) {
+            return EXTENT_FAIL;
+        }
+    }
+    add.start = child;
+    if(room == 0) {
+        inode->ext[inode->ext_count++] = add;
+    } else {
+        if(!(eb = extent_get(dev, path[room], depth - room))) {
+            return EXTENT_FAIL;
+        }
+        eb->ext[eb->count++] = add;
+        block_put((char *)eb, true);
+    }
+    return EXTENT_OK;
+}
+
+//
+// extent_free_level:
+//
+// Free the 'count' entries of 'ext' at 'depth' and everything below.
+//
+static extent_rtvl_t extent_free_level(int dev, extent_t *ext, block_t count, block_t depth)
+{
+    extent_block_t *eb = NULL;
+    block_t i = 0, j = 0;
+    for(i = 0; i < count; i++) {
+        if(depth == 0) {
+            for(j = 0; j < ext[i].length; j++) {
+                if(inode_free_data_block(dev, ext[i].start + j) != INODE_OK) {
+                    errno = EACCES;
+                    printk("extent_free_level:: error free'ing block dev=%d block=%u\n",
+                            dev, ext[i].start + j);
+                    return EXTENT_FAIL;
+                }
+            }
+            continue;
+        }
+        if(!(eb = extent_get(dev, ext[i].start, depth - 1))) {
+            return EXTENT_FAIL;
+        }
+        if(extent_free_level(dev, eb->ext, eb->count, depth - 1) != EXTENT_OK) {
+            block_put((char *)eb, false);
+            return EXTENT_FAIL;
+        }
+        // Clear self so a stale copy is not taken for an extent block.
+        eb->self = INODE_NULL;
+        block_put((char *)eb, true);
+        if(inode_free_data_block(dev, ext[i].start) != INODE_OK) {
+            errno = EACCES;
+            printk("extent_free_level:: error free'ing block dev=%d block=%u\n",
+                    dev, ext[i].start);
+            return EXTENT_FAIL;
+        }
+    }
+    return EXTENT_OK;
+}
+
+extent_rtvl_t extent_free(int dev, inode_t *inode)
+{
+    if(inode_free_prealloc(dev, inode) != INODE_OK) {
+        return EXTENT_FAIL;
+    }
+    if(extent_free_level(dev, inode->ext, inode->ext_count,
+                         inode->ext_depth) != EXTENT_OK) {
+        return EXTENT_FAIL;
+    }
+    memset((char *)inode->ext, 0x0, sizeof(inode->ext));
+    inode->ext_count = 0;
+    inode->ext_depth = 0;
+    return EXTENT_OK;
+}
+
+#ifdef _TEST_EXTENT
+#include "file.h"
+master_inode_t *master_get(int dev);
+
+#define TEST_EXTENTS 200
+
+int
+main(int argc, char **argv)
+{
+    inode_t node = {0};
+    file_t file = {0};
+    master_inode_t *master = NULL;
+    block_t blocks[TEST_EXTENTS]={0}, gaps[TEST_EXTENTS]={0};
+    block_t block = 0, run = 0, end = 0;
+    inode_ptr_t bytes = 0;
+    char data[DEV_BLOCK_SIZE]={0}, test[DEV_BLOCK_SIZE]={0};
+    int dev = 0, i = 0, errors = 0;
+
+    if(inode_dev_open("./inode.dat",&dev) == INODE_INIT) {
+       if(inode_mkfs("./inode.dat", 2 * TWOMEG) != INODE_OK) {
+            printk("extent:: error initializing filesystem\n");
+            return 1;
+       }
+       if(inode_dev_open("./inode.dat", &dev) != INODE_OK) {
+            printk("extent:: error opening device\n");
+            return 1;
+       }
+    }
+    master = master_get(dev);
+    master_set_dev("./inode.dat", dev);
+
+    // Append blocks with a gap between each so none of them merge,
+    // this grows the tree two levels below the inode.
+    if(inode_create(dev, INODE_ROOT_BLOCK, "/extent",
+                    INODE_CREATE_FILE,0777,0777,0,0,NULL) != INODE_OK ||
+       inode_get(dev, INODE_ROOT_BLOCK, "/extent",
+                 true, INODE_RW, &node) != INODE_OK) {
+        printk("extent:: error creating file\n");
+        return 1;
+    }
+    for(i = 0; i < TEST_EXTENTS; i++) {
+        if(inode_get_data_block(dev, &blocks[i]) != INODE_OK ||
+           inode_get_data_block(dev, &gaps[i]) != INODE_OK ||
+           extent_append(dev, &node, i, blocks[i]) != EXTENT_OK) {
+            printk("extent:: error appending block %d\n", i);
+            return 1;
+        }
+    }
+    printk("extent:: depth=%d count=%d\n", node.ext_depth, node.ext_count);
+    for(i = 0; i < TEST_EXTENTS; i++) {
+        if(extent_map(dev, &node, i, &block, &run) != EXTENT_OK ||
+           block != blocks[i] || run != 1) {
+            printk("extent:: error mapping lblock=%d block=%u expected=%u\n",
+                    i, block, blocks[i]);
+            errors++;
+        }
+    }
+    if(extent_map(dev, &node, TEST_EXTENTS, &block, &run) != EXTENT_OK ||
+       block != INODE_NULL ||
+       extent_end(dev, &node, &end) != EXTENT_OK || end != TEST_EXTENTS) {
+        printk("extent:: error at end of file end=%u\n", end);
+        errors++;
+    }
+    for(i = 0; i < TEST_EXTENTS; i++) {
+        inode_free_data_block(dev, gaps[i]);
+    }
+    if(extent_free(dev, &node) != EXTENT_OK || node.ext_count != 0) {
+        printk("extent:: error free'ing file\n");
+        errors++;
+    }
+
+    // Written in a loop a file is allocated from its preallocation
+    // window next to its last block and stays a single extent.
+    if(inode_create(dev, INODE_ROOT_BLOCK, "/contig",
+                    INODE_CREATE_FILE,0777,0777,0,0,NULL) != INODE_OK ||
+       inode_get(dev, INODE_ROOT_BLOCK, "/contig",
+                 true, INODE_RW, &node) != INODE_OK) {
+        printk("extent:: error creating file\n");
+        return 1;
+    }
+    node.dev = dev;
+    file.inode = &node;
+    file.current = INODE_NULL;
+    file.pos = 0;
+    for(i = 0; i < 64; i++) {
+        if(file_read_write(&file, file.pos, DEV_BLOCK_SIZE, data,
+                           false, &bytes) != FILE_OK) {
+            printk("extent:: error writing file\n");
+            return 1;
+        }
+    }
+    printk("extent:: contiguous depth=%d count=%d length=%u\n",
+            node.ext_depth, node.ext_count, node.ext[0].length);
+    if(node.ext_count != 1 || node.ext[0].length != 64) {
+        errors++;
+    }
+    if(extent_free(dev, &node) != EXTENT_OK || node.prealloc_count != 0) {
+        printk("extent:: error free'ing file\n");
+        errors++;
+    }
+
+    // A file written through the block_map_t chain before extents
+    // must still read back, including after a seek.
+    if(inode_create(dev, INODE_ROOT_BLOCK, "/chain",
+                    INODE_CREATE_FILE,0777,0777,0,0,NULL) != INODE_OK ||
+       inode_get(dev, INODE_ROOT_BLOCK, "/chain",
+                 true, INODE_RW, &node) != INODE_OK) {
+        printk("extent:: error creating file\n");
+        return 1;
+    }
+    node.is_extent = false;
+    node.dev = dev;
+    file.current = INODE_NULL;
+    file.pos = 0;
+    for(i = 0; i < 100; i++) {
+        memset(data, i, DEV_BLOCK_SIZE);
+        if(file_read_write(&file, file.pos, DEV_BLOCK_SIZE, data,
+                           false, &bytes) != FILE_OK) {
+            printk("extent:: error writing chained file\n");
+            return 1;
+        }
+    }
+    for(i = 99; i >= 0; i -= 13) {
+        memset(data, i, DEV_BLOCK_SIZE);
+        file.iblock = INODE_NOPOS;
+        if(file_read_write(&file, (inode_ptr_t)i * DEV_BLOCK_SIZE, DEV_BLOCK_SIZE,
+                           test, true, &bytes) != FILE_OK ||
+           memcmp(data, test, DEV_BLOCK_SIZE)) {
+            printk("extent:: error reading chained file block %d\n", i);
+            errors++;
+        }
+    }
+    if(errors) {
+        printk("extent:: %d errors\n", errors);
+        return 1;
+    }
+    printk("extent:: success\n");
+    return 0;
+}
+#endif
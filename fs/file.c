@@ -39,11 +39,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define printk printf
 #else
 #include <ox/error_rpt.h>
+#include <sys/ioctl.h> // For struct bstat and BIOCGSTAT.
 // TODO - Include the rest of the headers.
 #endif
 
 #include "file.h"
 #include "dir.h"
+#include "extent.h"
+#include "dcache.h"
+#include "icache.h"
 
 // file_add_blocks:
 //
@@ -330,7 +334,143 @@ file_rtvl_t file_add_one_data_block(int dev,
     return FILE_OK;
 }
 
-file_rtvl_t file_read_write(inode_t *inode, 
+//
+// file_extent_block:
+//
+// Return in *block the disk block of file block 'lblock' of an
+// extent mapped file and in *run how many follow it contiguously.
+// Files have no holes, when 'lblock' is past the end every block
+// up to it is allocated zero filled and appended to the tree.
+//
+static file_rtvl_t file_extent_block(inode_t *inode, 
+                                     block_t lblock, 
+                                     block_t *block, 
+                                     block_t *run)
+{
+    char zero_data[DEV_BLOCK_SIZE]={0};
+    block_t end = 0, goal = INODE_NULL;
+    int dev = inode->dev;
+
+    if(extent_map(dev, inode, lblock, block, run) != EXTENT_OK) {
+        printk("file_extent_block:: error mapping dev=%d lblock=%u\n",
+                dev, lblock);
+        return FILE_FAIL;
+    }
+    if(*block != INODE_NULL) {
+        return FILE_OK;
+    }
+    // Aim for the block following the end of the file so
+    // it stays contiguous on disk.
+    if(extent_end(dev, inode, &end) != EXTENT_OK ||
+       (end && extent_map(dev, inode, end - 1, &goal, run) != EXTENT_OK)) {
+        printk("file_extent_block:: error mapping dev=%d lblock=%u\n",
+                dev, lblock);
+        return FILE_FAIL;
+    }
+    for(; end <= lblock; end++) {
+        if(goal != INODE_NULL) {
+            goal++;
+        }
+        if(inode_get_file_block(dev, inode, goal, block) != INODE_OK) {
+            errno = ENOSPC;
+            printk("file_extent_block:: failed to get data block dev=%d\n", dev);
+            return FILE_FAIL;
+        }
+        if(block_write(dev, *block, (char *)zero_data) != BLOCK_OK) {
+            errno = EACCES;
+            printk("file_extent_block:: failed to write block dev=%d block=%u\n",
+                    dev, *block);
+            return FILE_FAIL;
+        }
+        if(extent_append(dev, inode, end, *block) != EXTENT_OK) {
+            printk("file_extent_block:: error adding block dev=%d block=%u\n",
+                    dev, *block);
+            return FILE_FAIL;
+        }
+        goal = *block;
+    }
+    *run = 1;
+    return FILE_OK;
+}
+
+//
+// file_extent_read_write:
+//
+// file_read_write for files mapped by an extent tree. Seeking is
+// a lookup in the tree, and file->current and file->iblock keep
+// the disk block at file->pos and the blocks left in its extent
+// so sequential access does not search the tree at all.
+//
+static file_rtvl_t file_extent_read_write(file_t *file, 
+                     inode_ptr_t pos, 
+                     inode_ptr_t length, 
+                     char *data, 
+                     bool reading, 
+                     inode_ptr_t *bytes_processed)
+{
+    block_t lblock = (block_t)(pos / DEV_BLOCK_SIZE);
+    block_t byte   = (block_t)(pos % DEV_BLOCK_SIZE);
+    block_t block  = INODE_NULL, run = 0;
+    inode_ptr_t i = 0;
+    char *dptr = NULL;
+    bool modified = false;
+    inode_t *inode = file->inode;
+    int dev = inode->dev;
+
+    if(file->pos == pos &&
+       file->current != INODE_NULL &&
+       file->iblock != INODE_NOPOS &&
+       file->iblock > 0) {
+        block = file->current;
+        run   = file->iblock;
+    }
+    while(length) {
+        if(!run) {
+            if(file_extent_block(inode, lblock, &block, &run) != FILE_OK) {
+                return FILE_FAIL;
+            }
+        }
+        if(!(dptr = block_get(dev, block))) {
+            errno = EACCES;
+            printk("file_read_write:: error reading block dev=%d block=%u\n",
+                    dev, block);
+            return FILE_FAIL;
+        }
+        modified = false;
+        do {
+            if(reading) {
+                // Past the end of the file reads as zeros.
+                data[i] = (pos + i < inode->size) ? dptr[byte] : 0;
+            } else {
+                dptr[byte] = data[i];
+                modified = true;
+            }
+            i++;
+            byte++;
+            length--;
+        } while(length && byte < DEV_BLOCK_SIZE);
+        block_put(dptr, modified);
+        if(byte == DEV_BLOCK_SIZE) {
+            byte = 0;
+            lblock++;
+            block++;
+            run--;
+        }
+    }
+    *bytes_processed = i;
+    file->pos = pos + i;
+    if(inode->size < pos + i) {
+        inode->size = pos + i;
+    }
+    file->current = run ? block : INODE_NULL;
+    file->current_parent = INODE_NULL;
+    file->iblock = run;
+    // The inode is written back on sync or the last close.
+    icache_dirty(inode);
+    return FILE_OK;
+}
+
+file_rtvl_t file_read_write(file_t *file, 
                      inode_ptr_t pos, 
                      inode_ptr_t length, 
                      char *data, 
@@ -348,10 +488,11 @@ file_rtvl_t file_read_write(inode_t *inode,
     block_t dblock= ((block_t)length / DEV_BLOCK_SIZE + ((length % DEV_BLOCK_SIZE)?1:0));
     block_t dbyte = (block_t)length % DEV_BLOCK_SIZE;
     block_t i = 0, start = 0, current = 0;
-    char dptr[DEV_BLOCK_SIZE]={0};
+    char *dptr = NULL;
+    inode_t *inode = file->inode;
     block_t block_start = inode->next;
     int dev = inode->dev;
-    block_map_t bmap={0}, tmp={0};
+    block_map_t bmap={0}, *bptr = NULL;
     bool write_flag = false;
 
     if(!length) {
@@ -359,13 +500,17 @@ file_rtvl_t file_read_write(inode_t *inode,
         *bytes_processed = 0;
         return FILE_OK;
     }
+    if(inode->is_extent) {
+        return file_extent_read_write(file, pos, length, data, 
+                                      reading, bytes_processed);
+    }
 
     // We need the correct uninitialized state
     // where pos == 0 and inode->next == INODE_NULL,
     // we therefore get a bmap block and a data block, and set start to
     // it and iblock to 0. And load bmap correctly.
     // Also, another case is we are initialized but the file has come under
-    // first use, in which case the inode->current is 0, and therefore
+    // first use, in which case the file->current is 0, and therefore
     // we can not load the initialization code.
     if(inode->next == INODE_NULL) {
         char zero_data[DEV_BLOCK_SIZE]={0};
@@ -374,12 +519,7 @@ file_rtvl_t file_read_write(inode_t *inode,
             return FILE_FAIL;
         }
         inode->next = block;
-        if(block_write(dev, inode->self, (char *)inode) != BLOCK_OK) {
-            errno = EACCES;
-            printk("file_read_write:: failed to write block dev=%d block=%u\n", 
-                    dev, inode->self);
-            return FILE_FAIL;
-        }
+        icache_dirty(inode);
         if(block_write(dev, inode->next, (char *)zero_data) != BLOCK_OK) {
             errno = EACCES;
             printk("file_read_write:: failed to write block dev=%d block=%u\n", 
@@ -408,7 +548,7 @@ file_rtvl_t file_read_write(inode_t *inode,
         start = block;
         iblock = 0;
         current = inode->next;
-    } else if(inode->pos == 0 && inode->current == INODE_NULL) {
+    } else if(file->pos == 0 && file->current == INODE_NULL) {
         current = inode->next;
         if(block_read(dev, current, (char *)&bmap) != BLOCK_OK) {
             errno = EACCES;
@@ -418,35 +558,42 @@ file_rtvl_t file_read_write(inode_t *inode,
         }
         start = bmap.blocks[0];
         iblock = 0;
-    } else if(inode->pos == pos && 
-              inode->current != INODE_NULL &&
-              inode->iblock != INODE_NOPOS) {
+    } else if(file->pos == pos && 
+              file->current != INODE_NULL &&
+              file->iblock != INODE_NOPOS) {
         // Setup the read starting from what was stored in the inode
         // from previous.
-        start = inode->current;
-        iblock = inode->iblock;
-        if(block_read(dev, inode->current_parent, (char *)&bmap) != BLOCK_OK) {
+        start = file->current;
+        iblock = file->iblock;
+        if(block_read(dev, file->current_parent, (char *)&bmap) != BLOCK_OK) {
             errno = EACCES;
             printk("file_read_write:: failed to read block dev=%d block=%u\n", 
-                    dev, inode->current_parent);
+                    dev, file->current_parent);
             return FILE_FAIL;
         }
-        current = inode->current_parent;
+        current = file->current_parent;
     } else {
         // Scan to the desired position.
         // NOTE: iter and iblock in this case were
         // precomputed at the beginning of this function.
         // DEBUG 
         printk("iter=%d\n",iter);
+        // The chain is followed in the buffer cache, only the
+        // last block map is copied out.
         for(i = 0, bmap.next = inode->next; i < iter; ++i) {
             current = bmap.next; // The current block.
-            if(block_read(dev, bmap.next, (char *)&tmp) != BLOCK_OK) { // Read the next pointer and assign to tmp.
+            if(!(bptr = (block_map_t *)block_get(dev, current))) {
                 errno = EACCES;
                 printk("file_read_write:: error reading block dev=%d block=%u\n",
                         dev, inode->next);
                 return FILE_FAIL;
             }
-            bmap = tmp; // Advance in the list.
+            if(i == (iter-1)) {
+                bmap = *bptr;
+            } else {
+                bmap.next = bptr->next; // Advance in the list.
+            }
+            block_put((char *)bptr, false);
         }
         // find starting block.
         start = bmap.blocks[iblock];
@@ -454,7 +601,9 @@ file_rtvl_t file_read_write(inode_t *inode,
 
     // In all cases above, we need start, current, and iblock
     // to be set up prior to the read/write.
-    if(block_read(dev, start, (char *)&dptr) != BLOCK_OK) {
+    // The data block is worked on in place in the buffer cache,
+    // it is pinned by block_get until the matching block_put.
+    if(!(dptr = block_get(dev, start))) {
         errno = EACCES;
         printk("file_read_write:: error reading block dev=%d block=%u\n",
                 dev, inode->next);
@@ -462,13 +611,14 @@ file_rtvl_t file_read_write(inode_t *inode,
     }
 
     // We can derive a write from this by swapping dptr[byte] = data[i]
-    // and when byte == 0, we block_write(dev, start, dptr), before doing any
+    // and when byte == 0, we block_put(dptr, true), before doing any
     // reading.
     i = 0;
     *bytes_processed = 0;
     do {
         if(reading) {
             if(*bytes_processed >= inode->size) {
+                write_flag = true;
                 data[i] = 0;
                 dptr[byte] = 0;
             } else {
@@ -486,13 +636,11 @@ file_rtvl_t file_read_write(inode_t *inode,
         if(byte == 0) {
             if(!reading || *bytes_processed >= inode->size) {
                 write_flag = false;
-                if(block_write(dev, start, (char *)&dptr) != BLOCK_OK) {
-                    errno = EACCES;
-                    printk("file_read_write:: error writing block dev=%d block=%u\n",
-                            dev, start);
-                    return FILE_FAIL;
-                }
+                block_put(dptr, true);
+            } else {
+                block_put(dptr, false);
             }
+            dptr = NULL;
             // Read next block.
             ++iblock; 
             iblock %= BMAP_BLOCKS;
@@ -513,13 +661,12 @@ file_rtvl_t file_read_write(inode_t *inode,
                 // and it should be referenced by bmap.next, otherwise,
                 // we came here and bmap.next was not INODE_NULL in the first place.
                 current = bmap.next; // This is the current block, bmap.next will point to next after load.
-                if(block_read(dev, bmap.next, (char *)&tmp) != BLOCK_OK) {
+                if(block_read(dev, current, (char *)&bmap) != BLOCK_OK) {
                     errno = EACCES;
                     printk("file_read_write:: error reading block dev=%d block=%u\n",
-                            dev, bmap.next);
+                            dev, current);
                     return FILE_FAIL;
                 }
-                bmap = tmp;
             }
             start = bmap.blocks[iblock];
             if(start == INODE_NULL) {
@@ -533,7 +680,7 @@ file_rtvl_t file_read_write(inode_t *inode,
                 }
             }
             start = bmap.blocks[iblock];
-            if(block_read(dev, start, (char *)&dptr) != BLOCK_OK) {
+            if(!(dptr = block_get(dev, start))) {
                 errno = EACCES;
                 printk("file_read_write:: error reading block dev=%d start=%u\n",
                         dev, start);
@@ -541,23 +688,16 @@ file_rtvl_t file_read_write(inode_t *inode,
             }
         }
     } while(length);
-    if(write_flag) {
-       // This occurs when length < DEV_BLOCK_SIZE as the above
-       // loop will only write when we cross a boundary.
-       // It also occurs at the last block write if its less
-       // than DEV_BLOCK_SIZE.
-       if(block_write(dev, start, (char *)&dptr) != BLOCK_OK) {
-                errno = EACCES;
-                printk("file_read_write:: error writing block dev=%d block=%u\n",
-                       dev, start);
-                return FILE_FAIL;
-       }
-    }
+    // Release the last block, write_flag is set when length < DEV_BLOCK_SIZE
+    // as the above loop will only mark it dirty when we cross a boundary.
+    // It also occurs at the last block write if its less
+    // than DEV_BLOCK_SIZE.
+    block_put(dptr, write_flag);
     // Setup our locations for the next run.
     // We must setup the pos, size, current, current_parent, and iblock.
     // Originally we used length, but this is decremented to 0 
     // in the read/write loop above.
-    inode->pos  = pos + *bytes_processed;
+    file->pos  = pos + *bytes_processed;
     if(inode->size < pos + *bytes_processed) {
         // The reasoning here is that we have pos + length where
         // if pos was >= size we handled in a special case above,
@@ -567,15 +707,11 @@ file_rtvl_t file_read_write(inode_t *inode,
         // where the inode->size terms cancel out.
         inode->size = pos + *bytes_processed;
     }
-    inode->current = start;
-    inode->current_parent = current; 
-    inode->iblock = iblock;
-    if(block_write(dev, inode->self, (char *)inode) != BLOCK_OK) {
-        errno = EACCES;
-        printk("file_read_write:: error writing block dev=%d block=%u\n",
-                dev, inode->self);
-        return FILE_FAIL;
-    }
+    file->current = start;
+    file->current_parent = current; 
+    file->iblock = iblock;
+    // The inode is written back on sync or the last close.
+    icache_dirty(inode);
     return FILE_OK;
 }
 
@@ -596,16 +732,131 @@ file_rtvl_t file_read_write(inode_t *inode,
 //  NOTE: tell is 'lseek(fd, 0, SEEK_CUR)'
 //
 
+// Open files of every process, a descriptor points to one of these.
+static file_t file_tab[MAX_FILES];
+
+//
+// file_get:
+//
+// The open file of descriptor 'fd' in the current process, NULL if
+// it is not open. Its inode is read again if it was written by path.
+//
+static file_t *file_get(int fd)
+{
+    file_t *file = ((fd < 0 || fd >= MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    if(file) {
+        icache_refresh(file->inode);
+    }
+    return file;
+}
+
+//
+// file_install:
+//
+// Open inode 'self' with 'flags' and return a descriptor for it in
+// the current process. The inode is shared through the icache with
+// every other open of it, the position belongs to the new file_t.
+//
+static int file_install(int dev, block_t self, int flags)
+{
+    file_t *file = NULL;
+    int i = 0, fd = 0;
+
+    for(fd = 0; fd < MAX_FILES && current_process->file_desc[fd]; ++fd)
+        ;
+    if(fd == MAX_FILES) {
+        errno = EMFILE;
+        printk("open:: error maximum file descriptors in use\n");
+        return -1;
+    }
+    for(i = 0; i < MAX_FILES && file_tab[i].count; ++i)
+        ;
+    if(i == MAX_FILES) {
+        errno = ENFILE;
+        printk("open:: error maximum open files in use\n");
+        return -1;
+    }
+    file = &file_tab[i];
+    if(!(file->inode = icache_get(dev, self))) {
+        errno = ENFILE;
+        printk("open:: error loading inode dev=%d block=%u\n", dev, self);
+        return -1;
+    }
+    file->o_mode = 0;
+    if(flags & O_RDONLY) {
+        file->o_mode |= O_RDONLY;
+    } else if(flags & O_WRONLY) {
+        file->o_mode |= O_WRONLY;
+    } else if(flags & O_RDWR) {
+        file->o_mode |= O_RDWR;
+    }
+    file->pos = (flags & O_APPEND) ? file->inode->size : 0;
+    file->current = INODE_NULL;
+    file->current_parent = INODE_NULL;
+    file->iblock = 0;
+    file->count = 1;
+    file->inode->accessed_time = ktime(0);
+    icache_dirty(file->inode);
+    current_process->file_desc[fd] = file;
+    return fd;
+}
+
+//
+// file_open_trunc:
+//
+// Truncate inode 'self' and open it. The data blocks are freed in
+// the copy shared through the icache so files that already have it
+// open see the truncation, as they do the blocks being released.
+//
+static int file_open_trunc(int dev, block_t self, int flags, const char *path)
+{
+    inode_t *inode = NULL;
+    block_map_t bmap = {0};
+    block_t current = 0;
+    int i = 0, fd = 0;
+
+    if(!(inode = icache_get(dev, self))) {
+        errno = ENFILE;
+        printk("open:: error loading inode dev=%d block=%u\n", dev, self);
+        return -1;
+    }
+    inode->modified_time = ktime(0);
+    bmap.next = inode->next;
+    current = bmap.next;
+    while(current != INODE_NULL) {
+        current = bmap.next;
+        block_read(dev, bmap.next, (char *)&bmap);
+        for(i = 0; i < BMAP_BLOCKS; ++i) {
+            if(bmap.blocks[i] != INODE_NULL) {
+                inode_free_data_block(dev, bmap.blocks[i]);
+            }
+        }
+        if(current != INODE_NULL) {
+            inode_free_data_block(dev, current);
+        }
+    }
+    if(inode->is_extent && extent_free(dev, inode) != EXTENT_OK) {
+        printk("open:: error truncating file [%s]\n", path);
+        icache_put(inode);
+        return -1;
+    }
+    // Once truncated, chained files are mapped with extents too.
+    inode->is_extent = inode->is_file;
+    inode->pos  = 0;
+    inode->size = 0;
+    inode->next = INODE_NULL;
+    icache_dirty(inode);
+    fd = file_install(dev, self, flags);
+    icache_put(inode);
+    return fd;
+}
+
 int kopen(const char *path, int flags)
 {
     inode_t inode;
-    int i = 0, fd = 0;
-    bool found = false;
     int dev = master_get_dev(path);
     inode_mode_t imode = 0;
     inode_perm_t  perm = 0;
-    block_map_t bmap = {0};
-    block_t current = 0;
 
     if(flags & O_RDONLY) {
         imode = INODE_READ;
@@ -648,92 +899,18 @@ int kopen(const char *path, int flags)
            return -1;
         }
     }
-    inode.accessed_time = ktime(0);
-    // Truncate if needed. Need to write code to do this.
-    // Basically, copy the inode, then call a truncate method based
-    // on inode_free. Basically a routine to free the data blocks 
-    // pointed to by the inode.
     if(flags & O_TRUNC) {
-        inode.modified_time = ktime(0);
-        bmap.next = inode.next;
-        current = bmap.next;
-        while(current != INODE_NULL) {
-            current = bmap.next;
-            block_read(dev, bmap.next, (char *)&bmap);
-            for(i = 0; i < BMAP_BLOCKS; ++i) {
-                if(bmap.blocks[i] != INODE_NULL) {
-                    // DEBUG printk("bmap.blocks[%d]=%u\n",i,bmap.blocks[i]);
-                    inode_free_data_block(dev, bmap.blocks[i]);
-                }
-            }
-            if(current != INODE_NULL) {
-                inode_free_data_block(dev, current);
-            }
-        }
-        inode.pos  = 0;
-        inode.size = 0;
-        inode.next = INODE_NULL;
-        block_write(dev, inode.self, (char *)&inode);
+        return file_open_trunc(dev, inode.self, flags, path);
     }
-    if(flags & O_RDONLY) {
-        inode.o_mode |= O_RDONLY;
-    } else if(flags & O_WRONLY) {
-        inode.o_mode |= O_WRONLY;
-    } else if(flags & O_RDWR) {
-        inode.o_mode |= O_RDWR;
-    }
-    if(flags & O_APPEND) {
-        inode.current = INODE_NULL;
-        inode.pos = inode.size;
-        inode.current_parent = INODE_NULL;
-        inode.iblock = 0;
-        inode.dev = dev;
-    } else {
-        inode.current = INODE_NULL;
-        inode.pos = 0;
-        inode.current_parent = INODE_NULL;
-        inode.iblock = 0;
-        inode.dev = dev;
-    }
-  // Determine if a file has been allocated.
-  for(i = 0, fd = -1; i < MAX_FILES; ++i) {
-      if(!current_process->file_tab[i].path || !strlen(current_process->file_tab[i].path)) {
-          for(fd = 0; fd < MAX_FILES; ++fd) {
-              if(!current_process->file_desc[fd]) {
-                  current_process->file_desc[fd] = &current_process->file_tab[i];
-                  found = true;
-                  break;
-              }
-          }
-          if(!found) {
-              fd = -1;
-          } else if(found) {
-              break;
-          }
-      }
-  }
-  // fd points to the file descriptor.
-  // Now load it using inode_get or inode_create.
-  if(fd == -1) {
-      errno = EMFILE;
-      printk("open:: error maximum file descriptors in use\n");
-      return fd;
-  }
-  // Struct assign.
-  *(current_process->file_desc[fd]) = inode;
-  return fd;
+    return file_install(dev, inode.self, flags);
 }
 
 int kopen2(const char *path, int flags, mode_t mode)
 {
     inode_t inode;
-    int i = 0, fd = 0;
-    bool found = false;
     int dev = master_get_dev(path);
     inode_mode_t imode = 0;
     inode_perm_t  perm = 0;
-    block_map_t bmap = {0};
-    block_t current = 0;
 
     if(flags & O_RDONLY) {
         imode = INODE_READ;
@@ -776,88 +953,17 @@ int kopen2(const char *path, int flags, mode_t mode)
            return -1;
         }
     }
-    inode.accessed_time = ktime(0);
-    // Truncate if needed. Need to write code to do this.
-    // Basically, copy the inode, then call a truncate method based
-    // on inode_free. Basically a routine to free the data blocks 
-    // pointed to by the inode.
     if(flags & O_TRUNC) {
-        inode.modified_time = ktime(0);
-        bmap.next = inode.next;
-        current = bmap.next;
-        while(current != INODE_NULL) {
-            current = bmap.next;
-            block_read(dev, bmap.next, (char *)&bmap);
-            for(i = 0; i < BMAP_BLOCKS; ++i) {
-                if(bmap.blocks[i] != INODE_NULL) {
-                    inode_free_data_block(dev, bmap.blocks[i]);
-                }
-            }
-            if(current != INODE_NULL) {
-                inode_free_data_block(dev, current);
-            }
-        }
-        inode.pos  = 0;
-        inode.size = 0;
-        inode.next = INODE_NULL;
-        block_write(dev, inode.self, (char *)&inode);
+        return file_open_trunc(dev, inode.self, flags, path);
     }
-    if(flags & O_RDONLY) {
-        inode.o_mode |= O_RDONLY;
-    } else if(flags & O_WRONLY) {
-        inode.o_mode |= O_WRONLY;
-    } else if(flags & O_RDWR) {
-        inode.o_mode |= O_RDWR;
-    }
-    if(flags & O_APPEND) {
-        inode.current = INODE_NULL;
-        inode.pos = inode.size;
-        inode.current_parent = INODE_NULL;
-        inode.iblock = 0;
-        inode.dev = dev;
-    } else {
-        inode.current = INODE_NULL;
-        inode.pos = 0;
-        inode.current_parent = INODE_NULL;
-        inode.iblock = 0;
-        inode.dev = dev;
-    }
-  // Determine if a file has been allocated.
-  for(i = 0, fd = -1; i < MAX_FILES; ++i) {
-      if(!current_process->file_tab[i].path || !strlen(current_process->file_tab[i].path)) {
-          for(fd = 0; fd < MAX_FILES; ++fd) {
-              if(!current_process->file_desc[fd]) {
-                  current_process->file_desc[fd] = &current_process->file_tab[i];
-                  found = true;
-                  break;
-              }
-          }
-          if(!found) {
-              fd = -1;
-          } else if(found) {
-              break;
-          }
-      }
-  }
-  // fd points to the file descriptor.
-  // Now load it using inode_get or inode_create.
-  if(fd == -1) {
-      errno = EMFILE;
-      printk("open:: error maximum file descriptors in use\n");
-      return fd;
-  }
-  // Struct assign.
-  *(current_process->file_desc[fd]) = inode;
-  return fd;
+    return file_install(dev, inode.self, flags);
 }
 
 int kcreat(const char *path, mode_t mode)
 {
     inode_t inode = {0};
-    int i = 0, fd = 0;
     int dev = master_get_dev(path);
     inode_mode_t imode = 0;
-    bool found = false;
 
     imode = inode_get_mode(mode, current_process->umask);
 
@@ -874,48 +980,13 @@ int kcreat(const char *path, mode_t mode)
        printk("creat:: error creating file\n");
        return -1;
    }
-   // Determine if a file has been allocated.
-   for(i = 0, fd = -1; i < MAX_FILES; ++i) {
-      if(!current_process->file_tab[i].path || !strlen(current_process->file_tab[i].path)) {
-          for(fd = 0; fd < MAX_FILES; ++fd) {
-              if(!current_process->file_desc[fd]) {
-                  current_process->file_desc[fd] = &current_process->file_tab[i];
-                  found = true;
-                  break;
-              }
-          }
-          if(!found) {
-              fd = -1;
-          } else if(found) {
-              break;
-          }
-      }
-   }
-   // fd points to the file descriptor.
-   // Now load it using inode_get.
-   if(fd == -1) {
-      errno = EMFILE;
-      printk("creat:: error maximum file descriptors in use\n");
-      return fd;
-   }
-
    if(inode_get(dev, current_process->cwd, path, true, imode, &inode) != INODE_OK) {
         errno = EMFILE;
         printk("creat:: error retrieving inode dev=%d current_dir=%u path=%s\n",
                 dev, current_process->cwd, path);
         return -1;
    }
-
-   // Must initialize the inode for read/write here.
-   inode.current = INODE_NULL;
-   inode.pos = 0;
-   inode.current_parent = INODE_NULL;
-   inode.iblock = 0;
-   inode.dev = dev;
-
-   // Struct assign.
-   *(current_process->file_desc[fd]) = inode;
-   return fd;
+   return file_install(dev, inode.self, O_WRONLY);
 }
 
 int kunlink(const char *path)
@@ -930,83 +1001,59 @@ int kunlink(const char *path)
 
 int kclose(int fd)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
-    inode_t zero_inode = {0};
-    bool found = false;
-    int i = 0;
+    file_t *file = file_get(fd);
+    inode_t *inode = NULL;
 
-    if(!inode) {
+    if(!file) {
         printk("close:: invalid file desc [%d]\n",fd);
         errno = EBADF;
         return -1;
     }
-
-    for(i = 0; i < MAX_FILES; ++i) {
-        if(current_process->file_desc[i] == inode && i != fd) {
-            found = true;
-            break;
-        }
-    }
-
-    if(found) {
-        // There was a duplicate, just NULL out
-        // this descriptor.
-        current_process->file_desc[fd] = NULL;
+    // NULL out our descriptor table indicating the
+    // descriptor is ready for use for some other file.
+    current_process->file_desc[fd] = NULL;
+    if(--file->count) {
+        // There was a duplicate, it keeps the file open.
         return 0;
     }
 
-    // Otherwise, continue with close.
-    if(block_sync(inode->dev) != BLOCK_OK) {
-        errno = EACCES;
-        printk("close:: error writing blocks dev=%d\n", inode->dev);
-        return -1;
-    }
-    inode->o_mode  = 0;
-    inode->current = INODE_NULL;
-    inode->current_parent = INODE_NULL;
-    inode->iblock = 0;
-    inode->pos = 0;
+    // Otherwise, continue with close. Dirty blocks are left
+    // in the cache for the write-back flusher (see block_flush),
+    // ksync forces them out.
+    // Blocks reserved for further writes go back to the free pool
+    // once the inode is not open anymore, see icache_put.
+    inode = file->inode;
     inode->accessed_time = ktime(0);
-    if(block_write(inode->dev, inode->self, (char *)inode) != BLOCK_OK) {
-        errno = EACCES;
-        printk("close:: error writing inode dev=%d block=%u\n",
-                inode->dev, inode->self);
-        return -1;
-    }
-    // Reset the file table.
-    for(i = 0; i < MAX_FILES; ++i) {
-        if(&(current_process->file_tab[i]) == inode) {
-            current_process->file_tab[i] = zero_inode;
-        }
-    }
-    // NULL out our descriptor table indicating the
-    // descriptor is ready for use for some other file.
-    current_process->file_desc[fd] = NULL;
+    icache_dirty(inode);
+    icache_put(inode);
+    file->inode = NULL;
     return 0;
 }
 
 ssize_t kread(int fd, void *buf, size_t count)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    file_t *file = file_get(fd);
+    inode_t *inode = NULL;
     inode_ptr_t bytes_processed = 0, bytes_processed1 = 0, tmp = 0;
-    if(!inode) {
+    if(!file) {
         printk("read:: invalid file desc [%d]\n",fd);
         return -1;
     }
+    inode = file->inode;
     inode->accessed_time = ktime(0);
-    if(inode->pos > inode->size) {
+    if(file->pos > inode->size) {
         char zero_data[DEV_BLOCK_SIZE]={0};
-        block_t iter = (inode->pos - inode->size) / DEV_BLOCK_SIZE;
-        block_t  mod = (inode->pos - inode->size) % DEV_BLOCK_SIZE;
+        block_t iter = (file->pos - inode->size) / DEV_BLOCK_SIZE;
+        block_t  mod = (file->pos - inode->size) % DEV_BLOCK_SIZE;
         while(iter--) {
-            if(file_read_write(inode, inode->size, DEV_BLOCK_SIZE, 
+            if(file_read_write(file, inode->size, DEV_BLOCK_SIZE, 
                            zero_data, true /* reading */, &tmp) != FILE_OK) {
                 return -1;
             }
             bytes_processed1 += tmp;
         }
         if(mod) {
-            if(file_read_write(inode, inode->size, mod, 
+            if(file_read_write(file, inode->size, mod, 
                            zero_data, true /* reading */, &tmp) != FILE_OK) {
                 return -1;
             }
@@ -1014,7 +1061,7 @@ ssize_t kread(int fd, void *buf, size_t count)
         }
     }
     //printk("RGD count=%u\n",count);
-    if(file_read_write(inode, inode->pos, count, buf, true /* reading */, &bytes_processed) != FILE_OK) {
+    if(file_read_write(file, file->pos, count, buf, true /* reading */, &bytes_processed) != FILE_OK) {
         return -1;
     }
     //printk("buf=[%s]\n",buf);
@@ -1023,33 +1070,35 @@ ssize_t kread(int fd, void *buf, size_t count)
 
 ssize_t kwrite(int fd, const void *buf, size_t count)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    file_t *file = file_get(fd);
+    inode_t *inode = NULL;
     inode_ptr_t bytes_processed = 0, bytes_processed1 = 0, tmp = 0;
-    if(!inode) {
+    if(!file) {
         printk("write:: invalid file desc [%d]\n",fd);
         return -1;
     }
+    inode = file->inode;
     inode->modified_time = ktime(0);
-    if(inode->pos > inode->size) {
+    if(file->pos > inode->size) {
         char zero_data[DEV_BLOCK_SIZE]={0};
-        block_t iter = (inode->pos - inode->size) / DEV_BLOCK_SIZE;
-        block_t  mod = (inode->pos - inode->size) % DEV_BLOCK_SIZE;
+        block_t iter = (file->pos - inode->size) / DEV_BLOCK_SIZE;
+        block_t  mod = (file->pos - inode->size) % DEV_BLOCK_SIZE;
         while(iter--) {
-            if(file_read_write(inode, inode->size, DEV_BLOCK_SIZE, 
+            if(file_read_write(file, inode->size, DEV_BLOCK_SIZE, 
                            zero_data, false /* writing */, &tmp) != FILE_OK) {
                 return -1;
             }
             bytes_processed1 += tmp;
         }
         if(mod) {
-            if(file_read_write(inode, inode->size, mod, 
+            if(file_read_write(file, inode->size, mod, 
                            zero_data, false /* writing */, &tmp) != FILE_OK) {
                 return -1;
             }
             bytes_processed1 += tmp;
         }
     }
-    if(file_read_write(inode, inode->pos, count, buf, false /* writing */, &bytes_processed) != FILE_OK) {
+    if(file_read_write(file, file->pos, count, buf, false /* writing */, &bytes_processed) != FILE_OK) {
         return -1;
     }
     return bytes_processed + bytes_processed1;
@@ -1059,58 +1108,53 @@ ssize_t kwrite(int fd, const void *buf, size_t count)
 //           are they in ox/types.h or sys/types.h ?
 off_t klseek(int fd, off_t offset, int whence)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
-    if(!inode) {
+    file_t *file = file_get(fd);
+    if(!file) {
         printk("lseek:: invalid file desc [%d]\n",fd);
         return (off_t)-1;
     }
     if(whence == SEEK_SET) {
-        inode->pos = offset;
+        file->pos = offset;
     } else if(whence == SEEK_CUR) {
-        inode->pos += offset;
-        if(inode->pos > SSIZE_MAX) {
+        file->pos += offset;
+        if(file->pos > SSIZE_MAX) {
             // Its actually unspecified, but we hard code
             // it to be the largest value.
-            inode->pos = SSIZE_MAX;
+            file->pos = SSIZE_MAX;
         }
     } else if(whence == SEEK_END) {
-        inode->pos = inode->size + offset;
+        file->pos = file->inode->size + offset;
     } else {
         return (off_t)-1;
     }
     // Must reset iblock as we need to
     // seek inside file_read_write since
     // an lseek was done.
-    inode->iblock = INODE_NOPOS;
-    if(block_write(inode->dev, inode->self, (char *)inode) != BLOCK_OK) {
-        errno = EACCES;
-        printk("lseek:: error writing block dev=%d block=%u\n",
-                inode->dev, inode->self);
-        return (off_t)-1;
-    }
-    return inode->pos;
+    file->iblock = INODE_NOPOS;
+    return file->pos;
 }
 
-//   dup and dup2 are implemented using two tables
+//   dup and dup2 are implemented using the file_desc table
 //   inside struct proc :=
 //
-//   inode_t file_tab[MAX_FILES]; and
-//   inode_t *file_desc[MAX_FILES];
+//   file_t *file_desc[MAX_FILES];
 //
-//   These allow us to duplicate the files.
+//   A duplicate points to the same file_t, sharing its position,
+//   file_t.count is the number of descriptors referring to it.
 //
 int kdup(int fd)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    file_t *file = file_get(fd);
     int i = 0;
-    if(!inode) {
+    if(!file) {
         errno = EBADF;
         printk("dup:: error bad file descriptor\n");
         return -1;
     }
     for(i = 0; i < MAX_FILES; ++i) {
         if(current_process->file_desc[i] == NULL) {
-            current_process->file_desc[i] = inode;
+            current_process->file_desc[i] = file;
+            file->count++;
             return i;
         }
     }
@@ -1121,18 +1165,18 @@ int kdup(int fd)
 
 int kdup2(int fd, int newfd)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
-    if(!inode) {
+    file_t *file = file_get(fd);
+    if(!file) {
         errno = EBADF;
         printk("dup2:: error bad file descriptor\n");
         return -1;
     }
-    if(newfd < 0 || newfd > MAX_FILES) {
+    if(newfd < 0 || newfd >= MAX_FILES) {
         errno = EBADF;
         printk("dup2:: error bad file descriptor\n");
         return -1;
     }
-    if(current_process->file_desc[newfd] == inode) {
+    if(current_process->file_desc[newfd] == file) {
         // No-op.
         return newfd;
     }
@@ -1141,7 +1185,8 @@ int kdup2(int fd, int newfd)
         kclose(newfd);
     }
     // Duplicate it.
-    current_process->file_desc[newfd] = inode;
+    current_process->file_desc[newfd] = file;
+    file->count++;
     return newfd;
 }
 
@@ -1183,7 +1228,8 @@ int kstat(const char *path, struct stat *buf)
 
 int kfstat(int fd, struct stat *buf)
 {
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    file_t *file = file_get(fd);
+    inode_t *inode = (file ? file->inode : NULL);
     int dev = master_get_dev(0);
     if(!inode) {
         errno = EBADF;
@@ -1213,6 +1259,51 @@ int kfstat(int fd, struct stat *buf)
     return 0;
 }
 
+#ifndef _TEST_FILE_INC
+// The host's <sys/ioctl.h> has no buffer cache requests.
+int kioctl(int fd, int request, void *arg)
+{
+    file_t *file = file_get(fd);
+    struct bstat *bs = (struct bstat *)arg;
+    block_stat_t st;
+    int dev = 0;
+    if(!file) {
+        errno = EBADF;
+        printk("ioctl:: invalid file desc [%d]\n",fd);
+        return -1;
+    }
+    // The statistics are those of the device the file is on.
+    dev = file->inode->dev;
+    switch(request) {
+        case BIOCGSTAT:
+            if(!bs) {
+                errno = EINVAL;
+                printk("ioctl:: buffer is NULL\n");
+                return -1;
+            }
+            block_stat(dev, &st);
+            bs->bs_hits          = st.hits;
+            bs->bs_misses        = st.misses;
+            bs->bs_ra_blocks     = st.ra_blocks;
+            bs->bs_ra_hits       = st.ra_hits;
+            bs->bs_evict_clean   = st.evict_clean;
+            bs->bs_evict_dirty   = st.evict_dirty;
+            bs->bs_sync_writes   = st.sync_writes;
+            bs->bs_dev_reads     = st.dev_reads;
+            bs->bs_dev_writes    = st.dev_writes;
+            bs->bs_bytes_read    = st.bytes_read;
+            bs->bs_bytes_written = st.bytes_written;
+            return 0;
+        case BIOCRSTAT:
+            block_stat_reset(dev);
+            return 0;
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+#endif
+
 int klstat(const char *path, struct stat *buf)
 {
     inode_t inode;
@@ -1255,6 +1346,10 @@ int klstat(const char *path, struct stat *buf)
 void ksync(void)
 {
     int dev = master_get_dev(0);
+    if(icache_sync(dev) != ICACHE_OK) {
+        errno = EACCES;
+        printk("sync:: error sync'ing inodes\n");
+    }
     if(block_sync(dev) != BLOCK_OK) {
         errno = EACCES;
         printk("sync:: error sync'ing blocks\n");
@@ -1292,8 +1387,9 @@ int kchmod(const char *path, mode_t mode)
 int kfchmod(int fd, mode_t mode)
 {
     // Get inode from file_desc table. Set the mode bits inside,
-    // write out to disk.
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    // it is written back on sync or the last close.
+    file_t *file = file_get(fd);
+    inode_t *inode = (file ? file->inode : NULL);
     if(!inode) {
         errno = EBADF;
         printk("fchmod:: invalid file desc [%d]\n",fd);
@@ -1306,12 +1402,7 @@ int kfchmod(int fd, mode_t mode)
                 inode->self, mode, current_process->umask);
         return -1;
     }
-    if(block_write(inode->dev, inode->self, (char *)inode) != BLOCK_OK) {
-        errno = EACCES;
-        printk("chmod:: error writing block dev=%d block=%u\n",
-                inode->dev, inode->self);
-        return -1;
-    }
+    icache_dirty(inode);
     return 0;
 }
 
@@ -1342,8 +1433,9 @@ int kchown(const char *path, uid_t owner, gid_t group)
 int kfchown(int fd, uid_t owner, gid_t group)
 {
     // Get inode from file_desc table. Set the mode bits inside,
-    // write out to disk.
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    // it is written back on sync or the last close.
+    file_t *file = file_get(fd);
+    inode_t *inode = (file ? file->inode : NULL);
     if(!inode) {
         errno = EBADF;
         printk("fchmod:: invalid file desc [%d]\n",fd);
@@ -1352,12 +1444,7 @@ int kfchown(int fd, uid_t owner, gid_t group)
     inode->owner = owner;
     inode->group = group;
     inode->modified_time = ktime(0);
-    if(block_write(inode->dev, inode->self, (char *)inode) != BLOCK_OK) {
-        errno = EACCES;
-        printk("chmod:: error writing block dev=%d block=%u\n",
-                inode->dev, inode->self);
-        return -1;
-    }
+    icache_dirty(inode);
     return 0;
 }
 
@@ -1470,7 +1557,8 @@ int kfchdir(int fd)
 {
     // Lookup the inode referenced by fd,
     // set current_process->cwd to inode.self of that descriptor.
-    inode_t *inode = ((fd < 0 || fd > MAX_FILES) ? NULL : current_process->file_desc[fd]);
+    file_t *file = file_get(fd);
+    inode_t *inode = (file ? file->inode : NULL);
     if(!inode) {
         errno = EBADF;
         return -1;
@@ -1544,16 +1632,61 @@ int krename(const char *oldpath, const char *newpath)
                 dev, newnode.self);
         return -1;
     }
+    // newnode now holds the old contents, a renamed directory brings
+    // its entries along, nothing looked up in newnode before holds.
+    dcache_invalidate(dev, newnode.self);
     return 0;
 }
 
 #ifdef _TEST_FILE
+//
+// file_test_freed:
+//
+// Check that the data blocks and preallocation window of 'node',
+// a copy of a closed file with its extents in the inode, are free
+// by reserving them again, then give them back.
+// Returns 1 if they are
+//         0 otherwise
+//
+static int file_test_freed(int dev, inode_t *node)
+{
+    block_t block = 0, count = 0, j = 0;
+    extent_t run[INODE_EXTENTS + 1] = {{0}};
+    int i = 0, n = 0, freed = 1;
+
+    if(node->ext_depth) {
+        return 0;
+    }
+    for(i = 0; i < node->ext_count; ++i) {
+        run[n++] = node->ext[i];
+    }
+    if(node->prealloc_count) {
+        run[n].start  = node->prealloc;
+        run[n].length = node->prealloc_count;
+        n++;
+    }
+    for(i = 0; i < n; ++i) {
+        if(inode_alloc_blocks(dev, run[i].start, run[i].length,
+                              &block, &count) != INODE_OK) {
+            return 0;
+        }
+        if(block != run[i].start || count != run[i].length) {
+            freed = 0;
+        }
+        for(j = 0; j < count; ++j) {
+            inode_free_data_block(dev, block + j);
+        }
+    }
+    return freed;
+}
+
 int
 main(int argc, char **argv)
 {
     int i  = 0;
-    int fd = 0, fd1 = 0;
+    int fd = 0, fd1 = 0, fd2 = 0;
     int dev = 0;
+    inode_t node = {0};
     master_inode_t *master = NULL;
     char buff[36]={0};
     char buff1[514]={0};
@@ -2068,6 +2201,92 @@ main(int argc, char **argv)
     if((fd = kclose(fd)) == -1) {
         printk("file_init:: error closing file\n");
     }
+    // Two opens of a file share its inode and keep their own position.
+    fd = kcreat("/shared", S_IRUSR | S_IWUSR);
+    if(kwrite(fd, "hello world", strlen("hello world")) == -1) {
+        printk("error writing file\n");
+    }
+    if((fd1 = kopen("/shared", O_RDWR)) == -1) {
+        printk("error kopen file twice failed\n");
+    }
+    klseek(fd, 0, SEEK_END);
+    if(kwrite(fd, "!", 1) != 1) {
+        printk("error writing file\n");
+    }
+    memset(buff,0x0,sizeof(buff));
+    if(kfstat(fd1, &stbuf) == -1 || stbuf.st_size != 12 ||
+       kstat("/shared", &stbuf) == -1 || stbuf.st_size != 12 ||
+       klseek(fd1, 0, SEEK_CUR) != 0 ||
+       kread(fd1, buff, 12) != 12 || strcmp(buff, "hello world!")) {
+        printk("error shared inode size=%u [%s]\n", stbuf.st_size, buff);
+    } else {
+        printk("successfully shared inode between opens\n");
+    }
+    // Truncating it is seen by the files that have it open.
+    if((fd2 = kopen("/shared", O_RDWR | O_TRUNC)) == -1 ||
+       kfstat(fd, &stbuf) == -1 || stbuf.st_size != 0) {
+        printk("error truncate of shared inode size=%u\n", stbuf.st_size);
+    } else {
+        printk("successfully truncated shared inode\n");
+    }
+    if(kclose(fd) == -1 || kclose(fd1) == -1 || kclose(fd2) == -1) {
+        printk("file_init:: error closing file\n");
+    }
+    // Unlinked while open, the data is still read and written through
+    // the descriptor and its blocks are released by the last close.
+    fd = kcreat("/unlinked", S_IRUSR | S_IWUSR);
+    memset(buff,0x0,sizeof(buff));
+    if(kwrite(fd, "A", 1) != 1 || kunlink("/unlinked") == -1 ||
+       klseek(fd, 0, SEEK_SET) != 0 || kread(fd, buff, 1) != 1 || buff[0] != 'A') {
+        printk("error reading unlinked file [%s]\n", buff);
+    } else {
+        printk("successfully read unlinked file\n");
+    }
+    for(i = 0; i < 8; ++i) {
+        if(kwrite(fd, buff1, 513) != 513) {
+            printk("error writing unlinked file\n");
+        }
+    }
+    memset(buff,0x0,sizeof(buff));
+    if(kfstat(fd, &stbuf) == -1 || stbuf.st_size != 1 + 8 * 513 ||
+       klseek(fd, 1 + 7 * 513, SEEK_SET) == -1 ||
+       kread(fd, buff, 16) != 16 || memcmp(buff, buff1, 16)) {
+        printk("error writing unlinked file size=%u\n", stbuf.st_size);
+    }
+    node = *file_get(fd)->inode;
+    if(kclose(fd) == -1 || !file_test_freed(dev, &node)) {
+        printk("error unlinked file blocks not released\n");
+    } else {
+        printk("successfully released unlinked file\n");
+    }
+    // Renamed while open, later writes go to the new name.
+    fd = kcreat("/before", S_IRUSR | S_IWUSR);
+    if(kwrite(fd, "hello", 5) != 5 || krename("/before", "/after") == -1 ||
+       kwrite(fd, " world", 6) != 6) {
+        printk("error writing renamed file\n");
+    }
+    for(i = 0; i < 8; ++i) {
+        if(kwrite(fd, buff1, 513) != 513) {
+            printk("error writing renamed file\n");
+        }
+    }
+    if(kclose(fd) == -1) {
+        printk("file_init:: error closing file\n");
+    }
+    memset(buff,0x0,sizeof(buff));
+    if((fd = kopen("/after", O_RDWR)) == -1 ||
+       kfstat(fd, &stbuf) == -1 || stbuf.st_size != 11 + 8 * 513 ||
+       kread(fd, buff, 11) != 11 || strcmp(buff, "hello world")) {
+        printk("error reading renamed file size=%u [%s]\n", stbuf.st_size, buff);
+    } else {
+        printk("successfully read renamed file\n");
+    }
+    node = *file_get(fd)->inode;
+    if(kunlink("/after") == -1 || kclose(fd) == -1 || !file_test_freed(dev, &node)) {
+        printk("error renamed file blocks not released\n");
+    } else {
+        printk("successfully released renamed file\n");
+    }
     printk("file_init:: success\n");
     return 0;
 }
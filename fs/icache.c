@@ -0,0 +1,438 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      icache.c
+//
+// @description:
+//      Kernel wide table of in-core inodes of open files.
+//      Every open of a file shares one copy of its inode, reads
+//      and writes through a descriptor only set its dirty flag
+//      and it is written to the buffer cache on icache_sync or
+//      when the last reference is released, which also gives
+//      back its preallocated blocks, or all of its blocks if the
+//      file was removed while open. Lookups by path
+//      go through inode_get, which writes a modified inode
+//      back first and has it read again before the next use
+//      through a descriptor, so both see the same metadata.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#include "bool.h"
+#include "paths.h"
+#include "block.h"
+#include "dev.h"
+#include "inode.h"
+#include "compat.h"
+
+#if defined(_TEST_ICACHE_INC) || defined(_TEST_ICACHE)
+#include <stdio.h>
+#include <string.h>
+#define printk printf
+#else
+#include <ox/error_rpt.h>
+#endif
+
+#include "icache.h"
+
+typedef struct icache_entry {
+    int      dev;        // DEV_NODEV if the entry is free.
+    block_t  self;       // Block of the inode.
+    int      count;      // References from icache_get.
+    bool     dirty;      // Modified since last written back.
+    bool     stale;      // Written by path, read again before use.
+    bool     unlinked;   // Removed by inode_free, not in a chain.
+    int      hash_next;  // Next entry in the same chain, or free entry.
+    inode_t  inode;
+} icache_entry_t;
+
+#define ICACHE_NOPOS -1
+
+static bool init = false;
+static icache_entry_t icache_tab[ICACHE_SIZE];
+static int icache_hash[ICACHE_HASH]; // First entry in each chain or ICACHE_NOPOS.
+static int icache_free = ICACHE_NOPOS; // First free entry.
+
+static void icache_init()
+{
+    int i = 0;
+    for(i = 0; i < ICACHE_HASH; ++i) {
+        icache_hash[i] = ICACHE_NOPOS;
+    }
+    for(i = 0; i < ICACHE_SIZE; ++i) {
+        icache_tab[i].dev = DEV_NODEV;
+        icache_tab[i].hash_next = (i == ICACHE_SIZE - 1) ? ICACHE_NOPOS : i + 1;
+    }
+    icache_free = 0;
+    init = true;
+}
+
+static int icache_hash_fn(int dev, block_t self)
+{
+    return ((unsigned)self + (unsigned)dev * 31) % ICACHE_HASH;
+}
+
+static int icache_find(int dev, block_t self)
+{
+    register int i = 0;
+    if(!init) {
+        return ICACHE_NOPOS;
+    }
+    for(i = icache_hash[icache_hash_fn(dev, self)]; 
+        i != ICACHE_NOPOS; i = icache_tab[i].hash_next) {
+        if(icache_tab[i].dev == dev && icache_tab[i].self == self) {
+            return i;
+        }
+    }
+    return ICACHE_NOPOS;
+}
+
+//
+// icache_entry:
+//
+// The entry holding 'inode', NULL if it was not
+// obtained from icache_get.
+//
+static icache_entry_t *icache_entry(inode_t *inode)
+{
+    int i = 0;
+    if(!init || (char *)inode < (char *)icache_tab ||
+       (char *)inode >= (char *)(icache_tab + ICACHE_SIZE)) {
+        return NULL;
+    }
+    i = ((char *)inode - (char *)icache_tab) / sizeof(icache_entry_t);
+    if(&icache_tab[i].inode != inode || icache_tab[i].dev == DEV_NODEV) {
+        return NULL;
+    }
+    return &icache_tab[i];
+}
+
+static void icache_unhash(int i)
+{
+    int h = icache_hash_fn(icache_tab[i].dev, icache_tab[i].self);
+    if(icache_hash[h] == i) {
+        icache_hash[h] = icache_tab[i].hash_next;
+        return;
+    }
+    for(h = icache_hash[h]; h != ICACHE_NOPOS; h = icache_tab[h].hash_next) {
+        if(icache_tab[h].hash_next == i) {
+            icache_tab[h].hash_next = icache_tab[i].hash_next;
+            return;
+        }
+    }
+}
+
+static icache_rtvl_t icache_read(icache_entry_t *entry)
+{
+    if(block_read(entry->dev, entry->self, (char *)&entry->inode) != BLOCK_OK) {
+        printk("icache_read:: error reading inode dev=%d block=%u\n",
+                entry->dev, entry->self);
+        return ICACHE_FAIL;
+    }
+    entry->inode.dev = entry->dev;
+    entry->stale = false;
+    return ICACHE_OK;
+}
+
+static icache_rtvl_t icache_write(icache_entry_t *entry)
+{
+    if(entry->unlinked) {
+        // Its block is free, maybe in use by another inode.
+        entry->dirty = false;
+        return ICACHE_OK;
+    }
+    if(block_write(entry->dev, entry->self, (char *)&entry->inode) != BLOCK_OK) {
+        printk("icache_write:: error writing inode dev=%d block=%u\n",
+                entry->dev, entry->self);
+        return ICACHE_FAIL;
+    }
+    entry->dirty = false;
+    return ICACHE_OK;
+}
+
+inode_t *icache_get(int dev, block_t self)
+{
+    icache_entry_t *entry = NULL;
+    int i = 0, h = 0;
+    if(!init) {
+        icache_init();
+    }
+    if((i = icache_find(dev, self)) != ICACHE_NOPOS) {
+        entry = &icache_tab[i];
+        if(entry->stale && icache_read(entry) != ICACHE_OK) {
+            return NULL;
+        }
+        entry->count++;
+        return &entry->inode;
+    }
+    if((i = icache_free) == ICACHE_NOPOS) {
+        printk("icache_get:: no free inodes dev=%d block=%u\n", dev, self);
+        return NULL;
+    }
+    entry = &icache_tab[i];
+    entry->dev = dev;
+    entry->self = self;
+    if(icache_read(entry) != ICACHE_OK) {
+        entry->dev = DEV_NODEV;
+        return NULL;
+    }
+    icache_free = entry->hash_next;
+    entry->count = 1;
+    entry->dirty = false;
+    entry->unlinked = false;
+    h = icache_hash_fn(dev, self);
+    entry->hash_next = icache_hash[h];
+    icache_hash[h] = i;
+    return &entry->inode;
+}
+
+void icache_put(inode_t *inode)
+{
+    icache_entry_t *entry = icache_entry(inode);
+    int i = 0;
+    if(!entry) {
+        printk("icache_put:: inode is not held\n");
+        return;
+    }
+    if(--entry->count) {
+        return;
+    }
+    i = entry - icache_tab;
+    if(entry->unlinked) {
+        // Removed while open, the last close releases its data.
+        if(entry->inode.is_file &&
+           inode_free_data(entry->dev, &entry->inode) != INODE_OK) {
+            printk("icache_put:: error releasing blocks dev=%d block=%u\n",
+                    entry->dev, entry->self);
+        }
+    } else {
+        if(entry->inode.prealloc_count) {
+            // Blocks reserved for further writes go back to the free pool.
+            if(inode_free_prealloc(entry->dev, &entry->inode) != INODE_OK) {
+                printk("icache_put:: error releasing blocks dev=%d block=%u\n",
+                        entry->dev, entry->self);
+            }
+            entry->dirty = true;
+        }
+        if(entry->dirty) {
+            icache_write(entry);
+        }
+        icache_unhash(i);
+    }
+    entry->dev = DEV_NODEV;
+    entry->hash_next = icache_free;
+    icache_free = i;
+}
+
+void icache_dirty(inode_t *inode)
+{
+    icache_entry_t *entry = icache_entry(inode);
+    if(entry) {
+        entry->dirty = true;
+    }
+}
+
+void icache_refresh(inode_t *inode)
+{
+    icache_entry_t *entry = icache_entry(inode);
+    if(entry && entry->stale) {
+        icache_read(entry);
+    }
+}
+
+icache_rtvl_t icache_flush(int dev, block_t self)
+{
+    int i = icache_find(dev, self);
+    if(i == ICACHE_NOPOS) {
+        return ICACHE_OK;
+    }
+    if(icache_tab[i].dirty && icache_write(&icache_tab[i]) != ICACHE_OK) {
+        return ICACHE_FAIL;
+    }
+    icache_tab[i].stale = true;
+    return ICACHE_OK;
+}
+
+bool icache_unlink(int dev, inode_t *inode)
+{
+    icache_entry_t *entry = NULL;
+    int i = icache_find(dev, inode->self);
+    if(i == ICACHE_NOPOS) {
+        return false;
+    }
+    entry = &icache_tab[i];
+    entry->inode = *inode;
+    entry->inode.dev = dev;
+    entry->dirty = false;
+    entry->stale = false;
+    entry->unlinked = true;
+    icache_unhash(i);
+    return true;
+}
+
+void icache_rename(int dev, block_t self, inode_t *newnode)
+{
+    icache_entry_t *entry = NULL;
+    int i = icache_find(dev, self), h = 0;
+    if(i == ICACHE_NOPOS) {
+        return;
+    }
+    entry = &icache_tab[i];
+    icache_unhash(i);
+    entry->self = newnode->self;
+    entry->inode = *newnode;
+    entry->inode.dev = dev;
+    entry->dirty = false;
+    entry->stale = false;
+    h = icache_hash_fn(dev, entry->self);
+    entry->hash_next = icache_hash[h];
+    icache_hash[h] = i;
+}
+
+icache_rtvl_t icache_sync(int dev)
+{
+    icache_rtvl_t rtvl = ICACHE_OK;
+    int i = 0;
+    if(!init) {
+        return ICACHE_OK;
+    }
+    for(i = 0; i < ICACHE_SIZE; ++i) {
+        if(icache_tab[i].dev == dev && icache_tab[i].dirty &&
+           icache_write(&icache_tab[i]) != ICACHE_OK) {
+            rtvl = ICACHE_FAIL;
+        }
+    }
+    return rtvl;
+}
+
+#ifdef _TEST_ICACHE
+int
+main(int argc, char **argv)
+{
+    inode_t node = {0}, *inode = NULL, *inode1 = NULL;
+    master_inode_t *master = NULL;
+    block_t block = 0, window = 0, count = 0, run = 0, n = 0;
+    int dev = 0, fail = 0;
+
+    if(inode_dev_open("./inode.dat",&dev) == INODE_INIT) {
+       if(inode_mkfs("./inode.dat", 2 * TWOMEG) != INODE_OK) {
+            printk("icache:: error initializing filesystem\n");
+            return 1;
+       }
+       if(inode_dev_open("./inode.dat", &dev) != INODE_OK) {
+            printk("icache:: error opening device\n");
+            return 1;
+       }
+    }
+    master = master_get(dev);
+    master_set_dev("./inode.dat", dev);
+    if(inode_create(dev, INODE_ROOT_BLOCK, "/icache",
+                    INODE_CREATE_FILE,0777,0777,0,0,NULL) != INODE_OK ||
+       inode_get(dev, INODE_ROOT_BLOCK, "/icache",
+                 true, INODE_RW, &node) != INODE_OK) {
+        printk("icache:: error creating file\n");
+        return 1;
+    }
+    // Both opens share one inode.
+    inode  = icache_get(dev, node.self);
+    inode1 = icache_get(dev, node.self);
+    if(!inode || inode != inode1) {
+        printk("error shared inode\n");
+        fail++;
+    }
+    // A change is seen by a lookup by path before it is written back.
+    inode->size = 1234;
+    icache_dirty(inode);
+    if(inode_get(dev, INODE_ROOT_BLOCK, "/icache",
+                 true, INODE_RW, &node) != INODE_OK || node.size != 1234) {
+        printk("error coherent size\n");
+        fail++;
+    }
+    // A change by path is seen by the open inode.
+    node.owner = 7;
+    block_write(dev, node.self, (char *)&node);
+    icache_refresh(inode);
+    if(inode->owner != 7 || inode->size != 1234) {
+        printk("error coherent owner\n");
+        fail++;
+    }
+    if(icache_sync(dev) != ICACHE_OK) {
+        printk("error sync\n");
+        fail++;
+    }
+    icache_put(inode1);
+    icache_put(inode);
+    // Released, the next get takes a new reference.
+    if(!(inode = icache_get(dev, node.self)) || inode->size != 1234) {
+        printk("error reget\n");
+        fail++;
+    }
+    icache_put(inode);
+    // The preallocation window stays while the file is open.
+    inode  = icache_get(dev, node.self);
+    inode1 = icache_get(dev, node.self);
+    if(!inode || !inode1 ||
+       inode_get_file_block(dev, inode, INODE_NULL, &block) != INODE_OK) {
+        printk("error prealloc\n");
+        return 1;
+    }
+    inode_free_data_block(dev, block);
+    icache_dirty(inode);
+    icache_put(inode1);
+    if(!inode->prealloc_count) {
+        printk("error prealloc released while open\n");
+        fail++;
+    }
+    // Unlinked while open, the window stays until the last close and
+    // the open copy does not write over a new inode in its block.
+    window = inode->prealloc;
+    count  = inode->prealloc_count;
+    if(inode_free(dev, INODE_ROOT_BLOCK, "/icache", NULL) != INODE_OK ||
+       inode->prealloc != window || inode->prealloc_count != count) {
+        printk("error unlink while open\n");
+        fail++;
+    }
+    if(inode_create(dev, INODE_ROOT_BLOCK, "/icache2",
+                    INODE_CREATE_FILE,0777,0777,0,0,NULL) != INODE_OK) {
+        printk("error creating file\n");
+        fail++;
+    }
+    inode->size = 4321;
+    icache_dirty(inode);
+    icache_put(inode);
+    if(inode_get(dev, INODE_ROOT_BLOCK, "/icache2",
+                 true, INODE_RW, &node) != INODE_OK || node.size != 0) {
+        printk("error unlinked inode written back\n");
+        fail++;
+    }
+    // The last close gave the window back.
+    if(inode_alloc_blocks(dev, window, count, &run, &n) != INODE_OK ||
+       run != window || n != count) {
+        printk("error blocks leaked after close\n");
+        fail++;
+    }
+    for(; n; n--) {
+        inode_free_data_block(dev, run++);
+    }
+    inode_free(dev, INODE_ROOT_BLOCK, "/icache2", NULL);
+    inode_dev_close(dev);
+    printk("icache test %s\n", fail ? "failed" : "passed");
+    return fail;
+}
+#endif
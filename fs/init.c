@@ -47,6 +47,172 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include <drivers/block/pio.h>
 // #include <ox/pio.h>
+#include <ox/def_int.h>
+#include <ox/mm/page.h>
+#include <ox/lib/conversions.h>
+#include <ox/lib/string.h>
+#include <platform/asm_core/util.h>
+
+static unsigned long fs_cache_kb = 0;
+static defint_id_t fs_tick_id  = DEFINT_IDALLOC;
+static defint_id_t fs_flush_id = DEFINT_IDALLOC;
+static int fs_busy = 0;
+
+/*
+ * fs_lock:
+ *
+ * Take the file system lock, sleeping while another
+ * process holds it.
+ *
+ */
+void fs_lock()
+{
+    unsigned long flags = asm_get_eflags();
+    asm_disable_interrupt();
+    while(fs_busy) {
+        sleep_on(&fs_busy, 0);
+    }
+    fs_busy = 1;
+    asm_set_eflags(flags);
+}
+
+/*
+ * fs_trylock:
+ *
+ * Take the file system lock if it is free.
+ * Returns 1 if taken
+ *         0 otherwise
+ *
+ */
+int fs_trylock()
+{
+    unsigned long flags = asm_get_eflags();
+    int taken = 0;
+    asm_disable_interrupt();
+    if(!fs_busy) {
+        fs_busy = taken = 1;
+    }
+    asm_set_eflags(flags);
+    return taken;
+}
+
+/*
+ * fs_unlock:
+ *
+ * Release the file system lock and wake up
+ * the processes waiting for it.
+ *
+ */
+void fs_unlock()
+{
+    unsigned long flags = asm_get_eflags();
+    asm_disable_interrupt();
+    fs_busy = 0;
+    wakeup(&fs_busy);
+    asm_set_eflags(flags);
+}
+
+/*
+ * fs_flush:
+ *
+ * Deferred write-back of the buffer cache, run by defint_exec
+ * outside of any file system call once armed by fs_flush_tick.
+ *
+ */
+static void fs_flush(void *args)
+{
+    // A process may be asleep in the middle of a file system
+    // call, skip this second rather than sleep here.
+    if(!fs_trylock()) {
+        return;
+    }
+    block_flush();
+    fs_unlock();
+}
+
+/*
+ * fs_flush_tick:
+ *
+ * Runs once a second from the timer, arms fs_flush and itself
+ * for the next second. The write-back is not done here as
+ * the timer may have interrupted the buffer cache.
+ *
+ */
+static void fs_flush_tick(void *args)
+{
+    defint_inuse(fs_flush_id);
+    defint_inuse(fs_tick_id);
+}
+
+/*
+ * fs_flush_init:
+ *
+ * Install the periodic buffer cache write-back.
+ *
+ */
+static int fs_flush_init()
+{
+    if(fs_flush_id != DEFINT_IDALLOC) {
+        return FS_INIT_OK;
+    }
+    if(defint_install_handler(DEFINT_EXEC, &fs_flush_id, DEFINT_PRI_03,
+                              fs_flush, NULL, DEFINT_CURR) != DEFINT_OK) {
+        printk("fs_flush_init:: error installing write-back handler\n");
+        fs_flush_id = DEFINT_IDALLOC;
+        return FS_INIT_FAIL;
+    }
+    if(defint_install_handler(DEFINT_EXEC, &fs_tick_id, DEFINT_PRI_03,
+                              fs_flush_tick, NULL, DEFINT_TIME) != DEFINT_OK) {
+        printk("fs_flush_init:: error installing write-back timer\n");
+        defint_uninstall_handler(fs_flush_id);
+        fs_flush_id = DEFINT_IDALLOC;
+        return FS_INIT_FAIL;
+    }
+    defint_schedule(fs_flush_id);
+    defint_schedule(fs_tick_id);
+    defint_inuse(fs_tick_id);
+    return FS_INIT_OK;
+}
+
+int fs_parse_param(char *param)
+{
+    if(!param || strncmp(param, FS_CACHE_PARAM, strlen(FS_CACHE_PARAM))) {
+        return 0;
+    }
+    fs_cache_kb = strtoul(param + strlen(FS_CACHE_PARAM), NULL, 10);
+    return 1;
+}
+
+/*
+ * fs_cache_init:
+ *
+ * Size the buffer cache from the free kernel memory, or the
+ * boot parameter, and allocate it from kernel pages. If this
+ * fails the static cache in block.c is used.
+ *
+ */
+static void fs_cache_init()
+{
+    unsigned long bytes = fs_cache_kb * 1024;
+    unsigned pages = 0;
+    void *mem = NULL;
+
+    if(!bytes) {
+        bytes = get_kernel_bytes_free() / FS_CACHE_FRACTION;
+    }
+    pages = bytes / PAGE_SIZE;
+    if(pages * PAGE_SIZE <= block_cache_bytes(BLOCK_ARRAY_SIZE)) {
+        return;
+    }
+    if(!(mem = kpage_alloc(pages))) {
+        printk("fs_cache_init:: error allocating %u pages\n", pages);
+        return;
+    }
+    if(block_cache_init(mem, pages * PAGE_SIZE) != BLOCK_OK) {
+        printk("fs_cache_init:: error initializing cache\n");
+        kpage_free(mem, pages);
+    }
+}
 
 /*
  * fs_reset:
@@ -83,13 +249,18 @@ int fs_init(unsigned long requested_size)
     int   dev  =  0;
     inode_rtvl_t rtvl = INODE_OK;
 
-    disk_size = ata_disk_size(0, &start_sector);
+    if(dev_open(path, &dev) != DEV_OK) {
+        printk("fs_init:: no disk for %s\n", path);
+        return FS_INIT_FAIL;
+    }
+    disk_size = ata_disk_size(dev, &start_sector);
 
     if(!disk_size) {
         printk("fs_init:: error sizing disk\n");
         return FS_INIT_FAIL;
     }
 
+    fs_cache_init();
     rtvl = inode_dev_open(path, &dev);
     if(rtvl == INODE_INIT) {
        printk("fs_init:: calling inode_mkfs\n");
@@ -104,11 +275,12 @@ int fs_init(unsigned long requested_size)
             printk("fs_init:: error opening device\n");
             return FS_INIT_FAIL;
        }
+       return fs_flush_init();
     } else if(rtvl == INODE_OK) {
         printk("fs_init:: successfully intialized drive\n");
         master = master_get(dev);
         master_set_dev(path, dev);
-        return FS_INIT_OK;
+        return fs_flush_init();
     } else {
         // rtvl == INODE_FAIL
         printk("fs_init:: error opening device\n");
@@ -70,7 +70,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "block.h"
 #include "dev.h"
 #include "inode.h"
+#include "extent.h"
+#include "dcache.h"
+#include "icache.h"
 #include "compat.h"
+#include <ox/lib/bitmap.h>
 
 #ifdef _TEST_INODE_INC
 #include <stdio.h>
@@ -78,12 +82,17 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define printk printf
 #else
 #include <ox/error_rpt.h>
+#include <ox/lib/string.h>
 #include <errno.h>
 #endif
 
 static master_inode_t master_tab[INODE_NR_DEV];
 static char master_bmap_memory[INODE_NR_DEV][DEV_BLOCK_SIZE];
 static char master_imap_memory[INODE_NR_DEV][DEV_BLOCK_SIZE];
+static bool master_bmap_dirty[INODE_NR_DEV];
+static bool master_imap_dirty[INODE_NR_DEV];
+static unsigned short master_bmap_free[INODE_NR_DEV][INODE_MAP_COUNTS];
+static unsigned short master_imap_free[INODE_NR_DEV][INODE_MAP_COUNTS];
 static bool init_master = false;
 static struct master_dev {
         char *path;
@@ -101,6 +110,8 @@ void master_init()
             memset(&master_tab[i],0x0,DEV_BLOCK_SIZE);
             memset(master_bmap_memory[i],0x0,DEV_BLOCK_SIZE);
             memset(master_imap_memory[i],0x0,DEV_BLOCK_SIZE);
+            master_bmap_dirty[i] = false;
+            master_imap_dirty[i] = false;
             master_tab[i].dev = INODE_NOPOS;
         }
         init_master = true;
@@ -144,6 +155,8 @@ master_inode_t *master_alloc(int dev)
     } else {
         for(; i < INODE_NR_DEV; ++i) {
             if(master_tab[i].dev == INODE_NOPOS) {
+                master_bmap_dirty[i] = false;
+                master_imap_dirty[i] = false;
                 master_tab[i].dev = dev;
                 return &master_tab[i];
             }
@@ -226,7 +239,8 @@ int master_get_dev(char *path)
 //                for the MBR, boot, kernel images.
 //                Currently, we reserve 2 MB (which is the size of
 //                a 1.44 MB floppy drive unformatted, but also gives
-//                us a nice (2*2^20)/512 = 4096 block as a start).
+//                us a nice (2*2^20)/512 = 4096 block as a start,
+//                512 with 4096 byte blocks).
 //
 // size := the size from block_start to end of diskspace
 //         this is the amount of space that the file system actually
@@ -298,6 +312,8 @@ inode_rtvl_t inode_create_fs(char *path, block_t block_start, block_t size)
    master->bmap = 0;
    master->inodes = inodes;
    master->blocks = blocks;
+   master->block_size = DEV_BLOCK_SIZE;
+   master->dir_format = INODE_DIR_FORMAT;
    memset(master->pad, 0x0, MNODE_PAD);
    /* Write it to disk.  */
    printk("inode_mkfs:: block_start=%d\n",block_start);
@@ -346,15 +362,264 @@ inode_rtvl_t inode_create_fs(char *path, block_t block_start, block_t size)
    block_reinit();
    dev_scan(dev,0);
    dev_close(dev);
+   dcache_purge(dev);
    master_free(dev);
    return INODE_OK;
 }
 
+//
+// The inode and block bitmaps are handled alike, an inode_map_t
+// points at the master fields and memory of one of them.
+//
+typedef struct inode_map {
+   block_t  *ptr;        // Bitmap block held in memory.
+   block_t  *bit;        // Allocation cursor within it.
+   char    **mem;        // Where the block held is.
+   char     *memory;     // Memory set aside for it.
+   bool     *dirty;      // Frees left the block held modified.
+   unsigned short *free; // Free bits of each bitmap block.
+   block_t   map_start;  // First bitmap block.
+   block_t   map_end;    // Past the last bitmap block.
+   block_t   first;      // Block mapped by bit 0.
+   block_t   nr;         // Number of blocks mapped.
+} inode_map_t;
+
+static bool inode_map_get(int dev, master_inode_t *master, bool data, inode_map_t *map)
+{
+   int i = master_get_mem_ptr(dev);
+   if(i == INODE_NOPOS) {
+        printk("inode_map_get:: failed to get memory dev=%d\n", dev);
+        return false;
+   }
+   if(data) {
+        map->ptr       = &master->bmap_ptr;
+        map->bit       = &master->bmap_bit;
+        map->mem       = &master->bmap;
+        map->memory    = master_bmap_memory[i];
+        map->dirty     = &master_bmap_dirty[i];
+        map->free      = master_bmap_free[i];
+        map->map_start = master->bmap_map_start;
+        map->map_end   = master->bmap_map_end;
+        map->first     = master->data_start;
+        map->nr        = master->blocks;
+   } else {
+        map->ptr       = &master->imap_ptr;
+        map->bit       = &master->imap_bit;
+        map->mem       = &master->imap;
+        map->memory    = master_imap_memory[i];
+        map->dirty     = &master_imap_dirty[i];
+        map->free      = master_imap_free[i];
+        map->map_start = master->inode_map_start;
+        map->map_end   = master->inode_map_end;
+        map->first     = master->inode_start;
+        map->nr        = master->inodes;
+   }
+   return true;
+}
+
+//
+// inode_map_bits:
+//
+// Number of bits in use in bitmap block 'ptr', the last block
+// may map fewer than INODE_MAP_BITS blocks.
+//
+static block_t inode_map_bits(inode_map_t *map, block_t ptr)
+{
+   block_t done = (ptr - map->map_start) * INODE_MAP_BITS;
+   if(done >= map->nr) {
+        return 0;
+   }
+   return (map->nr - done < INODE_MAP_BITS) ? map->nr - done : INODE_MAP_BITS;
+}
+
+//
+// inode_map_load:
+//
+// Make bitmap block 'ptr' the one held in memory. Frees only
+// clear bits in memory, so the block held is written back first
+// when they left it modified.
+//
+static inode_rtvl_t inode_map_load(int dev, inode_map_t *map, block_t ptr)
+{
+   if(*map->mem == map->memory && *map->ptr != 0) {
+        if(*map->ptr == ptr) {
+            return INODE_OK;
+        }
+        if(*map->dirty &&
+           block_write(dev, *map->ptr, (char *)*map->mem) != BLOCK_OK) {
+            errno = EACCES;
+            printk("inode_map_load:: block_write failed dev=%d block=%u\n",
+                    dev, *map->ptr);
+            return INODE_FAIL;
+        }
+   }
+   *map->dirty = false;
+   *map->mem = map->memory;
+   *map->ptr = ptr;
+   if(block_read(dev, ptr, (char *)*map->mem) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_map_load:: block_read failed dev=%d block=%u\n",
+                dev, ptr);
+        *map->ptr = 0;
+        return INODE_FAIL;
+   }
+   return INODE_OK;
+}
+
+//
+// inode_map_count:
+//
+// Count the free bits of each bitmap block, done once when the
+// device is opened so allocation can pass over full blocks
+// without reading them.
+//
+static inode_rtvl_t inode_map_count(int dev, inode_map_t *map)
+{
+   block_t ptr = 0;
+   char *data = NULL;
+   for(ptr = map->map_start;
+       ptr < map->map_end && ptr - map->map_start < INODE_MAP_COUNTS; ptr++) {
+        if(!(data = block_get(dev, ptr))) {
+            errno = EACCES;
+            printk("inode_map_count:: block_read failed dev=%d block=%u\n",
+                    dev, ptr);
+            return INODE_FAIL;
+        }
+        map->free[ptr - map->map_start] =
+            bitmap_count_zero(data, inode_map_bits(map, ptr));
+        block_put(data, false);
+   }
+   return INODE_OK;
+}
+
+//
+// inode_map_alloc:
+//
+// Scan the bitmap from the goal, or from where the last allocation
+// left off, for the first free bit and take as many of the free
+// bits following it as were asked for. Whole words are passed over
+// at a time and bitmap blocks known to be full are not read. The
+// master and bitmap block are written once per call rather than
+// once per block, so callers wanting several blocks should ask for
+// them together.
+//
+static inode_rtvl_t inode_map_alloc(int dev, master_inode_t *master, inode_map_t *map,
+                                    block_t goal, block_t want,
+                                    block_t *block, block_t *count)
+{
+   register block_t ptr = 0;
+   register block_t bit = 0;
+   register block_t end = 0;
+   block_t n = 0, nbits = 0, used = 0;
+
+   if(goal >= map->first && goal - map->first < map->nr) {
+        ptr = (goal - map->first) / INODE_MAP_BITS + map->map_start;
+        bit = (goal - map->first) % INODE_MAP_BITS;
+   }
+   if(ptr == 0 || ptr >= map->map_end) {
+        if(*map->ptr == 0) {
+            ptr = map->map_start;
+            bit = 0;
+        } else {
+            ptr = *map->ptr;
+            bit = *map->bit;
+        }
+   }
+   // Visit every bitmap block, the first one twice so the bits
+   // before the starting point are tried last.
+   for(n = 0; n <= map->map_end - map->map_start; n++) {
+       if(ptr - map->map_start >= INODE_MAP_COUNTS || map->free[ptr - map->map_start]) {
+           if(inode_map_load(dev, map, ptr) != INODE_OK) {
+                return INODE_FAIL;
+           }
+           nbits = inode_map_bits(map, ptr);
+           if((bit = bitmap_ffz(*map->mem, bit, nbits)) != BITMAP_NONE) {
+               // The run ends at the first bit in use.
+               end = (want < nbits - bit) ? bit + want : nbits;
+               if((used = bitmap_ffs(*map->mem, bit, end)) != BITMAP_NONE) {
+                    end = used;
+               }
+               bitmap_set_run(*map->mem, bit, end - bit);
+               if(ptr - map->map_start < INODE_MAP_COUNTS) {
+                    map->free[ptr - map->map_start] -= end - bit;
+               }
+               *map->bit = end - 1;
+               if(block_write(dev, master->block_start, (char *)master) != BLOCK_OK) {
+                    errno = EACCES;
+                    printk("inode_map_alloc:: block_write failed dev=%d block=%u\n",
+                       dev, master->block_start);
+                    return INODE_FAIL;
+               }
+               if(block_write(dev, ptr, (char *)*map->mem) != BLOCK_OK) {
+                    errno = EACCES;
+                    printk("inode_map_alloc:: block_write failed dev=%d block=%u\n",
+                       dev, ptr);
+                    return INODE_FAIL;
+               }
+               *map->dirty = false;
+               // block_calculation
+               *block = map->first +
+                       ((ptr - map->map_start) * INODE_MAP_BITS) +
+                        bit;
+               *count = end - bit;
+               return INODE_OK;
+           }
+       }
+       bit = 0;
+       if(++ptr >= map->map_end) {
+            ptr = map->map_start;
+       }
+   }
+   errno = ENOSPC;
+   return INODE_FAIL;
+}
+
+//
+// inode_map_free:
+//
+// Clear the bit of 'block', the bitmap block is written back
+// when another is loaded or by the next allocation.
+//
+static inode_rtvl_t inode_map_free(int dev, inode_map_t *map, block_t block)
+{
+   register block_t ptr = 0;
+   register block_t bit = 0;
+
+   if(block < map->first || block - map->first >= map->nr) {
+        errno = EINVAL;
+        printk("inode_map_free:: invalid block=%u\n", block);
+        return INODE_FAIL;
+   }
+   // Find ptr and bit given block number.
+   // This is from math, see 'block_calculation' above.
+   block -= map->first;
+   ptr = block / INODE_MAP_BITS + map->map_start;
+   bit = block % INODE_MAP_BITS;
+   if(inode_map_load(dev, map, ptr) != INODE_OK) {
+        return INODE_FAIL;
+   }
+   *map->bit = bit;
+   if(!bitmap_test(*map->mem, bit)) {
+       printk("inode_map_free:: warning free'ing free block=%u bit=%d\n", ptr, bit);
+       return INODE_OK;
+   }
+   // All we have to do is set this to zero and the block
+   // is free'd. This is how we unlink files, we just set the bit
+   // to free for the inode.
+   bitmap_clear(*map->mem, bit);
+   if(ptr - map->map_start < INODE_MAP_COUNTS) {
+        map->free[ptr - map->map_start]++;
+   }
+   *map->dirty = true;
+   return INODE_OK;
+}
+
 inode_rtvl_t inode_dev_open(char *path, int *dev)
 {
    int i    = 0;
    block_t size = 0;
    master_inode_t *master = NULL;
+   inode_map_t map;
 
    /* Open the device and load the master inode. */
    if(block_open(path,dev) != BLOCK_OK) {
@@ -385,7 +650,8 @@ inode_rtvl_t inode_dev_open(char *path, int *dev)
         if(dev_read(*dev,BLOCK_START,(char *)master) != DEV_OK) {
             errno = EACCES;
             dev_close(*dev);
-            printk("inode_dev_open:: failed to read master BLOCK_START=4096\n");
+            printk("inode_dev_open:: failed to read master BLOCK_START=%d\n",
+                    BLOCK_START);
             return INODE_INIT;
         }
         // Failed, this device doesn't have this file system on it.
@@ -403,6 +669,16 @@ inode_rtvl_t inode_dev_open(char *path, int *dev)
              master->init_fs);
       return INODE_INIT;
    }
+   // File systems made before the block size was recorded are 512.
+   if((master->block_size ? master->block_size : 512) != DEV_BLOCK_SIZE) {
+      printk("inode_dev_open:: file system has %d byte blocks, built for %d\n",
+             master->block_size ? master->block_size : 512, DEV_BLOCK_SIZE);
+      master_free(*dev);
+      dev_close(*dev);
+      return INODE_FAIL;
+   }
+   // Keep read-ahead within the file system.
+   block_set_limit(*dev, master->data_end);
    /* Setup the imap and bmap for runtime use. */
    /* We can not load the entire maps in ram,
     * load from the pointers and use a single block of 512 bytes.
@@ -440,358 +716,606 @@ inode_rtvl_t inode_dev_open(char *path, int *dev)
                 *dev, master->imap_ptr);
         return INODE_FAIL;
    }
+   master_bmap_dirty[i] = false;
+   master_imap_dirty[i] = false;
+   // Nothing cached from a file system previously on this dev is valid.
+   dcache_purge(*dev);
+   // Count what is free in each bitmap block.
+   if(!inode_map_get(*dev, master, true, &map) ||
+      inode_map_count(*dev, &map) != INODE_OK ||
+      !inode_map_get(*dev, master, false, &map) ||
+      inode_map_count(*dev, &map) != INODE_OK) {
+        master_free(*dev);
+        dev_close(*dev);
+        printk("inode_dev_open:: failed to read bitmaps dev=%d\n", *dev);
+        return INODE_FAIL;
+   }
    return INODE_OK;
 }
 
-inode_rtvl_t inode_get_data_block(int dev, block_t *block)
+inode_rtvl_t inode_alloc_blocks(int dev, block_t goal, block_t want,
+                                block_t *block, block_t *count)
 {
-   register master_inode_t *master = master_get(dev);
-   register block_t ptr = 0;
-   register block_t bit = 0;
-   register block_t pass= 0;
-   register int i = 0;
+   master_inode_t *master = master_get(dev);
+   inode_map_t map;
 
+   *block = INODE_NULL;
+   *count = 0;
    if(!master) {
-        printk("inode_get_data_block:: failed to get master dev=%d\n", dev);
+        printk("inode_alloc_blocks:: failed to get master dev=%d\n", dev);
         return INODE_FAIL;
    }
-   ptr = master->bmap_ptr;
-   bit = master->bmap_bit;
-   *block = INODE_NOPOS;
-   if(master->bmap_ptr == 0) {
-       // Initialize.
-       if(!master->init_fs) {
-            printk("inode_get_data_block:: invalid device\n");
-            return INODE_FAIL;
-       }
-       master->bmap_ptr = master->bmap_map_start;
-       i = master_get_mem_ptr(dev);
-       if(i == INODE_NOPOS) {
-            printk("inode_get_data_block:: failed to get memory\n");
-            return INODE_FAIL;
-       }
-       master->bmap = master_bmap_memory[i];
-       if(block_read(dev, master->bmap_ptr, (char *)master->bmap) != BLOCK_OK) {
-            errno = EACCES;
-            P();
-            printk("inode_get_data_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->bmap_ptr);
+   if(!master->init_fs) {
+        printk("inode_alloc_blocks:: invalid device\n");
+        return INODE_FAIL;
+   }
+   if(!inode_map_get(dev, master, true, &map)) {
+        return INODE_FAIL;
+   }
+   return inode_map_alloc(dev, master, &map, goal, want ? want : 1, block, count);
+}
+
+inode_rtvl_t inode_get_data_block(int dev, block_t *block)
+{
+   block_t count = 0;
+   return inode_alloc_blocks(dev, INODE_NULL, 1, block, &count);
+}
+
+inode_rtvl_t inode_get_file_block(int dev, inode_t *inode, block_t goal, block_t *block)
+{
+   if(!inode->prealloc_count) {
+        if(inode_alloc_blocks(dev, goal, INODE_PREALLOC,
+                              &inode->prealloc, &inode->prealloc_count) != INODE_OK) {
+            printk("inode_get_file_block:: unable to allocate dev=%d\n", dev);
             return INODE_FAIL;
-       }
-       ptr = master->bmap_ptr;
-       bit = 0;
+        }
    }
+   *block = inode->prealloc++;
+   inode->prealloc_count--;
+   if(!inode->prealloc_count) {
+        inode->prealloc = INODE_NULL;
+   }
+   return INODE_OK;
+}
 
-   do {
-       if(bit_get(master->bmap, bit) == 0) {
-           bit_set(master->bmap, bit, 1);
-           master->bmap_bit = bit;
-           if(block_write(dev, master->block_start, (char *)master) != BLOCK_OK) {
-                P();
-                errno = EACCES;
-                printk("inode_get_data_block:: block_write failed dev=%d block=%u\n",
-                   dev, master->block_start);
-                return INODE_FAIL;
-           }
-           if(block_write(dev, ptr, (char *)master->bmap) != BLOCK_OK) {
-                errno = EACCES;
-                printk("inode_get_data_block:: block_write failed dev=%d block=%u\n",
-                   dev, master->block_start);
-                return INODE_FAIL;
-           }
-           // block_calculation
-           *block = master->data_start +
-                   ((ptr - master->bmap_map_start) * DEV_BLOCK_SIZE) +
-                    bit; 
-            return INODE_OK;
-       }
-       ++bit;
-       bit %= DEV_BLOCK_SIZE;
-       master->bmap_bit = bit;
-       if(bit == 0) {
-           ptr++;
-           if(ptr < master->bmap_map_end) {
-               master->bmap_ptr = ptr;
-               if(block_read(dev, master->bmap_ptr, 
-                                  (char *)master->bmap) != BLOCK_OK) {
-                  P();
-                  errno = EACCES;
-                  printk("inode_get_data_block:: block_read failed dev=%d block=%u\n",
-                        dev, master->bmap_ptr);
-                    return INODE_FAIL;
-               }
-           } else {
-               ptr = master->bmap_ptr = master->bmap_map_start;
-               if(block_read(dev, master->bmap_ptr, 
-                                  (char *)master->bmap) != BLOCK_OK) {
-                  P();
-                  errno = EACCES;
-                  printk("inode_get_data_block:: block_read failed dev=%d block=%u\n",
-                        dev, master->bmap_ptr);
-                    return INODE_FAIL;
-               }
-               pass++;
-           }
-       }
-   } while(pass < INODE_NR_PASS);
-   *block = INODE_NULL;
-   return INODE_FAIL;
+inode_rtvl_t inode_free_prealloc(int dev, inode_t *inode)
+{
+   for(; inode->prealloc_count; inode->prealloc_count--) {
+        if(inode_free_data_block(dev, inode->prealloc++) != INODE_OK) {
+            return INODE_FAIL;
+        }
+   }
+   inode->prealloc = INODE_NULL;
+   return INODE_OK;
 }
 
 inode_rtvl_t inode_get_inode_block(int dev, block_t *block)
 {
    register master_inode_t *master = master_get(dev);
-   register block_t ptr = 0;
-   register block_t bit = 0;
-   register block_t pass= 0;
-   register int i = 0;
+   inode_map_t map;
+   block_t count = 0;
 
+   *block = INODE_NULL;
    if(!master) {
        printk("inode_get_inode_block:: failed to get master dev=%d\n",dev);
        return INODE_FAIL;
    }
-   ptr = master->imap_ptr;
-   bit = master->imap_bit;
-   *block = INODE_NOPOS;
+   if(!master->init_fs) {
+       printk("inode_get_inode_block:: invalid device\n");
+       return INODE_FAIL;
+   }
+   if(!inode_map_get(dev, master, false, &map)) {
+       return INODE_FAIL;
+   }
+   return inode_map_alloc(dev, master, &map, INODE_NULL, 1, block, &count);
+}
 
-   if(master->imap_ptr == 0) {
-       // Initialize.
-       if(!master->init_fs) {
-            printk("inode_get_data_block:: invalid device\n");
+inode_rtvl_t inode_free_data_block(int dev, block_t block)
+{
+    master_inode_t *master = master_get(dev);
+    inode_map_t map;
+
+    if(!master) {
+        printk("inode_free_data_block:: failed to get master dev=%d\n", dev);
+        return INODE_FAIL;
+    }
+    if(!inode_map_get(dev, master, true, &map)) {
+        return INODE_FAIL;
+    }
+    return inode_map_free(dev, &map, block);
+}
+
+inode_rtvl_t inode_free_inode_block(int dev, block_t block)
+{
+    master_inode_t *master = master_get(dev);
+    inode_map_t map;
+
+    if(!master) {
+        printk("inode_free_inode_block:: failed to get master dev=%d\n", dev);
+        return INODE_FAIL;
+    }
+    if(!inode_map_get(dev, master, false, &map)) {
+        return INODE_FAIL;
+    }
+    return inode_map_free(dev, &map, block);
+}
+
+inode_rtvl_t inode_dev_close(int dev)
+{
+   int i = 0;
+   master_inode_t *master = master_get(dev);
+   if(!master) {
+        printk("inode_dev_close:: failed to get master dev=%d\n", dev);
+        return INODE_FAIL;
+   }
+   if(icache_sync(dev) != ICACHE_OK) {
+        printk("inode_dev_close:: icache_sync failed dev=%d\n", dev);
+        return INODE_FAIL;
+   }
+   if(block_write(dev, master->imap_ptr, (char *)master->imap) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->imap_ptr);
+        return INODE_FAIL;
+   }
+   if(block_write(dev, master->bmap_ptr, (char *)master->bmap) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->bmap_ptr);
+        return INODE_FAIL;
+   }
+   // Write at block_start.
+   if(block_write(dev, master->block_start, (char *)master) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->block_start);
+        return INODE_FAIL;
+   }
+   if(block_close(dev) != BLOCK_OK) {
+        printk("inode_dev_close:: block_close failed\n");
+        return INODE_FAIL;
+   }
+
+   for(i = 0; i < MAX_DEV; ++i) {
+        if(master_dev_tab[i].dev == dev) {
+            master_dev_tab[i].path = NULL;
+            master_dev_tab[i].dev = 0;
+        }
+   }
+
+   dcache_purge(dev);
+   master_free(dev);
+   return INODE_OK;
+}
+
+//
+// inode_name_hash:
+// Hash of a directory entry name.
+//
+static unsigned inode_name_hash(char *name)
+{
+    register unsigned h = 0;
+    while(*name) {
+        h = h * 31 + (unsigned char)*name++;
+    }
+    return h;
+}
+
+//
+// inode_dir_hash:
+// Slot the probe for 'name' starts at in each block map of a
+// hashed directory.
+//
+static block_t inode_dir_hash(char *name)
+{
+    return inode_name_hash(name) % BMAP_BLOCKS;
+}
+
+//
+// inode_dir_full:
+// true if hashed block map 'bmap' takes no more entries in free slots.
+// Slots never go back to INODE_NULL, so once full it stays full and
+// a probe that ends in it must go on to the next block map.
+//
+static bool inode_dir_full(block_map_t *bmap)
+{
+    block_t i = 0, used = 0;
+    for(i = 0; i < BMAP_BLOCKS; ++i) {
+        if(bmap->blocks[i] != INODE_NULL) {
+            used++;
+        }
+    }
+    return used >= INODE_DIR_FILL;
+}
+
+//
+// inode_dir_link:
+// Chain directory block 'next' after 'last', or make it the first
+// block of 'dir' when 'last' is INODE_NULL. The directory inode is
+// updated in place so what was written to it since 'dir' was read
+// is kept.
+//
+static inode_rtvl_t inode_dir_link(int dev, inode_t *dir, block_t last, block_t next)
+{
+    inode_t *iptr = NULL;
+    block_map_t *bmap = NULL;
+    if(last == INODE_NULL) {
+        if(!(iptr = (inode_t *)block_get(dev, dir->self))) {
+            errno = EACCES;
+            printk("inode_dir_link:: error reading block dev=%d block=%u\n",
+                    dev, dir->self);
             return INODE_FAIL;
-       }
-       master->imap_ptr = master->inode_map_start;
-       i = master_get_mem_ptr(dev); 
-       if(i == INODE_NOPOS) {
-            printk("inode_get_inode_block:: failed to get memory\n");
+        }
+        dir->next = iptr->next = next;
+        block_put((char *)iptr, true);
+    } else {
+        if(!(bmap = (block_map_t *)block_get(dev, last))) {
+            errno = EACCES;
+            printk("inode_dir_link:: error reading block dev=%d block=%u\n",
+                    dev, last);
             return INODE_FAIL;
-       }
-       master->imap = master_imap_memory[i];
-       if(block_read(dev, master->imap_ptr, (char *)master->imap) != BLOCK_OK) {
+        }
+        bmap->next = next;
+        block_put((char *)bmap, true);
+    }
+    return INODE_OK;
+}
+
+//
+// inode_dir_add:
+// Enter inode 'block' as 'name' in hashed directory 'dir'. It takes
+// the first deleted or free slot probing from the hashed slot, before
+// the probe ends at a free one, in the first block map that has room.
+// When none does a block map is chained at the end.
+//
+static inode_rtvl_t inode_dir_add(int dev, inode_t *dir, char *name, block_t block)
+{
+    block_map_t *bmap = NULL, zero_bmap = {0};
+    block_t pos = inode_dir_hash(name), i = 0, n = 0;
+    block_t current = dir->next, last = INODE_NULL, next = INODE_NULL;
+    bool full = false;
+
+    while(current != INODE_NULL) {
+        if(!(bmap = (block_map_t *)block_get(dev, current))) {
             errno = EACCES;
-            printk("inode_get_inode_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->imap_ptr);
+            printk("inode_dir_add:: error reading block dev=%d block=%u\n",
+                    dev, current);
             return INODE_FAIL;
-       }
-       ptr = master->imap_ptr;
-       bit = 0;
-   }
+        }
+        full = inode_dir_full(bmap);
+        for(n = 0; n < BMAP_BLOCKS; ++n) {
+            i = (pos + n) % BMAP_BLOCKS;
+            if(bmap->blocks[i] == INODE_DIR_DELETED ||
+               (bmap->blocks[i] == INODE_NULL && !full)) {
+                bmap->blocks[i] = block;
+                block_put((char *)bmap, true);
+                return INODE_OK;
+            }
+            if(bmap->blocks[i] == INODE_NULL) {
+                break;
+            }
+        }
+        last = current;
+        current = bmap->next;
+        block_put((char *)bmap, false);
+    }
+    if(inode_get_data_block(dev, &next) != INODE_OK) {
+        errno = ENOSPC;
+        printk("inode_dir_add:: failed to get data block dev=%d\n", dev);
+        return INODE_FAIL;
+    }
+    zero_bmap.blocks[pos] = block;
+    if(block_write(dev, next, (char *)&zero_bmap) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_dir_add:: error writing block dev=%d block=%u\n", dev, next);
+        return INODE_FAIL;
+    }
+    return inode_dir_link(dev, dir, last, next);
+}
 
-   do {
-       if(bit_get(master->imap, bit) == 0) {
-           bit_set(master->imap, bit, 1);
-           master->imap_bit = bit;
-           if(block_write(dev, master->block_start, (char *)master) != BLOCK_OK) {
+dir_entry_t *inode_dir_entry(dir_block_t *dblk, block_t pos)
+{
+    dir_entry_t *ent = NULL;
+    if(pos + sizeof(dir_entry_t) > DIR_BLOCK_BYTES) {
+        return NULL;
+    }
+    ent = (dir_entry_t *)(dblk->entries + pos);
+    if(ent->rec_len < sizeof(dir_entry_t) || (ent->rec_len % DIR_ENTRY_ALIGN) ||
+       pos + ent->rec_len > DIR_BLOCK_BYTES ||
+       (ent->block != INODE_NULL && DIR_ENTRY_SIZE(ent->name_len) > ent->rec_len)) {
+        return NULL;
+    }
+    return ent;
+}
+
+//
+// inode_dir_type:
+// d_type of the entry for an inode created with 'mode'.
+//
+static unsigned char inode_dir_type(inode_mode_t mode)
+{
+    switch(mode) {
+        case INODE_CREATE_DIR:      return 'D';
+        case INODE_CREATE_SYMLINK:  return 'S';
+        case INODE_CREATE_HARDLINK: return 'H';
+        default:                    return 'F';
+    }
+}
+
+//
+// inode_dir_entry_lookup:
+// Search the entries directory whose first block is 'next' for 'name'.
+// Only the directory blocks are read, a record's name is compared
+// only when its hash and length match.
+// On return *found is the inode block or INODE_NULL if not present.
+//
+static inode_rtvl_t inode_dir_entry_lookup(int dev, block_t next, char *name, block_t *found)
+{
+    unsigned short hash = (unsigned short)inode_name_hash(name);
+    block_t len = strlen(name);
+    block_t current = next, pos = 0;
+    dir_block_t *dblk = NULL;
+    dir_entry_t *ent = NULL;
+
+    *found = INODE_NULL;
+    while(current != INODE_NULL) {
+        if(!(dblk = (dir_block_t *)block_get(dev, current))) {
+            errno = EACCES;
+            printk("inode_dir_entry_lookup:: error reading block dev=%d block=%u\n",
+                    dev, current);
+            return INODE_FAIL;
+        }
+        for(pos = 0; pos < DIR_BLOCK_BYTES; pos += ent->rec_len) {
+            if(!(ent = inode_dir_entry(dblk, pos))) {
                 errno = EACCES;
-                printk("inode_get_inode_block:: block_write failed dev=%d block=%u\n",
-                   dev, master->block_start);
+                printk("inode_dir_entry_lookup:: inconsistent directory dev=%d block=%u\n",
+                        dev, current);
+                block_put((char *)dblk, false);
                 return INODE_FAIL;
-           }
-           if(block_write(dev, ptr, (char *)master->imap) != BLOCK_OK) {
+            }
+            if(ent->block != INODE_NULL && ent->hash == hash && ent->name_len == len &&
+               !memcmp(DIR_ENTRY_NAME(ent), name, len)) {
+                *found = ent->block;
+                block_put((char *)dblk, false);
+                return INODE_OK;
+            }
+        }
+        current = dblk->next;
+        block_put((char *)dblk, false);
+    }
+    return INODE_OK;
+}
+
+//
+// inode_dir_entry_add:
+// Enter inode 'block' as 'name' in entries directory 'dir'. The
+// record goes in the first free record or the first record with
+// enough room left after its name, which is split. When no block
+// has room a new one is chained at the end.
+//
+static inode_rtvl_t inode_dir_entry_add(int dev, inode_t *dir, char *name,
+                                        block_t block, unsigned char type)
+{
+    block_t len = strlen(name), need = DIR_ENTRY_SIZE(len), used = 0, pos = 0;
+    block_t current = dir->next, last = INODE_NULL, next = INODE_NULL;
+    dir_block_t *dblk = NULL, zero_dblk = {0};
+    dir_entry_t *ent = NULL, *split = NULL;
+
+    if(len > DIR_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        printk("inode_dir_entry_add:: name too long [%s]\n", name);
+        return INODE_FAIL;
+    }
+    while(current != INODE_NULL) {
+        if(!(dblk = (dir_block_t *)block_get(dev, current))) {
+            errno = EACCES;
+            printk("inode_dir_entry_add:: error reading block dev=%d block=%u\n",
+                    dev, current);
+            return INODE_FAIL;
+        }
+        for(pos = 0; pos < DIR_BLOCK_BYTES; pos += ent->rec_len) {
+            if(!(ent = inode_dir_entry(dblk, pos))) {
                 errno = EACCES;
-                printk("inode_get_inode_block:: block_write failed dev=%d block=%u\n",
-                   dev, master->imap);
+                printk("inode_dir_entry_add:: inconsistent directory dev=%d block=%u\n",
+                        dev, current);
+                block_put((char *)dblk, false);
                 return INODE_FAIL;
-           }
-           // inode_block_calculation
-           *block = master->inode_start + 
-                   ((ptr - master->inode_map_start) * DEV_BLOCK_SIZE) +
-                    bit; 
-            return INODE_OK;
-       }
-       ++bit;
-       bit %= DEV_BLOCK_SIZE;
-       master->imap_bit = bit;
-       if(bit == 0) {
-           ptr++;
-           if(ptr < master->inode_map_end) {
-               master->imap_ptr = ptr;
-               if(block_read(dev, master->imap_ptr, 
-                                  (char *)master->imap) != BLOCK_OK) {
-                    errno = EACCES;
-                    printk("inode_get_inode_block:: block_read failed dev=%d block=%u\n",
-                        dev, master->imap_ptr);
-                    return INODE_FAIL;
-               }
-           } else {
-               ptr = master->imap_ptr = master->inode_map_start;
-               if(block_read(dev, master->imap_ptr, 
-                                  (char *)master->imap) != BLOCK_OK) {
-                    errno = EACCES;
-                    printk("inode_get_inode_block:: block_read failed dev=%d block=%u\n",
-                        dev, master->imap_ptr);
-                    return INODE_FAIL;
-               }
-               pass++;
-           }
-       }
-   } while(pass < INODE_NR_PASS);
-   *block = INODE_NULL;
-   return INODE_FAIL;
+            }
+            used = (ent->block == INODE_NULL) ? 0 : DIR_ENTRY_SIZE(ent->name_len);
+            if(ent->rec_len - used >= need) {
+                if(used) {
+                    split = (dir_entry_t *)((char *)ent + used);
+                    split->rec_len = ent->rec_len - used;
+                    ent->rec_len = used;
+                    ent = split;
+                }
+                break;
+            }
+        }
+        if(pos < DIR_BLOCK_BYTES) {
+            break;
+        }
+        last = current;
+        current = dblk->next;
+        block_put((char *)dblk, false);
+    }
+    if(current == INODE_NULL) {
+        if(inode_get_data_block(dev, &next) != INODE_OK) {
+            errno = ENOSPC;
+            printk("inode_dir_entry_add:: failed to get data block dev=%d\n", dev);
+            return INODE_FAIL;
+        }
+        dblk = &zero_dblk;
+        ent = (dir_entry_t *)dblk->entries;
+        ent->rec_len = DIR_BLOCK_BYTES;
+    }
+    ent->block = block;
+    ent->hash = (unsigned short)inode_name_hash(name);
+    ent->name_len = len;
+    ent->type = type;
+    memcpy(DIR_ENTRY_NAME(ent), name, len);
+    if(current != INODE_NULL) {
+        block_put((char *)dblk, true);
+        return INODE_OK;
+    }
+    if(block_write(dev, next, (char *)dblk) != BLOCK_OK) {
+        errno = EACCES;
+        printk("inode_dir_entry_add:: error writing block dev=%d block=%u\n", dev, next);
+        return INODE_FAIL;
+    }
+    return inode_dir_link(dev, dir, last, next);
 }
 
-inode_rtvl_t inode_free_data_block(int dev, block_t block)
+//
+// inode_dir_entry_remove:
+// Remove the record of inode 'block' from entries directory 'dir'.
+// Its space goes to the record before it, a directory block left
+// without entries is unlinked from the chain and free'd.
+//
+static inode_rtvl_t inode_dir_entry_remove(int dev, inode_t *dir, block_t block)
 {
-    master_inode_t *master = master_get(dev);
-    register block_t ptr = 0;
-    register block_t bit = 0;
-    register int i = 0;
+    block_t current = dir->next, last = INODE_NULL, next = INODE_NULL, pos = 0;
+    dir_block_t *dblk = NULL;
+    dir_entry_t *ent = NULL, *prev = NULL;
+    bool empty = true;
 
-    if(!master) {
-        printk("inode_free_data_block:: failed to get master dev=%d\n", dev);
+    while(current != INODE_NULL) {
+        if(!(dblk = (dir_block_t *)block_get(dev, current))) {
+            errno = EACCES;
+            printk("inode_dir_entry_remove:: error reading block dev=%d block=%u\n",
+                    dev, current);
+            return INODE_FAIL;
+        }
+        for(prev = NULL, pos = 0; pos < DIR_BLOCK_BYTES; pos += ent->rec_len) {
+            if(!(ent = inode_dir_entry(dblk, pos))) {
+                errno = EACCES;
+                printk("inode_dir_entry_remove:: inconsistent directory dev=%d block=%u\n",
+                        dev, current);
+                block_put((char *)dblk, false);
+                return INODE_FAIL;
+            }
+            if(ent->block == block) {
+                break;
+            }
+            prev = ent;
+        }
+        if(pos < DIR_BLOCK_BYTES) {
+            break;
+        }
+        last = current;
+        current = dblk->next;
+        block_put((char *)dblk, false);
+    }
+    if(current == INODE_NULL) {
+        return INODE_INCONSISTENT;
+    }
+    if(prev) {
+        prev->rec_len += ent->rec_len;
+    } else {
+        ent->block = INODE_NULL;
+    }
+    for(pos = 0; pos < DIR_BLOCK_BYTES; pos += ent->rec_len) {
+        ent = (dir_entry_t *)(dblk->entries + pos);
+        if(ent->block != INODE_NULL) {
+            empty = false;
+            break;
+        }
+    }
+    next = dblk->next;
+    block_put((char *)dblk, true);
+    if(!empty) {
+        return INODE_OK;
+    }
+    if(inode_dir_link(dev, dir, last, next) != INODE_OK) {
+        return INODE_FAIL;
+    }
+    if(inode_free_data_block(dev, current) != INODE_OK) {
+        errno = EACCES;
+        printk("inode_dir_entry_remove:: error free'ing data block dev=%d block=%u\n",
+                dev, current);
         return INODE_FAIL;
     }
-    ptr = master->bmap_ptr;
-    bit = master->bmap_bit;
-    if(master->bmap_ptr == 0) {
-       // Initialize.
-       master->bmap_ptr = master->bmap_map_start;
-       i = master_get_mem_ptr(dev);
-       if(i == INODE_NOPOS) {
-            printk("inode_free_data_block:: failed to get memory\n");
-            return INODE_FAIL;
-       }
-       master->bmap = master_bmap_memory[i];
-       if(block_read(dev, master->bmap_ptr, (char *)master->bmap) != BLOCK_OK) {
-            errno = EACCES;
-            printk("inode_free_data_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->bmap_ptr);
-            return INODE_FAIL;
-       }
-       ptr = master->bmap_ptr;
-       bit = 0;
-   }
-
-   // Find ptr and bit given block number.
-   // This is from math, see 'block_calculation' above.
-   block -= master->data_start;
-   ptr = block / DEV_BLOCK_SIZE + master->bmap_map_start;
-   bit = block % DEV_BLOCK_SIZE;
-   if(ptr != master->bmap_ptr) {
-        // We are not referencing it, load it.
-        master->bmap_ptr = ptr;
-        master->bmap_bit = bit;
-        if(block_read(dev, master->bmap_ptr, (char *)master->bmap) != BLOCK_OK) {
-            errno = EACCES;
-            printk("inode_free_data_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->bmap_ptr);
-            return INODE_FAIL;
-        }
-   } else if(ptr == master->bmap_ptr && bit != master->bmap_bit) {
-        // Setup the bit.
-        master->bmap_bit = bit;
-   }
-   if(bit_get(master->bmap, bit) == 0) {
-       printk("inode_free_data_block:: warning free'ing free block=%u bit=%d\n", ptr, bit);
-       return INODE_OK;
-   }
-   // All we have to do is set this to zero and the block
-   // is free'd. This is how we unlink files, we just set the bit
-   // to free for the inode.
-   bit_set(master->bmap, bit, 0);
-   return INODE_OK;
+    return INODE_OK;
 }
 
-inode_rtvl_t inode_free_inode_block(int dev, block_t block)
+//
+// inode_dir_lookup:
+// Search the directory whose first block map is 'next' for 'name'.
+// The block maps and the child inodes are examined in place in the
+// buffer cache with block_get/block_put instead of being copied out.
+// In a hashed directory each block map is probed from the hashed
+// slot up to the first free one, the next block map is searched
+// only if this one is full.
+// On return *found is the inode block or INODE_NULL if not present.
+//
+static inode_rtvl_t inode_dir_lookup(int dev, block_t next, char *name, block_t *found)
 {
     master_inode_t *master = master_get(dev);
-    register block_t ptr = 0;
-    register block_t bit = 0;
-    register int i = 0;
+    bool hashed = (master && master->dir_format == INODE_DIR_HASHED);
+    block_t pos = hashed ? inode_dir_hash(name) : 0;
+    block_map_t *bmap = NULL;
+    inode_t *tnode = NULL;
+    block_t current = next;
+    block_t ino = INODE_NULL;
+    int j = 0, n = 0;
 
-    if(!master) {
-        printk("inode_free_inode_block:: failed to get master dev=%d\n", dev);
-        return INODE_FAIL;
+    if(master && master->dir_format == INODE_DIR_ENTRIES) {
+        return inode_dir_entry_lookup(dev, next, name, found);
     }
-    ptr = master->imap_ptr;
-    bit = master->imap_bit;
-    if(master->imap_ptr == 0) {
-       // Initialize.
-       master->imap_ptr = master->inode_map_start;
-       i = master_get_mem_ptr(dev);
-       if(i == INODE_NOPOS) {
-            printk("inode_free_inode_block:: failed to get memory\n");
-            return INODE_FAIL;
-       }
-       master->imap = master_imap_memory[i];
-       if(block_read(dev, master->imap_ptr, (char *)master->imap) != BLOCK_OK) {
-            errno = EACCES;
-            printk("inode_free_inode_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->imap_ptr);
-            return INODE_FAIL;
-       }
-       ptr = master->imap_ptr;
-       bit = 0;
-   }
-
-   // Find ptr and bit given block number.
-   // This is from math, see 'inode_block_calculation' above.
-   block -= master->inode_start;
-   ptr = block / DEV_BLOCK_SIZE + master->inode_map_start;
-   bit = block % DEV_BLOCK_SIZE;
-   if(ptr != master->imap_ptr) {
-        // We are not referencing it, load it.
-        master->imap_ptr = ptr;
-        master->imap_bit = bit;
-        if(block_read(dev, master->imap_ptr, (char *)master->imap) != BLOCK_OK) {
+    *found = INODE_NULL;
+    while(current != INODE_NULL && *found == INODE_NULL) {
+        if(!(bmap = (block_map_t *)block_get(dev, current))) {
             errno = EACCES;
-            printk("inode_free_inode_block:: block_read failed dev=%d block=%u\n",
-                    dev, master->imap_ptr);
+            printk("inode_dir_lookup:: error reading block dev=%d block=%u\n",
+                    dev, current);
             return INODE_FAIL;
         }
-   } else if(ptr == master->imap_ptr && bit != master->imap_bit) {
-        // Setup the bit.
-        master->imap_bit = bit;
-   }
-   if(bit_get(master->imap, bit) == 0) {
-       printk("inode_free_inode_block:: warning free'ing free inode block=%u bit=%d\n", ptr, bit);
-       return INODE_OK;
-   }
-   // All we have to do is set this to zero and the block
-   // is free'd. This is how we unlink files, we just set the bit
-   // to free for the inode.
-   bit_set(master->imap, bit, 0);
-   return INODE_OK;
+        for(n = 0; n < BMAP_BLOCKS; n++) {
+            j = (pos + n) % BMAP_BLOCKS;
+            ino = bmap->blocks[j];
+            if(ino == INODE_NULL && hashed) {
+                break;
+            }
+            if(ino != INODE_NULL && ino != INODE_DIR_DELETED) {
+                if(!(tnode = (inode_t *)block_get(dev, ino))) {
+                    errno = EACCES;
+                    printk("inode_dir_lookup:: error reading block dev=%d block=%u\n",
+                            dev, ino);
+                    block_put((char *)bmap, false);
+                    return INODE_FAIL;
+                }
+                if(!strcmp(tnode->path,name)) {
+                    *found = ino;
+                }
+                block_put((char *)tnode, false);
+                if(*found != INODE_NULL) {
+                    break;
+                }
+            }
+        }
+        if(hashed && !inode_dir_full(bmap)) {
+            current = INODE_NULL;
+        } else {
+            current = bmap->next;
+        }
+        block_put((char *)bmap, false);
+    }
+    return INODE_OK;
 }
 
-inode_rtvl_t inode_dev_close(int dev)
+//
+// inode_dir_find:
+// Look 'name' up in directory 'dir' through the dentry cache, the
+// directory is scanned only on a miss. Found or not, the result is
+// entered in the cache so the next lookup does no I/O.
+//
+static inode_rtvl_t inode_dir_find(int dev, inode_t *dir, char *name, block_t *found)
 {
-   int i = 0;
-   master_inode_t *master = master_get(dev);
-   if(!master) {
-        printk("inode_dev_close:: failed to get master dev=%d\n", dev);
-        return INODE_FAIL;
-   }
-   if(block_write(dev, master->imap_ptr, (char *)master->imap) != BLOCK_OK) {
-        errno = EACCES;
-        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->imap_ptr);
-        return INODE_FAIL;
-   }
-   if(block_write(dev, master->bmap_ptr, (char *)master->bmap) != BLOCK_OK) {
-        errno = EACCES;
-        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->bmap_ptr);
-        return INODE_FAIL;
-   }
-   // Write at block_start.
-   if(block_write(dev, master->block_start, (char *)master) != BLOCK_OK) {
-        errno = EACCES;
-        printk("inode_dev_close:: block_write failed dev=%d block=%u\n", dev, master->block_start);
-        return INODE_FAIL;
-   }
-   if(block_close(dev) != BLOCK_OK) {
-        printk("inode_dev_close:: block_close failed\n");
+    if(dcache_lookup(dev, dir->self, name, found) == DCACHE_HIT) {
+        return INODE_OK;
+    }
+    if(inode_dir_lookup(dev, dir->next, name, found) != INODE_OK) {
         return INODE_FAIL;
-   }
-
-   for(i = 0; i < MAX_DEV; ++i) {
-        if(master_dev_tab[i].dev == dev) {
-            master_dev_tab[i].path = NULL;
-            master_dev_tab[i].dev = 0;
-        }
-   }
-
-   master_free(dev);
-   return INODE_OK;
+    }
+    dcache_enter(dev, dir->self, name, *found);
+    return INODE_OK;
 }
 
 // TODO - Double check that this code works, it was not tested.
@@ -815,10 +1339,9 @@ inode_rtvl_t inode_get(int dev,
                        inode_mode_t mode,
                        inode_t *res_inode)
 {
-       int  start = 0, tmp = 0, i = 0, j = 0, ptr_tab_len = 0;
+       int  start = 0, i = 0, ptr_tab_len = 0;
        char res_path[MAX_PATH]={0}, in_path[MAX_PATH]={0}, *ptr_tab[MAX_PATH]={0}; 
-       block_map_t bmap={0}, zero_bmap={0};
-       block_t block = 0, parent = 0, current = 0, found = 0;
+       block_t block = 0, parent = 0, found = 0;
        inode_t inode ={0}, tnode = {0}, zero_node = {0};
        master_inode_t *master = master_get(dev);
        inode_perm_t perm = 0, umask = 0;
@@ -852,6 +1375,12 @@ inode_rtvl_t inode_get(int dev,
             }
             start++;
        }
+       // Open files keep their inode in the icache, it is written
+       // back before it is read here so the metadata is current.
+       if(icache_flush(dev, INODE_ROOT_BLOCK) != ICACHE_OK) {
+            errno = EACCES;
+            return INODE_FAIL;
+       }
        // Check if we have root inode,
        if(block_read(dev, INODE_ROOT_BLOCK, (char *)&inode) != BLOCK_OK) {
             errno = EACCES;
@@ -944,7 +1473,6 @@ inode_rtvl_t inode_get(int dev,
                            perm, umask, current_process->group, current_process->owner);
                     return INODE_FAIL;
                 }
-                current = bmap.next = inode.next;
                 if(inode.next == INODE_NULL) {
                     errno = ENOENT;
                     printk("inode_get:: file not found [%s]\n", in_path);
@@ -952,31 +1480,9 @@ inode_rtvl_t inode_get(int dev,
                     *res_inode = zero_node;
                     return INODE_FILE_NOT_FOUND;
                 }
-                block = INODE_NULL;
-                found = INODE_NULL;
-                do {
-                    current = bmap.next;
-                    if(block_read(dev, bmap.next, (char *)&bmap) != BLOCK_OK) {
-                        errno = EACCES;
-                        printk("inode_get:: error reading block dev=%d block=%u\n",
-                                dev, bmap.next);
-                        return INODE_FAIL;
-                    }
-                    for(j = 0; j < BMAP_BLOCKS; j++) {
-                        if(bmap.blocks[j] != INODE_NULL) {
-                            if(block_read(dev, bmap.blocks[j], (char *)&tnode) != BLOCK_OK) {
-                                errno = EACCES;
-                                printk("inode_get:: error reading block dev=%d block=%u\n",
-                                        dev, bmap.blocks[j]);
-                                return INODE_FAIL;
-                            }
-                            if(!strcmp(tnode.path,path)) {
-                                found = bmap.blocks[j];
-                                break;
-                            }
-                        }
-                    }
-                } while(bmap.next != INODE_NULL && found == INODE_NULL);
+                if(inode_dir_find(dev, &inode, path, &found) != INODE_OK) {
+                    return INODE_FAIL;
+                }
                 if(found != INODE_NULL) {
                     // We found it, we were not at the end of the path
                     // so go back in the loop using the found node
@@ -986,6 +1492,12 @@ inode_rtvl_t inode_get(int dev,
 		                // We just return the inode if we are at the end,
 		                // the directory lookup is needed only in 
                         // the beginning and middle.
+                        if(icache_flush(dev, found) != ICACHE_OK ||
+                           block_read(dev, found, (char *)&tnode) != BLOCK_OK) {
+                            errno = EACCES;
+                            printk("inode_get:: error reading block dev=%d block=%u\n", dev, found);
+                            return INODE_FAIL;
+                        }
 		                if((tnode.is_symlink || tnode.is_hardlink) && do_readlink) {
                             printk("inode_get:: READING LINK block=%u path=%s\n",
                                     tnode.self, tnode.path);
@@ -995,7 +1507,8 @@ inode_rtvl_t inode_get(int dev,
 		                                dev, current_dir, tnode.path);
 		                        return INODE_FAIL;
 		                    }
-		                    if(block_read(dev, block, (char *)&tnode) != BLOCK_OK) {
+		                    if(icache_flush(dev, block) != ICACHE_OK ||
+		                       block_read(dev, block, (char *)&tnode) != BLOCK_OK) {
 		                        errno = EACCES;
 		                        printk("inode_get:: error reading block dev=%d block=%u\n", dev, block);
 		                        return INODE_FAIL;
@@ -1040,13 +1553,15 @@ inode_rtvl_t inode_get(int dev,
 
 inode_rtvl_t inode_set_parent_mod_time(int dev, block_t parent)
 {
-    inode_t inode={0};
-    if(block_read(dev, parent, (char *)&inode) != BLOCK_OK) {
+    inode_t *inode = NULL;
+    if(!(inode = (inode_t *)block_get(dev, parent))) {
         printk("inode_set_parent_mod_time:: error reading block dev=%d block=%u\n",
                 dev, parent);
         return INODE_FAIL;
     }
-    inode.modified_time = ktime(0);
+    // Update the cached inode in place and mark it for write back.
+    inode->modified_time = ktime(0);
+    block_put((char *)inode, true);
     return INODE_OK;
 }
 
@@ -1563,38 +2078,15 @@ inode_rtvl_t inode_create(int dev,
                            perm, umask, group, owner);
                     return INODE_FAIL;
                 }
-                current = bmap.next = inode.next;
                 if(inode.next == INODE_NULL) {
                     errno = ENOENT;
                     printk("inode_create:: file not found [%s]\n", in_path);
                     // *res_inode = *zero_node;
                     return INODE_FILE_NOT_FOUND;
                 }
-                block = INODE_NULL;
-                found = INODE_NULL;
-                do {
-                    current = bmap.next;
-                    if(block_read(dev, bmap.next, (char *)&bmap) != BLOCK_OK) {
-                        errno = EACCES;
-                        printk("inode_create:: error reading block dev=%d block=%u\n",
-                                dev, bmap.next);
-                        return INODE_FAIL;
-                    }
-                    for(j = 0; j < BMAP_BLOCKS; j++) {
-                        if(bmap.blocks[j] != INODE_NULL) {
-                            if(block_read(dev, bmap.blocks[j], (char *)&tnode) != BLOCK_OK) {
-                                errno = EACCES;
-                                printk("inode_create:: error reading block dev=%d block=%u\n",
-                                        dev, bmap.blocks[j]);
-                                return INODE_FAIL;
-                            }
-                            if(!strcmp(tnode.path,path)) {
-                                found = bmap.blocks[j];
-                                break;
-                            }
-                        }
-                    }
-                } while(bmap.next != INODE_NULL && found == INODE_NULL);
+                if(inode_dir_find(dev, &inode, path, &found) != INODE_OK) {
+                    return INODE_FAIL;
+                }
                 if(found != INODE_NULL) {
                     // We found it, we were not at the end of the path
                     // so go back in the loop using the found node
@@ -1650,33 +2142,8 @@ inode_rtvl_t inode_create(int dev,
                            perm, umask, group, owner);
                     return INODE_FAIL;
                 }
-                current = bmap.next = inode.next;
-                block = INODE_NULL;
-                found = INODE_NULL;
-                if(inode.next != INODE_NULL) {
-                    do {
-                        current = bmap.next;
-                        if(block_read(dev, bmap.next, (char *)&bmap) != BLOCK_OK) {
-                            errno = EACCES;
-                            printk("inode_create:: error reading block dev=%d block=%u\n",
-                                    dev, bmap.next);
-                            return INODE_FAIL;
-                        }
-                        for(j = 0; j < BMAP_BLOCKS; j++) {
-                            if(bmap.blocks[j] != INODE_NULL) {
-                                if(block_read(dev, bmap.blocks[j], (char *)&tnode) != BLOCK_OK) {
-                                    errno = EACCES;
-                                    printk("inode_create:: error reading block dev=%d block=%u\n",
-                                            dev, bmap.blocks[j]);
-                                    return INODE_FAIL;
-                                }
-                                if(!strcmp(tnode.path,path)) {
-                                    found = bmap.blocks[j];
-                                    break;
-                                }
-                            }
-                        }
-                    } while(bmap.next != INODE_NULL && found == INODE_NULL);
+                if(inode_dir_find(dev, &inode, path, &found) != INODE_OK) {
+                    return INODE_FAIL;
                 }
                 if(found != INODE_NULL) {
                     // We found it, but this time, we are at the end of
@@ -1700,7 +2167,22 @@ inode_rtvl_t inode_create(int dev,
                 }
                 current = bmap.next = parent_inode.next;
                 block = INODE_NULL;
-                if (parent_inode.next != INODE_NULL) {
+                if(master->dir_format == INODE_DIR_HASHED ||
+                   master->dir_format == INODE_DIR_ENTRIES) {
+                    if(inode_get_inode_block(dev, &block) == INODE_FAIL) {
+                        errno = ENOSPC;
+                        printk("inode_create:: failed to get inode block dev=%d\n",
+                                dev);
+                        return INODE_FAIL;
+                    }
+                    if((master->dir_format == INODE_DIR_ENTRIES ?
+                        inode_dir_entry_add(dev, &parent_inode, path, block,
+                                            inode_dir_type(mode)) :
+                        inode_dir_add(dev, &parent_inode, path, block)) != INODE_OK) {
+                        inode_free_inode_block(dev, block);
+                        return INODE_FAIL;
+                    }
+                } else if (parent_inode.next != INODE_NULL) {
                     do {
                         current = bmap.next;
                         if(block_read(dev, bmap.next, (char *)&bmap) != BLOCK_OK) {
@@ -1804,6 +2286,7 @@ inode_rtvl_t inode_create(int dev,
                 if(mode == INODE_CREATE_FILE) {
                         memset((char *)&inode,0x0,DEV_BLOCK_SIZE);
                         inode.is_file = true;
+                        inode.is_extent = true;
                         strcpy(inode.path, path);
                         if(inode_set_permissions(&inode, perm, umask) != INODE_OK) {
                             printk("inode_create:: error setting permissions\n");
@@ -1988,6 +2471,8 @@ inode_rtvl_t inode_create(int dev,
                     errno = EINVAL;
                     return INODE_FAIL;
                 }
+                // Replaces the negative entry left by the lookup above.
+                dcache_enter(dev, parent, path, block);
             } else if(!(inode.is_directory || inode.is_symlink) && (i == (ptr_tab_len-1))) {
                 if(inode.is_file) {
                     // This is an error, the path contains a file.
@@ -2005,6 +2490,208 @@ inode_rtvl_t inode_create(int dev,
        return INODE_OK;
 }
 
+inode_rtvl_t inode_free_data(int dev, inode_t *inode)
+{
+    block_t j = 0, k = 0;
+    block_map_t data = {0};
+
+    if(inode->is_extent) {
+        if(extent_free(dev, inode) != EXTENT_OK) {
+            errno = EACCES;
+            return INODE_FAIL;
+        }
+        return INODE_OK;
+    }
+    for(j = inode->next; j != INODE_NULL; j = data.next) {
+        if(block_read(dev, j, (char *)&data) != BLOCK_OK) {
+            errno = EACCES;
+            return INODE_FAIL;
+        }
+        // Free all data referenced in the block_map.
+        for(k = 0; k < BMAP_BLOCKS; k++) {
+            if(data.blocks[k] != INODE_NULL) {
+                if(inode_free_data_block(dev, data.blocks[k]) != INODE_OK) {
+                    errno = EACCES;
+                    printk("inode_free_data:: error free'ing block=%u\n",
+                           data.blocks[k]);
+                    return INODE_FAIL;
+                }
+            }
+        }
+        // Free the block_map.
+        if(inode_free_data_block(dev, j) != INODE_OK) {
+            errno = EACCES;
+            printk("inode_free_data:: error free'ing block=%u\n", j);
+            return INODE_FAIL;
+        }
+        // Memory pointed to by data is still valid,
+        // so data.next should still work to set up j
+        // for next iteration.
+    }
+    inode->next = INODE_NULL;
+    return INODE_OK;
+}
+
+//
+// inode_free_contents:
+// Release what 'inode', just removed from its directory, refers to.
+// The data and block maps of a file, the link of a soft link or the
+// reference a hard link holds. For rename, 'newnode' takes over the
+// contents instead, keeping its own name, self and parent.
+//
+static inode_rtvl_t inode_free_contents(int dev, block_t current_dir, inode_t *inode,
+                                        inode_t *newnode, char *in_path)
+{
+    inode_t tnode = {0};
+    link_t link = {0};
+
+    // We are not done yet.
+    // Free all data blocks if we are a file/hard/soft link.
+    // If we are a hard link, decrement what the reference count we
+    // were pointing to.
+    if(inode->is_file) {
+        if(newnode) {
+            // Copy into the newnode this is
+            // for implementing the rename system call
+            // where newnode is hopefully already allocated using
+            // inode_create and retrieved using inode_get.
+            char tmp[MAX_PATH]={0};
+            block_t self   = newnode->self;
+            block_t parent = newnode->parent;
+            strncpy(tmp, newnode->path, MAX_PATH);
+            // Struct assign.
+            (*newnode) = *inode;
+            strncpy(newnode->path,tmp, MAX_PATH);
+            newnode->self   = self;
+            newnode->parent = parent;
+            //P();
+            //printk("inode->next=%u size=%u pos=%u\n",inode->next,inode->size,inode->pos);
+            //printk("newnode->next=%u size=%u pos=%u\n",newnode->next,newnode->size,newnode->pos);
+        } else if(inode_free_data(dev, inode) != INODE_OK) {
+            errno = EACCES;
+            printk("inode_free:: error free'ing file [%s]\n", in_path);
+            return INODE_FAIL;
+        }
+    } else if(inode->is_directory) {
+        // In this case, inode->next must necessarily be INODE_NULL
+        // so there is no data blocks to free. We already free'd
+        // the inode above so nothing to do provided we maintain
+        // the inode list inside the directory.
+        if(newnode) {
+            // Copy into the newnode this is
+            // for implementing the rename system call
+            // where newnode is hopefully already allocated using
+            // inode_create and retrieved using inode_get.
+            char tmp[MAX_PATH]={0};
+            block_t self   = newnode->self;
+            block_t parent = newnode->parent;
+            strncpy(tmp, newnode->path, MAX_PATH);
+            // Struct assign.
+            (*newnode) = *inode;
+            strncpy(newnode->path,tmp, MAX_PATH);
+            newnode->self   = self;
+            newnode->parent = parent;
+        }
+    } else if(inode->is_symlink) {
+        // Free the link_t structure associated with the inode->
+        if(newnode) {
+            // Copy into the newnode this is
+            // for implementing the rename system call
+            // where newnode is hopefully already allocated using
+            // inode_create and retrieved using inode_get.
+            char tmp[MAX_PATH]={0};
+            block_t self   = newnode->self;
+            block_t parent = newnode->parent;
+            strncpy(tmp, newnode->path, MAX_PATH);
+            // Struct assign.
+            (*newnode) = *inode;
+            strncpy(newnode->path,tmp, MAX_PATH);
+            newnode->self   = self;
+            newnode->parent = parent;
+        } else {
+            if(inode->next != INODE_NULL) {
+                if(inode_free_data_block(dev, inode->next) != INODE_OK) {
+                    errno = EACCES;
+                    printk("inode_free:: error free'ing softlink [%s] block=%u\n",
+                        in_path, inode->next);
+                    return INODE_FAIL;
+                }
+            }
+        }
+    } else if(inode->is_hardlink) {
+        // We must read the link.
+        if(newnode) {
+            // Copy into the newnode this is
+            // for implementing the rename system call
+            // where newnode is hopefully already allocated using
+            // inode_create and retrieved using inode_get.
+            char tmp[MAX_PATH]={0};
+            block_t self   = newnode->self;
+            block_t parent = newnode->parent;
+            strncpy(tmp, newnode->path, MAX_PATH);
+            // Struct assign.
+            (*newnode) = *inode;
+            strncpy(newnode->path,tmp, MAX_PATH);
+            newnode->self   = self;
+            newnode->parent = parent;
+        } else {
+          if(inode->next != INODE_NULL) {
+            if(block_read(dev, inode->next, (char *)&link) != BLOCK_OK) {
+                errno = EACCES;
+                printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
+                        in_path, inode->next);
+                return INODE_FAIL;
+            }
+            /* Dont follow through if we have a hard link to a soft link. */
+            if(inode_get(dev,current_dir,link.path,false,INODE_RW, &tnode) != INODE_OK) {
+                errno = EACCES;
+                printk("inode_free:: error free'ing hardlink [%s] path=%s\n",
+                        in_path, link.path);
+                return INODE_FAIL;
+            }
+            tnode.refcount--;
+            if(block_write(dev, tnode.self, (char *)&tnode) != BLOCK_OK) {
+                errno = EACCES;
+                printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
+                    in_path, tnode.self);
+                return INODE_FAIL;
+            }
+          } else {
+            errno = EACCES;
+            printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
+                    in_path, INODE_NULL);
+            return INODE_FAIL;
+          }
+        }
+    }
+    return INODE_OK;
+}
+
+//
+// inode_free_release:
+// Called by inode_free once 'inode' is out of its directory and its
+// block is free. For rename 'newnode' takes the contents and an open
+// copy of the inode follows it. Otherwise the contents are released,
+// but a file that is still open keeps its data until the last close.
+//
+static inode_rtvl_t inode_free_release(int dev, block_t current_dir, inode_t *inode,
+                                       inode_t *newnode, char *in_path)
+{
+    inode_rtvl_t rtvl = INODE_OK;
+
+    if(newnode) {
+        if((rtvl = inode_free_contents(dev, current_dir, inode, newnode, in_path)) != INODE_OK) {
+            return rtvl;
+        }
+        icache_rename(dev, inode->self, newnode);
+        return INODE_OK;
+    }
+    if(icache_unlink(dev, inode) && inode->is_file) {
+        return INODE_OK;
+    }
+    return inode_free_contents(dev, current_dir, inode, NULL, in_path);
+}
+
 // 
 // TODO - We should call inode free for the inode being unlinked.
 //        DONE
@@ -2031,13 +2718,14 @@ inode_rtvl_t inode_create(int dev,
 inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newnode)
 {
    /* Free an existing inode. */
-   block_t     i = 0, j = 0, k = 0, current = 0;
+   block_t     i = 0, current = 0;
    inode_t      inode = {0};
    inode_t     parent = {0};
-   inode_t      tnode = {0};
-   block_map_t   bmap = {0}, data = {0};
-   link_t        link = {0};
+   block_map_t   bmap = {0};
    inode_rtvl_t  rtvl;
+   master_inode_t *master = master_get(dev);
+   bool hashed = (master && master->dir_format == INODE_DIR_HASHED);
+   block_t pos = 0, n = 0;
    char in_path[MAX_PATH] = {0};
    if(strlen(path) > MAX_PATH) {
       errno = ENAMETOOLONG;
@@ -2084,8 +2772,24 @@ inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newno
        errno = EINVAL;
        return INODE_FAIL;
    }
+   if(master && master->dir_format == INODE_DIR_ENTRIES) {
+      if((rtvl = inode_dir_entry_remove(dev, &parent, inode.self)) != INODE_OK) {
+          printk("inode_free:: error removing [%s] from its directory\n", in_path);
+          return rtvl;
+      }
+      dcache_invalidate(dev, inode.self);
+      if(inode_free_inode_block(dev, inode.self) != INODE_OK) {
+          printk("inode_free:: error free'ing inode block dev=%d block=%u\n",dev,inode.self);
+          return INODE_FAIL;
+      }
+      return inode_free_release(dev, current_dir, &inode, newnode, in_path);
+   }
    /* Scan for the entry referring to this inode. */
    /* We have to read from the bmap. */
+   /* In a hashed directory it is found probing from its hashed slot. */
+   if(hashed) {
+      pos = inode_dir_hash(inode.path);
+   }
    bmap.next = parent.next;
    do {
       current = bmap.next;
@@ -2095,14 +2799,17 @@ inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newno
                 dev, inode.parent);
         return INODE_FAIL;
       }
-      for(i = 0; i < BMAP_BLOCKS; i++) {
+      for(n = 0; n < BMAP_BLOCKS; n++) {
+         i = (pos + n) % BMAP_BLOCKS;
          if(inode.self == bmap.blocks[i]) {
             // This is the actual delete logic,
             // find the entry in the list, and set it to
             // INODE_NULL. Then write the block_map back
             // to the disk to record the change and release
-            // the inode.
-            bmap.blocks[i] = INODE_NULL;
+            // the inode. A hashed directory keeps the slot
+            // as deleted for the probes that went past it.
+            bmap.blocks[i] = hashed ? INODE_DIR_DELETED : INODE_NULL;
+            dcache_invalidate(dev, inode.self);
             if(inode_free_inode_block(dev, inode.self) != INODE_OK) {
                 printk("inode_free:: error free'ing inode block dev=%d block=%u\n",dev,inode.self);
                 return INODE_FAIL;
@@ -2112,149 +2819,8 @@ inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newno
                         dev, current);
                 return INODE_FAIL;
             }
-            // We are not done yet.
-            // Free all data blocks if we are a file/hard/soft link.
-            // If we are a hard link, decrement what the reference count we
-            // were pointing to.
-            if(inode.is_file) {
-                if(newnode) {
-                    // Copy into the newnode this is
-                    // for implementing the rename system call
-                    // where newnode is hopefully already allocated using
-                    // inode_create and retrieved using inode_get.
-                    char tmp[MAX_PATH]={0};
-                    block_t self   = newnode->self;
-                    block_t parent = newnode->parent;
-                    strncpy(tmp, newnode->path, MAX_PATH);
-                    // Struct assign.
-                    (*newnode) = inode;
-                    strncpy(newnode->path,tmp, MAX_PATH);
-                    newnode->self   = self;
-                    newnode->parent = parent;
-                    //P();
-                    //printk("inode.next=%u size=%u pos=%u\n",inode.next,inode.size,inode.pos);
-                    //printk("newnode->next=%u size=%u pos=%u\n",newnode->next,newnode->size,newnode->pos);
-                } else {
-                  for(j = inode.next; j != INODE_NULL; j = data.next) {
-                    if(block_read(dev, j, (char *)&data) != BLOCK_OK) {
-                        errno = EACCES;
-                        printk("inode_free:: error free'ing file [%s]\n", in_path);
-                        return INODE_FAIL;
-                    }
-                    // Free all data referenced in the block_map.
-                    for(k = 0; k < BMAP_BLOCKS; k++) {
-                        if(data.blocks[k] != INODE_NULL) {
-                            if(inode_free_data_block(dev, data.blocks[k]) != INODE_OK) {
-                                errno = EACCES;
-                                printk("inode_free:: error free'ing file [%s] block=%u\n",
-                                       in_path, data.blocks[k]);
-                                return INODE_FAIL;
-                            }
-                        }
-                    }
-                    // Free the block_map.
-                    if(inode_free_data_block(dev, j) != INODE_OK) {
-                        errno = EACCES;
-                        printk("inode_free:: error free'ing file [%s] block=%u\n",
-                                in_path, j);
-                        return INODE_FAIL;
-                    }
-                    // Memory pointed to by data is still valid,
-                    // so data.next should still work to set up j
-                    // for next iteration.
-                  }
-                }
-            } else if(inode.is_directory) {
-                // In this case, inode.next must necessarily be INODE_NULL
-                // so there is no data blocks to free. We already free'd
-                // the inode above so nothing to do provided we maintain
-                // the inode list inside the directory.
-                if(newnode) {
-                    // Copy into the newnode this is
-                    // for implementing the rename system call
-                    // where newnode is hopefully already allocated using
-                    // inode_create and retrieved using inode_get.
-                    char tmp[MAX_PATH]={0};
-                    block_t self   = newnode->self;
-                    block_t parent = newnode->parent;
-                    strncpy(tmp, newnode->path, MAX_PATH);
-                    // Struct assign.
-                    (*newnode) = inode;
-                    strncpy(newnode->path,tmp, MAX_PATH);
-                    newnode->self   = self;
-                    newnode->parent = parent;
-                }
-            } else if(inode.is_symlink) {
-                // Free the link_t structure associated with the inode.
-                if(newnode) {
-                    // Copy into the newnode this is
-                    // for implementing the rename system call
-                    // where newnode is hopefully already allocated using
-                    // inode_create and retrieved using inode_get.
-                    char tmp[MAX_PATH]={0};
-                    block_t self   = newnode->self;
-                    block_t parent = newnode->parent;
-                    strncpy(tmp, newnode->path, MAX_PATH);
-                    // Struct assign.
-                    (*newnode) = inode;
-                    strncpy(newnode->path,tmp, MAX_PATH);
-                    newnode->self   = self;
-                    newnode->parent = parent;
-                } else {
-                    if(inode.next != INODE_NULL) {
-                        if(inode_free_data_block(dev, inode.next) != INODE_OK) {
-                            errno = EACCES;
-                            printk("inode_free:: error free'ing softlink [%s] block=%u\n",
-                                in_path, inode.next);
-                            return INODE_FAIL;
-                        }
-                    }
-                }
-            } else if(inode.is_hardlink) {
-                // We must read the link.
-                if(newnode) {
-                    // Copy into the newnode this is
-                    // for implementing the rename system call
-                    // where newnode is hopefully already allocated using
-                    // inode_create and retrieved using inode_get.
-                    char tmp[MAX_PATH]={0};
-                    block_t self   = newnode->self;
-                    block_t parent = newnode->parent;
-                    strncpy(tmp, newnode->path, MAX_PATH);
-                    // Struct assign.
-                    (*newnode) = inode;
-                    strncpy(newnode->path,tmp, MAX_PATH);
-                    newnode->self   = self;
-                    newnode->parent = parent;
-                } else {
-                  if(inode.next != INODE_NULL) {
-                    if(block_read(dev, inode.next, (char *)&link) != BLOCK_OK) {
-                        errno = EACCES;
-                        printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
-                                in_path, inode.next);
-                        return INODE_FAIL;
-                    }
-                    /* Dont follow through if we have a hard link to a soft link. */
-                    if(inode_get(dev,current_dir,link.path,false,INODE_RW, &tnode) != INODE_OK) {
-                        errno = EACCES;
-                        printk("inode_free:: error free'ing hardlink [%s] path=%s\n",
-                                in_path, link.path);
-                        return INODE_FAIL;
-                    }
-                    tnode.refcount--;
-                    if(block_write(dev, tnode.self, (char *)&tnode) != BLOCK_OK) {
-                        errno = EACCES;
-                        printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
-                            in_path, tnode.self);
-                        return INODE_FAIL;
-                    }
-                  } else {
-                    errno = EACCES;
-                    printk("inode_free:: error free'ing hardlink [%s] block=%u\n",
-                            in_path, INODE_NULL);
-                    return INODE_FAIL;
-                  }
-                }
+            if(inode_free_release(dev, current_dir, &inode, newnode, in_path) != INODE_OK) {
+                return INODE_FAIL;
             }
             {// Fixup parent directory block_map.
               int i = 0;
@@ -2270,7 +2836,8 @@ inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newno
                  }
                  empty = true;
                  for(i = 0; i < BMAP_BLOCKS; ++i) {
-                     if(bmap.blocks[i] != INODE_NULL) {
+                     if(bmap.blocks[i] != INODE_NULL &&
+                        bmap.blocks[i] != INODE_DIR_DELETED) {
                          empty = false;
                      }
                  }
@@ -2280,7 +2847,7 @@ inode_rtvl_t inode_free(int dev, block_t current_dir, char *path, inode_t *newno
                          // which is inode.next to current pointer next (bmap.next)
                          // then write inode back to disk at the end of this code block
                          // (see below).
-                         parent.next == bmap.next;
+                         parent.next = bmap.next;
                          if(inode_free_data_block(dev, current) != INODE_OK) {
                             errno = EACCES;
                             printk("inode_free:: error free'ing data block dev=%d block=%u\n",
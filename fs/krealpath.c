@@ -40,6 +40,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "paths.h"
 #include "bool.h"
 #include "block.h"
+#include "dev.h"
 #include "inode.h"
 #include "compat.h"
 #endif
@@ -53,6 +54,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "paths.h"
 #include "bool.h"
 #include "block.h"
+#include "dev.h"
 #include "inode.h"
 #include "compat.h"
 
@@ -90,8 +90,8 @@ int klink(const char *oldpath, const char *newpath)
 block_t kreadlink(int dev, int current_dir, char *pathcomponent, int *error)
 {
         static int nr_recursion = 0;
-        inode_t inode = {0};
-        link_t  link  = {0};
+        inode_t inode = {0}, *iptr = NULL;
+        link_t  *lptr = NULL;
         char link_path[MAX_PATH]={0};
         char res_path[MAX_PATH]={0};
         // Open current_dir, find pathcomponent.
@@ -109,7 +109,7 @@ block_t kreadlink(int dev, int current_dir, char *pathcomponent, int *error)
             --nr_recursion;
             return INODE_NULL;
         }
-        if(block_read(dev, current_dir, (char *)&inode)!= BLOCK_OK) {
+        if(!(iptr = (inode_t *)block_get(dev, current_dir))) {
             *error = EACCES;
             printk("kreadlink:: error reading block dev=%d current_dir=%u\n",
                     dev, current_dir);
@@ -123,7 +123,7 @@ block_t kreadlink(int dev, int current_dir, char *pathcomponent, int *error)
         //         With such a reference count, we do not delete
         //         if its not zero. Additionally, we do not allow
         //         hard links to anything other than an existing file.
-        if(!(inode.is_symlink || inode.is_hardlink)) {
+        if(!(iptr->is_symlink || iptr->is_hardlink)) {
             // Regular inode.
             // We were going to :=
             //   Scan for the block containing the path.
@@ -131,17 +131,21 @@ block_t kreadlink(int dev, int current_dir, char *pathcomponent, int *error)
             // But this is a logical error, kreadlink only reads links.
             *error = EINVAL;
             printk("kreadlink:: file [%s] not a link\n", pathcomponent);
+            block_put((char *)iptr, false);
             return INODE_NULL;
         } else {
             // Its a symlink. Get the actual path and
             // do symlink processing below.
-            if(block_read(dev, inode.next, (char *)&link) != BLOCK_OK) {
+            if(!(lptr = (link_t *)block_get(dev, iptr->next))) {
                 *error = EACCES;
                 printk("kreadlink:: error reading block dev=%d block=%u\n",
-                        dev, inode.next);
+                        dev, iptr->next);
+                block_put((char *)iptr, false);
                 return INODE_NULL;
             }
-            strncpy(link_path, link.path, MAX_PATH);
+            strncpy(link_path, lptr->path, MAX_PATH);
+            block_put((char *)lptr, false);
+            block_put((char *)iptr, false);
         }
         if(!krealpath(dev, current_dir, link_path, res_path, error)) {
             printk("kreadlink:: error resolving path dev=%d current_dir=%u link_path=%s error=%d\n", dev, current_dir, link_path, *error);
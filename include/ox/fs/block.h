@@ -31,19 +31,95 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 typedef unsigned long block_t;
 
-// The number of blocks stored.
+// The number of blocks stored when the cache is not sized at
+// boot by block_cache_init.
 //#define BLOCK_ARRAY_SIZE 4096 // RGD
+#ifndef BLOCK_ARRAY_SIZE
 #define BLOCK_ARRAY_SIZE 128 // RGD
+#endif
 #define BLOCK_FREE         -1
-#define BLOCK_MAX_LRU    (block_t)4294967295 // 2147483647
 #define BLOCK_NOPOS        -1
 
+// Replacement lists, every cache slot is on exactly one.
+// The hot lists are only used by BLOCK_POLICY_2Q.
+#define BLOCK_LIST_FREE      0
+#define BLOCK_LIST_CLEAN     1
+#define BLOCK_LIST_DIRTY     2
+#define BLOCK_LIST_HOT_CLEAN 3
+#define BLOCK_LIST_HOT_DIRTY 4
+#define BLOCK_NR_LISTS       5
+
+// Replacement policy, plain LRU or scan resistant 2Q.
+#define BLOCK_POLICY_LRU    0
+#define BLOCK_POLICY_2Q     1
+#ifndef BLOCK_POLICY
+#define BLOCK_POLICY        BLOCK_POLICY_2Q
+#endif
+
+// Sequential read-ahead, the window is in blocks including
+// the block requested and grows from BLOCK_RA_MIN to BLOCK_RA_MAX
+// while a device is read sequentially.
+#define BLOCK_RA_MIN        4
+#ifndef BLOCK_RA_MAX
+#define BLOCK_RA_MAX        32
+#endif
+// Number of devices tracked for read-ahead.
+#define BLOCK_RA_DEVS       8
+// Longest run of consecutive dirty blocks merged into
+// a single device write.
+#ifndef BLOCK_CLUSTER_MAX
+#define BLOCK_CLUSTER_MAX   BLOCK_RA_MAX
+#endif
+
+// Write-back defaults, see block_flush. The ratio is the percentage
+// of the cache allowed to be dirty and the age is in block_flush
+// passes, the flusher runs once a second.
+#define BLOCK_DIRTY_RATIO   10
+#define BLOCK_DIRTY_AGE     5
+// Most blocks written by a single block_flush pass.
+#define BLOCK_FLUSH_MAX     32
+// Device requests the cache may have in flight, see block_fill
+// and block_write_sorted.
+#define BLOCK_IO_MAX        8
+
 typedef enum block_rtvl {
    BLOCK_OK    = 0,
    BLOCK_FAIL  = -1,
    BLOCK_PARAM = -2
 } block_rtvl_t;
 
+// Number of devices statistics are kept for.
+#define BLOCK_STAT_DEVS     8
+
+// Buffer cache statistics for one device, see block_stat.
+typedef struct block_stat {
+   unsigned long hits;        // Requests found in the cache.
+   unsigned long misses;      // Requests not found in the cache.
+   unsigned long ra_blocks;   // Blocks brought in by read-ahead.
+   unsigned long ra_hits;     // First hits on blocks brought in by read-ahead.
+   unsigned long evict_clean; // Clean blocks evicted.
+   unsigned long evict_dirty; // Dirty blocks written out to be evicted.
+   unsigned long sync_writes; // Blocks written by block_sync and block_flush.
+   unsigned long dev_reads;   // Read requests issued to the device.
+   unsigned long dev_writes;  // Write requests issued to the device.
+   unsigned long bytes_read;  // Bytes read from the device.
+   unsigned long bytes_written; // Bytes written to the device.
+} block_stat_t;
+
+//
+// block_cache_bytes:
+// Return the memory needed for a cache of 'nr' blocks.
+//
+unsigned long block_cache_bytes(block_t nr);
+
+//
+// block_cache_init:
+// Build the cache in the 'bytes' of memory at 'mem', holding
+// as many blocks as fit. Must be called before the first block_open,
+// otherwise a static cache of BLOCK_ARRAY_SIZE blocks is used.
+//
+block_rtvl_t block_cache_init(void *mem, unsigned long bytes);
+
 block_rtvl_t block_open(char *path, int *dev);
 
 block_rtvl_t block_close(int dev);
@@ -54,13 +130,75 @@ block_rtvl_t block_write(int dev, block_t block, char *data);
 
 block_rtvl_t block_free(int dev, block_t block);
 
+//
+// block_get:
+// Return a pointer to the cached copy of the block, reading it
+// in if needed, or NULL on failure. The buffer is pinned and will
+// not be evicted until it is released with block_put, so callers
+// can work on the cache directly instead of copying through
+// block_read/block_write.
+//
+char *block_get(int dev, block_t block);
+
+//
+// block_put:
+// Release a buffer obtained from block_get, if 'modified' is non zero
+// the buffer was modified and is marked for write back.
+//
+block_rtvl_t block_put(char *data, int modified);
+
+//
+// block_set_limit:
+// Set the last block on 'dev' that read-ahead may touch,
+// 0 means there is no limit.
+//
+block_rtvl_t block_set_limit(int dev, block_t limit);
+
 //
 // block_sync:
 // Go through entire cache, write every block to disk,
-// reset dirty bit to be clean.
+// reset dirty bit to be clean. Blocks are written in ascending
+// order with runs of consecutive blocks merged into one request.
 //
 block_rtvl_t block_sync(int dev);
 
+//
+// block_flush:
+// Trickle dirty blocks to disk, called periodically. Blocks dirty
+// for at least the max age are written and, while more of the cache
+// than the dirty ratio is dirty, the least recently used dirty blocks
+// as well. At most BLOCK_FLUSH_MAX blocks are written per call in
+// ascending (dev, block) order. The writes are queued without waiting
+// for them. Returns the number of blocks written or queued.
+//
+int block_flush(void);
+
+//
+// block_flush_tune:
+// Set the dirty ratio (0-100 percent) and max age used by block_flush.
+//
+block_rtvl_t block_flush_tune(int ratio, int age);
+
+//
+// block_set_policy:
+// Select BLOCK_POLICY_LRU or BLOCK_POLICY_2Q replacement,
+// cached blocks are kept.
+//
+block_rtvl_t block_set_policy(int policy);
+
+//
+// block_stat:
+// Copy the statistics gathered for 'dev' since it was
+// first used or since the last block_stat_reset.
+//
+block_rtvl_t block_stat(int dev, block_stat_t *st);
+
+//
+// block_stat_reset:
+// Zero the statistics for 'dev'.
+//
+block_rtvl_t block_stat_reset(int dev);
+
 //
 // block_disk_write:
 //
@@ -0,0 +1,73 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      dcache.h
+//
+// @description:
+//      Directory entry cache used by path resolution.
+//      Maps (dev, parent directory block, name) to the
+//      inode block of the name, or INODE_NULL when the
+//      name is known not to exist.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+// Number of names held, the least recently used is replaced.
+#define DCACHE_SIZE      256
+// Number of hash chains.
+#define DCACHE_HASH      127
+// Longest name held, longer names are always looked up on disk.
+#define DCACHE_NAME_LEN  32
+
+typedef enum dcache_rtvl {
+    DCACHE_HIT  = 0,
+    DCACHE_MISS = -1
+} dcache_rtvl_t;
+
+//
+// dcache_lookup:
+// Look up 'name' in directory 'parent'. On DCACHE_HIT *block is
+// the inode block of the name, INODE_NULL if it does not exist.
+//
+dcache_rtvl_t dcache_lookup(int dev, block_t parent, char *name, block_t *block);
+
+//
+// dcache_enter:
+// Record that 'name' in directory 'parent' is inode 'block',
+// INODE_NULL records that it does not exist.
+//
+void dcache_enter(int dev, block_t parent, char *name, block_t block);
+
+//
+// dcache_invalidate:
+// Forget the name of inode 'block' and every name looked up in it,
+// called when the inode is free'd or its contents replaced.
+//
+void dcache_invalidate(int dev, block_t block);
+
+//
+// dcache_purge:
+// Forget every name on 'dev'.
+//
+void dcache_purge(int dev);
+
+#endif // _DCACHE_H
@@ -32,19 +32,62 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define _DEV_H
 
 // Size of a disk sector in bytes.
+#define DEV_SECTOR_SIZE 512
+// Size of a file system block in bytes, 512 or 4096.
 // NOTE: There are new developments for 4096 byte sectors.
-// For now, we will keep this inline with traditional 512 byte
-// sectors inline with boot loader code.
+// By default we keep this inline with traditional 512 byte
+// sectors inline with boot loader code. Building with 4096
+// has each block moved as 8 consecutive sectors.
 // See: http://www.ibm.com/developerworks/linux/library/l-4kb-sector-disks/
+#ifndef DEV_BLOCK_SIZE
 #define DEV_BLOCK_SIZE 512
+#endif
+#if DEV_BLOCK_SIZE != 512 && DEV_BLOCK_SIZE != 4096
+#error "DEV_BLOCK_SIZE must be 512 or 4096"
+#endif
+#define DEV_SECTORS (DEV_BLOCK_SIZE / DEV_SECTOR_SIZE) // Sectors per block.
 #define DEV_NODEV -1
+// Most blocks moved by one dev_readv/dev_writev, the
+// ATA driver's limit of 256 sectors for a single command.
+#define DEV_IOV_MAX (256 / DEV_SECTORS)
+// Devices that can have a request queue at the same time.
+#define DEV_QUEUES  8
 
 typedef enum dev_rtvl {
+   DEV_BUSY    = 1, // Request queued or in flight.
    DEV_OK      = 0,
    DEV_FAIL    = -1,
    DEV_PARAM   = -2
 } dev_rtvl_t;
 
+// Request operations.
+#define DEV_REQ_READ  0
+#define DEV_REQ_WRITE 1
+
+struct dev_req;
+typedef void (*dev_done_t)(struct dev_req *req);
+
+//
+// dev_req_t:
+// A block I/O request. The caller owns the request and the
+// buffers until it completes, 'status' is DEV_BUSY until then.
+// 'done' is called on completion, in the kernel possibly from
+// the disk interrupt, and must not block.
+//
+typedef struct dev_req {
+   int op;          // DEV_REQ_READ or DEV_REQ_WRITE.
+   int dev;         // Device, as returned by dev_open.
+   block_t block;   // First block.
+   int count;       // Number of blocks, at most DEV_IOV_MAX.
+   char **data;     // Block i of the request is data[i].
+   dev_done_t done; // Completion callback or NULL.
+   void *arg;       // For the caller's use.
+   volatile dev_rtvl_t status; // DEV_BUSY, then DEV_OK or DEV_FAIL.
+   void *waiter;    // Process sleeping in dev_wait.
+   unsigned long seq; // Submission order, for overlapping requests.
+   struct dev_req *next; // Queue link.
+} dev_req_t;
+
 dev_rtvl_t dev_open(char *path, int *dev);
 
 dev_rtvl_t dev_close(int dev);
@@ -62,4 +105,61 @@ dev_rtvl_t dev_write(int dev, block_t block, char *data);
 
 dev_rtvl_t dev_scan(int dev, block_t block);
 
+//
+// dev_read_blocks:
+// Read 'count' consecutive blocks starting at 'block' into 'data'
+// which must hold count * DEV_BLOCK_SIZE bytes. Blocks past the end
+// of the device are returned zero filled.
+//
+dev_rtvl_t dev_read_blocks(int dev, block_t block, int count, char *data);
+
+//
+// dev_write_blocks:
+// Write 'count' consecutive blocks starting at 'block' from 'data'.
+//
+dev_rtvl_t dev_write_blocks(int dev, block_t block, int count, char *data);
+
+//
+// dev_readv:
+// Read 'count' (at most DEV_IOV_MAX) consecutive blocks starting at
+// 'block' in one device request, block i going to the buffer data[i].
+// Blocks past the end of the device are returned zero filled.
+//
+dev_rtvl_t dev_readv(int dev, block_t block, int count, char **data);
+
+//
+// dev_writev:
+// Write 'count' consecutive blocks starting at 'block', block i
+// coming from data[i], in one device request.
+//
+dev_rtvl_t dev_writev(int dev, block_t block, int count, char **data);
+
+//
+// dev_submit:
+// Queue 'req' on its device. Each device has a queue kept in block
+// order and served C-LOOK, ascending from the last block transferred
+// then wrapping to the lowest, with requests that continue each other
+// on disk issued as one transfer. Requests that overlap a write are
+// kept in submission order. Returns DEV_PARAM for a bad request,
+// otherwise the request's status, DEV_BUSY if it has not completed.
+//
+dev_rtvl_t dev_submit(dev_req_t *req);
+
+//
+// dev_wait:
+// Wait for 'req' to complete and return its status.
+//
+dev_rtvl_t dev_wait(dev_req_t *req);
+
+//
+// dev_plug:
+// dev_unplug:
+// While a device is plugged requests are queued but not issued,
+// so that a batch submitted together is sorted and merged before
+// any of it starts. dev_wait unplugs the device.
+//
+void dev_plug(int dev);
+
+void dev_unplug(int dev);
+
 #endif
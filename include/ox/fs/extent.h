@@ -0,0 +1,73 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      extent.h
+// 
+// @description:
+//      Extent tree mapping the blocks of a regular file.
+//      The root is held in the inode, see extent_t and
+//      extent_block_t in inode.h.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+// Bounds the walk from the inode down to a leaf, with
+// INODE_EXTENTS at the root this covers every block_t.
+#define EXTENT_MAX_DEPTH 8
+
+typedef enum extent_rtvl {
+    EXTENT_OK   = 0,
+    EXTENT_FAIL = -1
+} extent_rtvl_t;
+
+//
+// extent_map:
+// Find the disk block holding file block 'lblock' of 'inode'.
+// *block is INODE_NULL if 'lblock' is not mapped, otherwise *run
+// is the number of blocks mapped contiguously from *block on.
+//
+extent_rtvl_t extent_map(int dev, inode_t *inode, block_t lblock,
+                         block_t *block, block_t *run);
+
+//
+// extent_end:
+// Return in *lblock the first file block past the last one mapped.
+//
+extent_rtvl_t extent_end(int dev, inode_t *inode, block_t *lblock);
+
+//
+// extent_append:
+// Map disk block 'block' as file block 'lblock', which must be
+// the one returned by extent_end. It is merged into the last extent
+// when contiguous with it. Only the root in 'inode' is updated in
+// memory, the caller writes the inode back.
+//
+extent_rtvl_t extent_append(int dev, inode_t *inode, block_t lblock, block_t block);
+
+//
+// extent_free:
+// Release every data and extent block of 'inode', including its
+// preallocation window, and empty the root.
+//
+extent_rtvl_t extent_free(int dev, inode_t *inode);
+
+#endif // _EXTENT_H
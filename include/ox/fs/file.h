@@ -34,6 +34,22 @@ typedef enum file_rtvl {
     FILE_FAIL   = -1
 } file_rtvl_t;
 
+//
+// An open file. Descriptors returned by kopen, including those
+// copied by dup and fork, point to one of these, so the position
+// is shared between them and kept apart from other opens of the
+// same file. The inode is shared through the icache.
+//
+typedef struct file {
+    inode_t      *inode;          // In-core inode from icache_get.
+    inode_ptr_t   pos;            // Where in the file we are currently.
+    block_t       current;        // Current data block.
+    block_t       current_parent; // Block map to which current is stored in.
+    int           iblock;         // Where in the current_parent we are.
+    inode_perm_t  o_mode;         // File open mode.
+    int           count;          // Descriptors referring to it, 0 if free.
+} file_t;
+
 file_rtvl_t file_add_blocks(int dev, 
                             block_t *next,
                             block_t *current,
@@ -52,7 +68,7 @@ file_rtvl_t file_add_one_data_block(int dev,
                                block_map_t *bmap, 
                                block_t iblock);
 
-file_rtvl_t file_read_write(inode_t *inode, 
+file_rtvl_t file_read_write(file_t *file, 
                      inode_ptr_t pos, 
                      inode_ptr_t length, 
                      char *data, 
@@ -71,6 +87,7 @@ int kdup(int fd);
 int kdup2(int fd, int newfd);
 int kstat(const char *path, struct stat *buf);
 int kfstat(int fd, struct stat *buf);
+int kioctl(int fd, int request, void *arg);
 int klstat(const char *path, struct stat *buf);
 void ksync(void);
 int kchmod(const char *path, mode_t mode);
@@ -0,0 +1,111 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+//
+// @file:
+//      icache.h
+//
+// @description:
+//      Kernel wide table of in-core inodes of open files.
+//      Every open of the same (dev, self) shares one inode_t,
+//      changes to it are written back on icache_sync or when
+//      the last reference is released.
+//
+// @author:
+//      Dr. Roger G. Doss, PhD
+//
+#ifndef _ICACHE_H
+#define _ICACHE_H
+
+// Number of inodes held, one per file open in the system however
+// many descriptors refer to it. Each holds a whole inode block.
+#ifndef ICACHE_SIZE
+#define ICACHE_SIZE  64
+#endif
+// Number of hash chains.
+#define ICACHE_HASH  127
+
+typedef enum icache_rtvl {
+    ICACHE_OK   = 0,
+    ICACHE_FAIL = -1
+} icache_rtvl_t;
+
+//
+// icache_get:
+// Return the in-core inode for 'self' on 'dev', reading it in if
+// it is not held, or NULL if the table is full. Each call takes a
+// reference released by icache_put.
+//
+inode_t *icache_get(int dev, block_t self);
+
+//
+// icache_put:
+// Release a reference taken by icache_get. With the last one the
+// preallocation window is returned to the free pool and the inode
+// is written back, or if it was unlinked meanwhile the data of
+// the file is released.
+//
+void icache_put(inode_t *inode);
+
+//
+// icache_dirty:
+// Record that 'inode' was modified. Inodes not obtained from
+// icache_get are left for the caller to write.
+//
+void icache_dirty(inode_t *inode);
+
+//
+// icache_refresh:
+// Read 'inode' again if it was written by path since it was
+// last used, called before using it through an open file.
+//
+void icache_refresh(inode_t *inode);
+
+//
+// icache_flush:
+// Write back inode 'self' if it is held and modified, and have it
+// read again before its next use. Called when the inode is about
+// to be read, and maybe written, by path.
+//
+icache_rtvl_t icache_flush(int dev, block_t self);
+
+//
+// icache_unlink:
+// Called by inode_free once 'inode' is removed from its directory.
+// An open copy takes its contents, is no longer found by its block,
+// which may be given to a new inode, and is never written back.
+// Returns true if the inode is held, the data of a file is then
+// left for icache_put to release.
+//
+bool icache_unlink(int dev, inode_t *inode);
+
+//
+// icache_rename:
+// Called by inode_free once 'newnode' took over the contents of
+// inode 'self' for rename. An open copy becomes 'newnode' and is
+// written back to its block from then on.
+//
+void icache_rename(int dev, block_t self, inode_t *newnode);
+
+//
+// icache_sync:
+// Write back every modified inode on 'dev', called before
+// the block cache is sync'd.
+//
+icache_rtvl_t icache_sync(int dev);
+
+#endif // _ICACHE_H
@@ -32,6 +32,14 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define FS_INIT_OK      0
 #define FS_INIT_FAIL    1
 
+/*
+ * By default the buffer cache takes 1/FS_CACHE_FRACTION
+ * of the free kernel memory, the "bcache=<KiB>" boot
+ * parameter overrides this.
+ */
+#define FS_CACHE_FRACTION   16
+#define FS_CACHE_PARAM      "bcache="
+
 /*
  * fs_reset:
  *
@@ -51,4 +59,31 @@ void fs_reset();
  */
 int fs_init(unsigned long requested_size);
 
+/*
+ * fs_parse_param:
+ *
+ * Handle a boot parameter meant for the file system,
+ * must be called before fs_init.
+ * Returns 1 if the parameter was consumed
+ *         0 otherwise
+ *
+ */
+int fs_parse_param(char *param);
+
+/*
+ * fs_lock, fs_trylock, fs_unlock:
+ *
+ * The file system lock, held by the system calls
+ * across each call into the file system. Disk I/O
+ * sleeps until the transfer completes and the
+ * buffer cache, inode and file layers may not be
+ * entered by another process meanwhile.
+ * fs_trylock returns 1 if the lock was taken
+ *                    0 otherwise
+ *
+ */
+void fs_lock();
+int  fs_trylock();
+void fs_unlock();
+
 #endif
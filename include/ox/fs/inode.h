@@ -36,31 +36,66 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define INODE_ROOT_BLOCK   master->inode_start
 #define INODE_NULL         0
 #define INODE_BLOCKS       54   // These were hard code to 4096 sector, its 512.
-#define INODE_PAD          166  // 54*4-2 (for is_symlink,is_hardlink fields)
-#define BMAP_BLOCKS        127  // INODE_BLOCKS is the size of array of blocks in inode
-#define MNODE_PAD          436  // BMAP_BLOCKS is size of array of blocks:
-                                // calculated as: ((DEV_BLOCK_SIZE/sizeof(block_t))-1)
+
+// The master inode, inodes, block maps and links each fill one
+// DEV_BLOCK_SIZE block. Their padding and BMAP_BLOCKS are derived
+// from the block size below, so building with a DEV_BLOCK_SIZE of
+// 4096 lays the file system out in 4096 byte blocks.
+#define BMAP_BLOCKS        ((DEV_BLOCK_SIZE / sizeof(block_t)) - 1)
+
+// Directory formats, recorded in the master inode. A linear directory
+// fills its block maps in order. In a hashed one an entry is placed by
+// probing each block map from the slot its name hashes to, a removed
+// entry is left as INODE_DIR_DELETED so probes go on past it. Both
+// hold only inode blocks, the name is in the child inode. An entries
+// directory is a chain of dir_block_t holding the names themselves.
+#define INODE_DIR_LINEAR   0
+#define INODE_DIR_HASHED   1
+#define INODE_DIR_ENTRIES  2
+#define INODE_DIR_DELETED  ((block_t)~0)
+// Format given to directories by inode_mkfs, all three are read
+// and written. Build with -DINODE_DIR_FORMAT=INODE_DIR_HASHED or
+// INODE_DIR_LINEAR to make file systems in one of the others.
+#ifndef INODE_DIR_FORMAT
+#define INODE_DIR_FORMAT   INODE_DIR_ENTRIES
+#endif
+#if INODE_DIR_FORMAT != INODE_DIR_LINEAR && \
+    INODE_DIR_FORMAT != INODE_DIR_HASHED && \
+    INODE_DIR_FORMAT != INODE_DIR_ENTRIES
+#error "INODE_DIR_FORMAT must be INODE_DIR_LINEAR, INODE_DIR_HASHED or INODE_DIR_ENTRIES"
+#endif
+// A hashed block map with this many slots used, live or deleted,
+// takes no new entries in free slots, they go to the next one.
+// Keeps the probes short.
+#define INODE_DIR_FILL     ((BMAP_BLOCKS * 3) / 4)
 
 #define INODE_MAGIC       1925 // Identifies our file system on disk.
 #define INODE_NR_PASS        2
 #define INODE_NOPOS         -1
 #define INODE_NR_DEV        16 // Max number of devices we currently support.
 
-#define BLOCK_START 4096
-#define TWOMEG      2097152
+// Data blocks tracked by each block of the free block bitmap. Only
+// the first DEV_BLOCK_SIZE bits of a bitmap block are used, which
+// is how existing file systems were laid out.
+#define INODE_MAP_BITS     DEV_BLOCK_SIZE
+// Bitmap blocks per map whose free count is kept in memory, blocks
+// past this are read to find out if they are full.
+#define INODE_MAP_COUNTS   1024
+
+// The file system starts 2MB into the disk, leaving room for the
+// boot loader. That is block 4096 with 512 byte blocks.
+#define TWOMEG             2097152
+#define BLOCK_START        (TWOMEG / DEV_BLOCK_SIZE)
+#define BLOCK_START_SECTOR (TWOMEG / DEV_SECTOR_SIZE)
 
 // RGDTODO
 // This should be 64 bit, we will look at the code
 // in file.c and dir.c to see if we can implement it.
 // Otherwise, the maximum file size is 4GB even though
 // the max file system size is 2TB. For file systems
-// larger than that, we are hopingwe could address them
-// with a 4096 DEV_BLOCK_SIZE which would give us 16TB.
-// It really makes no sense to me to have a 512 byte sector
-// for a multi-terabyte drive. We could implement it by
-// addressing 8 512 byte blocks in succession in the dev.c
-// code but ideally we want support in the BIOS and disk drive.
-// This is something to be done later.
+// larger than that, build with a 4096 DEV_BLOCK_SIZE
+// which gives us 16TB; dev.c then moves 8 sectors
+// per block.
 typedef unsigned long long int inode_ptr_t;
 typedef unsigned int inode_group_t; // Group.
 typedef unsigned int inode_own_t;   // Owner.
@@ -82,85 +117,128 @@ typedef enum inode_mode {
     INODE_DONTCHECKPERMS    = 12  // Don't check permissions
 } inode_mode_t;
 
-// NOTE: This scheme allows us to address 512 bytes per sector times 4Gig sectors
-//       or 2048 gigs (2 Terabytes). This should be sufficient for a first
-//       version file system. A mere 4096 512 sectors is 2 meg.
-//       In the future, I would like to see a 4096 or 8192 sector.
+// NOTE: This scheme allows us to address DEV_BLOCK_SIZE bytes per block
+//       times 4Gig blocks, 2 Terabytes with 512 byte blocks and 16
+//       with 4096. A mere 4096 512 byte blocks is 2 meg.
+#define MNODE_FIELDS \
+   short magic;           /* Magic to identify the file system. */ \
+   short init_fs;         /* 1 if fs is initialized, 0 otherwise. */ \
+   block_t block_start;       /* location of master inode. */ \
+   block_t inode_map_start;   /* map of free inodes start. */ \
+   block_t inode_map_end;     /* map of free inodes end.   */ \
+   block_t bmap_map_start;    /* map of free blocks start. */ \
+   block_t bmap_map_end;      /* map of free blocks end.   */ \
+   block_t inode_start;       /* start of inodes.          */ \
+   block_t inode_end;         /* end of inodes.            */ \
+   block_t data_start;        /* start of data.            */ \
+   block_t data_end;          /* end of data.              */ \
+   block_t imap_ptr;          /* what inode map block on disk.  */ \
+   block_t imap_bit;          /* what inode map bit. */ \
+   block_t bmap_ptr;          /* what bit map block on disk.    */ \
+   block_t bmap_bit;          /* what bit map bit. */ \
+   block_t inodes;            /* number of inodes. */ \
+   block_t blocks;            /* number of blocks. */ \
+   char *imap;            /* Created on the fly and loaded. */ \
+   char *bmap;            /* Created on the fly and loaded. */ \
+   block_t dev;      /* Device we are on. */ \
+   block_t block_size; /* DEV_BLOCK_SIZE it was made with, 0 for 512. */ \
+   block_t dir_format; /* INODE_DIR_LINEAR (0), INODE_DIR_HASHED or INODE_DIR_ENTRIES. */
+
+struct master_inode_fields { MNODE_FIELDS };
+#define MNODE_PAD (DEV_BLOCK_SIZE - sizeof(struct master_inode_fields))
+
 typedef struct master_inode {
-   short magic;           /* Magic to identify the file system. */
-   short init_fs;         /* 1 if fs is initialized, 0 otherwise. */
-   block_t block_start;       /* location of master inode. */
-   block_t inode_map_start;   /* map of free inodes start. */
-   block_t inode_map_end;     /* map of free inodes end.   */
-   block_t bmap_map_start;    /* map of free blocks start. */
-   block_t bmap_map_end;      /* map of free blocks end.   */
-   block_t inode_start;       /* start of inodes.          */
-   block_t inode_end;         /* end of inodes.            */
-   block_t data_start;        /* start of data.            */
-   block_t data_end;          /* end of data.              */
-   block_t imap_ptr;          /* what inode map block on disk.  */
-   block_t imap_bit;          /* what inode map bit. */
-   block_t bmap_ptr;          /* what bit map block on disk.    */
-   block_t bmap_bit;          /* what bit map bit. */
-   block_t inodes;            /* number of inodes. */
-   block_t blocks;            /* number of blocks. */
-   char *imap;            /* Created on the fly and loaded. */
-   char *bmap;            /* Created on the fly and loaded. */
-   block_t dev;      /* Device we are on. */
-   char pad[MNODE_PAD];   /* padding to fit page size. */
+   MNODE_FIELDS
+   char pad[MNODE_PAD];   /* padding to fill the block. */
 } master_inode_t;
 
-typedef struct inode {
-   char user_read;
-   char user_write;
-   char user_execute;
-
-   char group_read;
-   char group_write;
-   char group_execute;
-
-   char world_read;
-   char world_write;
-   char world_execute;
-
-   char is_directory; /* If this is a directory, 
-                       * all blocks point to other inodes, including next. */
-   char is_device;    /* If this is a device, call device driver subsystem. */
-   char is_file;      /* If this is a file, all blocks point to data, including next. */
-   char is_symlink;   /* If this is a symlink.  */
-   char is_hardlink;  /* If this is a hardlink. */
-
-   block_t  create_time;   /* Time of last status change. */
-   block_t  modified_time; /* Time of last modification.  */
-   block_t  accessed_time; /* Time of last access.        */
-
-   block_t  self;
-   block_t  parent;
-
-   /* The following are used for implementing files:
-    * size      (sizeof file)
-    * pos       (position in the file)
-    * current   (current block number of block we are in)
-    * dev       (device we are on)
-    */ 
-   inode_ptr_t  size; /* Size of the file in 64 bits. */
-
-   inode_ptr_t  pos;  /* Where in the file we are currently. */
+// An extent maps 'length' file blocks starting at file block 'lblock'
+// onto the disk blocks starting at 'start'. In the index levels of
+// the tree length is 0 and start is the extent block holding the
+// entries from lblock on. Entries are kept sorted by lblock.
+typedef struct extent {
+   block_t lblock;
+   block_t start;
+   block_t length;
+} extent_t;
+
+#define INODE_EXTENTS      4  // Extents held in the inode itself.
+#define INODE_PREALLOC     16 // Blocks reserved at a time for a file.
+
+#define INODE_FIELDS \
+   char user_read; \
+   char user_write; \
+   char user_execute; \
+ \
+   char group_read; \
+   char group_write; \
+   char group_execute; \
+ \
+   char world_read; \
+   char world_write; \
+   char world_execute; \
+ \
+   char is_directory; /* If this is a directory, \
+                       * all blocks point to other inodes, including next. */ \
+   char is_device;    /* If this is a device, call device driver subsystem. */ \
+   char is_file;      /* If this is a file, all blocks point to data, including next. */ \
+   char is_symlink;   /* If this is a symlink.  */ \
+   char is_hardlink;  /* If this is a hardlink. */ \
+ \
+   block_t  create_time;   /* Time of last status change. */ \
+   block_t  modified_time; /* Time of last modification.  */ \
+   block_t  accessed_time; /* Time of last access.        */ \
+ \
+   block_t  self; \
+   block_t  parent; \
+ \
+   /* The following are used for implementing files: \
+    * size      (sizeof file) \
+    * pos       (position in the file) \
+    * current   (current block number of block we are in) \
+    * dev       (device we are on) \
+    */ \
+   inode_ptr_t  size; /* Size of the file in 64 bits. */ \
+ \
+   inode_ptr_t  pos;  /* Where in the file we are currently. */ \
+ \
+   /* NOTE - pos, current, current_parent, iblock and o_mode are \
+    * kept per open file in file_t, they remain here so the \
+    * layout on disk does not change. */ \
+   block_t      current; /* Current data block. */ \
+   block_t      current_parent; /* Block map to which current is stored in. */ \
+   int          iblock; /* Where in the current_parent we are. */ \
+   int              dev; /* Device we are on. */ \
+   inode_perm_t  o_mode; /* File open mode. */ \
+   /* The above fields are needed for implementing files. */ \
+ \
+   inode_group_t group; /* Group where we belong. */ \
+   inode_own_t   owner; /* Who owns this file. */ \
+ \
+   block_t refcount;    /* Reference count. */ \
+ \
+   char path[MAX_PATH]; \
+ \
+   /* Regular files created since extents were added map their \
+    * data with the extent tree rooted in ext, older files keep \
+    * the block_map_t chain at next. \
+    */ \
+   char     is_extent; /* Data is mapped by ext rather than next. */ \
+   char     ext_depth; /* Levels of extent blocks below ext. */ \
+   short    ext_count; /* Entries used in ext. */ \
+   extent_t ext[INODE_EXTENTS]; \
+ \
+   /* Data blocks reserved for the file but not yet mapped, \
+    * see inode_get_file_block. \
+    */ \
+   block_t  prealloc;       /* First block of the window. */ \
+   block_t  prealloc_count; /* Blocks left in the window. */
+
+struct inode_fields { INODE_FIELDS };
+#define INODE_PAD (DEV_BLOCK_SIZE - sizeof(struct inode_fields) - sizeof(block_t))
 
-   // NOTE - These fields must be initialized on open of the file.
-   block_t      current; /* Current data block. */
-   block_t      current_parent; /* Block map to which current is stored in. */
-   int          iblock; /* Where in the current_parent we are. */
-   int              dev; /* Device we are on. */
-   inode_perm_t  o_mode; /* File open mode. */
-   // The above fields are needed for implementing files.
-
-   inode_group_t group; /* Group where we belong. */
-   inode_own_t   owner; /* Who owns this file. */
-
-   block_t refcount;    /* Reference count. */
-
-   char path[MAX_PATH];
+typedef struct inode {
+   INODE_FIELDS
 
    /* block_t blocks[INODE_BLOCKS]; */
    char pad[INODE_PAD];
@@ -179,11 +257,57 @@ typedef struct block_map {
    block_t blocks[BMAP_BLOCKS];
 } block_map_t;
 
+// A directory block of the INODE_DIR_ENTRIES format. 'entries' is
+// packed with records, a dir_entry_t followed by the name and padded
+// to DIR_ENTRY_ALIGN. Their rec_len add up to DIR_BLOCK_BYTES, space
+// left after a name belongs to its record. A record whose block is
+// INODE_NULL is free. next is where it is in block_map_t.
+#define DIR_BLOCK_BYTES  (DEV_BLOCK_SIZE - sizeof(block_t))
+#define DIR_ENTRY_ALIGN  sizeof(block_t)
+#define DIR_NAME_MAX     255
+
+typedef struct dir_entry {
+   block_t        block;    // Inode of the entry or INODE_NULL.
+   unsigned short rec_len;  // Bytes from this record to the next.
+   unsigned short hash;     // Hash of the name, compared first.
+   unsigned char  name_len; // Bytes of name following, not terminated.
+   unsigned char  type;     // d_type readdir reports for the entry.
+} dir_entry_t;
+
+#define DIR_ENTRY_NAME(e)   ((char *)(e) + sizeof(dir_entry_t))
+#define DIR_ENTRY_SIZE(len) ((sizeof(dir_entry_t) + (len) + DIR_ENTRY_ALIGN - 1) & \
+                             ~(DIR_ENTRY_ALIGN - 1))
+
+typedef struct dir_block {
+   block_t next;
+   char    entries[DIR_BLOCK_BYTES];
+} dir_block_t;
+
+// An extent block, one node of the extent tree below the inode.
+// depth is 0 for a leaf holding extents of data blocks.
+#define EXTENT_BLOCK_ENTRIES ((DEV_BLOCK_SIZE / sizeof(extent_t)) - 1)
+
+typedef struct extent_block {
+   block_t  self;  // Where this block is on disk.
+   block_t  depth; // Levels of extent blocks below this one.
+   block_t  count; // Entries used in ext.
+   extent_t ext[EXTENT_BLOCK_ENTRIES];
+   char pad[DEV_BLOCK_SIZE % sizeof(extent_t)];
+} extent_block_t;
+
 typedef struct link {
   char path[MAX_PATH];
-  char pad[MAX_PATH];
+  char pad[DEV_BLOCK_SIZE - MAX_PATH];
 } link_t;
 
+// Each of the above must be exactly one block.
+typedef char inode_size_check[(sizeof(master_inode_t) == DEV_BLOCK_SIZE &&
+                               sizeof(inode_t) == DEV_BLOCK_SIZE &&
+                               sizeof(block_map_t) == DEV_BLOCK_SIZE &&
+                               sizeof(dir_block_t) == DEV_BLOCK_SIZE &&
+                               sizeof(extent_block_t) == DEV_BLOCK_SIZE &&
+                               sizeof(link_t) == DEV_BLOCK_SIZE) ? 1 : -1];
+
 typedef enum inode_rtvl {
    INODE_OK             = 0,
    INODE_FAIL           = -1,
@@ -219,9 +343,33 @@ inode_rtvl_t inode_free(int dev,block_t current_dir,char *path,inode_t *newnode)
 inode_rtvl_t inode_get_data_block(int dev, block_t *block);
 inode_rtvl_t inode_get_inode_block(int dev, block_t *block);
 
+// Reserve up to 'want' contiguous free data blocks, the first
+// free block at or after 'goal' and as many as follow it free.
+// INODE_NULL as the goal continues from the last allocation.
+// The first block is returned in *block and the number reserved
+// in *count, which is at least 1.
+inode_rtvl_t inode_alloc_blocks(int dev, block_t goal, block_t want,
+                                block_t *block, block_t *count);
+
+// Take the next block for 'inode' from its preallocation window,
+// refilling the window with up to INODE_PREALLOC blocks at 'goal'
+// when it is empty. inode_free_prealloc returns what is left of
+// the window, the caller writes the inode back in both cases.
+inode_rtvl_t inode_get_file_block(int dev, inode_t *inode, block_t goal, block_t *block);
+inode_rtvl_t inode_free_prealloc(int dev, inode_t *inode);
+
 inode_rtvl_t inode_free_data_block(int dev, block_t block);
 inode_rtvl_t inode_free_inode_block(int dev, block_t block);
 
+// Release the data blocks and block maps of file 'inode' with its
+// preallocation window. Done by inode_free, or by the last close
+// when the file was removed while open (see icache_put).
+inode_rtvl_t inode_free_data(int dev, inode_t *inode);
+
+// Record at byte 'pos' of directory block 'dblk' for walking its
+// entries, NULL if the record there is not consistent.
+dir_entry_t *inode_dir_entry(dir_block_t *dblk, block_t pos);
+
 // Utility methods for getting the block and parent block numbers
 // given a path and current_dir.
 block_t inode_get_block_number(int dev, block_t current_dir, char *path);
@@ -251,6 +399,9 @@ bool inode_check_permissions(inode_t *inode,
 inode_rtvl_t inode_set_parent_mod_time(int dev, block_t parent);
 inode_rtvl_t inode_set_timestamps(inode_t *inode);
 
+// Return the master inode of an open device, NULL if there is none.
+master_inode_t *master_get(int dev);
+
 // Given a path set the device.
 // Return -1 if failed to insert into table, otherwise
 // i indicating successful insert.
@@ -0,0 +1,92 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+/*********************************************************************
+ * Copyright (C) Roger George Doss. All Rights Reserved.
+ *********************************************************************
+ *
+ * 	<ox/lib/bitmap.h>
+ *
+ *		bitmaps of arbitrary length searched a 32 bit
+ *		word at a time, shared by the page allocator
+ *		and the file system block and inode maps.
+ *
+ *		Bit n is bit n % 8 of byte n / 8, the same
+ *		layout as bit_get/bit_set in the file system,
+ *		so existing maps on disk read unchanged.
+ *		A map is a whole number of 32 bit words.
+ *********************************************************************/
+#ifndef _OX_LIB_BITMAP_H
+#define _OX_LIB_BITMAP_H 1
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#define BITMAP_WORD_BITS 32
+#define BITMAP_NONE      (~0U) /* Returned when no bit is found. */
+
+/*
+ * bitmap_test:-
+ * return 1 if bit is set, 0 otherwise
+ */
+int bitmap_test(const void *map, unsigned bit);
+
+/*
+ * bitmap_set, bitmap_clear:-
+ * set or clear a single bit
+ */
+void bitmap_set(void *map, unsigned bit);
+void bitmap_clear(void *map, unsigned bit);
+
+/*
+ * bitmap_set_run, bitmap_clear_run:-
+ * set or clear n bits from start
+ */
+void bitmap_set_run(void *map, unsigned start, unsigned n);
+void bitmap_clear_run(void *map, unsigned start, unsigned n);
+
+/*
+ * bitmap_ffz:-
+ * first zero bit at or after start and before nbits,
+ * full words are skipped, BITMAP_NONE if there is none
+ */
+unsigned bitmap_ffz(const void *map, unsigned start, unsigned nbits);
+
+/*
+ * bitmap_ffs:-
+ * first set bit at or after start and before nbits,
+ * BITMAP_NONE if there is none
+ */
+unsigned bitmap_ffs(const void *map, unsigned start, unsigned nbits);
+
+/*
+ * bitmap_find_run:-
+ * first run of n zero bits at or after start and
+ * ending by nbits, BITMAP_NONE if there is none
+ */
+unsigned bitmap_find_run(const void *map, unsigned start, unsigned nbits, unsigned n);
+
+/*
+ * bitmap_count_zero:-
+ * number of zero bits before nbits
+ */
+unsigned bitmap_count_zero(const void *map, unsigned nbits);
+
+#ifdef __cplusplus
+ }
+#endif
+#endif /* _OX_LIB_BITMAP_H */
@@ -89,6 +89,7 @@ struct process {
 	long		p_cutime;
 	long		p_cstime;
 	long		p_start_time;
+	void	       *p_wchan;	// Wait channel in sleep_on.
    
 	unsigned short	p_used_math;
 
@@ -103,8 +104,7 @@ struct process {
     inode_perm_t    umask;
     inode_own_t     owner;
     inode_group_t   group;
-    inode_t file_tab[MAX_FILES];
-    inode_t *file_desc[MAX_FILES];
+    struct file *file_desc[MAX_FILES];
     DIR dir_tab[MAX_DIR];
 
     /* exec
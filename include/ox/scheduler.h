@@ -57,6 +57,8 @@ extern unsigned int which_queue;
 
 int scheduler_interrupt_handler(int irq);
 void schedule(void );
+int  sleep_on(void *chan, int tries);
+void wakeup(void *chan);
 
 #ifdef __cplusplus
  }
@@ -45,6 +45,25 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define TCIOCGPGRP _IOW('T',18, int)
 #define TCIOCSPGRP _IOW('T',19, int)
 
+/* buffer cache statistics for the device a file is on */
+struct bstat {
+	unsigned long bs_hits;         /* requests found in the cache */
+	unsigned long bs_misses;       /* requests not found in the cache */
+	unsigned long bs_ra_blocks;    /* blocks brought in by read-ahead */
+	unsigned long bs_ra_hits;      /* hits on read-ahead blocks */
+	unsigned long bs_evict_clean;  /* clean blocks evicted */
+	unsigned long bs_evict_dirty;  /* dirty blocks written to be evicted */
+	unsigned long bs_sync_writes;  /* blocks written back by sync/flush */
+	unsigned long bs_dev_reads;    /* device read requests */
+	unsigned long bs_dev_writes;   /* device write requests */
+	unsigned long bs_bytes_read;   /* bytes read from the device */
+	unsigned long bs_bytes_written;/* bytes written to the device */
+};
+
+/* ioctl's for the buffer cache */
+#define BIOCGSTAT  _IOR('B', 1, struct bstat)   /* get statistics */
+#define BIOCRSTAT  _IO ('B', 2)                 /* reset statistics */
+
 #ifdef __cplusplus
  }
 #endif
@@ -647,11 +647,8 @@ int kexecve(const char *filename, char *const argv[],
     }
     // Close all open files.
     for(i = 0; i < MAX_FILES; ++i) {
-        for(j = 0; j < MAX_FILES; ++j) {
-            if(current_process->file_desc[i] == 
-               &(current_process->file_tab[j])) {
-                kclose(i);
-            }
+        if(current_process->file_desc[i]) {
+            kclose(i);
         }
     }
     // Close all open directories.
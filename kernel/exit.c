@@ -28,6 +28,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  *********************************************************/
 #include <ox/fs.h>
 #include <ox/fs/fs_syscalls.h>
+#include <ox/fs/init.h>
 #include <ox/fs/compat.h>
 #include <sys/signal.h>
 #include <sys/unistd.h>
@@ -55,7 +56,7 @@ extern unsigned *GDT_MAP;
 
 void free_process(struct process *proc)
 {
-    int i = 0, j = 0;
+    int i = 0;
     struct process *tmp = current_process;
 
     if(!proc) {
@@ -76,14 +77,13 @@ void free_process(struct process *proc)
         }
         free((void *)proc->p_argv);
     }
-    // Close all open files.
+    // Close all open files, taking the file system lock
+    // as the caller before acting on behalf of proc.
+    fs_lock();
     current_process = proc;
     for(i = 0; i < MAX_FILES; ++i) {
-        for(j = 0; j < MAX_FILES; ++j) {
-            if(proc->file_desc[i] == 
-               &(proc->file_tab[j])) {
-                kclose(i);
-            }
+        if(proc->file_desc[i]) {
+            kclose(i);
         }
     }
     // Close all open directories.
@@ -93,6 +93,7 @@ void free_process(struct process *proc)
         }
     }
     current_process = tmp;
+    fs_unlock();
     // Now unlink proc from the queue.
     if(proc->p_priority < 0 || proc->p_priority >= Nr_PRIORITY) {
         printk("free_process:: priority = [%d]\n",proc->p_priority);
@@ -301,7 +301,7 @@ int kfork(struct cpu_ctx ctx)
     // Return from this syscall with the child pid.
     unsigned long msize = PAGE_SIZE + sizeof(struct process);
     struct process *proc = (struct process *)kmalloc(msize);
-    unsigned int i = 0, j = 0;
+    unsigned int i = 0;
     unsigned char priv = 0;
     if(current_process->p_euid != 0) {
         // A user process, this probably means
@@ -373,18 +373,12 @@ int kfork(struct cpu_ctx ctx)
     for(i = 0; i < MAX_DIR; ++i) {
         proc->dir_tab[i] = current_process->dir_tab[i];
     }
+    // The child shares the open files of the parent,
+    // including their position.
     for(i = 0; i < MAX_FILES; ++i) {
-        proc->file_tab[i] = current_process->file_tab[i];
-    }
-    // Find which file_desc entries match to what file_tab
-    // entry in current_process, and setup a reference
-    // to the same file in the child proc.
-    for(i = 0; i < MAX_FILES; ++i) {
-           for(j = 0; j < MAX_FILES; ++j) {
-                if(current_process->file_desc[j] == 
-                        &(current_process->file_tab[j])) {
-                    proc->file_desc[i] = &(proc->file_desc[j]);
-           }
+        proc->file_desc[i] = current_process->file_desc[i];
+        if(proc->file_desc[i]) {
+            proc->file_desc[i]->count++;
         }
     }
     proc->p_uid  = current_process->p_uid;
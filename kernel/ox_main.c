@@ -253,6 +253,13 @@ int ox_main (int argc, char **argv)
 
 #endif
 
+   // Boot parameters.
+   for(i = 0; i < argc; ++i) {
+       if(!fs_parse_param(argv[i])) {
+           printk("ox_main:: unknown parameter [%s]\n", argv[i]);
+       }
+   }
+
 #ifdef _TEST_DISK_SIZE
    printk("testing ata_disk_size\n");
    ide_enable();
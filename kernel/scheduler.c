@@ -308,6 +308,72 @@ int kpause()
     return 0;
 }// kpause
 
+/*
+ * sleep_on:
+ * Sleep on the wait channel 'chan' until wakeup(chan), normally
+ * called from an interrupt handler. The caller disables interrupts
+ * before testing the condition it waits for, so the wakeup can not
+ * be lost in between; they are disabled on return. Other processes
+ * run meanwhile, when the scheduler has nothing else to run the cpu
+ * idles with interrupts enabled until the next one. Returns 0 once
+ * woken, 1 if a signal ended the sleep or 'tries' idle periods went
+ * by without a wakeup (0 waits for ever), for callers that poll in
+ * case the interrupt was lost.
+ */
+int sleep_on(void *chan, int tries)
+{
+    struct process *proc = current_process;
+    int i = 0;
+
+    asm_disable_interrupt();
+    proc->p_wchan = chan;
+    proc->p_state = P_INTERRUPTIBLE;
+    for(;;) {
+        schedule();
+        if(proc->p_state != P_INTERRUPTIBLE || (tries && ++i > tries)) {
+            break;
+        }
+        // Back with nothing else to run, idle.
+        asm_enable_interrupt();
+        asm_hlt();
+        asm_disable_interrupt();
+        if(proc->p_state != P_INTERRUPTIBLE) {
+            break;
+        }
+    }
+    if(proc->p_wchan == chan) {
+        proc->p_wchan = NULL;
+        proc->p_state = P_RUNNING;
+        return 1;
+    }
+    return 0;
+}// sleep_on
+
+/*
+ * wakeup:
+ * Make every process sleeping on 'chan' runnable,
+ * called with interrupts disabled.
+ */
+void wakeup(void *chan)
+{
+    struct process *curr = NULL;
+    int i = 0;
+    for(i = 0; i < Nr_PRIORITY; ++i) {
+        curr = process_tab[i];
+        do {
+            if(curr) {
+                if(curr->p_wchan == chan) {
+                    curr->p_wchan = NULL;
+                    curr->p_state = P_RUNNING;
+                }
+                curr = curr->p_next;
+            } else {
+                break;
+            }
+        } while(curr != process_tab[i]);
+    }
+}// wakeup
+
 int knice(int value)
 {
     if((current_process->p_counter - value) > 0) {
@@ -26,6 +26,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  ********************************************************/
 #include <ox/fs.h>
 #include <ox/fs/fs_syscalls.h>
+#include <ox/fs/init.h>
 #include <sys/unistd.h>
 #include <ox/defs.h>
 #include <platform/protected_mode_defs.h>
@@ -112,18 +113,22 @@ int sys_startup(void)
 int sys_sync(void)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     ksync();
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_sync */
 
 char *sys_get_current_dir_name(void)
 {
     char *rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kget_current_dir_name();
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_get_current_dir_name */
 /*
@@ -26,6 +26,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  ********************************************************/
 #include <ox/fs.h>
 #include <ox/fs/fs_syscalls.h>
+#include <ox/fs/init.h>
 #include <sys/unistd.h>
 #include <platform/asm_core/io.h>
 #include <sys/types.h>
@@ -66,18 +67,22 @@ void *sys_sbrk(ptrdiff_t increment)
 int sys_chdir(const char *path)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kchdir(path);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_chdir */
 
 int sys_fchdir(int fd)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kfchdir(fd);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_fchdir */
 
@@ -88,18 +93,22 @@ int sys_chroot(const char *path)
 int sys_close(int fd)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kclose(fd);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_close */
 
 int sys_dup(int fd)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kdup(fd);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_dup */
 
@@ -129,9 +138,11 @@ int sys_raise(int sig)
 int sys_rmdir(const char *path)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = krmdir(path);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_rmdir */
 
@@ -228,9 +239,11 @@ int sys_uname(struct utsname *name)
 int sys_unlink(const char *path)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kunlink(path);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_unlink */
 
@@ -241,43 +254,53 @@ pid_t sys_wait(WAIT_STATUS wait_stat)
 char *sys_getwd(char *buf)
 {
     char *rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kgetwd(buf);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_getwd */
 
 DIR *sys_opendir(const char *path)
 {
     DIR *rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kopendir(path);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_opendir */
 
 int sys_closedir(DIR *dir)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kclosedir(dir);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_closedir */
 
 void sys_rewinddir(DIR *dir)
 {
+    fs_lock();
     asm_disable_interrupt();
     krewinddir(dir);
     asm_enable_interrupt();
+    fs_unlock();
 }/* sys_rewinddir */
 
 struct dirent *sys_readdir(DIR *dir)
 {
     struct dirent *rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kreaddir(dir);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_readdir */
 /*
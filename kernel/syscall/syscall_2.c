@@ -38,6 +38,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // parameters it has.
 #include <ox/fs.h>
 #include <ox/fs/fs_syscalls.h>
+#include <ox/fs/init.h>
 #include <sys/signal.h>
 #include <sys/unistd.h>
 #include <ox/defs.h>
@@ -58,54 +59,66 @@ int sys_access(const char *path,mode_t mode)
 int sys_chmod(const char *path,mode_t mode)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kchmod(path,mode);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_chmod */
 
 int sys_fchmod(int fd, mode_t mode)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kfchmod(fd,mode);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }
 
 int sys_creat(const char *path,mode_t mode)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kcreat(path,mode);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_creat */
 
 int sys_dup2(int fd1,int fd2)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kdup2(fd1,fd2);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_dup2 */
 
 int sys_fstat(int fd,struct stat *stbuf)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kfstat(fd,stbuf);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_fstat */
 
 char *sys_getcwd(char *buf,size_t size)
 {
     char *rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kgetcwd(buf,size);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_getcwd */
 
@@ -117,18 +130,22 @@ int sys_kill(pid_t pid,int sig)
 int sys_link(const char *oldpath,const char *newpath)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = klink(oldpath,newpath);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_link */
 
 int sys_mkdir(const char *path,mode_t mode)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kmkdir(path,mode);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_mkdir */
 
@@ -165,9 +182,11 @@ int sys_sigismember(const sigset_t *set, int signum)
 int sys_stat(const char *path,struct stat *stbuf)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kstat(path,stbuf);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_stat */
 
@@ -178,27 +197,33 @@ int sys_ustat(dev_t dev, struct ustat *ubuf)
 int sys_lstat(const char *path, struct stat *buf)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = klstat(path,buf);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_lstat */
 
 int sys_utime(const char *file, struct utimbuf *buf)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kutime(file,buf);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_utime */
 
 int sys_rename(const char *oldpath, const char *newpath)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = krename(oldpath,newpath);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_utime */
 
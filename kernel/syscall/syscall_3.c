@@ -26,6 +26,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  ********************************************************/
 #include <ox/fs.h>
 #include <ox/fs/fs_syscalls.h>
+#include <ox/fs/init.h>
 #include <sys/unistd.h>
 #include <platform/asm_core/io.h>
 #include <ox/defs.h>
@@ -33,6 +34,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <platform/segment.h>
 #include <platform/tss.h>
 #include <ox/exit.h>
+#include <stdarg.h>
 
 int sys_fcntl(int fd,int request, ...)
 {
@@ -40,6 +42,16 @@ int sys_fcntl(int fd,int request, ...)
 
 int sys_ioctl(int fd, int request, ...)
 {
+    int rtvl = 0;
+    va_list args;
+    va_start(args, request);
+    fs_lock();
+    asm_disable_interrupt();
+    rtvl = kioctl(fd, request, va_arg(args, void *));
+    asm_enable_interrupt();
+    fs_unlock();
+    va_end(args);
+    return rtvl;
 }/* sys_ioctl */
 
 int sys_open(const char *path, int flag, int mode)
@@ -49,6 +61,7 @@ int sys_open(const char *path, int flag, int mode)
     // we here should check if mode == 0, if it is,
     // call kopen, otherwise, call kopen2.
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     if(mode == 0) {
         rtvl = kopen(path, flag);
@@ -56,6 +69,7 @@ int sys_open(const char *path, int flag, int mode)
         rtvl = kopen2(path, flag, mode);
     }
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_open */
 
@@ -78,9 +92,11 @@ int sys_execve(const char *path,const char **argv,const char **envp)
 off_t sys_lseek(int fd,off_t offset,int whence)
 {
     int rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = klseek(fd,offset,whence);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_lseek */
 
@@ -95,9 +111,11 @@ int sys_mount(const char *specialfile,const char *dir,int rwflag)
 ssize_t sys_read(int fd,void *buf,size_t count)
 {
     ssize_t rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kread(fd,buf,count);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_read */
 
@@ -121,9 +139,11 @@ pid_t sys_waitpid(pid_t pid,WAIT_STATUS wait_stat,int options)
 ssize_t sys_write(int fd,void *buf,size_t count)
 {
     ssize_t rtvl = 0;
+    fs_lock();
     asm_disable_interrupt();
     rtvl = kwrite(fd,buf,count);
     asm_enable_interrupt();
+    fs_unlock();
     return rtvl;
 }/* sys_write */
 
@@ -37,6 +37,6 @@ int ioctl(int fd, int request, ...)
 	va_list arg;
 	va_start(arg,request);
 	param = (unsigned)va_arg(arg,unsigned);
-	_ioctl(fd,request,param);
 	va_end(arg);
+	return _ioctl(fd,request,param);
 }
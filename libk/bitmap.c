@@ -0,0 +1,192 @@
+/*
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+/*********************************************************************
+ * Copyright (C) Roger George Doss. All Rights Reserved.
+ *********************************************************************
+ * @module
+ * 	bitmap.c
+ *
+ *	Bitmap search and update a 32 bit word at a time.
+ *	Words that are all ones (or all zeros when looking
+ *	for a set bit) are skipped with one compare and the
+ *	bit within a word is found with bsf.
+ *
+ *********************************************************************/
+#include <ox/lib/bitmap.h>
+
+#define WORD(bit) ((bit) / BITMAP_WORD_BITS)
+#define BIT(bit)  ((bit) % BITMAP_WORD_BITS)
+
+/*
+ * bitmap_bsf:-
+ * index of the lowest set bit of x, x is not 0
+ */
+static inline unsigned bitmap_bsf(unsigned x)
+{
+	unsigned r;
+	__asm__ ("bsfl %1, %0" : "=r" (r) : "rm" (x));
+	return r;
+}
+
+int bitmap_test(const void *map, unsigned bit)
+{
+	return (((const unsigned *)map)[WORD(bit)] >> BIT(bit)) & 1;
+}
+
+void bitmap_set(void *map, unsigned bit)
+{
+	((unsigned *)map)[WORD(bit)] |= (1U << BIT(bit));
+}
+
+void bitmap_clear(void *map, unsigned bit)
+{
+	((unsigned *)map)[WORD(bit)] &= ~(1U << BIT(bit));
+}
+
+/*
+ * bitmap_mask:-
+ * mask of the bits of the word holding start that are in
+ * [start, start + *n), *n is reduced by the bits covered
+ */
+static inline unsigned bitmap_mask(unsigned start, unsigned *n)
+{
+	unsigned b = BIT(start);
+	unsigned m = ~0U << b;
+	if(*n < BITMAP_WORD_BITS - b) {
+		m &= ~(~0U << (b + *n));
+		*n = 0;
+	} else {
+		*n -= BITMAP_WORD_BITS - b;
+	}
+	return m;
+}
+
+void bitmap_set_run(void *map, unsigned start, unsigned n)
+{
+	unsigned *w = (unsigned *)map + WORD(start);
+	while(n) {
+		*w++ |= bitmap_mask(start, &n);
+		start = 0;
+	}
+}
+
+void bitmap_clear_run(void *map, unsigned start, unsigned n)
+{
+	unsigned *w = (unsigned *)map + WORD(start);
+	while(n) {
+		*w++ &= ~bitmap_mask(start, &n);
+		start = 0;
+	}
+}
+
+/*
+ * bitmap_find:-
+ * first bit equal to 'set' in [start, nbits), the words
+ * are inverted when looking for a zero so both cases
+ * look for a one
+ */
+static unsigned bitmap_find(const void *map, unsigned start, unsigned nbits, unsigned invert)
+{
+	const unsigned *w = (const unsigned *)map;
+	unsigned i = WORD(start), x;
+	if(start >= nbits) {
+		return BITMAP_NONE;
+	}
+	x = (w[i] ^ invert) & (~0U << BIT(start));
+	while(!x) {
+		if(++i >= WORD(nbits - 1) + 1) {
+			return BITMAP_NONE;
+		}
+		x = w[i] ^ invert;
+	}
+	start = i * BITMAP_WORD_BITS + bitmap_bsf(x);
+	return (start < nbits) ? start : BITMAP_NONE;
+}
+
+unsigned bitmap_ffz(const void *map, unsigned start, unsigned nbits)
+{
+	return bitmap_find(map, start, nbits, ~0U);
+}
+
+unsigned bitmap_ffs(const void *map, unsigned start, unsigned nbits)
+{
+	return bitmap_find(map, start, nbits, 0);
+}
+
+unsigned bitmap_find_run(const void *map, unsigned start, unsigned nbits, unsigned n)
+{
+	unsigned end;
+	while((start = bitmap_ffz(map, start, nbits)) != BITMAP_NONE) {
+		if(n > nbits - start) {
+			return BITMAP_NONE;
+		}
+		/* A set bit inside the run restarts the search past it. */
+		if((end = bitmap_ffs(map, start, start + n)) == BITMAP_NONE) {
+			return start;
+		}
+		start = end;
+	}
+	return BITMAP_NONE;
+}
+
+unsigned bitmap_count_zero(const void *map, unsigned nbits)
+{
+	const unsigned *w = (const unsigned *)map;
+	unsigned i, x, n = nbits, count = 0;
+	for(i = 0; n; i++) {
+		x = ~w[i] & bitmap_mask(0, &n);
+		/* Population count without a library call. */
+		x = x - ((x >> 1) & 0x55555555);
+		x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+		x = (x + (x >> 4)) & 0x0f0f0f0f;
+		count += (x * 0x01010101) >> 24;
+	}
+	return count;
+}
+
+#ifdef _TEST_BITMAP
+#include <stdio.h>
+int
+main(int argc, char **argv)
+{
+	unsigned map[8] = {0};
+	int errors = 0;
+
+	bitmap_set_run(map, 0, 40);
+	bitmap_set(map, 45);
+	if(bitmap_ffz(map, 0, 256) != 40) errors++;
+	if(bitmap_ffz(map, 45, 256) != 46) errors++;
+	if(bitmap_ffs(map, 41, 256) != 45) errors++;
+	if(bitmap_find_run(map, 0, 256, 5) != 40) errors++;
+	if(bitmap_find_run(map, 0, 256, 6) != 46) errors++;
+	if(bitmap_find_run(map, 0, 50, 6) != BITMAP_NONE) errors++;
+	if(bitmap_count_zero(map, 256) != 256 - 41) errors++;
+	bitmap_clear_run(map, 3, 30);
+	if(bitmap_count_zero(map, 64) != 64 - 11) errors++;
+	if(bitmap_test(map, 2) != 1 || bitmap_test(map, 3) != 0) errors++;
+	bitmap_set_run(map, 64, 192);
+	if(bitmap_ffz(map, 64, 256) != BITMAP_NONE) errors++;
+	if(bitmap_ffz(map, 64, 255) != BITMAP_NONE) errors++;
+	printf("bitmap %s errors=%d\n", errors ? "failed" : "passed", errors);
+	return errors;
+}
+#endif
+
+/*
+ * EOF
+ */ 
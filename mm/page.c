@@ -87,6 +87,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <asm_core/io.h>
 #include <platform/asm_core/util.h>
 #endif
+#include <ox/lib/bitmap.h>
 
 #ifndef __cplusplus
 typedef int bool;
@@ -501,53 +502,28 @@ void mem_unset_read_only(void *addr, unsigned nr_pages)
     asm_enable_interrupt();
 }
 
+// The mem_maps are contiguous, so together they are a single
+// bitmap of NR_PAGES bits.
 void mem_set_bit(unsigned page)
 {
-    register unsigned block = page / PAGE_BITS;
-    register unsigned byte  = page % PAGE_BITS / BITS_PER_BYTE;
-    register unsigned bit   = page % PAGE_BITS % BITS_PER_BYTE;
-    register mem_map_t *mem = &mem_map[block];
-#ifdef _DEBUG_MEM
-    printf("block=%d\tbyte=%d\tbit=%d\t\n",block,byte,bit);
-#endif
-    mem->page[byte] |= (1 << bit);
-#ifdef _DEBUG_MEM
-    printf("mem->page[byte]=%d\n",mem->page[byte]);
-#endif
+    bitmap_set(mem_map, page);
 }
 
 void mem_clear_bit(unsigned page)
 {
-    register unsigned block = page / PAGE_BITS;
-    register unsigned byte  = page % PAGE_BITS / BITS_PER_BYTE;
-    register unsigned bit   = page % PAGE_BITS % BITS_PER_BYTE;
-    register mem_map_t *mem = &mem_map[block];
-#ifdef _DEBUG_MEM
-    printf("block=%d\tbyte=%d\tbit=%d\t\n",block,byte,bit);
-#endif
-    mem->page[byte] &= ~(1 << bit);
+    bitmap_clear(mem_map, page);
 }
 
 unsigned mem_test_bit(unsigned page)
 {
-    register unsigned block = page / PAGE_BITS;
-    register unsigned byte  = page % PAGE_BITS / BITS_PER_BYTE;
-    register unsigned bit   = page % PAGE_BITS % BITS_PER_BYTE;
-    register mem_map_t *mem = &mem_map[block];
-#ifdef _DEBUG_MEM
-    printf("block=%d\tbyte=%d\tbit=%d\t\n",block,byte,bit);
-    printf("(mem->page[byte] & (1 << bit) >> bit)=%d\n",((mem->page[byte] & (1 << bit)) >> bit));
-#endif
-    return ((mem->page[byte] & (1 << bit)) >> bit);
+    return bitmap_test(mem_map, page);
 }
 
 void *page_alloc(unsigned nr_pages)
 {
-    // Use two loops, scan for a region as big as nr_pages.
-    // Return as START_MEM + (page_start * PAGE_SIZE)
-    // Less what we have for a header indicating the size.
-    register unsigned page = ULAST_PAGE;
-    register unsigned run  = 0;
+    // Scan for a region as big as nr_pages, a word of the
+    // bitmap at a time. Return as page_start * PAGE_SIZE.
+    register unsigned page = 0;
 
     if((ALLOC_PAGES * PAGE_SIZE) >= UBYTES_FREE) {
         return (void *)0;
@@ -557,62 +533,23 @@ void *page_alloc(unsigned nr_pages)
     if(ULAST_PAGE == 0) {
         ULAST_PAGE = START_UMEM / PAGE_SIZE;
     }
-    // Scan from last page allocated/free'd.
-    for(page = ULAST_PAGE; page < NR_PAGES; ++page) {
-        if(mem_test_bit(page) == false) {
-            // Found a possible run.
-            for(run = 0; run < nr_pages; ++run) {
-                if(mem_test_bit(page + run) == true) {
-                    break;
-                }
-            }
-            if(run == nr_pages) {
-                // Found a run.
-                for(run = 0; run < nr_pages; ++run) {
-                    mem_set_bit(page + run);
-                }
-                // Next scan is past what we allocated.
-                ULAST_PAGE = page + run + 1;
-                // printk("ULAST_PAGE [%d]\n",ULAST_PAGE); // RGDDEBUG
-                ALLOC_PAGES += nr_pages;
-                asm_enable_interrupt();
-                return (void *)(page * PAGE_SIZE);
-            } else {
-                // Skip past the ones we know don't fit.
-                page += run;
-            }
-        }
+    // Scan from last page allocated/free'd, then from the start
+    // of the region if there was no run past it.
+    page = bitmap_find_run(mem_map, ULAST_PAGE, NR_PAGES, nr_pages);
+    if(page == BITMAP_NONE) {
+        page = bitmap_find_run(mem_map, START_UMEM / PAGE_SIZE, NR_PAGES, nr_pages);
     }
-    // Didn't find any sufficient runs, scan from 0 to
-    // ULAST_PAGE.
-    for(page = START_UMEM / PAGE_SIZE; page < ULAST_PAGE; ++page) {
-        if(mem_test_bit(page) == false) {
-            // Found a possible run.
-            for(run = 0; run < nr_pages; ++run) {
-                if(mem_test_bit(page + run) == true) {
-                    break;
-                }
-            }
-            if(run == nr_pages) {
-                // Found a run.
-                for(run = 0; run < nr_pages; ++run) {
-                    mem_set_bit(page + run);
-                }
-                // Next scan is past what we allocated.
-                ULAST_PAGE = page + run + 1;
-                ALLOC_PAGES += nr_pages;
-                asm_enable_interrupt();
-                // printk("ULAST_PAGE [%d]\n",ULAST_PAGE); // RGDDEBUG
-                return (void *)(page * PAGE_SIZE);
-            } else {
-                // Skip past the ones we know don't fit.
-                page += run;
-            }
-        }
+    if(page == BITMAP_NONE) {
+        // Not enough memory.
+        asm_enable_interrupt();
+        return (void *)0;
     }
-    // Not enough memory.
+    bitmap_set_run(mem_map, page, nr_pages);
+    // Next scan is past what we allocated.
+    ULAST_PAGE = page + nr_pages + 1;
+    ALLOC_PAGES += nr_pages;
     asm_enable_interrupt();
-    return (void *)0;
+    return (void *)(page * PAGE_SIZE);
 }
 
 void page_free(void *addr, unsigned nr_pages)
@@ -623,14 +560,11 @@ void page_free(void *addr, unsigned nr_pages)
     // *Note* we should store the number of pages requested in malloc.c
     // as its easier to manage there instead of here so review that code.
     register unsigned page = ((unsigned)(char *)addr / PAGE_SIZE);
-    register unsigned run  = 0;
     if(page < NR_KPAGES || page > NR_PAGES) {
         panic("page_free:: free'ing invalid page [%d] NR_KPAGES [%d] NR_PAGES [%d]\n",page,NR_KPAGES,NR_PAGES);
     }
     asm_disable_interrupt();
-    for(run = 0; run < nr_pages; ++run) {
-        mem_clear_bit(page + run);
-    }
+    bitmap_clear_run(mem_map, page, nr_pages);
     ULAST_PAGE = page;
     ALLOC_PAGES -= nr_pages;
     if(ALLOC_PAGES < 0) {
@@ -642,11 +576,9 @@ void page_free(void *addr, unsigned nr_pages)
 
 void *kpage_alloc(unsigned nr_pages)
 {
-    // Use two loops, scan for a region as big as nr_pages.
-    // Return as START_MEM + (page_start * PAGE_SIZE)
-    // Less what we have for a header indicating the size.
-    register unsigned page = ULAST_PAGE;
-    register unsigned run  = 0;
+    // Scan for a region as big as nr_pages, a word of the
+    // bitmap at a time. Return as page_start * PAGE_SIZE.
+    register unsigned page = 0;
 
     if((KALLOC_PAGES * PAGE_SIZE) >= KBYTES_FREE) {
         return (void *)0;
@@ -656,62 +588,23 @@ void *kpage_alloc(unsigned nr_pages)
     if(KLAST_PAGE == 0) {
         KLAST_PAGE = START_KMEM / PAGE_SIZE;
     }
-    // Scan from last page allocated/free'd.
-    for(page = KLAST_PAGE; page < NR_KPAGES; ++page) {
-        if(mem_test_bit(page) == false) {
-            // Found a possible run.
-            for(run = 0; run < nr_pages; ++run) {
-                if(mem_test_bit(page + run) == true) {
-                    break;
-                }
-            }
-            if(run == nr_pages) {
-                // Found a run.
-                for(run = 0; run < nr_pages; ++run) {
-                    mem_set_bit(page + run);
-                }
-                // Next scan is past what we allocated.
-                KLAST_PAGE = page + run + 1;
-                // printk("KLAST_PAGE [%d]\n",KLAST_PAGE); // RGDDEBUG
-                KALLOC_PAGES += nr_pages;
-                asm_enable_interrupt();
-                return (void *)(page * PAGE_SIZE);
-            } else {
-                // Skip past the ones we know don't fit.
-                page += run;
-            }
-        }
+    // Scan from last page allocated/free'd, then from the start
+    // of the region if there was no run past it.
+    page = bitmap_find_run(mem_map, KLAST_PAGE, NR_KPAGES, nr_pages);
+    if(page == BITMAP_NONE) {
+        page = bitmap_find_run(mem_map, START_KMEM / PAGE_SIZE, NR_KPAGES, nr_pages);
     }
-    // Didn't find any sufficient runs, scan from 0 to
-    // KLAST_PAGE.
-    for(page = START_KMEM / PAGE_SIZE; page < KLAST_PAGE; ++page) {
-        if(mem_test_bit(page) == false) {
-            // Found a possible run.
-            for(run = 0; run < nr_pages; ++run) {
-                if(mem_test_bit(page + run) == true) {
-                    break;
-                }
-            }
-            if(run == nr_pages) {
-                // Found a run.
-                for(run = 0; run < nr_pages; ++run) {
-                    mem_set_bit(page + run);
-                }
-                // Next scan is past what we allocated.
-                KLAST_PAGE = page + run + 1;
-                // printk("KLAST_PAGE [%d]\n",KLAST_PAGE); // RGDDEBUG
-                KALLOC_PAGES += nr_pages;
-                asm_enable_interrupt();
-                return (void *)(page * PAGE_SIZE);
-            } else {
-                // Skip past the ones we know don't fit.
-                page += run;
-            }
-        }
+    if(page == BITMAP_NONE) {
+        // Not enough memory.
+        asm_enable_interrupt();
+        return (void *)0;
     }
-    // Not enough memory.
+    bitmap_set_run(mem_map, page, nr_pages);
+    // Next scan is past what we allocated.
+    KLAST_PAGE = page + nr_pages + 1;
+    KALLOC_PAGES += nr_pages;
     asm_enable_interrupt();
-    return (void *)0;
+    return (void *)(page * PAGE_SIZE);
 }
 
 void kpage_free(void *addr, unsigned nr_pages)
@@ -722,14 +615,11 @@ void kpage_free(void *addr, unsigned nr_pages)
     // *Note* we should store the number of pages requested in malloc.c
     // as its easier to manage there instead of here so review that code.
     register unsigned page = ((unsigned)(char *)addr / PAGE_SIZE);
-    register unsigned run  = 0;
     if(page > NR_KPAGES) {
         panic("kpage_free:: free'ing invalid page [%d] NR_KPAGES [%d]\n",page,NR_KPAGES);
     }
     asm_disable_interrupt();
-    for(run = 0; run < nr_pages; ++run) {
-        mem_clear_bit(page + run);
-    }
+    bitmap_clear_run(mem_map, page, nr_pages);
     KLAST_PAGE = page;
     KALLOC_PAGES -= nr_pages;
     if(KALLOC_PAGES < 0) {
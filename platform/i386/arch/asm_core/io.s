@@ -438,11 +438,15 @@ C_ENTRY io_insb
         push dword ecx
         push dword edx
         push dword edi
+        push es                         ; ins stores through es:edi
+        mov  eax,ds
+        mov  es,eax
         mov  dword ecx,[ebp + PARAM3]   ; count
         mov  dword edi,[ebp + PARAM2]   ; destination address
         mov  dword edx,[ebp + PARAM1]   ; port
         cld                             ; increment address in esi
         rep  insb
+        pop  es
         pop  dword edi
         pop  dword edx
         pop  dword ecx
@@ -480,11 +484,15 @@ C_ENTRY io_insw
         push dword ecx
         push dword edx
         push dword edi
+        push es                         ; ins stores through es:edi
+        mov  eax,ds
+        mov  es,eax
         mov  dword ecx,[ebp + PARAM3]   ; count
         mov  dword edi,[ebp + PARAM2]   ; destination address
         mov  dword edx,[ebp + PARAM1]   ; port
         cld                             ; increment address in esi
         rep  insw
+        pop  es
         pop  dword edi
         pop  dword edx
         pop  dword ecx
@@ -522,11 +530,15 @@ C_ENTRY io_insl
         push dword ecx
         push dword edx
         push dword edi
+        push es                         ; ins stores through es:edi
+        mov  eax,ds
+        mov  es,eax
         mov  dword ecx,[ebp + PARAM3]   ; count
         mov  dword edi,[ebp + PARAM2]   ; destination address
         mov  dword edx,[ebp + PARAM1]   ; port
         cld                             ; increment address in edi
         rep  insd
+        pop  es
         pop  dword edi
         pop  dword edx
         pop  dword ecx
@@ -554,6 +566,15 @@ C_ENTRY io_outsl
         leave
 	ret
 
+;
+; io_rdtsc:
+;   unsigned long long io_rdtsc ( void )
+;   returns the time stamp counter in edx:eax
+;
+C_ENTRY io_rdtsc
+        rdtsc
+        ret
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;	io memory operations
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
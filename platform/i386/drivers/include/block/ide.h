@@ -63,6 +63,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define ATA_CMD_WRITE_PIO_EXT     0x34
 #define ATA_CMD_WRITE_DMA         0xCA
 #define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_MULTIPLE     0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE    0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE      0xC6
 #define ATA_CMD_CACHE_FLUSH       0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT   0xEA
 #define ATA_CMD_PACKET            0xA0
@@ -79,6 +84,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define ATA_IDENT_SECTORS      12
 #define ATA_IDENT_SERIAL       20
 #define ATA_IDENT_MODEL        54
+#define ATA_IDENT_MAX_MULTIPLE 94
+#define ATA_IDENT_DWORD_IO     96
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID   106
 #define ATA_IDENT_MAX_LBA      120
@@ -109,6 +116,34 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define ATA_REG_ALTSTATUS  0x0C
 #define ATA_REG_DEVADDRESS 0x0D
 
+// Bus Master IDE registers, relative to channels[].bmide:
+#define ATA_BM_COMMAND     0x00
+#define ATA_BM_STATUS      0x02
+#define ATA_BM_PRDT        0x04
+
+#define ATA_BM_CMD_START   0x01
+#define ATA_BM_CMD_READ    0x08 // Device to memory.
+
+#define ATA_BM_SR_ACTIVE   0x01
+#define ATA_BM_SR_ERR      0x02
+#define ATA_BM_SR_IRQ      0x04
+#define ATA_BM_SR_DRV0     0x20 // Drive 0 DMA capable.
+#define ATA_BM_SR_DRV1     0x40 // Drive 1 DMA capable.
+
+// Physical Region Descriptor, the table may not cross 64K
+// and neither may the region an entry describes.
+#define ATA_PRD_EOT        0x8000
+#define ATA_PRD_MAX_BYTES  0x10000
+
+struct ata_prd {
+   unsigned int   addr;  // Physical address of the region.
+   unsigned short count; // Byte count, 0 means 64K.
+   unsigned short flags; // ATA_PRD_EOT on the last entry.
+};
+
+// IDENTIFY capabilities:
+#define ATA_CAP_DMA        0x100
+
 // Channels:
 #define      ATA_PRIMARY      0x00
 #define      ATA_SECONDARY    0x01
@@ -134,6 +169,8 @@ struct ide_device {
    unsigned short Capabilities;// Features.
    unsigned int   CommandSets; // Command Sets Supported.
    unsigned int   Size;        // Size in Sectors.
+   unsigned char  MaxMultiple; // Most sectors per READ/WRITE MULTIPLE block, 0 if unsupported.
+   unsigned char  DwordIO;     // 1 if the drive reports 32-bit PIO data transfers.
    unsigned char  Model[41];   // Model in string.
 } ide_devices[4];
 
@@ -144,6 +181,8 @@ void ide_initialize(unsigned int BAR0,
                     unsigned int BAR3,
                     unsigned int BAR4);
 
+unsigned int ide_pci_bmide(void);
+
 unsigned char ide_read(unsigned char channel, unsigned char reg);
 
 void ide_write(unsigned char channel, unsigned char reg, unsigned char data);
@@ -36,6 +36,18 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define SLAVE_PIC  0xA0
 #define EOI        0x20
 
+/* Last sector reachable with LBA28 addressing. */
+#define ATA_LBA28_MAX 0x0FFFFFFF
+
+/* Most sectors moved by one multiple sector command. */
+#define ATA_MULTI_MAX 256
+
+/*
+ * Drives are numbered as ide_devices: 0 and 1 are the primary
+ * master and slave, 2 and 3 those of the secondary channel.
+ */
+#define ATA_DRIVES 4
+
 /*
  * ide_enable:
  * Initialize OS for ide i/o.
@@ -45,12 +57,20 @@ void ide_enable(void);
 /*
  * ata_nr_drives:
  *
- * Report if there are ATA drives
- * on the controller.
+ * Report how many ATA drives there
+ * are on both channels.
  *
  */
 int ata_nr_drives(void);
 
+/*
+ * ata_present:
+ *
+ * Report if there is an ATA disk at 'drive'.
+ *
+ */
+int ata_present(unsigned char drive);
+
 /*
  * ata_disk_size:
  *
@@ -61,13 +81,23 @@ int ata_nr_drives(void);
  */
 unsigned long ata_disk_size(unsigned char drive, unsigned long *start_sector);
 
+/*
+ * ata_lba48:
+ *
+ * Report if the drive supports 48 bit addressing.
+ *
+ */
+int ata_lba48(unsigned char drive);
+
 /*
  * ata_read:
  *
- * Read from the ATA disk.
+ * Read from the ATA disk. The lba is used as is,
+ * with LBA28 addressing up to ATA_LBA28_MAX and
+ * LBA48 beyond it.
  *
  */
-int ata_read(unsigned char drive, unsigned int lba, char *buffer);
+int ata_read(unsigned char drive, unsigned long lba, char *buffer);
 
 /*
  * ata_write:
@@ -75,7 +105,66 @@ int ata_read(unsigned char drive, unsigned int lba, char *buffer);
  * Write to the ATA disk.
  *
  */
-int ata_write(unsigned char drive, unsigned int lba, char *buffer);
+int ata_write(unsigned char drive, unsigned long lba, char *buffer);
+
+/*
+ * ata_read_multi:
+ *
+ * Read 'count' (1-ATA_MULTI_MAX) consecutive sectors
+ * into 'buffer' with one READ DMA command if a bus master
+ * controller was found, else one READ MULTIPLE command, or
+ * READ SECTORS if the drive has no multiple mode.
+ *
+ */
+int ata_read_multi(unsigned char drive, unsigned long lba, int count, char *buffer);
+
+/*
+ * ata_write_multi:
+ *
+ * Write 'count' consecutive sectors from 'buffer'
+ * with one WRITE DMA or WRITE MULTIPLE command.
+ *
+ */
+int ata_write_multi(unsigned char drive, unsigned long lba, int count, char *buffer);
+
+/*
+ * ata_readv:
+ * ata_writev:
+ *
+ * As ata_read_multi/ata_write_multi with sector i
+ * of the run in the 512 byte buffer vec[i].
+ *
+ */
+int ata_readv(unsigned char drive, unsigned long lba, int count, char **vec);
+
+int ata_writev(unsigned char drive, unsigned long lba, int count, char **vec);
+
+/*
+ * ata_submit:
+ *
+ * Start a DMA transfer of 'count' sectors, sector i at
+ * vec[i], and return without waiting. Returns 0 if it was
+ * started, 'done(arg, status)' is then called from the disk
+ * interrupt with status 0 on success or 1 on failure, after
+ * which the transfer may be retried with PIO. Returns 1 if
+ * the transfer can not be done asynchronously, because there
+ * is no bus master, the IRQ is not set up or the channel is
+ * busy, and -1 on error. It may be called from the disk
+ * interrupt, DMA being set up beforehand by ide_enable.
+ *
+ */
+int ata_submit(unsigned char drive, unsigned long lba, int count, char **vec,
+               int writing, void (*done)(void *arg, int status), void *arg);
+
+/*
+ * ata_poll:
+ *
+ * Finish a transfer started by ata_submit on the channel of
+ * 'drive' whose interrupt was missed. Returns 1 while one is
+ * still in flight there.
+ *
+ */
+int ata_poll(unsigned char drive);
 
 /*
  * ata_status_check:
@@ -95,6 +184,17 @@ int ata_status_check(int operation, unsigned char error_reg, unsigned char statu
 unsigned char get_drive_head(unsigned char drive, 
                              unsigned char head);
 
+/*
+ * get_lba_drive_head:
+ *
+ * Returns the drive/head register value selecting LBA
+ * addressing on the drive (0-1) with bits 24-27 of 'lba'.
+ * This is needed in the call to pio_read/pio_write.
+ *
+ */
+unsigned char get_lba_drive_head(unsigned char drive,
+                                 unsigned long lba);
+
 /*
  * get_chs:
  *
@@ -141,11 +241,19 @@ int pio_read(unsigned char drive_head, unsigned char sector,
 int pio_write(unsigned char drive_head, unsigned char sector,
                unsigned char cyl1, unsigned char cyl2, char *buff);
 
+/*
+ * ata_pio_width:
+ *
+ * Set the PIO data width of 'drive' to 16 or 32 bits,
+ * or probe it when 'bits' is 0. Returns the width in use.
+ */
+int ata_pio_width(unsigned char drive, int bits);
 
 /*
  * ata_test_rw
  *
- * Test reading/writing a set of sectors.
+ * Test reading/writing a set of sectors, then time
+ * reading them back with 16 and 32-bit PIO.
  */ 
 void ata_test_rw(int sectors);
 
@@ -77,23 +77,64 @@ unsigned static char atapi_packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 #define  inb  io_inb
 #define insl io_insl
 
-#if 0
-outl((1 << 31) | (bus << 16) | (device << 11) | (func << 8) | 8, 0xCF8); // Send the parameters.
-if ((inl(0xCFC) >> 16) != 0xFFFF) { // If device exists (class isn't 0xFFFF)
-   // Check if this device needs an IRQ assignment:
-   outl((1 << 31) | (bus << 16) | (device << 11) | (func << 8) | 0x3C, 0xCF8); // Read the interrupt line field
-   outb(0xFE, 0xCFC); // Change the IRQ field to 0xFE
-   outl((1 << 31) | (bus << 16) | (device << 11) | (func << 8) | 0x3C, 0xCF8); // Read the interrupt line field
-   if ((inl(0xCFC) & 0xFF) == 0xFE) {
-      // This device needs an IRQ assignment.
-   } else {
-      // The device doesn't use IRQs, check if this is an Parallel IDE:
-      if (class == 0x01 && subclass == 0x01 && (ProgIF == 0x8A || ProgIF == 0x80)) {
-         // This is a Parallel IDE Controller which uses IRQs 14 and 15.
+/*
+ * PCI configuration space, mechanism #1.
+ */
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+#define PCI_ADDR(bus,dev,func,reg) \
+   ((1UL << 31) | ((bus) << 16) | ((dev) << 11) | ((func) << 8) | ((reg) & 0xFC))
+
+static unsigned int pci_read(int bus, int dev, int func, int reg)
+{
+   io_outl(PCI_CONFIG_ADDRESS, PCI_ADDR(bus, dev, func, reg));
+   return io_inl(PCI_CONFIG_DATA);
+}/* pci_read */
+
+static void pci_write(int bus, int dev, int func, int reg, unsigned int data)
+{
+   io_outl(PCI_CONFIG_ADDRESS, PCI_ADDR(bus, dev, func, reg));
+   io_outl(PCI_CONFIG_DATA, data);
+}/* pci_write */
+
+/*
+ * ide_pci_bmide:
+ *
+ * Find the first IDE controller (class 0x01, subclass 0x01)
+ * that can bus master, turn on bus mastering in its command
+ * register and return BAR4, the Bus Master IDE ports.
+ * Returns 0 if there is none, in which case only PIO is used.
+ */
+unsigned int ide_pci_bmide(void)
+{
+   unsigned int id = 0, class = 0, bar4 = 0;
+   int bus = 0, dev = 0, func = 0, nr_func = 0;
+   for (bus = 0; bus < 256; bus++)
+      for (dev = 0; dev < 32; dev++) {
+         if ((pci_read(bus, dev, 0, 0x00) & 0xFFFF) == 0xFFFF)
+            continue; // No device.
+         // Header type bit 7 marks a multi-function device.
+         nr_func = (pci_read(bus, dev, 0, 0x0C) & 0x800000) ? 8 : 1;
+         for (func = 0; func < nr_func; func++) {
+            id = pci_read(bus, dev, func, 0x00);
+            if ((id & 0xFFFF) == 0xFFFF)
+               continue;
+            class = pci_read(bus, dev, func, 0x08);
+            // Class, subclass, then ProgIF bit 7 for bus master capable.
+            if ((class >> 16) != 0x0101 || !(class & 0x8000))
+               continue;
+            bar4 = pci_read(bus, dev, func, 0x20);
+            if (!(bar4 & 0x1) || !(bar4 & 0xFFFFFFFC))
+               continue; // Not an I/O space BAR or not assigned.
+            // Command register: I/O space and bus master enable.
+            pci_write(bus, dev, func, 0x04, pci_read(bus, dev, func, 0x04) | 0x5);
+            printk(" IDE bus master %x:%x at %d:%d.%d ports %x\n",
+               id & 0xFFFF, id >> 16, bus, dev, func, bar4 & 0xFFFFFFFC);
+            return bar4;
+         }
       }
-   }
-}
-#endif
+   return 0;
+}/* ide_pci_bmide */
 
 void ide_initialize(unsigned int BAR0, 
                     unsigned int BAR1, 
@@ -109,7 +150,7 @@ void ide_initialize(unsigned int BAR0,
    channels[ATA_SECONDARY].base  = (BAR2 & 0xFFFFFFFC) + 0x170 * (!BAR2);
    channels[ATA_SECONDARY].ctrl  = (BAR3 & 0xFFFFFFFC) + 0x374 * (!BAR3);
    channels[ATA_PRIMARY  ].bmide = (BAR4 & 0xFFFFFFFC) + 0; // Bus Master IDE
-   channels[ATA_SECONDARY].bmide = (BAR4 & 0xFFFFFFFC) + 8; // Bus Master IDE
+   channels[ATA_SECONDARY].bmide = (BAR4 & 0xFFFFFFFC) + 8 * (!!BAR4); // Bus Master IDE
 
     // 2- Disable IRQs:
    ide_write(ATA_PRIMARY  , ATA_REG_CONTROL, 2);
@@ -120,6 +161,7 @@ void ide_initialize(unsigned int BAR0,
       for (j = 0; j < 2; j++) {
  
          unsigned char err = 0, type = IDE_ATA, status;
+         count = i * 2 + j; // Entry 0-3 is primary master to secondary slave.
          ide_devices[count].Reserved = 0; // Assuming that no drive here.
  
          // (I) Select Drive:
@@ -169,6 +211,8 @@ void ide_initialize(unsigned int BAR0,
          ide_devices[count].Signature    = *((unsigned short *)(ide_buf + ATA_IDENT_DEVICETYPE));
          ide_devices[count].Capabilities = *((unsigned short *)(ide_buf + ATA_IDENT_CAPABILITIES));
          ide_devices[count].CommandSets  = *((unsigned int *)(ide_buf + ATA_IDENT_COMMANDSETS));
+         ide_devices[count].MaxMultiple  = ide_buf[ATA_IDENT_MAX_MULTIPLE];
+         ide_devices[count].DwordIO      = ide_buf[ATA_IDENT_DWORD_IO] & 0x1;
  
          // (VII) Get Size:
          if (ide_devices[count].CommandSets & (1 << 26))
@@ -183,8 +227,6 @@ void ide_initialize(unsigned int BAR0,
             ide_devices[count].Model[k] = ide_buf[ATA_IDENT_MODEL + k + 1];
             ide_devices[count].Model[k + 1] = ide_buf[ATA_IDENT_MODEL + k];}
          ide_devices[count].Model[40] = 0; // Terminate String.
- 
-         count++;
       }
  
    // 4- Print Summary:
@@ -236,13 +278,9 @@ void ide_read_buffer(unsigned char channel,
                      unsigned int buffer,
                      unsigned int quads)
 {
-   /* WARNING: This code contains a serious bug. The inline assembly trashes ES and
-    *           ESP for all of the code the compiler generates between the inline
-    *           assembly blocks.
-    */
+   // io_insl loads ES from DS itself, so no segment juggling here.
    if (reg > 0x07 && reg < 0x0C)
       ide_write(channel, ATA_REG_CONTROL, 0x80 | channels[channel].nIEN);
-   //asm("pushw %es; movw %ds, %ax; movw %ax, %es");
    if (reg < 0x08)
       insl(channels[channel].base  + reg - 0x00, buffer, quads);
    else if (reg < 0x0C)
@@ -251,7 +289,6 @@ void ide_read_buffer(unsigned char channel,
       insl(channels[channel].ctrl  + reg - 0x0A, buffer, quads);
    else if (reg < 0x16)
       insl(channels[channel].bmide + reg - 0x0E, buffer, quads);
-   //asm("popw %es;");
    if (reg > 0x07 && reg < 0x0C)
       ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN);
 }/* ide_read_buffer */
@@ -322,5 +359,5 @@ unsigned char ide_print_error(unsigned int drive, unsigned char err)
 }/* ide_print_error */
 
 #ifdef _TEST_IDE
-ide_initialize(0x1F0, 0x3F4, 0x170, 0x374, 0x000);
+ide_initialize(0x1F0, 0x3F4, 0x170, 0x374, ide_pci_bmide());
 #endif
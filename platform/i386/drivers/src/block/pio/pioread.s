@@ -77,6 +77,9 @@
 ;       - caller of pio_read receives a drive number and logical block address
 ;         converts it into chs and calls pio_read with drive+chs and a buffer
 ;         to read data into
+;       - in LBA28 mode the same four ports carry the address instead,
+;         drive_head has bit 6 set and LBA bits 24-27, sector, cyl1 and
+;         cyl2 are LBA bits 0-7, 8-15 and 16-23, see 'get_lba_drive_head'
 ;       - currently its setup to read one sector (512 byes) at a time
 extern  print_reg               ; libk/printk.c
 extern  local_sleep             ; kernel/misc.c
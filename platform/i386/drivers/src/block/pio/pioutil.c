@@ -21,8 +21,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 //
 // @description:
 //     Implements C callable PIO hard disk access
-//     and supporting routines. Requires pio_read/pio_write
-//     low-level asm routines.
+//     and supporting routines. Transfers complete on
+//     IRQ14 once ide_enable has run, polling before that.
 //
 // @author:
 //     Dr. Roger G. Doss, PhD
@@ -45,7 +45,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include <asm_core/io.h>
 #include <ox/error_rpt.h>
-#include <ox/fs.h> // For BLOCK_START in inode.h.
+#include <ox/fs.h> // For BLOCK_START_SECTOR in inode.h.
+#include <ox/fs/compat.h> // For current_process and schedule.
+#include <ox/mm/page.h> // For kpage_alloc.
 
 #include <stddef.h>
 
@@ -57,12 +59,50 @@ unsigned io_outb_p(unsigned x,unsigned y){return 0;}
 unsigned io_inb_p(unsigned x){return 0;}
 #endif
 
+/*
+ * IRQ completion.
+ *
+ * Once ide_enable has installed the handler the drive is
+ * left with interrupts enabled and a process waiting on it
+ * sleeps in ide_irq_wait on the channel's ide_irq_pending
+ * until ide_handler wakes it up.
+ */
+static volatile int ide_irq_pending[2] = {0, 0}; // Set by ide_handler per channel.
+static bool ide_irq_ready = false; // ide_enable installed the handler.
+
+/* Transfers started by ata_submit per channel, see ata_async_end. */
+#define ATA_ASYNC_IDLE  0
+#define ATA_ASYNC_DMA   1 // Waiting for the data transfer.
+#define ATA_ASYNC_FLUSH 2 // Waiting for the cache flush after a write.
+
+static struct ata_async {
+    volatile int state;
+    unsigned char drive;
+    unsigned long lba;
+    int count;
+    int writing;
+    int ext;
+    void (*done)(void *arg, int status);
+    void *arg;
+} ata_async[2];
+
+static void ata_identify(void);
+static void ata_dma_setup(void);
+static void ata_async_end(int channel, unsigned char status);
+
 irq_stat_t ide_handler(int irq)
 {
-    printk("ide_handler:: entering IDE handler\n");
+    int channel = (irq == 15);
+    // Reading the status register acknowledges the drive.
+    unsigned char status = io_inb(channels[channel].base + ATA_REG_STATUS);
+    if(ata_async[channel].state != ATA_ASYNC_IDLE) {
+        ata_async_end(channel, status);
+    } else {
+        ide_irq_pending[channel] = 1;
+        wakeup((void *)&ide_irq_pending[channel]);
+    }
     io_outb(MASTER_PIC, EOI);
     io_outb(SLAVE_PIC, EOI);
-    printk("ide_handler:: done IDE handler\n");
     return IRQ_ENABLE;
 }
 
@@ -84,12 +124,21 @@ void ide_enable(void)
 {
     asm_disable_interrupt();
     printk("initializing IDE disk driver version 1.0\n");
+    // The handler reads the ports ide_initialize finds.
+    ata_identify();
+    ata_dma_setup();
     interrupt_install_handler(14,
               IRQ_EXCL,
-              ide_handler,
+              (interrupt_handler_t)ide_handler,
+              ide_info);
+    interrupt_install_handler(15,
+              IRQ_EXCL,
+              (interrupt_handler_t)ide_handler,
               ide_info);
     printk("done initializing IDE disk driver version 1.0\n");
     enable_irq(14);
+    enable_irq(15);
+    ide_irq_ready = true;
 }/* ide_init */
 
 /*
@@ -108,6 +157,23 @@ unsigned char get_drive_head(unsigned char drive,
    return val;
 }/* get_drive_head */
 
+/*
+ * get_lba_drive_head:
+ *
+ * drive can be 0 or 1 for first or second drive.
+ * Bit 6 selects LBA addressing and bits 0-3 take
+ * bits 24-27 of an LBA28 address.
+ *
+ */
+unsigned char get_lba_drive_head(unsigned char drive,
+                                 unsigned long lba)
+{
+   unsigned char val = 224; // bit 7 == 1, bit 6 == 1, bit 5 == 1.
+   val |= ((drive & 0x1)<< 4); // Set the forth bit.
+   val |= ((lba >> 24) & 0xF); // LBA bits 24-27 in bits 0-3.
+   return val;
+}/* get_lba_drive_head */
+
 /*
  * get_chs:
  *
@@ -150,24 +216,62 @@ unsigned int get_lba(unsigned char head, unsigned char sector,
 /*
  * ata_nr_drives:
  *
- * Report if there are ATA drives
- * on the controller.
+ * Report how many ATA drives there
+ * are on both channels.
  *
  */
 int ata_nr_drives(void)
 {
-    io_outb(0x70,0x12);
-    register int disks = io_inb(0x70);
-    if(disks & 0xF0) {
-        if(disks & 0x0F) {
-            return 2;
-        } else {
-            return 1;
-        }
+    register int i = 0, disks = 0;
+    for(i = 0; i < ATA_DRIVES; ++i) {
+        disks += ata_present(i);
     }
-    return 0;
+    return disks;
 }/* ata_nr_drives */
 
+/*
+ * ata_identify:
+ *
+ * Fill ide_devices from the IDENTIFY data of the drives
+ * on the primary and secondary channels, done once.
+ *
+ */
+static void ata_identify(void)
+{
+    static bool identified = false;
+    if(!identified) {
+        ide_initialize(0x1F0, 0x3F4, 0x170, 0x374, ide_pci_bmide());
+        identified = true;
+    }
+}/* ata_identify */
+
+/*
+ * ata_present:
+ *
+ * Report if 'drive', an index into ide_devices,
+ * is an ATA disk.
+ *
+ */
+int ata_present(unsigned char drive)
+{
+    ata_identify();
+    return drive < ATA_DRIVES && ide_devices[drive].Reserved &&
+           ide_devices[drive].Type == IDE_ATA;
+}/* ata_present */
+
+/*
+ * ata_lba48:
+ *
+ * Report if the drive supports 48 bit addressing,
+ * bit 26 of the IDENTIFY command sets.
+ *
+ */
+int ata_lba48(unsigned char drive)
+{
+    return ata_present(drive) &&
+           (ide_devices[drive].CommandSets & (1 << 26));
+}/* ata_lba48 */
+
 /*
  * ata_disk_size:
  *
@@ -186,6 +290,10 @@ unsigned long ata_disk_size(unsigned char drive, unsigned long *start_sector)
     } else {
         printk("ata_disk_size:: there are %d disks found\n",nr_disks);
     }
+    if(!ata_present(drive)) {
+        printk("ata_disk_size:: no ATA disk at drive=%d\n",drive);
+        return 0;
+    }
 
     if(!ata_read(drive, 0, ptr)) {
         /*
@@ -205,21 +313,17 @@ unsigned long ata_disk_size(unsigned char drive, unsigned long *start_sector)
             printk("buf[0]=[%x]   buf[1]=[%x]\n"  ,buf[0]  ,buf[1]);
             printk("start_sector=[%d] size=[%d]\n",part->start_sector,
                 part->nr_sectors * 512);
-            ide_initialize(0x1F0, 0x3F4, 0x170, 0x374, 0x000);
             /* Access ide_devices to calculate disk size. */
-            /* TODO: For now, just get the master drive on
-             *       Primary Channel.
-             */
-            if(!ide_devices[0].Size) {
-                printk("NO IDE device on primary channel\n");
+            if(!ide_devices[drive].Size) {
+                printk("NO size reported for IDE drive=%d\n",drive);
                 panic("...");
             }
-            part->nr_sectors = ide_devices[0].Size;
+            part->nr_sectors = ide_devices[drive].Size;
             /* Now start sector is based on the init
              * function in the file system.
-             * See BLOCK_START in the file system code.
+             * See BLOCK_START_SECTOR in the file system code.
              */
-            part->start_sector = BLOCK_START;
+            part->start_sector = BLOCK_START_SECTOR;
             buf[510] = 0x55;
             buf[511] = 0xAA;
             /* Now write the partition table.
@@ -239,7 +343,7 @@ unsigned long ata_disk_size(unsigned char drive, unsigned long *start_sector)
                 panic("error writing partition...\n");
             }
             /* Return our disk size. */
-            *start_sector = BLOCK_START;
+            *start_sector = BLOCK_START_SECTOR;
             return part->nr_sectors * 512; 
         }
         *start_sector = part->start_sector;
@@ -254,59 +358,626 @@ unsigned long ata_disk_size(unsigned char drive, unsigned long *start_sector)
 }/* ata_disk_size */
 
 /*
- * ata_read:
+ * Multiple sector transfers.
  *
- * Read from the ATA disk.
+ * These program the task file from C and move the data with
+ * string I/O, one command per run of up to ATA_MULTI_MAX sectors.
+ * With SET MULTIPLE MODE in effect the drive raises DRQ once per
+ * block of 'ata_multi[drive]' sectors rather than once per sector.
+ * A drive is an index into ide_devices, the ports used are those
+ * of its channel, so each channel has its own transfer going.
+ */
+#define ATA_CHANNEL(drive)    (ide_devices[(drive)].Channel)
+#define ATA_PORT(ch, reg)     (channels[(ch)].base + (reg))
+#define ATA_CTRL_PORT(ch)     (channels[(ch)].ctrl + 2)
+#define ATA_POLL_MAX   1000000
+#define ATA_IRQ_MAX    100     // Wakeups to wait for an interrupt.
+
+/* Sectors per DRQ block set on each drive, 0 if not set yet. */
+static unsigned int ata_multi[ATA_DRIVES] = {0, 0, 0, 0};
+
+/*
+ * ide_irq_wait:
  *
+ * Wait for ide_handler to report completion on 'channel'.
+ * The current process sleeps until the handler wakes it up;
+ * before the scheduler is up the cpu halts until the next
+ * interrupt. A caller that has interrupts disabled, such as
+ * the request queue in fs/dev.c, is not put to sleep as that
+ * would let the interrupt in, it polls the drive instead.
+ * Returns 0 if the interrupt arrived, 1 if it did not and
+ * the caller should poll.
  */
-int ata_read(unsigned char drive, unsigned int lba, char *buffer)
+static int ide_irq_wait(int channel)
 {
-    unsigned char head       = 0x0;
-    unsigned char sector     = 0x0;
-    unsigned char cyl1       = 0x0;
-    unsigned char cyl2       = 0x0;
-    unsigned char drive_head = 0x0;
-    get_chs(lba, &head, &sector, &cyl1, &cyl2);
-    drive_head = get_drive_head(drive, head);
-    if(pio_read(drive_head, sector, cyl1, cyl2, buffer) == 1) {
-        printk("ata_read:: "
-               "FAILED lba=%x drive=%x drive_head=%x sector=%x cyl1=%x cyl2=%x\n",
-                lba,drive,drive_head,sector,cyl1,cyl2);
-        panic("ata_read:: FAILED");
-        // Coincides with dev.c; however, we will not return
-        // from kernel panic...
+    unsigned long flags = asm_get_eflags();
+    register int i = 0;
+    if(!(flags & EFLAGS_IF)) {
+        return 1;
+    }
+    asm_disable_interrupt();
+    if(current_process) {
+        if(!ide_irq_pending[channel]) {
+            sleep_on((void *)&ide_irq_pending[channel], ATA_IRQ_MAX);
+        }
+    } else {
+        for(i = 0; !ide_irq_pending[channel] && i < ATA_IRQ_MAX; ++i) {
+            asm_enable_interrupt();
+            asm_hlt();
+            asm_disable_interrupt();
+        }
+    }
+    asm_set_eflags(flags);
+    if(!ide_irq_pending[channel]) {
+        return 1;
+    }
+    ide_irq_pending[channel] = 0;
+    return 0;
+}/* ide_irq_wait */
+
+/*
+ * ata_wait:
+ *
+ * Wait until the drive is not busy and, if 'drq' is set,
+ * ready to transfer data. If 'irq' is set the drive will
+ * interrupt when it gets there, so sleep on that first;
+ * the status register of 'channel' is polled either way.
+ * Returns 0 on success, 1 on a drive error or timeout.
+ */
+static int ata_wait(int channel, int operation, int drq, int irq)
+{
+    register int i = 0;
+    unsigned char status = 0;
+    if(irq && ide_irq_ready) {
+        ide_irq_wait(channel);
+    }
+    for(i = 0; i < ATA_POLL_MAX; ++i) {
+        status = io_inb(ATA_PORT(channel, ATA_REG_STATUS));
+        if(status & ATA_SR_BSY) {
+            continue;
+        }
+        if(status & (ATA_SR_ERR | ATA_SR_DF)) {
+            ata_status_check(operation, io_inb(ATA_PORT(channel, ATA_REG_ERROR)),
+                             status | ATA_SR_ERR);
+            return 1;
+        }
+        if(!drq || (status & ATA_SR_DRQ)) {
+            return 0;
+        }
+    }
+    printk("ata_wait:: timeout status=%x\n", status);
+    return 1;
+}/* ata_wait */
+
+/*
+ * ata_task_file:
+ *
+ * Select the drive, load the sector count and address,
+ * using the LBA48 register sequence if 'ext' is set,
+ * and issue 'command'. A count of 256 is sent as 0.
+ */
+static void ata_task_file(unsigned char drive, unsigned long lba,
+                          int count, int ext, unsigned char command)
+{
+    int ch = ATA_CHANNEL(drive);
+    unsigned char slave = ide_devices[drive].Drive;
+    // Leave nIEN clear once ide_handler is installed.
+    io_outb(ATA_CTRL_PORT(ch), ide_irq_ready ? 0x00 : 0x02);
+    if(ext) {
+        io_outb(ATA_PORT(ch, ATA_REG_HDDEVSEL), get_lba_drive_head(slave, 0));
+        io_outb(ATA_PORT(ch, ATA_REG_SECCOUNT0), (count >> 8) & 0xFF);
+        io_outb(ATA_PORT(ch, ATA_REG_LBA0), (lba >> 24) & 0xFF);
+        io_outb(ATA_PORT(ch, ATA_REG_LBA1), 0); // block_t is 32 bits.
+        io_outb(ATA_PORT(ch, ATA_REG_LBA2), 0);
+    } else {
+        io_outb(ATA_PORT(ch, ATA_REG_HDDEVSEL), get_lba_drive_head(slave, lba));
+    }
+    io_outb(ATA_PORT(ch, ATA_REG_SECCOUNT0), count & 0xFF);
+    io_outb(ATA_PORT(ch, ATA_REG_LBA0), lba & 0xFF);
+    io_outb(ATA_PORT(ch, ATA_REG_LBA1), (lba >> 8) & 0xFF);
+    io_outb(ATA_PORT(ch, ATA_REG_LBA2), (lba >> 16) & 0xFF);
+    ide_irq_pending[ch] = 0;
+    io_outb(ATA_PORT(ch, ATA_REG_COMMAND), command);
+}/* ata_task_file */
+
+/*
+ * ata_set_multiple:
+ *
+ * Return the sectors per DRQ block for the drive, issuing
+ * SET MULTIPLE MODE the first time with the largest block
+ * the drive reports. Returns 1 if the drive does not
+ * support it, in which case READ/WRITE SECTORS are used.
+ */
+static unsigned int ata_set_multiple(unsigned char drive)
+{
+    unsigned int max = 0;
+    if(ata_multi[drive]) {
+        return ata_multi[drive];
+    }
+    ata_multi[drive] = 1;
+    max = ide_devices[drive].MaxMultiple;
+    if(max > 1) {
+        ata_task_file(drive, 0, max, 0, ATA_CMD_SET_MULTIPLE);
+        if(!ata_wait(ATA_CHANNEL(drive), 0, 0, 1)) {
+            ata_multi[drive] = max;
+        } else {
+            printk("ata_set_multiple:: drive=%x refused %d sectors\n",
+                    drive, max);
+        }
+    }
+    return ata_multi[drive];
+}/* ata_set_multiple */
+
+/*
+ * Bus master DMA.
+ *
+ * When ide_initialize found a bus master controller and the
+ * drive reports DMA, transfers are described to the controller
+ * with a Physical Region Descriptor table and the drive moves
+ * the data itself, completing on IRQ14 or IRQ15. Kernel memory is
+ * identity mapped so buffer addresses are physical addresses.
+ */
+#define ATA_BM_PORT(ch, reg) (channels[(ch)].bmide + (reg))
+#define ATA_PRD_MAX          (PAGE_SIZE / sizeof(struct ata_prd))
+
+/* PRD table per channel, one kernel page so it never crosses 64K. */
+static struct ata_prd *ata_prdt[2] = {NULL, NULL};
+/* Per drive: 0 PIO only, 1 DMA, set by ata_dma_setup. */
+static int ata_dma_mode[ATA_DRIVES] = {0, 0, 0, 0};
+
+/*
+ * ata_dma_setup:
+ *
+ * Decide for each drive whether DMA is used and allocate
+ * the PRD table of every channel with such a drive. Done
+ * once from ide_enable: kpage_alloc enables interrupts, so
+ * it can not run under DEV_LOCK or from the disk interrupt
+ * when a transfer is started. A drive whose channel gets
+ * no table is left to PIO.
+ */
+static void ata_dma_setup(void)
+{
+    unsigned long flags = 0;
+    unsigned char drive = 0;
+    int ch = 0;
+    for(drive = 0; drive < ATA_DRIVES; ++drive) {
+        ata_dma_mode[drive] = 0;
+        ch = ATA_CHANNEL(drive);
+        if(!ata_present(drive) || !channels[ch].bmide ||
+           !(ide_devices[drive].Capabilities & ATA_CAP_DMA)) {
+            continue;
+        }
+        if(!ata_prdt[ch]) {
+            flags = asm_get_eflags();
+            ata_prdt[ch] = (struct ata_prd *)kpage_alloc(1);
+            asm_set_eflags(flags);
+            if(!ata_prdt[ch]) {
+                printk("ata_dma_setup:: unable to allocate PRD table channel=%d\n", ch);
+                continue;
+            }
+        }
+        // Tell the controller the drive is set up for DMA.
+        io_outb(ATA_BM_PORT(ch, ATA_BM_STATUS), io_inb(ATA_BM_PORT(ch, ATA_BM_STATUS)) |
+                (ide_devices[drive].Drive ? ATA_BM_SR_DRV1 : ATA_BM_SR_DRV0));
+        ata_dma_mode[drive] = 1;
+        printk("ata_dma_setup:: drive=%x using bus master DMA\n",drive);
+    }
+}/* ata_dma_setup */
+
+/*
+ * ata_prd_build:
+ *
+ * Describe the sectors to the controller in 'prdt', merging
+ * physically adjacent sectors into one region and splitting
+ * at 64K boundaries. Returns the number of entries, 0 if a
+ * buffer is not word aligned and DMA cannot be used.
+ */
+static int ata_prd_build(struct ata_prd *prdt, int count, char **vec, char *buffer)
+{
+    unsigned long addr = 0, len = 0, chunk = 0;
+    struct ata_prd *prd = NULL;
+    int nr = 0;
+    register int i = 0;
+    for(i = 0; i < count; ++i) {
+        addr = (unsigned long)(vec ? vec[i] : buffer + (i * 512));
+        if(addr & 0x1) {
+            return 0;
+        }
+        for(len = 512; len; len -= chunk, addr += chunk) {
+            chunk = ATA_PRD_MAX_BYTES - (addr & (ATA_PRD_MAX_BYTES - 1));
+            if(chunk > len) {
+                chunk = len;
+            }
+            prd = nr ? &prdt[nr - 1] : NULL;
+            if(prd && prd->addr + (prd->count ? prd->count : ATA_PRD_MAX_BYTES) == addr &&
+               (prd->addr & ~(ATA_PRD_MAX_BYTES - 1)) == (addr & ~(ATA_PRD_MAX_BYTES - 1))) {
+                // Same 64K window and contiguous, extend the entry.
+                prd->count += chunk;
+                continue;
+            }
+            if(nr == ATA_PRD_MAX) {
+                return 0;
+            }
+            prd = &prdt[nr++];
+            prd->addr  = addr;
+            prd->count = chunk & 0xFFFF;
+            prd->flags = 0;
+        }
+    }
+    prdt[nr - 1].flags = ATA_PRD_EOT;
+    return nr;
+}/* ata_prd_build */
+
+/*
+ * ata_dma_start:
+ *
+ * Load the PRD table and start a READ/WRITE DMA command.
+ * Returns 0 once the transfer is running, 1 if DMA can not
+ * be used for it, -1 if the drive is in error.
+ */
+static int ata_dma_start(unsigned char drive, unsigned long lba, int count,
+                         char **vec, char *buffer, int writing, int ext)
+{
+    unsigned char command = 0;
+    int ch = ATA_CHANNEL(drive);
+
+    if(!ata_dma_mode[drive] || !ata_prd_build(ata_prdt[ch], count, vec, buffer)) {
+        return 1;
+    }
+    io_outb(ATA_BM_PORT(ch, ATA_BM_COMMAND), 0);
+    io_outl(ATA_BM_PORT(ch, ATA_BM_PRDT), (unsigned long)ata_prdt[ch]);
+    // Clear the interrupt and error bits, they are write one to clear.
+    io_outb(ATA_BM_PORT(ch, ATA_BM_STATUS), io_inb(ATA_BM_PORT(ch, ATA_BM_STATUS)) |
+            ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    io_outb(ATA_BM_PORT(ch, ATA_BM_COMMAND), writing ? 0 : ATA_BM_CMD_READ);
+    if(ata_wait(ch, writing, 0, 0)) {
         return -1;
     }
-    local_sleep(1);
+    command = writing ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                      : (ext ? ATA_CMD_READ_DMA_EXT  : ATA_CMD_READ_DMA);
+    ata_task_file(drive, lba, count, ext, command);
+    io_outb(ATA_BM_PORT(ch, ATA_BM_COMMAND),
+            (writing ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
     return 0;
-}/* ata_read */
+}/* ata_dma_start */
 
 /*
- * ata_write:
+ * ata_dma_stop:
  *
- * Write to the ATA disk.
+ * Stop the controller of 'channel' after a transfer and
+ * return its status register from before it was cleared.
+ */
+static unsigned char ata_dma_stop(int channel)
+{
+    unsigned char bm_status = io_inb(ATA_BM_PORT(channel, ATA_BM_STATUS));
+    io_outb(ATA_BM_PORT(channel, ATA_BM_COMMAND), 0);
+    io_outb(ATA_BM_PORT(channel, ATA_BM_STATUS), bm_status | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    return bm_status;
+}/* ata_dma_stop */
+
+/*
+ * ata_rw_dma:
  *
+ * Transfer 'count' sectors with READ/WRITE DMA, laid out
+ * as in ata_rw_multi, and wait for it. Returns 0 on success,
+ * 1 if DMA could not be set up so the caller should use PIO,
+ * -1 on a drive or controller error.
  */
-int ata_write(unsigned char drive, unsigned int lba, char *buffer)
+static int ata_rw_dma(unsigned char drive, unsigned long lba, int count,
+                      char **vec, char *buffer, int writing, int ext)
 {
-    unsigned char head       = 0x0;
-    unsigned char sector     = 0x0;
-    unsigned char cyl1       = 0x0;
-    unsigned char cyl2       = 0x0;
-    unsigned char drive_head = 0x0;
-    get_chs(lba, &head, &sector, &cyl1, &cyl2);
-    drive_head = get_drive_head(drive, head);
-    if(pio_write(drive_head, sector, cyl1, cyl2, buffer)== 1) {
-        printk("ata_write:: "
-               "FAILED lba=%x drive=%x drive_head=%x sector=%x cyl1=%x cyl2=%x\n",
-                lba,drive,drive_head,sector,cyl1,cyl2);
-        panic("ata_write:: FAILED");
-        // Coincides with dev.c; however, we will not return
-        // from kernel panic...
+    unsigned char bm_status = 0;
+    int rtvl = 0;
+
+    if((rtvl = ata_dma_start(drive, lba, count, vec, buffer, writing, ext))) {
+        return rtvl;
+    }
+    rtvl = ata_wait(ATA_CHANNEL(drive), writing, 0, 1);
+    bm_status = ata_dma_stop(ATA_CHANNEL(drive));
+    if(rtvl || (bm_status & (ATA_BM_SR_ERR | ATA_BM_SR_ACTIVE))) {
+        printk("ata_rw_dma:: FAILED lba=%x count=%d drive=%x bm_status=%x\n",
+                lba,count,drive,bm_status);
+        return -1;
+    }
+    return 0;
+}/* ata_rw_dma */
+
+/*
+ * Asynchronous transfers.
+ *
+ * ata_submit starts a DMA transfer and returns at once, the
+ * rest of it, the cache flush after a write and the call to
+ * the completion routine, is driven by ide_handler. One
+ * transfer is in flight per channel at a time, so drives on
+ * different channels run in parallel.
+ */
+/*
+ * ata_async_end:
+ *
+ * Move the transfer in flight on 'channel' on once the drive
+ * reports 'status', called with interrupts disabled.
+ */
+static void ata_async_end(int channel, unsigned char status)
+{
+    struct ata_async *async = &ata_async[channel];
+    unsigned char bm_status = 0;
+    int failed = (status & (ATA_SR_ERR | ATA_SR_DF)) != 0;
+
+    if(async->state == ATA_ASYNC_DMA) {
+        bm_status = ata_dma_stop(channel);
+        if(bm_status & (ATA_BM_SR_ERR | ATA_BM_SR_ACTIVE)) {
+            failed = 1;
+        }
+        if(!failed && async->writing) {
+            async->state = ATA_ASYNC_FLUSH;
+            io_outb(ATA_PORT(channel, ATA_REG_COMMAND), async->ext ?
+                    ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+            return;
+        }
+    }
+    if(failed) {
+        printk("ata_async_end:: FAILED lba=%x count=%d drive=%x status=%x bm_status=%x\n",
+                async->lba,async->count,async->drive,status,bm_status);
+        // Later transfers to the drive use PIO.
+        ata_dma_mode[async->drive] = 0;
+    }
+    async->state = ATA_ASYNC_IDLE;
+    async->done(async->arg, failed);
+}/* ata_async_end */
+
+/*
+ * ata_submit:
+ *
+ * Start transferring 'count' sectors at 'lba' to or from
+ * the buffers in 'vec'. Returns 0 if it was started, 'done'
+ * is then called from the interrupt with status 0 on success,
+ * or 1 if it failed and may be retried (DMA is then off for
+ * the drive). Returns 1 if the transfer could not be started
+ * asynchronously, the channel being busy or DMA not in use,
+ * and -1 on error. The request queue calls it from the disk
+ * interrupt as well, so it only uses what ide_enable set up
+ * and never allocates.
+ */
+int ata_submit(unsigned char drive, unsigned long lba, int count, char **vec,
+               int writing, void (*done)(void *arg, int status), void *arg)
+{
+    struct ata_async *async = NULL;
+    unsigned long flags = 0;
+    int ext = 0;
+    int rtvl = 1;
+
+    if(count <= 0 || count > ATA_MULTI_MAX || !vec || !done || !ata_present(drive)) {
+        return -1;
+    }
+    ext = (lba + count - 1 > ATA_LBA28_MAX);
+    if(ext && !ata_lba48(drive)) {
+        return -1;
+    }
+    if(!ata_dma_mode[drive]) {
+        // No PRD table from ata_dma_setup, the caller uses PIO.
+        return 1;
+    }
+    async = &ata_async[ATA_CHANNEL(drive)];
+    flags = asm_get_eflags();
+    asm_disable_interrupt();
+    if(ide_irq_ready && async->state == ATA_ASYNC_IDLE) {
+        async->state = ATA_ASYNC_DMA;
+        async->drive = drive;
+        async->lba = lba;
+        async->count = count;
+        async->writing = writing;
+        async->ext = ext;
+        async->done = done;
+        async->arg = arg;
+        if((rtvl = ata_dma_start(drive, lba, count, vec, NULL, writing, ext))) {
+            async->state = ATA_ASYNC_IDLE;
+        }
+    }
+    asm_set_eflags(flags);
+    return rtvl;
+}/* ata_submit */
+
+/*
+ * ata_poll:
+ *
+ * Complete the transfer in flight on the channel of 'drive'
+ * if it has finished without its interrupt being seen.
+ * Returns 1 while a transfer is still in flight there, 0 once
+ * the channel is idle.
+ */
+int ata_poll(unsigned char drive)
+{
+    struct ata_async *async = NULL;
+    unsigned long flags = asm_get_eflags();
+    unsigned char status = 0;
+    int ch = 0;
+    int busy = 0;
+
+    if(!ata_present(drive)) {
+        return 0;
+    }
+    ch = ATA_CHANNEL(drive);
+    async = &ata_async[ch];
+    asm_disable_interrupt();
+    if(async->state != ATA_ASYNC_IDLE) {
+        status = io_inb(ATA_CTRL_PORT(ch)); // Alternate status, no acknowledge.
+        if(!(status & ATA_SR_BSY) &&
+           (async->state == ATA_ASYNC_FLUSH ||
+            (!(status & ATA_SR_DRQ) &&
+             !(io_inb(ATA_BM_PORT(ch, ATA_BM_STATUS)) & ATA_BM_SR_ACTIVE)))) {
+            ata_async_end(ch, io_inb(ATA_PORT(ch, ATA_REG_STATUS)));
+        }
+    }
+    busy = (async->state != ATA_ASYNC_IDLE);
+    asm_set_eflags(flags);
+    return busy;
+}/* ata_poll */
+
+/* Per drive: -1 not probed yet, 0 16-bit PIO, 1 32-bit PIO. */
+static int ata_pio32[ATA_DRIVES] = {-1, -1, -1, -1};
+
+/*
+ * ata_pio_width:
+ *
+ * Set the PIO data width of 'drive' to 'bits' (16 or 32),
+ * or just probe it if 'bits' is 0. The probe only uses
+ * 32 bits if word 48 of IDENTIFY reports it, the drive is
+ * left at 16 bits otherwise. Returns the width in use.
+ */
+int ata_pio_width(unsigned char drive, int bits)
+{
+    if(!ata_present(drive)) {
+        return 16;
+    }
+    if(bits) {
+        ata_pio32[drive] = (bits == 32);
+    } else if(ata_pio32[drive] < 0) {
+        ata_pio32[drive] = (ide_devices[drive].DwordIO != 0);
+    }
+    return ata_pio32[drive] ? 32 : 16;
+}/* ata_pio_width */
+
+/*
+ * ata_rw_multi:
+ *
+ * Transfer 'count' sectors starting at 'lba' with a single
+ * command. Sector i is at vec[i] if 'vec' is given, otherwise
+ * at buffer + i * 512. Uses bus master DMA when available
+ * and READ/WRITE MULTIPLE otherwise, moving the data 32 bits
+ * at a time if ata_pio_width allows it.
+ */
+static int ata_rw_multi(unsigned char drive, unsigned long lba, int count,
+                        char **vec, char *buffer, int writing)
+{
+    unsigned int block = 0;
+    unsigned char command = 0;
+    register int i = 0;
+    int ext = 0;
+    int pio32 = 0;
+    int ch = 0;
+    char *ptr = NULL;
+
+    if(count <= 0 || count > ATA_MULTI_MAX || (!vec && !buffer)) {
+        return -1;
+    }
+    if(!ata_present(drive)) {
+        printk("ata_rw_multi:: no ATA disk at drive=%x\n",drive);
+        return -1;
+    }
+    ch = ATA_CHANNEL(drive);
+    // A transfer started by ata_submit owns the channel until it ends.
+    for(i = 0; ata_poll(drive); ++i) {
+        if(i == ATA_POLL_MAX) {
+            printk("ata_rw_multi:: channel busy lba=%x drive=%x\n",lba,drive);
+            return -1;
+        }
+    }
+    ext = (lba + count - 1 > ATA_LBA28_MAX);
+    if(ext && !ata_lba48(drive)) {
+        printk("ata_rw_multi:: lba=%x count=%d is beyond LBA28 on drive=%x\n",
+                lba,count,drive);
         return -1;
     }
-    local_sleep(1);
+    switch(ata_rw_dma(drive, lba, count, vec, buffer, writing, ext)) {
+        case 0:
+            goto flush;
+        case 1:
+            break;
+        default:
+            // Give the drive one more try with PIO.
+            ata_dma_mode[drive] = 0;
+            break;
+    }
+    block = ata_set_multiple(drive);
+    pio32 = (ata_pio_width(drive, 0) == 32);
+    if(block > 1) {
+        command = writing ? (ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE)
+                          : (ext ? ATA_CMD_READ_MULTIPLE_EXT  : ATA_CMD_READ_MULTIPLE);
+    } else {
+        command = writing ? (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                          : (ext ? ATA_CMD_READ_PIO_EXT  : ATA_CMD_READ_PIO);
+    }
+    ata_task_file(drive, lba, count, ext, command);
+    for(i = 0; i < count; ++i) {
+        // The drive asks for service once per block. A read
+        // interrupts for every block, a write for every block
+        // after the first.
+        if(!(i % block) && ata_wait(ch, writing, 1, !writing || i)) {
+            // The caller sees the failure, a media error
+            // is not a reason to stop the kernel.
+            printk("ata_rw_multi:: FAILED lba=%x count=%d drive=%x\n",
+                    lba + i,count,drive);
+            return -1;
+        }
+        ptr = vec ? vec[i] : buffer + (i * 512);
+        if(pio32 && writing) {
+            io_outsl(ATA_PORT(ch, ATA_REG_DATA), ptr, 512/4);
+        } else if(pio32) {
+            io_insl(ATA_PORT(ch, ATA_REG_DATA), ptr, 512/4);
+        } else if(writing) {
+            io_outsw(ATA_PORT(ch, ATA_REG_DATA), ptr, 512/2);
+        } else {
+            io_insw(ATA_PORT(ch, ATA_REG_DATA), ptr, 512/2);
+        }
+    }
+flush:
+    if(writing) {
+        // Flush once for the whole run.
+        if(ata_wait(ch, 1, 0, 1)) {
+            return -1;
+        }
+        ide_irq_pending[ch] = 0;
+        io_outb(ATA_PORT(ch, ATA_REG_COMMAND),
+                ext ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+        if(ata_wait(ch, 1, 0, 1)) {
+            return -1;
+        }
+    }
     return 0;
+}/* ata_rw_multi */
+
+int ata_read_multi(unsigned char drive, unsigned long lba, int count, char *buffer)
+{
+    return ata_rw_multi(drive, lba, count, NULL, buffer, 0);
+}/* ata_read_multi */
+
+int ata_write_multi(unsigned char drive, unsigned long lba, int count, char *buffer)
+{
+    return ata_rw_multi(drive, lba, count, NULL, buffer, 1);
+}/* ata_write_multi */
+
+int ata_readv(unsigned char drive, unsigned long lba, int count, char **vec)
+{
+    return ata_rw_multi(drive, lba, count, vec, NULL, 0);
+}/* ata_readv */
+
+int ata_writev(unsigned char drive, unsigned long lba, int count, char **vec)
+{
+    return ata_rw_multi(drive, lba, count, vec, NULL, 1);
+}/* ata_writev */
+
+/*
+ * ata_read:
+ *
+ * Read from the ATA disk. The lba is passed to the drive
+ * as is, LBA28 addressing is used up to ATA_LBA28_MAX and
+ * LBA48 beyond it when the drive supports it.
+ *
+ */
+int ata_read(unsigned char drive, unsigned long lba, char *buffer)
+{
+    return ata_rw_multi(drive, lba, 1, NULL, buffer, 0);
+}/* ata_read */
+
+/*
+ * ata_write:
+ *
+ * Write to the ATA disk, addressed as in ata_read.
+ *
+ */
+int ata_write(unsigned char drive, unsigned long lba, char *buffer)
+{
+    return ata_rw_multi(drive, lba, 1, NULL, buffer, 1);
 }/* ata_write */
 
 int ata_status_check(int operation, unsigned char error_reg, unsigned char status_reg)
@@ -356,6 +1027,8 @@ void ata_test_rw(int sectors)
     static const int drive = 0;
     char buf[512]={0}, *ptr = buf;
     int i = 1;
+    int width = 0, dma = 0, bits = 0;
+    unsigned long long start = 0, cycles = 0;
     for(i = 1; i < sectors; ++i) {
 	    printk("ata_test_rw:: testing write\n");
 	    ptr[0]=i;
@@ -368,6 +1041,27 @@ void ata_test_rw(int sectors)
 	        printk("failed ptr[0]=[%d] sector=[%d]\n",ptr[0],i);
 	    }
     }
+    // Time the same reads with 16 and then 32-bit PIO,
+    // DMA held off so the data port does the work.
+    if(!ata_present(drive) || !(ptr = (char *)kpage_alloc(1))) {
+        return;
+    }
+    width = ata_pio_width(drive, 0);
+    dma = ata_dma_mode[drive];
+    ata_dma_mode[drive] = 0;
+    for(bits = 16; bits <= 32; bits += 16) {
+        ata_pio_width(drive, bits);
+        start = io_rdtsc();
+        for(i = 1; i < sectors; i += PAGE_SIZE / 512) {
+            ata_read_multi(drive, i, PAGE_SIZE / 512, ptr);
+        }
+        cycles = io_rdtsc() - start;
+        printk("ata_test_rw:: %d-bit PIO sectors=[%d] kcycles=[%d]\n",
+                bits, sectors, (unsigned int)(cycles >> 10));
+    }
+    ata_pio_width(drive, width);
+    ata_dma_mode[drive] = dma;
+    kpage_free(ptr, 1);
 }/* ata_test_rw */
 
 #ifdef _TEST_PIO_UTIL
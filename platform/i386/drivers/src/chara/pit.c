@@ -36,6 +36,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <ox/linkage.h>
 #include <ox/error_rpt.h>
 #include <ox/bool_t.h>
+#include <ox/def_int.h>
 
 #include <platform/interrupt.h>
 #include <platform/interrupt_admin.h>
@@ -80,6 +81,8 @@ irq_stat_t pit_handler(int irq)
     ++tick;
     // Launch once a second...
     if(tick % 18 == 0) {
+        // Deferred work registered as DEFINT_TIME.
+        defint_exec_selected(DEFINT_TIME);
         if(pit_mode == PIT_SCHEDULER) {
             // Handler for os scheduler.
             handler = pit_handlers_tab[0];
@@ -139,6 +139,10 @@ void io_insl   ( unsigned int port, void *address, unsigned long count );
 extern
 void io_outsl  ( unsigned int port, void *address, unsigned long count );
 
+/* time stamp counter, for timing device transfers */
+extern
+unsigned long long io_rdtsc ( void );
+
 
 extern
 void io_memset ( unsigned int port, unsigned long value, unsigned long count );
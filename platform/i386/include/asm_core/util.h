@@ -40,6 +40,9 @@ void asm_disable_interrupt( void );
 extern 
 unsigned long asm_get_eflags ( void );
 
+/* Interrupt enable flag in the value of asm_get_eflags. */
+#define EFLAGS_IF 0x00000200
+
 extern
 void asm_set_eflags ( unsigned long flags );
 
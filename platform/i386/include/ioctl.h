@@ -87,9 +87,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
              ((nmbr) << _IOC_NMBR_SHIFT))
 
 /* macros to encode IOC numbers */
-#define _IO  (type,nmbr)      _IOC_ENCODE(_IOC_V,            0,(type),(nmbr))
-#define _IOR (type,nmbr,size) _IOC_ENCODE(_IOC_R, sizeof(size),(type),(nmbr))
-#define _IOW (type,nmbr,size) _IOC_ENCODE(_IOC_W, sizeof(size),(type),(nmbr))
+#define _IO(type,nmbr)        _IOC_ENCODE(_IOC_V,            0,(type),(nmbr))
+#define _IOR(type,nmbr,size)  _IOC_ENCODE(_IOC_R, sizeof(size),(type),(nmbr))
+#define _IOW(type,nmbr,size)  _IOC_ENCODE(_IOC_W, sizeof(size),(type),(nmbr))
 #define _IOWR(type,nmbr,size) _IOC_ENCODE(_IOC_RW,sizeof(size),(type),(nmbr))
 
 /* macros to decode IOC numbers */